@@ -10,8 +10,17 @@ LOCAL_CFLAGS := -DRTMP_API_EXPORTS -fvisibility=hidden -std=gnu99
 LOCAL_SRC_FILES := \
 	src/rtmp.c \
 	src/amf.c \
-	src/rtmp_chunk_stream.c
+	src/rtmp_buffer_pool.c \
+	src/rtmp_chunk_stream.c \
+	src/rtmp_flv_reader.c \
+	src/rtmp_nal.c \
+	src/rtmp_resolver.c \
+	src/rtmp_submit_queue.c \
+	src/rtmp_tls.c
 LOCAL_LIBRARIES := libfutils libpomp libulog
+ifneq ("$(TARGET_OS_FLAVOUR)","android")
+LOCAL_LDLIBS := -lpthread
+endif
 
 include $(BUILD_LIBRARY)
 
@@ -27,4 +36,39 @@ ifeq ("$(TARGET_OS_FLAVOUR)","native")
 	LOCAL_SRC_FILES := test/rtmp_test_mp4.c test/mp4_reader.c
 	LOCAL_LIBRARIES := librtmp libpomp libulog libmp4
 	include $(BUILD_EXECUTABLE)
+
+	include $(CLEAR_VARS)
+	LOCAL_MODULE := rtmp_bench
+	LOCAL_DESCRIPTION := RTMP chunk stream & AMF micro-benchmarks
+	LOCAL_CFLAGS := -std=gnu99
+	LOCAL_C_INCLUDES := $(LOCAL_PATH)/include $(LOCAL_PATH)/src
+	# Built from the library sources, to reach the internal APIs
+	LOCAL_SRC_FILES := \
+		test/rtmp_bench.c \
+		src/amf.c \
+		src/rtmp_buffer_pool.c \
+		src/rtmp_chunk_stream.c \
+		src/rtmp_nal.c \
+		src/rtmp_tls.c
+	LOCAL_LIBRARIES := libfutils libpomp libulog
+	include $(BUILD_EXECUTABLE)
+
+	include $(CLEAR_VARS)
+	LOCAL_MODULE := rtmp_test_loopback
+	LOCAL_DESCRIPTION := RTMP end-to-end latency test over a loopback sink
+	LOCAL_CFLAGS := -std=gnu99
+	LOCAL_C_INCLUDES := $(LOCAL_PATH)/include $(LOCAL_PATH)/src
+	# The sink reuses the library chunk stream & AMF internals
+	LOCAL_SRC_FILES := \
+		test/rtmp_test_loopback.c \
+		test/rtmp_sink.c \
+		test/rtmp_tls_identity.c \
+		src/amf.c \
+		src/rtmp_buffer_pool.c \
+		src/rtmp_chunk_stream.c \
+		src/rtmp_nal.c \
+		src/rtmp_tls.c
+	LOCAL_LIBRARIES := librtmp libfutils libpomp libulog
+	LOCAL_LDLIBS := -lpthread
+	include $(BUILD_EXECUTABLE)
 endif
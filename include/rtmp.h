@@ -46,7 +46,27 @@ extern "C" {
 
 /* Forward declarations */
 struct rtmp_client;
+struct rtmp_group;
 struct pomp_loop;
+struct iovec;
+
+/** Default outgoing chunk size */
+#define RTMP_DEFAULT_CHUNK_SIZE 256
+
+/** Maximum outgoing chunk size (no message can be bigger) */
+#define RTMP_MAX_CHUNK_SIZE 0xFFFFFF
+
+/**
+ * Automatic outgoing chunk size: the chunk size is selected from the socket
+ * MSS and the observed video frame sizes, and updated during the connection
+ */
+#define RTMP_CHUNK_SIZE_AUTO 0
+
+/**
+ * Default scheduler quantum: maximum payload length sent from a message before
+ * the messages of the other channels can be interleaved
+ */
+#define RTMP_DEFAULT_SCHED_QUANTUM 4096
 
 /** Connection state */
 enum rtmp_connection_state {
@@ -55,6 +75,407 @@ enum rtmp_connection_state {
 	RTMP_CONNECTED, /**< Client is connected */
 };
 
+/** Data queues of an rtmp_client */
+enum rtmp_data_queue {
+	RTMP_QUEUE_VIDEO, /**< Video frames & avcC */
+	RTMP_QUEUE_AUDIO, /**< Audio frames, AudioSpecificConfig & metadata */
+};
+
+/** Default number of messages in a data queue */
+#define RTMP_DEFAULT_QUEUE_LEN 10
+
+/**
+ * Data queue limits.
+ *
+ * A new message is refused (-EAGAIN) if any of the limits would be exceeded.
+ * The byte and duration limits never refuse a message if the queue is empty.
+ */
+struct rtmp_queue_config {
+	/** Max number of messages in the queue (0 for the default) */
+	unsigned int max_len;
+	/** Max number of bytes in the queue (0 for unlimited) */
+	size_t max_bytes;
+	/**
+	 * Max duration in milliseconds between the oldest and the newest
+	 * message timestamps of the queue (0 for unlimited)
+	 */
+	uint32_t max_duration;
+};
+
+/** Data queue status */
+struct rtmp_queue_status {
+	/** Number of messages in the queue */
+	unsigned int len;
+	/** Number of bytes in the queue */
+	size_t bytes;
+	/**
+	 * Duration in milliseconds between the oldest and the newest message
+	 * timestamps of the queue
+	 */
+	uint32_t duration;
+};
+
+/** Video frames drop policy */
+enum rtmp_drop_policy {
+	/** Never drop frames (default) */
+	RTMP_DROP_NONE = 0,
+	/** Drop the queued non-reference frames when late */
+	RTMP_DROP_NON_REF,
+	/**
+	 * Drop the queued non-reference frames when late, then, if still late,
+	 * the rest of the GOP until the next keyframe
+	 */
+	RTMP_DROP_GOP,
+};
+
+/** Number of RTMP message type ids tracked in struct rtmp_stats */
+#define RTMP_STATS_MSG_TYPES 23
+
+/** Maximum number of channels reported in struct rtmp_stats */
+#define RTMP_STATS_MAX_CHANNELS 8
+
+/** Statistics of an outgoing chunk stream channel */
+struct rtmp_channel_stats {
+	/** Chunk stream id */
+	uint32_t csid;
+	/** Current number of queued messages */
+	unsigned int queue_len;
+	/** Maximum number of queued messages */
+	unsigned int queue_peak_len;
+	/** Number of messages fully sent */
+	uint64_t sent_msgs;
+	/** Number of messages dropped by the drop policy */
+	uint64_t dropped_msgs;
+	/**
+	 * Total time spent by the sent messages between their submission and
+	 * the end of their send, in microseconds
+	 */
+	uint64_t queued_time;
+	/** Maximum time spent by a message in the queue, in microseconds */
+	uint64_t max_queued_time;
+};
+
+/** Runtime statistics of an rtmp_client */
+struct rtmp_stats {
+	/** Number of messages sent, indexed by message type id */
+	uint64_t tx_msgs[RTMP_STATS_MSG_TYPES];
+	/** Number of payload bytes sent, indexed by message type id */
+	uint64_t tx_bytes[RTMP_STATS_MSG_TYPES];
+	/** Number of chunks sent */
+	uint64_t tx_chunks;
+	/** Number of sendmsg() calls */
+	uint64_t tx_sendmsg;
+	/** Number of partial sends (socket buffer full) */
+	uint64_t tx_partial_sends;
+	/** Number of messages refused because their queue was full */
+	uint64_t tx_eagain;
+	/**
+	 * Number of messages sent right away when queued, without waiting for
+	 * the socket to be reported writable
+	 */
+	uint64_t tx_write_through;
+	/** Number of audio messages packed in Aggregate messages */
+	uint64_t tx_aggregated_msgs;
+	/** Number of bytes written to the socket (chunk headers included) */
+	uint64_t tx_total_bytes;
+	/** Number of messages sent without copy (MSG_ZEROCOPY) */
+	uint64_t tx_zerocopy_msgs;
+	/**
+	 * Number of MSG_ZEROCOPY sendmsg() calls for which the kernel copied
+	 * the data anyway (e.g. loopback interface, or network device without
+	 * scatter/gather support)
+	 */
+	uint64_t tx_zerocopy_copied;
+	/** Number of times the transmission waited for the pacer */
+	uint64_t tx_pacer_waits;
+	/** Current pacing rate in bytes per second (0 if not paced) */
+	uint32_t tx_pacing_rate;
+
+	/** Number of valid entries in channels */
+	unsigned int nb_channels;
+	/** Outgoing channels statistics */
+	struct rtmp_channel_stats channels[RTMP_STATS_MAX_CHANNELS];
+
+	/** Number of bytes received (wraps at 2^32, as the RTMP ack sequence) */
+	uint32_t rx_total_bytes;
+	/** Number of bytes received since the last sent ack */
+	uint32_t rx_bytes_since_last_ack;
+
+	/** Last peer bandwidth (0 if unknown) */
+	uint32_t peer_bw;
+	/** Window acknowledgement size (0 if unknown) */
+	uint32_t window_ack_size;
+
+	/** Number of messages submitted with rtmp_client_submit_xxx() and
+	 * released without being sent (not connected or queue full) */
+	uint64_t submit_dropped;
+};
+
+/**
+ * Fast connection setup flags
+ */
+
+/** Send C2 along with the connect command, without waiting for S2 */
+#define RTMP_FAST_CONNECT_COALESCE (1 << 0)
+/** Send C0 + C1 with the TCP SYN (TCP Fast Open), if supported */
+#define RTMP_FAST_CONNECT_TFO (1 << 1)
+/**
+ * Send releaseStream / FCPublish / createStream right after connect, without
+ * waiting for the connect result (the server must tolerate it)
+ */
+#define RTMP_FAST_CONNECT_PIPELINE (1 << 2)
+/** All the fast connection setup flags */
+#define RTMP_FAST_CONNECT_ALL                                                  \
+	(RTMP_FAST_CONNECT_COALESCE | RTMP_FAST_CONNECT_TFO |                  \
+	 RTMP_FAST_CONNECT_PIPELINE)
+
+/**
+ * Connection setup timings, in microseconds since the call to
+ * rtmp_client_connect(), 0 if the phase was not reached
+ */
+struct rtmp_connect_timings {
+	/** TCP connection established */
+	uint64_t tcp;
+	/** Handshake done (S2 received, or S1 received in coalesced mode) */
+	uint64_t handshake;
+	/** connect result received */
+	uint64_t connect;
+	/** createStream result received */
+	uint64_t create_stream;
+	/** Publish (or play) started (connection ready) */
+	uint64_t publish;
+	/** TLS handshake done (rtmps URLs only) */
+	uint64_t tls;
+};
+
+/**
+ * Pacer configuration
+ *
+ * The pacer is a token bucket limiting the rate at which the data is written
+ * to the socket, so that the big messages (e.g. video keyframes) are spread in
+ * time instead of being written in a single burst, which would overrun the
+ * shallow buffers of some links (e.g. cellular). The pacing rate is the lowest
+ * of the enabled limits, the data is not paced while none of them is known.
+ */
+struct rtmp_pacing_config {
+	/** Rate limit set by the application, in bytes per second (0 for
+	 * none) */
+	uint32_t max_rate;
+	/** Set to limit the rate to the peer bandwidth sent by the server.
+	 * The peer bandwidth being an amount of unacknowledged data, it is
+	 * spread over the round trip time estimate, so the server must send
+	 * acknowledgements (see rtmp_client_set_bw_estimate_config()) */
+	int peer_bw;
+	/** Limit the rate to the acknowledged throughput estimate multiplied
+	 * by estimate_gain percent (e.g. RTMP_DEFAULT_PACING_GAIN), 0 to not
+	 * use the estimate. A gain above 100% is needed for the rate to grow
+	 * back, as the estimate measures the paced data */
+	uint32_t estimate_gain;
+	/** Token bucket size, i.e. maximum burst, in bytes (0 for
+	 * RTMP_DEFAULT_PACING_BURST) */
+	uint32_t burst;
+};
+
+/** Default pacer burst size, in bytes */
+#define RTMP_DEFAULT_PACING_BURST 16384
+
+/** Default pacing gain over the throughput estimate, in percent. The video
+ * pacers typically send at 2.5 times the media rate, so a keyframe takes a
+ * few frame intervals at most */
+#define RTMP_DEFAULT_PACING_GAIN 250
+
+/**
+ * Automatic reconnection configuration
+ */
+struct rtmp_reconnect_config {
+	/** Reconnect when the connection is lost after the stream was
+	 * published (default is 0) */
+	int enabled;
+	/** Delay before the second reconnection attempt in milliseconds, the
+	 * first one being immediate. The delay doubles on each failed
+	 * attempt */
+	uint32_t min_delay;
+	/** Maximum delay between two reconnection attempts in milliseconds */
+	uint32_t max_delay;
+	/** Number of failed reconnection attempts before giving up, 0 for no
+	 * limit */
+	unsigned int max_retries;
+	/** Maximum age in milliseconds of the queued audio and video frames
+	 * sent again after a reconnection, 0 to drop them all */
+	uint32_t max_latency;
+};
+
+/** Default delay before the second reconnection attempt, in milliseconds */
+#define RTMP_DEFAULT_RECONNECT_MIN_DELAY 250
+
+/** Default maximum delay between reconnection attempts, in milliseconds */
+#define RTMP_DEFAULT_RECONNECT_MAX_DELAY 10000
+
+/**
+ * Default time during which the resolved addresses of a host are reused by
+ * the next connections, in milliseconds
+ */
+#define RTMP_DEFAULT_DNS_CACHE_TTL 60000
+
+/**
+ * Default maximum amount of unsent data in the kernel socket buffer in low
+ * latency mode, in bytes
+ */
+#define RTMP_DEFAULT_NOTSENT_LOWAT 16384
+
+/**
+ * Default minimum message size for the zero-copy transmission, in bytes.
+ * Below about 10KB, the page pinning & completion costs exceed the copy cost
+ */
+#define RTMP_DEFAULT_ZEROCOPY_THRESHOLD 16384
+
+/** Default period of the bw_estimate callback, in milliseconds */
+#define RTMP_DEFAULT_BW_ESTIMATE_PERIOD 1000
+
+/**
+ * Default acknowledgement window requested to the server when the
+ * bw_estimate callback is set, in bytes
+ */
+#define RTMP_DEFAULT_ACK_WINDOW 262144
+
+/**
+ * Network estimation, computed from the acknowledgements sent by the server.
+ *
+ * The server acknowledges the received bytes each time it gets an ack window
+ * worth of data, so the estimation is only updated once per ack window.
+ */
+struct rtmp_bw_estimate {
+	/** Bytes sent but not yet acknowledged by the server */
+	uint32_t bytes_in_flight;
+	/** Smoothed acknowledged throughput, in bytes per second */
+	uint32_t acked_rate;
+	/** Rate at which bytes were sent during the last period, in B/s */
+	uint32_t send_rate;
+	/** Smoothed round trip time estimate, in microseconds (0 if unknown) */
+	uint32_t rtt;
+	/** Number of acknowledgements received from the server */
+	uint32_t acks;
+	/** Acknowledgement window requested to the server (0 if none) */
+	uint32_t ack_window;
+};
+
+/** Lifecycle event of an outgoing message */
+enum rtmp_trace_type {
+	/** Message queued by a rtmp_client_send_xxx() function */
+	RTMP_TRACE_QUEUED = 0,
+	/** First bytes of the message written to the socket */
+	RTMP_TRACE_FIRST_CHUNK,
+	/** Last bytes of the message written to the socket */
+	RTMP_TRACE_LAST_CHUNK,
+	/** Message buffer released (data_unref callback for the application
+	 * buffers) */
+	RTMP_TRACE_RELEASED,
+};
+
+/** Reason why a message was released without being sent */
+enum rtmp_trace_drop_reason {
+	/** Not dropped: the message was sent, or copied in an Aggregate
+	 * message */
+	RTMP_TRACE_DROP_NONE = 0,
+	/** Dropped by the drop policy of the channel */
+	RTMP_TRACE_DROP_POLICY,
+	/** Connection closed before the message was sent */
+	RTMP_TRACE_DROP_DISCONNECTED,
+	/** Too old to be sent again after a reconnection */
+	RTMP_TRACE_DROP_EXPIRED,
+};
+
+/**
+ * Lifecycle event of an outgoing message, see rtmp_client_set_trace_cb().
+ *
+ * The messages sent by the library itself (commands, control messages,
+ * Aggregate messages) are traced as well, with a NULL buffer_userdata.
+ */
+struct rtmp_trace_event {
+	/** Event type */
+	enum rtmp_trace_type type;
+	/** Monotonic time of the event, in microseconds */
+	uint64_t time_us;
+	/** Chunk stream id of the message */
+	int csid;
+	/** RTMP message type id (8 for audio, 9 for video...) */
+	uint8_t mtid;
+	/** Message timestamp, in milliseconds */
+	uint32_t timestamp;
+	/** Message size in bytes, including the FLV audio/video header */
+	size_t size;
+	/** Data given to the rtmp_client_send_xxx() function */
+	const uint8_t *data;
+	/** User data given along the data */
+	void *buffer_userdata;
+	/** Drop reason, only set for RTMP_TRACE_RELEASED */
+	enum rtmp_trace_drop_reason drop_reason;
+};
+
+/**
+ * Callback called for each message lifecycle event.
+ *
+ * @param event : the event, only valid during the call.
+ * @param userdata : userdata passed in rtmp_client_set_trace_cb().
+ */
+typedef void (*rtmp_trace_cb_t)(const struct rtmp_trace_event *event,
+				void *userdata);
+
+/** Mode of an rtmp_client */
+enum rtmp_client_mode {
+	/** Publish a stream to the server (default) */
+	RTMP_CLIENT_MODE_PUBLISH = 0,
+	/** Play a stream from the server */
+	RTMP_CLIENT_MODE_PLAY,
+};
+
+/** Type of the media frames received in play mode */
+enum rtmp_media_type {
+	/** Video frame or codec configuration */
+	RTMP_MEDIA_VIDEO = 0,
+	/** Audio frame or codec configuration */
+	RTMP_MEDIA_AUDIO,
+	/** AMF0 data message (e.g. onMetaData) */
+	RTMP_MEDIA_DATA,
+};
+
+/** FLV video codec id of AVC (H.264) */
+#define RTMP_VIDEO_CODEC_AVC 7
+
+/** FLV audio sound format of AAC */
+#define RTMP_AUDIO_FORMAT_AAC 10
+
+/**
+ * Media frame received in play mode, with its FLV tag header parsed
+ */
+struct rtmp_media_frame {
+	/** Frame type */
+	enum rtmp_media_type type;
+	/** Decoding timestamp, in milliseconds */
+	uint32_t timestamp;
+	/** Payload, after the FLV audio or video tag header: AVCC NAL units or
+	 * AVCDecoderConfigurationRecord for AVC video, raw frame or
+	 * AudioSpecificConfig for AAC audio, AMF0 values for data messages */
+	const uint8_t *data;
+	/** Payload length */
+	size_t len;
+	/** Video codec id or audio sound format (FLV values) */
+	uint8_t codec;
+	/** Codec configuration (AVC or AAC sequence header) */
+	int is_config;
+	/** Video keyframe */
+	int is_key;
+	/** Video disposable inter frame */
+	int is_non_ref;
+	/** Video composition time offset (presentation - decoding time), in
+	 * ms */
+	int32_t cts;
+	/** Audio sound rate, size and type bits of the FLV tag header */
+	uint8_t audio_flags;
+	/** Buffer holding the payload, see rtmp_media_buffer_ref() */
+	uint8_t *buffer;
+};
+
 /**
  * Gets the string description of a connection state.
  *
@@ -83,8 +504,12 @@ struct rtmp_callbacks {
 	 *
 	 * When this callback is called with RTMP_CONNECTED, it is safe to call
 	 * the rtmp_client_send_xxx() functions.
-	 * The rtmp_client won't try to automatically reconnect when
-	 * disconnected.
+	 * Unless enabled with rtmp_client_set_reconnect(), the rtmp_client
+	 * won't try to automatically reconnect when disconnected. While
+	 * reconnecting, the state is RTMP_CONNECTING and the
+	 * rtmp_client_send_xxx() functions return -EAGAIN; the metadata and
+	 * codec configurations are sent again automatically once the stream is
+	 * published again.
 	 *
 	 * @param state : the client connection state.
 	 * @param userdata : userdata passed in rtmp_client_new.
@@ -108,6 +533,9 @@ struct rtmp_callbacks {
 	 * Callback called when a metadata/frame/audio buffer is fully sent and
 	 * can be reused. (mandatory)
 	 *
+	 * A buffer sent right away can be released before the
+	 * rtmp_client_send_xxx() function returns.
+	 *
 	 * @param data : the data which is no longer needed by rtmp_client.
 	 * @param buffer_userdata : user data passed along the buffer in a
 	 * rtmp_client_send_xxx() function.
@@ -116,6 +544,121 @@ struct rtmp_callbacks {
 	void (*data_unref)(uint8_t *data,
 			   void *buffer_userdata,
 			   void *userdata);
+
+	/**
+	 * Callback called periodically with the network estimation while
+	 * connected. (optional)
+	 *
+	 * The period and the acknowledgement window requested to the server
+	 * can be changed with rtmp_client_set_bw_estimate_config().
+	 *
+	 * @param estimate : the network estimation.
+	 * @param userdata : userdata passed in rtmp_client_new.
+	 */
+	void (*bw_estimate)(const struct rtmp_bw_estimate *estimate,
+			    void *userdata);
+
+	/**
+	 * Callback called for each media frame received in play mode.
+	 * (mandatory in play mode)
+	 *
+	 * The frame payload is not copied out of the received message: it is
+	 * only valid during the call, unless frame->buffer is kept with
+	 * rtmp_media_buffer_ref().
+	 *
+	 * @param frame : the received frame.
+	 * @param userdata : userdata passed in rtmp_client_new.
+	 */
+	void (*media_frame)(const struct rtmp_media_frame *frame,
+			    void *userdata);
+};
+
+/**
+ * TLS implementation used for the rtmps URLs.
+ *
+ * The library does not depend on a TLS library: the application provides
+ * the TLS sessions. Once the handshake is done, the transmit direction is
+ * handed over to the kernel TLS (kTLS) when possible, so that the messages
+ * are still written with scatter/gather sendmsg() calls on the socket,
+ * without being encrypted in user space. The received data is always
+ * decrypted by the session.
+ *
+ * All the functions are called from the pomp loop thread, and return
+ * negative errno values on error.
+ */
+struct rtmp_tls_backend {
+	/**
+	 * Creates a client session on a connected non-blocking socket.
+	 * (mandatory)
+	 *
+	 * @param fd : the socket file descriptor.
+	 * @param host : the server host name, for the server name indication
+	 * and the certificate verification.
+	 * @param userdata : userdata passed in rtmp_client_set_tls_backend.
+	 *
+	 * @return the session, or NULL in case of error.
+	 */
+	void *(*session_new)(int fd, const char *host, void *userdata);
+
+	/**
+	 * Advances the handshake of a session. (mandatory)
+	 *
+	 * @param session : the session.
+	 * @param want_write : set to 1 if the handshake waits for the socket
+	 * to be writable, 0 if it waits for the socket to be readable.
+	 *
+	 * @return 0 once the handshake is done, -EAGAIN while it is in
+	 * progress, negative errno on error (e.g. certificate verification
+	 * failure).
+	 */
+	int (*handshake)(void *session, int *want_write);
+
+	/**
+	 * Reads decrypted data. (mandatory)
+	 *
+	 * @return the number of bytes read, 0 if the connection was closed by
+	 * the server, -EAGAIN if no data is available.
+	 */
+	ssize_t (*read)(void *session, void *buf, size_t len);
+
+	/**
+	 * Gets the number of decrypted bytes which can be read without reading
+	 * the socket. (mandatory)
+	 */
+	size_t (*pending)(void *session);
+
+	/**
+	 * Encrypts and writes data, only used if the kernel TLS is not
+	 * available. (mandatory)
+	 *
+	 * @return the number of bytes written, which can be less than the
+	 * total iovecs length, or -EAGAIN if nothing could be written.
+	 */
+	ssize_t (*writev)(void *session, const struct iovec *iov, int iovcnt);
+
+	/**
+	 * Gets the transmit parameters of the session for the kernel TLS.
+	 * (optional)
+	 *
+	 * Not needed if the TLS library already enabled the kernel TLS on the
+	 * socket. Once this function succeeds, the session must not write to
+	 * the socket anymore.
+	 *
+	 * @param session : the session.
+	 * @param info : the crypto info given to setsockopt(SOL_TLS, TLS_TX)
+	 * (e.g. struct tls12_crypto_info_aes_gcm_128, see linux/tls.h),
+	 * including the key, IV and record sequence number (output).
+	 * @param len : size of info.
+	 *
+	 * @return the length of info, negative errno on error (e.g. -ENOTSUP
+	 * for a cipher not supported by the kernel TLS).
+	 */
+	ssize_t (*get_ktls_tx_info)(void *session, void *info, size_t len);
+
+	/**
+	 * Destroys a session, the socket is closed afterwards. (mandatory)
+	 */
+	void (*session_destroy)(void *session);
 };
 
 /**
@@ -142,11 +685,380 @@ RTMP_API struct rtmp_client *rtmp_client_new(struct pomp_loop *loop,
  */
 RTMP_API void rtmp_client_destroy(struct rtmp_client *client);
 
+/**
+ * Sets the outgoing chunk size of an rtmp_client.
+ *
+ * The chunk size is sent to the server right after the connect command. If the
+ * client is already connected, a new SetChunkSize message is sent to the
+ * server. Bigger chunks reduce the header overhead and the number of syscalls,
+ * smaller chunks allow a better interleaving of audio and video messages.
+ * The default chunk size is RTMP_DEFAULT_CHUNK_SIZE.
+ *
+ * @param client : the rtmp_client.
+ * @param chunk_size : the chunk size in bytes (1 to RTMP_MAX_CHUNK_SIZE), or
+ * RTMP_CHUNK_SIZE_AUTO for an automatically selected chunk size.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_chunk_size(struct rtmp_client *client,
+					uint32_t chunk_size);
+
+/**
+ * Sets the scheduler quantum of an rtmp_client.
+ *
+ * Outgoing messages are interleaved at the chunk level: control messages are
+ * sent first, then commands, audio & metadata, and video. When several
+ * channels have queued messages, at most quantum bytes of a message are sent
+ * (rounded up to the next chunk boundary) before the scheduler picks the next
+ * channel again, so that a big video frame does not delay the audio frames.
+ * The default quantum is RTMP_DEFAULT_SCHED_QUANTUM.
+ *
+ * @param client : the rtmp_client.
+ * @param quantum : the quantum in bytes, or 0 to always send whole messages.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_sched_quantum(struct rtmp_client *client,
+					   size_t quantum);
+
+/**
+ * Sets the audio aggregation window of an rtmp_client.
+ *
+ * When enabled, the audio frames are not sent as individual messages: the
+ * frames sent within window milliseconds (of media time) are copied in a
+ * single RTMP Aggregate message, which takes one queue slot and is sent at
+ * once. This reduces the per-message costs (queue slots, chunk headers and
+ * syscalls) for small frames, at the cost of up to window milliseconds of
+ * additional audio latency. The frames are released as soon as they are
+ * copied. Audio specific configs and metadata are never aggregated.
+ * Disabled by default, the setting is kept across connections.
+ *
+ * @param client : the rtmp_client.
+ * @param window : the aggregation window in milliseconds, or 0 to disable.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_audio_aggregation(struct rtmp_client *client,
+					       uint32_t window);
+
+/**
+ * Sets the pacer configuration of an rtmp_client.
+ *
+ * Disabled by default: the data is written as fast as the socket accepts it.
+ * The pacer applies to all the messages, after the scheduler, and along with
+ * the low latency mode limit if enabled. The setting is kept across
+ * connections.
+ *
+ * @param client : the rtmp_client.
+ * @param config : the pacer configuration, copied, or NULL to disable the
+ * pacer.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_pacing(struct rtmp_client *client,
+				    const struct rtmp_pacing_config *config);
+
+/**
+ * Sets the limits of a data queue of an rtmp_client.
+ *
+ * Can be called at any time, the limits are kept across connections. The
+ * queue length can not be reduced below the number of currently queued
+ * messages.
+ *
+ * @param client : the rtmp_client.
+ * @param queue : the queue to configure.
+ * @param config : the queue limits.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_queue_config(struct rtmp_client *client,
+					  enum rtmp_data_queue queue,
+					  const struct rtmp_queue_config *config);
+
+/**
+ * Sets the video frames drop policy of an rtmp_client.
+ *
+ * When a new video frame is sent and the timestamp difference between the
+ * oldest queued frame and the new frame exceeds max_latency, queued frames are
+ * dropped according to the policy. Codec configuration (avcC) and frames
+ * partially sent are never dropped. Dropped frames are released through the
+ * data_unref() callback, possibly before rtmp_client_send_video_frame()
+ * returns.
+ *
+ * Can be called at any time, the policy is kept across connections.
+ *
+ * @param client : the rtmp_client.
+ * @param policy : the drop policy.
+ * @param max_latency : the latency target, in milliseconds.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_drop_policy(struct rtmp_client *client,
+					 enum rtmp_drop_policy policy,
+					 uint32_t max_latency);
+
+/**
+ * Gets the current status of a data queue of an rtmp_client.
+ *
+ * This can be used by the application to implement its own flow control.
+ *
+ * @param client : the rtmp_client.
+ * @param queue : the queue.
+ * @param status : the queue status (output).
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_get_queue_status(struct rtmp_client *client,
+					  enum rtmp_data_queue queue,
+					  struct rtmp_queue_status *status);
+
+/**
+ * Sets the bw_estimate callback configuration of an rtmp_client.
+ *
+ * Must be called before rtmp_client_connect() to be applied. The default
+ * values are RTMP_DEFAULT_BW_ESTIMATE_PERIOD and RTMP_DEFAULT_ACK_WINDOW.
+ * A smaller ack window gives more frequent estimations, for a small extra
+ * upstream traffic from the server.
+ *
+ * @param client : the rtmp_client.
+ * @param period : the callback period in milliseconds, 0 to disable it.
+ * @param ack_window : the acknowledgement window requested to the server in
+ * bytes, 0 to keep the server default.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_bw_estimate_config(struct rtmp_client *client,
+						uint32_t period,
+						uint32_t ack_window);
+
+/**
+ * Sets the low latency socket mode of an rtmp_client.
+ *
+ * By default, the data is written to the socket as long as the kernel accepts
+ * it, and may stay for a long time in the socket buffer on slow links, out of
+ * reach of the drop policy and of the scheduler. In low latency mode, the
+ * amount of unsent data in the kernel is limited with TCP_NOTSENT_LOWAT, so
+ * the data stays in the rtmp_client queues.
+ *
+ * Applied on the next call to rtmp_client_connect().
+ *
+ * @param client : the rtmp_client.
+ * @param notsent_lowat : maximum amount of unsent data in the socket buffer
+ * in bytes (e.g. RTMP_DEFAULT_NOTSENT_LOWAT), 0 to disable the low latency
+ * mode.
+ * @param sndbuf : socket send buffer size (SO_SNDBUF) in bytes, 0 to keep the
+ * system default.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_low_latency(struct rtmp_client *client,
+					 uint32_t notsent_lowat,
+					 uint32_t sndbuf);
+
+/**
+ * Sets the zero-copy transmission mode of an rtmp_client.
+ *
+ * By default, sendmsg() copies all the data to the kernel. In zero-copy mode
+ * (MSG_ZEROCOPY, Linux 4.14 or later), the messages of at least threshold
+ * bytes are sent from the application buffers, which the kernel reads until
+ * the data is acknowledged by the server. The data_unref callback of these
+ * messages is then called later than without zero-copy, once the kernel
+ * released the buffers, and possibly after the data_unref of smaller
+ * messages sent afterwards. On disconnection, all the buffers are released
+ * right away.
+ *
+ * The zero-copy mode is not used for rtmps connections, the data being
+ * encrypted anyway.
+ *
+ * Applied on the next call to rtmp_client_connect().
+ *
+ * @param client : the rtmp_client.
+ * @param threshold : minimum message size in bytes (e.g.
+ * RTMP_DEFAULT_ZEROCOPY_THRESHOLD), 0 to disable the zero-copy mode.
+ *
+ * @return 0 on success, -ENOTSUP if not supported by the system, negative
+ * errno on error.
+ */
+RTMP_API int rtmp_client_set_zero_copy(struct rtmp_client *client,
+				       size_t threshold);
+
+/**
+ * Sets the message tracing callback of an rtmp_client.
+ *
+ * When set, the callback is called when each outgoing message is queued,
+ * when its first and last bytes are written to the socket, and when it is
+ * released, so that the latency of a given frame can be split between the
+ * queueing, the sending and the zero-copy completion. The callback is
+ * called from the pomp loop thread, or from the rtmp_client_send_xxx()
+ * functions, and must not call them. Nothing is traced while no callback is
+ * set. The messages kept for a reconnection are traced again when they are
+ * queued on the new connection.
+ *
+ * Kept across the connections.
+ *
+ * @param client : the rtmp_client.
+ * @param cb : the callback, or NULL to disable the tracing.
+ * @param userdata : userdata passed to cb.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_trace_cb(struct rtmp_client *client,
+				      rtmp_trace_cb_t cb,
+				      void *userdata);
+
+/**
+ * Sets the fast connection setup mode of an rtmp_client.
+ *
+ * By default, each step of the connection setup waits for the server answer
+ * to the previous one. The RTMP_FAST_CONNECT_* flags allow to remove some of
+ * these round trips. C0 and C1 are always written in a single segment. When
+ * any flag is set, the Nagle algorithm is also disabled (TCP_NODELAY) on the
+ * socket.
+ *
+ * Applied on the next call to rtmp_client_connect().
+ *
+ * @param client : the rtmp_client.
+ * @param flags : a combination of RTMP_FAST_CONNECT_* flags, 0 to disable.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_fast_connect(struct rtmp_client *client,
+					  uint32_t flags);
+
+/**
+ * Sets the TLS implementation of an rtmp_client, needed for the rtmps URLs.
+ *
+ * Applied on the next call to rtmp_client_connect().
+ *
+ * @param client : the rtmp_client.
+ * @param backend : the TLS implementation, copied, or NULL to disable the
+ * rtmps URLs.
+ * @param userdata : userdata passed to backend->session_new().
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int
+rtmp_client_set_tls_backend(struct rtmp_client *client,
+			    const struct rtmp_tls_backend *backend,
+			    void *userdata);
+
+/**
+ * Sets the mode of an rtmp_client.
+ *
+ * In RTMP_CLIENT_MODE_PLAY mode, the stream given by the key of the URL is
+ * played instead of published: the received audio, video and data messages
+ * are reported by the media_frame callback, and the rtmp_client_send_xxx()
+ * functions must not be used. With the automatic reconnection, the stream is
+ * played again once the connection is established again.
+ *
+ * The client must be disconnected (RTMP_DISCONNECTED state).
+ *
+ * @param client : the rtmp_client.
+ * @param mode : the client mode.
+ *
+ * @return 0 on success, -EINVAL if the media_frame callback is missing for
+ * the play mode, -EBUSY if the client is not disconnected, negative errno on
+ * other errors.
+ */
+RTMP_API int rtmp_client_set_mode(struct rtmp_client *client,
+				  enum rtmp_client_mode mode);
+
+/**
+ * Keeps a buffer of a received media frame after the media_frame callback
+ * returned.
+ *
+ * Each call must be balanced by a call to rtmp_media_buffer_unref(). A
+ * buffer can be shared by several frames. The buffers must be referenced and
+ * released on the thread of the client pomp_loop, and stay valid after the
+ * client is destroyed.
+ *
+ * @param buffer : the frame->buffer given to the media_frame callback.
+ */
+RTMP_API void rtmp_media_buffer_ref(uint8_t *buffer);
+
+/**
+ * Releases a buffer kept with rtmp_media_buffer_ref().
+ *
+ * @param buffer : the buffer to release.
+ */
+RTMP_API void rtmp_media_buffer_unref(uint8_t *buffer);
+
+/**
+ * Configures the automatic reconnection of an rtmp_client.
+ *
+ * When enabled, a connection lost after the stream was published is
+ * established again, the stream is published again under the same key and
+ * the last metadata and codec configurations are sent again. The audio and
+ * video frames still queued when the connection was lost are sent on the new
+ * connection if they are not older than config->max_latency, the video
+ * restarting from a keyframe.
+ *
+ * @param client : the rtmp_client.
+ * @param config : the reconnection configuration.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int
+rtmp_client_set_reconnect(struct rtmp_client *client,
+			  const struct rtmp_reconnect_config *config);
+
+/**
+ * Sets the time during which the resolved addresses of the server are reused
+ * by the next connections of an rtmp_client to the same host and port.
+ *
+ * The cached addresses are dropped if no connection can be established to
+ * any of them.
+ *
+ * @param client : the rtmp_client.
+ * @param ttl : cache duration in milliseconds (default is
+ * RTMP_DEFAULT_DNS_CACHE_TTL), 0 to disable the cache.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_dns_cache_ttl(struct rtmp_client *client,
+					   uint32_t ttl);
+
+/**
+ * Gets the connection setup timings of the last connection of an
+ * rtmp_client.
+ *
+ * @param client : the rtmp_client.
+ * @param timings : the timings (output).
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int
+rtmp_client_get_connect_timings(struct rtmp_client *client,
+				struct rtmp_connect_timings *timings);
+
+/**
+ * Gets the runtime statistics of an rtmp_client.
+ *
+ * The statistics are reset on each connection. If the client is not
+ * connected, all the statistics are 0.
+ *
+ * @param client : the rtmp_client.
+ * @param stats : the statistics (output).
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_get_stats(struct rtmp_client *client,
+				   struct rtmp_stats *stats);
+
 /**
  * Connects an rtmp_client to the given rtmp URL.
  *
  * If the client is already connected or connecting, an error is returned.
  *
+ * The URL format is rtmp://host[:port]/app/key, IPv6 literal addresses must be
+ * enclosed in brackets. rtmps://host[:port]/app/key URLs (default port 443)
+ * are also supported once a TLS implementation is set with
+ * rtmp_client_set_tls_backend(). The host name is resolved asynchronously,
+ * and the connection is attempted to all the resolved IPv4 and IPv6
+ * addresses, starting a new attempt every 250ms until one succeeds (Happy
+ * Eyeballs). A failure after this function returned is reported by the
+ * connection_state callback with RTMP_DISCONNECTED.
+ *
  * @param client : the rtmp_client to connect.
  * @param url : the rtmp url to connect to.
  *
@@ -235,6 +1147,10 @@ RTMP_API int rtmp_client_send_video_avcc(struct rtmp_client *client,
 /**
  * Sends a video frame to the server.
  *
+ * The frame is made of NAL units with 4 bytes length prefixes (AVCC), which
+ * are parsed to find the keyframes. See rtmp_client_send_video_frame_ext() to
+ * give the frame type, a composition time offset, or Annex B frames.
+ *
  * This function must be called on an RTMP_CONNECTED client.
  *
  * @param client : the connected rtmp_client which will send the data.
@@ -245,7 +1161,8 @@ RTMP_API int rtmp_client_send_video_avcc(struct rtmp_client *client,
  * @param frame_userdata : userdata passed back to the data_unref() callback.
  * buf must NOT be changed before being passed to data_unref().
  *
- * @return the number of waiting frames on success, negative errno on error.
+ * @return the number of waiting frames on success, -EBADMSG if a NAL unit
+ * length goes past the end of the frame, negative errno on other errors.
  */
 RTMP_API int rtmp_client_send_video_frame(struct rtmp_client *client,
 					  const uint8_t *buf,
@@ -253,6 +1170,61 @@ RTMP_API int rtmp_client_send_video_frame(struct rtmp_client *client,
 					  uint32_t timestamp,
 					  void *frame_userdata);
 
+/** Format of the video frames given to rtmp_client_send_video_frame_ext() */
+enum rtmp_video_format {
+	/** NAL units with 4 bytes big-endian length prefixes (AVCC) */
+	RTMP_VIDEO_FORMAT_AVCC = 0,
+	/** NAL units with start codes (ISO/IEC 14496-10 Annex B) */
+	RTMP_VIDEO_FORMAT_ANNEXB,
+};
+
+/** Composition time offset limits (signed 24 bits) */
+#define RTMP_VIDEO_CTS_MIN (-8388608)
+#define RTMP_VIDEO_CTS_MAX 8388607
+
+/** Video frame description, for rtmp_client_send_video_frame_ext() */
+struct rtmp_video_frame_info {
+	/** Frame format */
+	enum rtmp_video_format format;
+	/** Keyframe (IDR frame) */
+	int is_key;
+	/** Non-reference frame, dropped first by the drop policy */
+	int is_non_ref;
+	/** Composition time offset (presentation - decoding time), in ms */
+	int32_t cts;
+};
+
+/**
+ * Sends a video frame to the server, described by the caller.
+ *
+ * Unlike rtmp_client_send_video_frame(), the frame is not parsed to find the
+ * keyframes. Annex B frames are sent without being copied: each NAL unit is
+ * sent from buf, after a length prefix. An Annex B frame can have at most 256
+ * NAL units.
+ *
+ * This function must be called on an RTMP_CONNECTED client.
+ *
+ * @param client : the connected rtmp_client which will send the data.
+ * @param buf : pointer to a video frame.
+ * @param len : length of the video buffer.
+ * @param timestamp : decoding timestamp of the frame, in milliseconds, from
+ * the rtmp connection.
+ * @param info : the frame description.
+ * @param frame_userdata : userdata passed back to the data_unref() callback.
+ * buf must NOT be changed before being passed to data_unref().
+ *
+ * @return the number of waiting frames on success, -EBADMSG if an Annex B
+ * frame has no start code, -E2BIG if it has too many NAL units, negative
+ * errno on other errors.
+ */
+RTMP_API int
+rtmp_client_send_video_frame_ext(struct rtmp_client *client,
+				 const uint8_t *buf,
+				 size_t len,
+				 uint32_t timestamp,
+				 const struct rtmp_video_frame_info *info,
+				 void *frame_userdata);
+
 /**
  * Sends an AudioSpecifiConfig buffer to the server.
  * (See ISO/IEC 14496-3 1.6.2)
@@ -295,6 +1267,365 @@ RTMP_API int rtmp_client_send_audio_data(struct rtmp_client *client,
 					 uint32_t timestamp,
 					 void *frame_userdata);
 
+/** FLV tag types */
+enum rtmp_flv_tag_type {
+	/** Audio tag */
+	RTMP_FLV_TAG_AUDIO = 8,
+	/** Video tag */
+	RTMP_FLV_TAG_VIDEO = 9,
+	/** Script data tag (e.g. onMetaData) */
+	RTMP_FLV_TAG_SCRIPT = 18,
+};
+
+/**
+ * Sends the body of an FLV tag to the server, as it is.
+ *
+ * The audio and video tags are sent with their AudioTagHeader or
+ * VideoTagHeader, without being parsed or copied: the keyframes and
+ * disposable frames are found from the FrameType of the video tags, the
+ * codec configurations from the AVC and AAC sequence headers. The script
+ * data tags are sent as metadata, like with
+ * rtmp_client_send_packedmetadata().
+ *
+ * This function must be called on an RTMP_CONNECTED client.
+ *
+ * @param client : the connected rtmp_client which will send the data.
+ * @param type : the tag type.
+ * @param buf : pointer to the tag body (the FLV tag data, after the tag
+ * header).
+ * @param len : length of the tag body.
+ * @param timestamp : timestamp of the tag, in milliseconds, from the rtmp
+ * connection.
+ * @param frame_userdata : userdata passed back to the data_unref() callback.
+ * buf must NOT be changed before being passed to data_unref().
+ *
+ * @return the number of waiting frames on the tag data queue on success,
+ * negative errno on error.
+ */
+RTMP_API int rtmp_client_send_flv_tag(struct rtmp_client *client,
+				      enum rtmp_flv_tag_type type,
+				      const uint8_t *buf,
+				      size_t len,
+				      uint32_t timestamp,
+				      void *frame_userdata);
+
+/**
+ * Enables the thread-safe submission queue of an rtmp_client.
+ *
+ * The rtmp_client_send_xxx() functions must be called from the pomp loop
+ * thread. Once the submission queue is enabled, the rtmp_client_submit_xxx()
+ * functions can be called from any thread, without locking: the messages are
+ * pushed to a lock-free queue, and queued for sending in batches on the pomp
+ * loop.
+ *
+ * Messages which cannot be queued for sending once on the loop (client not
+ * connected, or data queue full) are released through the data_unref()
+ * callback, and counted in rtmp_stats.submit_dropped.
+ *
+ * This function must be called from the pomp loop thread while no other
+ * thread submits messages. Pending messages are released when the queue is
+ * resized or disabled, and when the client is destroyed.
+ *
+ * @param client : the rtmp_client.
+ * @param size : maximum number of pending submitted messages (rounded up to a
+ * power of two), 0 to disable the submission queue.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_client_set_submit_queue(struct rtmp_client *client,
+					  unsigned int size);
+
+/**
+ * Submits a metadata packet from any thread.
+ *
+ * See rtmp_client_send_packedmetadata() and rtmp_client_set_submit_queue().
+ *
+ * @return 0 on success, -EAGAIN if the submission queue is full, -EPERM if the
+ * submission queue is not enabled, negative errno on error.
+ */
+RTMP_API int rtmp_client_submit_packedmetadata(struct rtmp_client *client,
+					       const uint8_t *buf,
+					       size_t len,
+					       uint32_t timestamp,
+					       void *frame_userdata);
+
+/**
+ * Submits a video avcC configuration structure from any thread.
+ *
+ * See rtmp_client_send_video_avcc() and rtmp_client_set_submit_queue().
+ *
+ * @return 0 on success, -EAGAIN if the submission queue is full, -EPERM if the
+ * submission queue is not enabled, negative errno on error.
+ */
+RTMP_API int rtmp_client_submit_video_avcc(struct rtmp_client *client,
+					   const uint8_t *buf,
+					   size_t len,
+					   void *frame_userdata);
+
+/**
+ * Submits a video frame from any thread.
+ *
+ * See rtmp_client_send_video_frame() and rtmp_client_set_submit_queue(). The
+ * frame is parsed on the calling thread.
+ *
+ * @return 0 on success, -EAGAIN if the submission queue is full, -EPERM if the
+ * submission queue is not enabled, negative errno on error.
+ */
+RTMP_API int rtmp_client_submit_video_frame(struct rtmp_client *client,
+					    const uint8_t *buf,
+					    size_t len,
+					    uint32_t timestamp,
+					    void *frame_userdata);
+
+/**
+ * Submits an AudioSpecificConfig buffer from any thread.
+ *
+ * See rtmp_client_send_audio_specific_config() and
+ * rtmp_client_set_submit_queue().
+ *
+ * @return 0 on success, -EAGAIN if the submission queue is full, -EPERM if the
+ * submission queue is not enabled, negative errno on error.
+ */
+RTMP_API int
+rtmp_client_submit_audio_specific_config(struct rtmp_client *client,
+					 const uint8_t *buf,
+					 size_t len,
+					 void *frame_userdata);
+
+/**
+ * Submits an audio chunk from any thread.
+ *
+ * See rtmp_client_send_audio_data() and rtmp_client_set_submit_queue().
+ *
+ * @return 0 on success, -EAGAIN if the submission queue is full, -EPERM if the
+ * submission queue is not enabled, negative errno on error.
+ */
+RTMP_API int rtmp_client_submit_audio_data(struct rtmp_client *client,
+					   const uint8_t *buf,
+					   size_t len,
+					   uint32_t timestamp,
+					   void *frame_userdata);
+
+
+/**
+ * Publisher group callbacks
+ */
+struct rtmp_group_callbacks {
+	/**
+	 * Callback called when a buffer sent through an rtmp_group was sent or
+	 * dropped by all the members it was queued on, and can be reused.
+	 * (mandatory)
+	 *
+	 * @param data : the data which is no longer needed by the group.
+	 * @param buffer_userdata : user data passed along the buffer in a
+	 * rtmp_group_send_xxx() function.
+	 * @param userdata : userdata passed in rtmp_group_new.
+	 */
+	void (*data_unref)(uint8_t *data,
+			   void *buffer_userdata,
+			   void *userdata);
+};
+
+/**
+ * Creates a new publisher group.
+ *
+ * A publisher group sends the same stream to several rtmp_clients (e.g. to
+ * several servers). A buffer given to a rtmp_group_send_xxx() function is
+ * queued by reference on every connected member, and is released once through
+ * the group data_unref() callback when the last member has sent or dropped it.
+ * Each member keeps its own queues, drop policy and connection, so a slow
+ * server does not delay the other ones.
+ *
+ * @param cbs : the group callbacks.
+ * @param userdata : an opaque piece of data passed back to the callbacks.
+ *
+ * @return rtmp_group structure or NULL in case of error.
+ */
+RTMP_API struct rtmp_group *
+rtmp_group_new(const struct rtmp_group_callbacks *cbs, void *userdata);
+
+/**
+ * Destroys a publisher group.
+ *
+ * The members are removed from the group but are neither disconnected nor
+ * destroyed. The buffers still queued on the members are released through
+ * the group data_unref() callback once sent or dropped.
+ *
+ * @param group : the rtmp_group to destroy.
+ */
+RTMP_API void rtmp_group_destroy(struct rtmp_group *group);
+
+/**
+ * Adds an rtmp_client to a publisher group.
+ *
+ * A client can be in a single group. The client can still be used directly
+ * with the rtmp_client_send_xxx() functions, and is removed from its group
+ * when destroyed.
+ *
+ * @param group : the rtmp_group.
+ * @param client : the rtmp_client to add.
+ *
+ * @return 0 on success, -EBUSY if the client is already in a group, negative
+ * errno on error.
+ */
+RTMP_API int rtmp_group_add_client(struct rtmp_group *group,
+				   struct rtmp_client *client);
+
+/**
+ * Removes an rtmp_client from a publisher group.
+ *
+ * The buffers already queued on the client are still sent.
+ *
+ * @param group : the rtmp_group.
+ * @param client : the rtmp_client to remove.
+ *
+ * @return 0 on success, -ENOENT if the client is not in the group, negative
+ * errno on error.
+ */
+RTMP_API int rtmp_group_remove_client(struct rtmp_group *group,
+				      struct rtmp_client *client);
+
+/**
+ * Sends a metadata packet to all the connected members of a group.
+ *
+ * See rtmp_client_send_packedmetadata().
+ *
+ * @return the number of members the metadata was queued on, or negative
+ * errno if it was queued on none (-EAGAIN if no member is connected). Only if
+ * it was queued, buf is passed to the group data_unref() callback.
+ */
+RTMP_API int rtmp_group_send_packedmetadata(struct rtmp_group *group,
+					    const uint8_t *buf,
+					    size_t len,
+					    uint32_t timestamp,
+					    void *frame_userdata);
+
+/**
+ * Sends a video avcC configuration structure to all the connected members of
+ * a group.
+ *
+ * See rtmp_client_send_video_avcc().
+ *
+ * @return the number of members the configuration was queued on, or negative
+ * errno if it was queued on none (-EAGAIN if no member is connected). Only if
+ * it was queued, buf is passed to the group data_unref() callback.
+ */
+RTMP_API int rtmp_group_send_video_avcc(struct rtmp_group *group,
+					const uint8_t *buf,
+					size_t len,
+					void *frame_userdata);
+
+/**
+ * Sends a video frame to all the connected members of a group.
+ *
+ * See rtmp_client_send_video_frame(). The frame is parsed only once for all
+ * the members.
+ *
+ * @return the number of members the frame was queued on, or negative errno
+ * if it was queued on none (-EAGAIN if no member is connected). Only if it
+ * was queued, buf is passed to the group data_unref() callback.
+ */
+RTMP_API int rtmp_group_send_video_frame(struct rtmp_group *group,
+					 const uint8_t *buf,
+					 size_t len,
+					 uint32_t timestamp,
+					 void *frame_userdata);
+
+/**
+ * Sends an AudioSpecificConfig buffer to all the connected members of a
+ * group.
+ *
+ * See rtmp_client_send_audio_specific_config().
+ *
+ * @return the number of members the configuration was queued on, or negative
+ * errno if it was queued on none (-EAGAIN if no member is connected). Only if
+ * it was queued, buf is passed to the group data_unref() callback.
+ */
+RTMP_API int rtmp_group_send_audio_specific_config(struct rtmp_group *group,
+						   const uint8_t *buf,
+						   size_t len,
+						   void *frame_userdata);
+
+/**
+ * Sends an audio chunk to all the connected members of a group.
+ *
+ * See rtmp_client_send_audio_data().
+ *
+ * @return the number of members the audio chunk was queued on, or negative
+ * errno if it was queued on none (-EAGAIN if no member is connected). Only if
+ * it was queued, buf is passed to the group data_unref() callback.
+ */
+RTMP_API int rtmp_group_send_audio_data(struct rtmp_group *group,
+					const uint8_t *buf,
+					size_t len,
+					uint32_t timestamp,
+					void *frame_userdata);
+
+/**
+ * FLV file reader.
+ *
+ * The file is mapped in memory, and its tags are returned in place: the tags
+ * of a file can be sent with rtmp_client_send_flv_tag() without being read
+ * or copied.
+ */
+struct rtmp_flv_reader;
+
+/** Tag of a FLV file */
+struct rtmp_flv_tag {
+	/** Tag type */
+	enum rtmp_flv_tag_type type;
+	/** Timestamp, in milliseconds */
+	uint32_t timestamp;
+	/** Tag body, in the file mapping */
+	const uint8_t *data;
+	/** Tag body length */
+	size_t len;
+};
+
+/**
+ * Opens a FLV file.
+ *
+ * @param path : path of the FLV file.
+ *
+ * @return rtmp_flv_reader structure or NULL in case of error.
+ */
+RTMP_API struct rtmp_flv_reader *rtmp_flv_reader_new(const char *path);
+
+/**
+ * Closes a FLV file.
+ *
+ * The data of the tags returned by the reader must no longer be used, e.g.
+ * all the tags given to rtmp_client_send_flv_tag() must have been passed to
+ * data_unref().
+ *
+ * @param reader : the rtmp_flv_reader to close.
+ */
+RTMP_API void rtmp_flv_reader_destroy(struct rtmp_flv_reader *reader);
+
+/**
+ * Gets the next tag of a FLV file.
+ *
+ * The tags of unknown types are skipped. A truncated last tag (e.g. a
+ * recording which was interrupted) ends the file.
+ *
+ * @param reader : the rtmp_flv_reader.
+ * @param tag : the tag (output), valid until the reader is destroyed.
+ *
+ * @return 0 on success, -ENODATA at the end of the file, negative errno on
+ * other errors.
+ */
+RTMP_API int rtmp_flv_reader_next(struct rtmp_flv_reader *reader,
+				  struct rtmp_flv_tag *tag);
+
+/**
+ * Goes back to the first tag of a FLV file.
+ *
+ * @param reader : the rtmp_flv_reader.
+ *
+ * @return 0 on success, negative errno on error.
+ */
+RTMP_API int rtmp_flv_reader_rewind(struct rtmp_flv_reader *reader);
+
 
 #ifdef __cplusplus
 }
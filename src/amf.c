@@ -28,6 +28,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ULOG_TAG amf
@@ -51,12 +52,18 @@ ULOG_DECLARE_TAG(amf);
 #define AMF0_NULL_TAG 0x05
 #define AMF0_NULL_LEN 1
 
+#define AMF0_UNDEFINED_TAG 0x06
+#define AMF0_UNDEFINED_LEN 1
+
 #define AMF0_ECMA_TAG 0x08
 #define AMF0_ECMA_LEN 5
 
 #define AMF0_OBJ_END_TAG 0x09
 #define AMF0_OBJ_END_LEN 3
 
+/* Maximum nesting of objects & ECMA arrays skipped by amf_skip_data() */
+#define AMF_MAX_DEPTH 16
+
 /* Internal API */
 
 static int amf_put_number(struct rtmp_buffer *buf, double value);
@@ -70,22 +77,41 @@ static int amf_put_object_end(struct rtmp_buffer *buf);
 
 /* Encoder API */
 
-int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
+/* Grow buf to hold len more bytes */
+static int amf_reserve(struct rtmp_buffer *buf, size_t len)
 {
-	va_list ap;
+	uint8_t *tmp;
+
+	if (buf->len + len <= buf->cap)
+		return 0;
 
+	tmp = realloc(buf->buf, buf->len + len);
+	if (!tmp)
+		return -ENOMEM;
+	buf->buf = tmp;
+	buf->cap = buf->len + len;
+	return 0;
+}
+
+static int amf_template_add(struct amf_template *tpl,
+			    enum amf_op op,
+			    size_t len)
+{
+	if (tpl->count >= AMF_TEMPLATE_MAX_OPS)
+		return -E2BIG;
+	tpl->ops[tpl->count++] = op;
+	tpl->fixed_len += len;
+	return 0;
+}
+
+int amf_template_compile(struct amf_template *tpl, const char *fmt)
+{
 	char c, d, e;
 	int ret = 0;
 
 	int objcount = 0;
 	int arraycount = 0;
 
-	/* arg values */
-	double number;
-	uint8_t boolean;
-	const char *str;
-	int32_t ecma_len;
-
 	/* 1 if next arg MUST be a property (%s) */
 	int needprop = 0;
 
@@ -98,10 +124,12 @@ int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
 	 */
 
 
-	if (!buffer || !fmt)
+	if (!tpl || !fmt)
 		return -EINVAL;
 
-	va_start(ap, fmt);
+	tpl->count = 0;
+	tpl->fixed_len = 0;
+
 	while (*fmt && ret == 0) {
 		c = *fmt++;
 		switch (c) {
@@ -113,23 +141,28 @@ int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
 					ret = -EINVAL;
 					break;
 				}
-				number = va_arg(ap, double);
-				ret = amf_put_number(buffer, number);
+				ret = amf_template_add(
+					tpl, AMF_OP_NUMBER, AMF0_NUMBER_LEN);
 				break;
 			case 'u':
 				if (needprop) {
 					ret = -EINVAL;
 					break;
 				}
-				boolean = va_arg(ap, unsigned int);
-				ret = amf_put_boolean(buffer, boolean);
+				ret = amf_template_add(
+					tpl, AMF_OP_BOOLEAN, AMF0_BOOLEAN_LEN);
 				break;
 			case 's':
-				str = va_arg(ap, const char *);
 				if (needprop)
-					ret = amf_put_property(buffer, str);
+					ret = amf_template_add(
+						tpl,
+						AMF_OP_PROPERTY,
+						AMF0_STRING_LEN_BASE - 1);
 				else
-					ret = amf_put_string(buffer, str);
+					ret = amf_template_add(
+						tpl,
+						AMF_OP_STRING,
+						AMF0_STRING_LEN_BASE);
 				break;
 			default:
 				ULOGW("Unexpected format char %c", d);
@@ -150,7 +183,8 @@ int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
 			}
 			objcount++;
 			needprop = 1;
-			ret = amf_put_object_start(buffer);
+			ret = amf_template_add(
+				tpl, AMF_OP_OBJECT_START, AMF0_OBJ_START_LEN);
 			break;
 
 		case '}':
@@ -160,7 +194,8 @@ int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
 			}
 			objcount--;
 			needprop = (objcount > 0 || arraycount > 0);
-			ret = amf_put_object_end(buffer);
+			ret = amf_template_add(
+				tpl, AMF_OP_OBJECT_END, AMF0_OBJ_END_LEN);
 			break;
 
 		case '[':
@@ -176,8 +211,8 @@ int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
 			}
 			arraycount++;
 			needprop = 1;
-			ecma_len = va_arg(ap, int);
-			ret = amf_put_ecma_start(buffer, ecma_len);
+			ret = amf_template_add(
+				tpl, AMF_OP_ECMA_START, AMF0_ECMA_LEN);
 			break;
 
 		case ']':
@@ -187,7 +222,8 @@ int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
 			}
 			arraycount--;
 			needprop = (objcount > 0 || arraycount > 0);
-			ret = amf_put_object_end(buffer);
+			ret = amf_template_add(
+				tpl, AMF_OP_ECMA_END, AMF0_OBJ_END_LEN);
 			break;
 
 		case '0':
@@ -195,7 +231,7 @@ int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
 				ret = -EINVAL;
 				break;
 			}
-			ret = amf_put_null(buffer);
+			ret = amf_template_add(tpl, AMF_OP_NULL, AMF0_NULL_LEN);
 			needprop = (objcount > 0 || arraycount > 0);
 			break;
 
@@ -214,7 +250,6 @@ int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
 			break;
 		}
 	}
-	va_end(ap);
 
 	/* All arrays/objects should be terminated */
 	if (arraycount > 0 || objcount > 0)
@@ -223,26 +258,211 @@ int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
 	return ret;
 }
 
+int amf_template_vsize(const struct amf_template *tpl,
+		       va_list ap,
+		       size_t *size)
+{
+	size_t i, slen;
+	const char *str;
+
+	if (!tpl || !size)
+		return -EINVAL;
+
+	*size = tpl->fixed_len;
+	for (i = 0; i < tpl->count; i++) {
+		switch (tpl->ops[i]) {
+		case AMF_OP_NUMBER:
+			(void)va_arg(ap, double);
+			break;
+		case AMF_OP_BOOLEAN:
+			(void)va_arg(ap, unsigned int);
+			break;
+		case AMF_OP_STRING:
+		case AMF_OP_PROPERTY:
+			str = va_arg(ap, const char *);
+			if (!str)
+				return -EINVAL;
+			slen = strlen(str);
+			*size += slen;
+			/* Long strings have a 32 bits length */
+			if (slen > UINT16_MAX)
+				*size += AMF0_LONG_STRING_LEN_BASE -
+					 AMF0_STRING_LEN_BASE;
+			break;
+		case AMF_OP_ECMA_START:
+			(void)va_arg(ap, int);
+			break;
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+int amf_template_vencode(const struct amf_template *tpl,
+			 struct rtmp_buffer *buffer,
+			 va_list ap)
+{
+	va_list aq;
+	size_t i, size;
+	int ret;
+
+	if (!tpl || !buffer)
+		return -EINVAL;
+
+	/* Get the exact encoded size first, to grow the buffer only once */
+	va_copy(aq, ap);
+	ret = amf_template_vsize(tpl, aq, &size);
+	va_end(aq);
+	if (ret != 0)
+		return ret;
+	ret = amf_reserve(buffer, size);
+	if (ret != 0)
+		return ret;
+
+	for (i = 0; i < tpl->count && ret == 0; i++) {
+		switch (tpl->ops[i]) {
+		case AMF_OP_NUMBER:
+			ret = amf_put_number(buffer, va_arg(ap, double));
+			break;
+		case AMF_OP_BOOLEAN:
+			ret = amf_put_boolean(buffer, va_arg(ap, unsigned int));
+			break;
+		case AMF_OP_STRING:
+			ret = amf_put_string(buffer, va_arg(ap, const char *));
+			break;
+		case AMF_OP_PROPERTY:
+			ret = amf_put_property(buffer, va_arg(ap, const char *));
+			break;
+		case AMF_OP_OBJECT_START:
+			ret = amf_put_object_start(buffer);
+			break;
+		case AMF_OP_ECMA_START:
+			ret = amf_put_ecma_start(buffer, va_arg(ap, int));
+			break;
+		case AMF_OP_OBJECT_END:
+		case AMF_OP_ECMA_END:
+			ret = amf_put_object_end(buffer);
+			break;
+		case AMF_OP_NULL:
+			ret = amf_put_null(buffer);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+int amf_template_encode(const struct amf_template *tpl,
+			struct rtmp_buffer *buffer,
+			...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, buffer);
+	ret = amf_template_vencode(tpl, buffer, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+int amf_encode(struct rtmp_buffer *buffer, const char *fmt, ...)
+{
+	va_list ap;
+	struct amf_template tpl;
+	int ret;
+
+	if (!buffer || !fmt)
+		return -EINVAL;
+
+	ret = amf_template_compile(&tpl, fmt);
+	if (ret != 0)
+		return ret;
+
+	va_start(ap, fmt);
+	ret = amf_template_vencode(&tpl, buffer, ap);
+	va_end(ap);
+
+	return ret;
+}
+
 /* Decoder API */
 
 char *amf_get_msg_name(struct rtmp_buffer *buf, double *id)
 {
 	int ret;
+	struct amf_str name;
 	char *str;
 
-	ret = amf_get_string(buf, &str);
-	if (ret != 0) {
-		ULOG_ERRNO("amf_get_msg_name", -ret);
+	ret = amf_get_msg_name_view(buf, &name, id);
+	if (ret < 0)
 		return NULL;
+
+	str = strndup(name.ptr, name.len);
+	if (!str)
+		ULOG_ERRNO("strndup", ENOMEM);
+	return str;
+}
+
+int amf_get_msg_name_view(struct rtmp_buffer *buf,
+			  struct amf_str *name,
+			  double *id)
+{
+	int ret;
+	size_t rd;
+
+	if (!buf)
+		return -EINVAL;
+
+	rd = buf->rd;
+	ret = amf_get_string_view(buf, name);
+	if (ret < 0) {
+		ULOG_ERRNO("amf_get_msg_name", -ret);
+		return ret;
 	}
 
 	ret = amf_get_number(buf, id);
 	if (ret != 0) {
 		ULOG_ERRNO("amf_get_msg_name", -ret);
-		free(str);
-		return NULL;
+		buf->rd = rd;
+		return ret;
 	}
-	return str;
+	return 0;
+}
+
+int amf_str_eq(const struct amf_str *str, const char *cstr)
+{
+	size_t len;
+
+	if (!str || !cstr)
+		return 0;
+
+	len = strlen(cstr);
+	return str->len == len && memcmp(str->ptr, cstr, len) == 0;
+}
+
+int amf_object_next(struct rtmp_buffer *buf, struct amf_str *key)
+{
+	int ret;
+
+	if (!buf || !key)
+		return -EINVAL;
+
+	/* Object end is an empty key followed by the end tag */
+	ret = amf_get_object_end(buf);
+	if (ret == 0)
+		return 0;
+	else if (ret != -EBADMSG)
+		return ret;
+
+	ret = amf_get_property_view(buf, key);
+	if (ret < 0)
+		return ret;
+	return 1;
 }
 
 /* Internal implementation */
@@ -463,17 +683,18 @@ int amf_get_boolean(struct rtmp_buffer *buf, uint8_t *value)
 	return 0;
 }
 
-static ssize_t amf_get_stringp(struct rtmp_buffer *buf,
-			       char **stringp,
-			       size_t *len,
-			       int check_tag)
+/* Read a string slice, without the tag for the property names. Note:
+ * string->ptr is NOT null terminated! */
+static int amf_get_stringp(struct rtmp_buffer *buf,
+			   struct amf_str *string,
+			   int check_tag)
 {
 	uint8_t tag;
 	size_t size_offset;
 	size_t size_len;
-	ssize_t total_len;
-	/* Note : stringp is NOT null terminated ! */
-	if (!buf || !stringp || !len)
+	size_t len;
+
+	if (!buf || !string)
 		return -EINVAL;
 
 	/* we always need at least 2 bytes, for non-tag strings */
@@ -495,41 +716,51 @@ static ssize_t amf_get_stringp(struct rtmp_buffer *buf,
 		return -EBADMSG;
 	}
 
+	if (buf->rd + size_offset + size_len > buf->len)
+		return -ENOMEM;
+
 	if (size_len == 2) {
 		uint16_t val_ne;
 		memcpy(&val_ne, &buf->buf[buf->rd + size_offset], size_len);
-		*len = ntohs(val_ne);
+		len = ntohs(val_ne);
 	} else {
 		uint32_t val_ne;
 		memcpy(&val_ne, &buf->buf[buf->rd + size_offset], size_len);
-		*len = ntohl(val_ne);
+		len = ntohl(val_ne);
 	}
 
-	total_len = size_offset + size_len + *len;
-
-	if (buf->rd + total_len > buf->len)
+	if (len > buf->len - buf->rd - size_offset - size_len)
 		return -ENOMEM;
 
-	*stringp = (char *)&buf->buf[buf->rd + size_offset + size_len];
-	return total_len;
+	string->ptr = (const char *)&buf->buf[buf->rd + size_offset + size_len];
+	string->len = len;
+	buf->rd += size_offset + size_len + len;
+	return 0;
+}
+
+int amf_get_string_view(struct rtmp_buffer *buf, struct amf_str *string)
+{
+	return amf_get_stringp(buf, string, 1);
+}
+
+int amf_get_property_view(struct rtmp_buffer *buf, struct amf_str *key)
+{
+	return amf_get_stringp(buf, key, 0);
 }
 
 int amf_get_string(struct rtmp_buffer *buf, char **string)
 {
-	ssize_t data_len;
-	char *stringp;
-	size_t string_len;
+	int ret;
+	struct amf_str view;
 
 	if (!string)
 		return -EINVAL;
 
-	data_len = amf_get_stringp(buf, &stringp, &string_len, 1);
-	if (data_len < 0)
-		return data_len;
+	ret = amf_get_string_view(buf, &view);
+	if (ret < 0)
+		return ret;
 
-	buf->rd += data_len;
-
-	*string = strndup(stringp, string_len);
+	*string = strndup(view.ptr, view.len);
 	if (!*string)
 		return -errno;
 
@@ -538,20 +769,17 @@ int amf_get_string(struct rtmp_buffer *buf, char **string)
 
 int amf_get_property(struct rtmp_buffer *buf, char **key)
 {
-	ssize_t data_len;
-	char *stringp;
-	size_t string_len;
+	int ret;
+	struct amf_str view;
 
 	if (!key)
 		return -EINVAL;
 
-	data_len = amf_get_stringp(buf, &stringp, &string_len, 0);
-	if (data_len < 0)
-		return data_len;
+	ret = amf_get_property_view(buf, &view);
+	if (ret < 0)
+		return ret;
 
-	buf->rd += data_len;
-
-	*key = strndup(stringp, string_len);
+	*key = strndup(view.ptr, view.len);
 	if (!*key)
 		return -errno;
 
@@ -573,6 +801,25 @@ int amf_get_object_start(struct rtmp_buffer *buf)
 	return 0;
 }
 
+int amf_get_ecma_start(struct rtmp_buffer *buf, uint32_t *count)
+{
+	uint32_t count_ne;
+
+	if (!buf || !count)
+		return -EINVAL;
+
+	if (buf->rd + AMF0_ECMA_LEN > buf->len)
+		return -ENOMEM;
+
+	if (buf->buf[buf->rd] != AMF0_ECMA_TAG)
+		return -EBADMSG;
+
+	memcpy(&count_ne, &buf->buf[buf->rd + 1], sizeof(count_ne));
+	*count = ntohl(count_ne);
+	buf->rd += AMF0_ECMA_LEN;
+	return 0;
+}
+
 int amf_get_null(struct rtmp_buffer *buf)
 {
 	if (!buf)
@@ -604,14 +851,34 @@ int amf_get_object_end(struct rtmp_buffer *buf)
 	return 0;
 }
 
-int amf_skip_data(struct rtmp_buffer *buf)
+static int amf_skip_value(struct rtmp_buffer *buf, unsigned int depth);
+
+static int amf_skip_properties(struct rtmp_buffer *buf, unsigned int depth)
+{
+	int ret;
+	struct amf_str key;
+
+	if (depth >= AMF_MAX_DEPTH) {
+		ULOGE("Too many nested AMF objects");
+		return -EBADMSG;
+	}
+
+	while ((ret = amf_object_next(buf, &key)) == 1) {
+		ret = amf_skip_value(buf, depth + 1);
+		if (ret != 0)
+			return ret;
+	}
+	return ret;
+}
+
+static int amf_skip_value(struct rtmp_buffer *buf, unsigned int depth)
 {
 	uint8_t tag;
 	double number;
 	uint8_t boolean;
-	char *string;
-	size_t len;
-	ssize_t sret;
+	uint32_t count;
+	struct amf_str string;
+	int ret;
 
 	if (!buf)
 		return -EINVAL;
@@ -627,12 +894,29 @@ int amf_skip_data(struct rtmp_buffer *buf)
 		return amf_get_boolean(buf, &boolean);
 	case AMF0_STRING_TAG:
 	case AMF0_LONG_STRING_TAG:
-		sret = amf_get_stringp(buf, &string, &len, 1);
-		return sret < 0 ? sret : 0;
+		return amf_get_string_view(buf, &string);
+	case AMF0_OBJ_START_TAG:
+		ret = amf_get_object_start(buf);
+		if (ret != 0)
+			return ret;
+		return amf_skip_properties(buf, depth);
+	case AMF0_ECMA_TAG:
+		ret = amf_get_ecma_start(buf, &count);
+		if (ret != 0)
+			return ret;
+		return amf_skip_properties(buf, depth);
 	case AMF0_NULL_TAG:
 		return amf_get_null(buf);
+	case AMF0_UNDEFINED_TAG:
+		buf->rd += AMF0_UNDEFINED_LEN;
+		return 0;
 	default:
 		ULOGE("Cannot skip tag type %u", tag);
 		return -ENOSYS;
 	}
 }
+
+int amf_skip_data(struct rtmp_buffer *buf)
+{
+	return amf_skip_value(buf, 0);
+}
@@ -28,6 +28,8 @@
 
 #include "rtmp_internal.h"
 
+#include <stdarg.h>
+
 /** Wrapper for gcc printf attribute */
 #ifndef AMF_ATTRIBUTE_FORMAT_PRINTF
 #	if defined(__GNUC__) && defined(__MINGW32__) && !defined(__clang__)
@@ -42,9 +44,47 @@
 #endif /* !AMF_ATTRIBUTE_FORMAT_PRINTF */
 
 
+/* Maximum number of values in an AMF template */
+#define AMF_TEMPLATE_MAX_OPS 64
+
+enum amf_op {
+	AMF_OP_NUMBER = 0,
+	AMF_OP_BOOLEAN,
+	AMF_OP_STRING,
+	AMF_OP_PROPERTY,
+	AMF_OP_OBJECT_START,
+	AMF_OP_OBJECT_END,
+	AMF_OP_ECMA_START,
+	AMF_OP_ECMA_END,
+	AMF_OP_NULL,
+};
+
+/**
+ * AMF format compiled by amf_template_compile(), to encode messages without
+ * parsing the format string again.
+ */
+struct amf_template {
+	uint8_t ops[AMF_TEMPLATE_MAX_OPS];
+	size_t count;
+	/* Encoded size, excluding the strings content */
+	size_t fixed_len;
+};
+
+/**
+ * Slice of a string inside a decoded AMF buffer. The string is NOT
+ * null-terminated, and is only valid as long as the buffer is.
+ */
+struct amf_str {
+	const char *ptr;
+	size_t len;
+};
+
 /**
  * Encode an AMF message into the given buffer.
  *
+ * The exact encoded size is computed first: if needed, buf->buf is grown with
+ * realloc(), so it must be either NULL or allocated with malloc().
+ *
  * Available formatters & associated arg type:
  * - '%f' : Number (double)
  * - '%u' : Boolean (uint8_t)
@@ -70,6 +110,32 @@
 int amf_encode(struct rtmp_buffer *buf, const char *fmt, ...)
 	AMF_ATTRIBUTE_FORMAT_PRINTF(2, 3);
 
+/**
+ * Compile a format string (see amf_encode()) into a template.
+ *
+ * Returns 0 on success, -EINVAL if the format is invalid or -E2BIG if it has
+ * more than AMF_TEMPLATE_MAX_OPS values.
+ */
+int amf_template_compile(struct amf_template *tpl, const char *fmt);
+
+/**
+ * Get the encoded size of a message for the given template and args.
+ */
+int amf_template_vsize(const struct amf_template *tpl,
+		       va_list ap,
+		       size_t *size);
+
+/**
+ * Encode an AMF message from a compiled template, with the same args as
+ * amf_encode(). buf is grown as for amf_encode().
+ */
+int amf_template_encode(const struct amf_template *tpl,
+			struct rtmp_buffer *buf,
+			...);
+int amf_template_vencode(const struct amf_template *tpl,
+			 struct rtmp_buffer *buf,
+			 va_list ap);
+
 /**
  * Get the message name (first encoded string) and call ID (second encoded
  * Number) from an AMF buffer.
@@ -84,6 +150,36 @@ int amf_encode(struct rtmp_buffer *buf, const char *fmt, ...)
  */
 char *amf_get_msg_name(struct rtmp_buffer *buf, double *id);
 
+/**
+ * Same as amf_get_msg_name(), but without any allocation: name points inside
+ * the buffer.
+ *
+ * Returns 0 on success, or a negative errno on error.
+ */
+int amf_get_msg_name_view(struct rtmp_buffer *buf,
+			  struct amf_str *name,
+			  double *id);
+
+/**
+ * Compare a string slice with a null-terminated string.
+ *
+ * Returns 1 if both strings are equal, 0 otherwise.
+ */
+int amf_str_eq(const struct amf_str *str, const char *cstr);
+
+/**
+ * Iterate over the properties of an AMF object or ECMA array, whose start was
+ * already read with amf_get_object_start() or amf_get_ecma_start().
+ *
+ * On each call, the next property name is read into key, and the buffer is
+ * left on the property value, which the caller must then read with one of the
+ * getters, or skip with amf_skip_data().
+ *
+ * Returns 1 if a property was read, 0 once the object end was read, or a
+ * negative errno on error.
+ */
+int amf_object_next(struct rtmp_buffer *buf, struct amf_str *key);
+
 /* Low level getters */
 int amf_get_number(struct rtmp_buffer *buf, double *value);
 int amf_get_boolean(struct rtmp_buffer *buf, uint8_t *value);
@@ -91,10 +187,14 @@ int amf_get_string(struct rtmp_buffer *buf,
 		   char **string); /* Allocates memory */
 int amf_get_property(struct rtmp_buffer *buf,
 		     char **key); /* Allocates memory */
+int amf_get_string_view(struct rtmp_buffer *buf, struct amf_str *string);
+int amf_get_property_view(struct rtmp_buffer *buf, struct amf_str *key);
 int amf_get_object_start(struct rtmp_buffer *buf);
+int amf_get_ecma_start(struct rtmp_buffer *buf, uint32_t *count);
 int amf_get_null(struct rtmp_buffer *buf);
 int amf_get_object_end(struct rtmp_buffer *buf);
 
+/* Skip any value, including whole objects & ECMA arrays */
 int amf_skip_data(struct rtmp_buffer *buf);
 
 #endif /* _AMF_H_ */
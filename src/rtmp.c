@@ -28,22 +28,32 @@
 #include "amf.h"
 #include "rtmp_chunk_stream.h"
 #include "rtmp_internal.h"
+#include "rtmp_nal.h"
+#include "rtmp_resolver.h"
+#include "rtmp_submit_queue.h"
+#include "rtmp_tls.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libpomp.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <futils/list.h>
 #include <futils/random.h>
+#include <futils/timetools.h>
 
 #define ULOG_TAG rtmp
 #include <ulog.h>
@@ -51,18 +61,93 @@ ULOG_DECLARE_TAG(rtmp);
 
 #define HANDSHAKE_SIZE 1536
 
+/* Delay before starting a connection attempt to the next address, if the
+ * previous one neither succeeded nor failed (RFC 8305), in milliseconds */
+#define RTMP_CONNECT_ATTEMPT_DELAY 250
+
 #define RTMP_ONSTATUS_PUBLISH_CODE "NetStream.Publish.Start"
+#define RTMP_ONSTATUS_PLAY_CODE "NetStream.Play.Start"
+
+/* Buffer length announced to the server in play mode, in milliseconds */
+#define RTMP_PLAY_BUFFER_LENGTH 1000
 
 enum rtmp_internal_state {
 	RTMP_CONN_IDLE = 0,
+	RTMP_CONN_RESOLVING,
 	RTMP_CONN_WAIT_TCP,
+	RTMP_CONN_WAIT_TLS,
 	RTMP_CONN_WAIT_S0,
 	RTMP_CONN_WAIT_S1,
 	RTMP_CONN_WAIT_S2,
 	RTMP_CONN_WAIT_FMS,
 	RTMP_CONN_READY,
+	RTMP_CONN_WAIT_RECONNECT,
+};
+
+/* AMF messages sent by the client, compiled once */
+enum amf_cmd {
+	/* releaseStream / FCPublish / createStream */
+	AMF_CMD_STREAM = 0,
+	AMF_CMD_PUBLISH,
+	AMF_CMD_CHECKBW,
+	AMF_CMD_CONNECT,
+	AMF_CMD_DELETE_STREAM,
+	AMF_CMD_METADATA,
+
+	AMF_CMD_COUNT,
+};
+
+static const char *const amf_cmd_formats[AMF_CMD_COUNT] = {
+	[AMF_CMD_STREAM] = "%s,%f,0,%s",
+	[AMF_CMD_PUBLISH] = "%s,%f,0,%s,%s",
+	[AMF_CMD_CHECKBW] = "%s%f0",
+	[AMF_CMD_CONNECT] = "%s,%f,{%s:%s,%s:%s,%s:%s,%s:%s}",
+	[AMF_CMD_DELETE_STREAM] = "%s,%f,0,%f",
+	[AMF_CMD_METADATA] = "%s[%d,%s:%f,%s:%f,%s:%f,%s:%f,"
+			     "%s:%f,%s:%f,%s:%f,%s:%u,%s:%f]",
+};
+
+static struct amf_template amf_cmds[AMF_CMD_COUNT];
+
+/* AMF messages received from the server, dispatched by name through a hash
+ * table indexed once */
+struct amf_handler {
+	const char *name;
+	size_t len;
+	void (*cb)(struct rtmp_client *client,
+		   struct rtmp_buffer *data,
+		   const struct amf_str *name,
+		   double id);
 };
 
+/* Power of two, at least twice the number of handlers */
+#define AMF_HANDLERS_SIZE 16
+#define AMF_HANDLERS_MASK (AMF_HANDLERS_SIZE - 1)
+
+static const struct amf_handler *amf_handlers_index[AMF_HANDLERS_SIZE];
+
+static pthread_once_t amf_once = PTHREAD_ONCE_INIT;
+static int amf_status;
+
+static void index_amf_handlers(void);
+
+static void init_amf(void)
+{
+	int i, ret;
+
+	index_amf_handlers();
+
+	for (i = 0; i < AMF_CMD_COUNT; i++) {
+		ret = amf_template_compile(&amf_cmds[i], amf_cmd_formats[i]);
+		if (ret != 0) {
+			ULOG_ERRNO("amf_template_compile(%s)",
+				   -ret,
+				   amf_cmd_formats[i]);
+			amf_status = ret;
+		}
+	}
+}
+
 static inline char *xstrdup(const char *src)
 {
 	if (!src)
@@ -74,10 +159,14 @@ static enum rtmp_connection_state
 internal_to_public(enum rtmp_internal_state state)
 {
 	switch (state) {
+	case RTMP_CONN_RESOLVING:
+	case RTMP_CONN_WAIT_TCP:
+	case RTMP_CONN_WAIT_TLS:
 	case RTMP_CONN_WAIT_S0:
 	case RTMP_CONN_WAIT_S1:
 	case RTMP_CONN_WAIT_S2:
 	case RTMP_CONN_WAIT_FMS:
+	case RTMP_CONN_WAIT_RECONNECT:
 		return RTMP_CONNECTING;
 	case RTMP_CONN_READY:
 		return RTMP_CONNECTED;
@@ -92,8 +181,12 @@ static const char *internal_to_string(enum rtmp_internal_state state)
 	switch (state) {
 	case RTMP_CONN_IDLE:
 		return "IDLE";
+	case RTMP_CONN_RESOLVING:
+		return "RESOLVING";
 	case RTMP_CONN_WAIT_TCP:
 		return "WAIT_TCP";
+	case RTMP_CONN_WAIT_TLS:
+		return "WAIT_TLS";
 	case RTMP_CONN_WAIT_S0:
 		return "WAIT_S0";
 	case RTMP_CONN_WAIT_S1:
@@ -104,11 +197,20 @@ static const char *internal_to_string(enum rtmp_internal_state state)
 		return "WAIT_FMS";
 	case RTMP_CONN_READY:
 		return "READY";
+	case RTMP_CONN_WAIT_RECONNECT:
+		return "WAIT_RECONNECT";
 	default:
 		return "UNKNOWN";
 	}
 }
 
+struct connect_attempt {
+	int fd;
+	const struct rtmp_resolver_addr *addr;
+	/* Part of C0 + C1 sent with the SYN (TCP Fast Open) */
+	size_t c0c1_len;
+};
+
 struct rtmp_client {
 	/* Pomp loop */
 	struct pomp_loop *loop;
@@ -121,11 +223,20 @@ struct rtmp_client {
 	int sock;
 	struct rtmp_buffer buffer;
 
+	/* TLS implementation, and session of rtmps connections */
+	struct rtmp_tls_backend tls_backend;
+	int has_tls_backend;
+	void *tls_userdata;
+	struct rtmp_tls *tls;
+	/* Set once the TLS handshake is done */
+	int tls_connected;
+
 	/* Internal state */
 	enum rtmp_internal_state state;
 	enum rtmp_connection_state public_state;
 
 	/* RTMP Address */
+	int secure;
 	char *host;
 	int port;
 	char *app;
@@ -141,8 +252,154 @@ struct rtmp_client {
 
 	/* Saved for delete_stream */
 	double published_stream_id;
+
+	/* Publish or play mode */
+	enum rtmp_client_mode mode;
+
+	/* Outgoing chunk size (or RTMP_CHUNK_SIZE_AUTO) */
+	uint32_t tx_chunk_size;
+
+	/* Scheduler quantum */
+	size_t sched_quantum;
+	/* Audio aggregation window (ms, 0 if disabled) */
+	uint32_t aggr_window;
+	/* Pacer configuration, if enabled */
+	struct rtmp_pacing_config pacing;
+	int pacing_enabled;
+	/* Tx messages tracing callback (NULL if disabled) */
+	rtmp_trace_cb_t trace_cb;
+	void *trace_userdata;
+
+	/* Data queues limits, indexed by enum rtmp_data_queue */
+	struct rtmp_queue_config queue_config[2];
+
+	/* Video drop policy */
+	enum rtmp_drop_policy drop_policy;
+	uint32_t max_latency;
+
+	/* Low latency socket mode */
+	uint32_t notsent_lowat;
+	uint32_t sndbuf;
+	/* Set if TCP_NOTSENT_LOWAT was applied to the current socket */
+	int notsent_lowat_set;
+
+	/* Zero-copy transmission threshold (0 if disabled) */
+	size_t zerocopy_threshold;
+
+	/* Network estimation */
+	struct pomp_timer *bw_timer;
+	uint32_t bw_estimate_period;
+	uint32_t ack_window;
+
+	/* Fast connection setup (RTMP_FAST_CONNECT_* flags) */
+	uint32_t fast_connect;
+	/* Set once C0+C1 are fully written */
+	int c0c1_sent;
+	/* Set once releaseStream / FCPublish / createStream are queued */
+	int create_stream_sent;
+
+	/* Address resolution */
+	struct rtmp_resolver_req *resolver_req;
+	uint32_t dns_cache_ttl;
+	/* Cached addresses of the last resolution */
+	char *cache_host;
+	int cache_port;
+	uint64_t cache_expiry;
+	struct rtmp_resolver_addr cache_addrs[RTMP_RESOLVER_MAX_ADDRS];
+	size_t cache_count;
+
+	/* Concurrent connection attempts (Happy Eyeballs) */
+	struct rtmp_resolver_addr addrs[RTMP_RESOLVER_MAX_ADDRS];
+	size_t nb_addrs;
+	size_t next_addr;
+	struct connect_attempt attempts[RTMP_RESOLVER_MAX_ADDRS];
+	size_t nb_attempts;
+	struct pomp_timer *attempt_timer;
+	int connect_error;
+
+	/* Automatic reconnection */
+	struct rtmp_reconnect_config reconnect;
+	struct pomp_timer *reconnect_timer;
+	/* Number of consecutive reconnection attempts */
+	unsigned int retries;
+	/* Set once the stream was published, until rtmp_client_disconnect() */
+	int published;
+	/* Media messages kept for the next connection */
+	struct rtmp_tx_backlog *backlog;
+	/* Last codec configurations & metadata, sent again after a
+	 * reconnection */
+	struct rtmp_buffer avcc;
+	struct rtmp_buffer asc;
+	struct rtmp_buffer metadata;
+	uint32_t metadata_ts;
+
+	/* Connection setup timings */
+	uint64_t connect_start;
+	struct rtmp_connect_timings timings;
+
+	/* Publisher group, if any */
+	struct rtmp_group *group;
+	struct list_node group_node;
+
+	/* Messages submitted from other threads */
+	struct rtmp_submit_queue *submit;
+	uint64_t submit_dropped;
+};
+
+/* Media messages sent through a group or the submission queue */
+enum media_msg_type {
+	MEDIA_MSG_METADATA = 0,
+	MEDIA_MSG_VIDEO_CONFIG,
+	MEDIA_MSG_VIDEO,
+	MEDIA_MSG_AUDIO_CONFIG,
+	MEDIA_MSG_AUDIO,
+};
+
+struct rtmp_group {
+	struct rtmp_group_callbacks cbs;
+	void *userdata;
+
+	/* Member clients */
+	struct list_node clients;
+
+	/* Owner reference, plus one reference per frame being sent */
+	unsigned int refs;
 };
 
+/* Frame queued by reference on the chunk streams of several group members */
+struct group_frame {
+	struct rtmp_group *group;
+	void *frame_userdata;
+	/* Number of chunk streams still holding the frame */
+	unsigned int refs;
+};
+
+static void group_frame_unref(struct group_frame *frame, uint8_t *data);
+static void destroy_submit_queue(struct rtmp_client *client);
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+	uint64_t us;
+
+	time_get_monotonic(&ts);
+	time_timespec_to_us(&ts, &us);
+	return us;
+}
+
+/* Record the end of a connection setup phase, only the first time */
+static void set_phase_time(struct rtmp_client *client, uint64_t *phase)
+{
+	uint64_t elapsed;
+
+	if (*phase != 0)
+		return;
+
+	elapsed = get_time_us() - client->connect_start;
+	/* 0 means 'not reached' */
+	*phase = elapsed > 0 ? elapsed : 1;
+}
+
 static double get_next_amf_id(struct rtmp_client *client)
 {
 	double d;
@@ -172,51 +429,96 @@ static void set_state(struct rtmp_client *client,
 	client->public_state = pub;
 }
 
-static int send_full(int fd, void *buf, size_t len)
+/* send() on the client socket, through the TLS session if any, returns
+ * -errno on error */
+static ssize_t client_send(struct rtmp_client *client,
+			   const void *buf,
+			   size_t len)
+{
+	ssize_t ret;
+	int flags = 0;
+	struct iovec iov;
+
+	if (client->tls && !rtmp_tls_ktls_tx(client->tls)) {
+		iov.iov_base = (void *)buf;
+		iov.iov_len = len;
+		return rtmp_tls_writev(client->tls, &iov, 1);
+	}
+
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+
+	do {
+		ret = send(client->sock, buf, len, flags);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : ret;
+}
+
+/* recv() on the client socket, through the TLS session if any, returns -errno
+ * on error */
+static ssize_t client_recv(struct rtmp_client *client, void *buf, size_t len)
 {
 	ssize_t ret;
+
+	if (client->tls)
+		return rtmp_tls_recv(client->tls, buf, len);
+
 	do {
-		ret = send(fd, buf, len, 0);
+		ret = recv(client->sock, buf, len, 0);
 	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : ret;
+}
+
+static int send_full(struct rtmp_client *client, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	ret = client_send(client, buf, len);
 	if (ret < 0)
-		return -errno;
+		return (int)ret;
 	if ((size_t)ret != len)
 		return -EIO;
 	return 0;
 }
 
-static int send_c0(struct rtmp_client *client)
+/* Fill client->buffer with C0 + C1, so that they can be written in a single
+ * segment */
+static void prepare_c0c1(struct rtmp_client *client)
 {
-	uint8_t c0 = 3;
+	uint8_t *buf = client->buffer.buf;
 
-	if (!client || client->sock < 0)
-		return -EINVAL;
+	buf[0] = 3; /* C0: RTMP version */
+	memset(&buf[1], 0, 8); /* C1: time + constant value 0 */
+	futils_random_bytes(&buf[9], HANDSHAKE_SIZE - 8);
 
-	return send_full(client->sock, &c0, sizeof(c0));
+	client->buffer.len = HANDSHAKE_SIZE + 1;
+	client->buffer.rd = 0;
+	client->c0c1_sent = 0;
 }
 
-static int send_c1(struct rtmp_client *client)
+/* Send the remaining part of C0 + C1, returns -EAGAIN if the write is not
+ * complete */
+static int send_c0c1(struct rtmp_client *client)
 {
-	int ret = 0;
-	uint8_t *buf;
-	uint32_t *tmp;
+	ssize_t ret;
 
 	if (!client || client->sock < 0)
 		return -EINVAL;
 
-	buf = malloc(HANDSHAKE_SIZE);
-	if (!buf)
-		return -ENOMEM;
-
-	tmp = (uint32_t *)buf;
-	tmp[0] = 0;
-	tmp[1] = 0; /* Constant value 0 */
-
-	futils_random_bytes(&buf[8], HANDSHAKE_SIZE - 8);
+	while (client->buffer.rd < client->buffer.len) {
+		ret = client_send(client,
+				  &client->buffer.buf[client->buffer.rd],
+				  client->buffer.len - client->buffer.rd);
+		if (ret < 0)
+			return (int)ret;
+		client->buffer.rd += ret;
+	}
 
-	ret = send_full(client->sock, buf, HANDSHAKE_SIZE);
-	free(buf);
-	return ret;
+	client->buffer.len = 0;
+	client->buffer.rd = 0;
+	client->c0c1_sent = 1;
+	return 0;
 }
 
 static int send_c2(struct rtmp_client *client, uint8_t *buf, size_t len)
@@ -224,982 +526,2999 @@ static int send_c2(struct rtmp_client *client, uint8_t *buf, size_t len)
 	if (!client || client->sock < 0 || !buf || len != HANDSHAKE_SIZE)
 		return -EINVAL;
 
-	return send_full(client->sock, buf, len);
+	return send_full(client, buf, len);
 }
 
-struct rtmp_client *rtmp_client_new(struct pomp_loop *loop,
-				    const struct rtmp_callbacks *cbs,
-				    void *userdata)
+static void bw_timer_cb(struct pomp_timer *timer, void *userdata)
 {
-	struct rtmp_client *client;
-
-	if (!cbs || !loop) {
-		ULOG_ERRNO("rtmp_client_new", EINVAL);
-		return NULL;
-	}
-
-	client = calloc(1, sizeof(*client));
-	if (!client) {
-		ULOG_ERRNO("calloc", ENOMEM);
-		return NULL;
-	}
+	struct rtmp_client *client = userdata;
+	struct rtmp_bw_estimate estimate;
+	int ret;
 
-	client->loop = loop;
-	client->cbs = *cbs;
-	client->userdata = userdata;
-	set_state(client, RTMP_CONN_IDLE);
-	client->sock = -1;
+	if (!client->stream || !client->cbs.bw_estimate)
+		return;
 
-	client->buffer.buf = malloc(HANDSHAKE_SIZE);
-	if (!client->buffer.buf) {
-		free(client);
-		return NULL;
+	ret = get_bw_estimate(client->stream, &estimate);
+	if (ret < 0) {
+		ULOG_ERRNO("get_bw_estimate", -ret);
+		return;
 	}
-	client->buffer.cap = HANDSHAKE_SIZE;
 
-	return client;
+	client->cbs.bw_estimate(&estimate, client->userdata);
 }
 
-RTMP_API void rtmp_client_destroy(struct rtmp_client *client)
+static void pomp_event_cb(int fd, uint32_t revents, void *userdata);
+static void connection_error(struct rtmp_client *client);
+
+static void addr_to_str(const struct rtmp_resolver_addr *addr,
+			char *str,
+			size_t len)
 {
-	if (!client)
+	int ret;
+	char host[INET6_ADDRSTRLEN];
+	char serv[8];
+
+	ret = getnameinfo((const struct sockaddr *)&addr->addr,
+			  addr->len,
+			  host,
+			  sizeof(host),
+			  serv,
+			  sizeof(serv),
+			  NI_NUMERICHOST | NI_NUMERICSERV);
+	if (ret != 0) {
+		snprintf(str, len, "unknown");
 		return;
-	EINVAL;
+	}
+	if (addr->addr.ss_family == AF_INET6)
+		snprintf(str, len, "[%s]:%s", host, serv);
+	else
+		snprintf(str, len, "%s:%s", host, serv);
+}
 
-	if (client->state != RTMP_CONN_IDLE)
-		rtmp_client_disconnect(client);
+static void setup_low_latency(struct rtmp_client *client, int fd)
+{
+	int ret;
+	int val;
 
-	free(client->host);
-	free(client->app);
-	free(client->key);
-	free(client->buffer.buf);
+	client->notsent_lowat_set = 0;
 
-	free(client);
-}
+	if (client->sndbuf > 0) {
+		val = client->sndbuf > INT_MAX ? INT_MAX : client->sndbuf;
+		ret = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+		if (ret != 0)
+			ULOG_ERRNO("setsockopt(SO_SNDBUF)", errno);
+	}
 
-static void peer_bw_changed(uint32_t bandwidth, void *userdata)
-{
-	struct rtmp_client *client = userdata;
+	if (client->notsent_lowat == 0)
+		return;
 
-	if (client->cbs.peer_bw_changed)
-		client->cbs.peer_bw_changed(bandwidth, client->userdata);
-	else
-		ULOGI("Peer BW changed to %" PRIu32 " B/s", bandwidth);
+#ifdef TCP_NOTSENT_LOWAT
+	val = client->notsent_lowat > INT_MAX ? INT_MAX : client->notsent_lowat;
+	ret = setsockopt(
+		fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val, sizeof(val));
+	if (ret != 0) {
+		ULOG_ERRNO("setsockopt(TCP_NOTSENT_LOWAT)", errno);
+		return;
+	}
+	client->notsent_lowat_set = 1;
+#else
+	ULOGW("TCP_NOTSENT_LOWAT not supported, low latency mode disabled");
+#endif
 }
 
-static void handle_connect_result(struct rtmp_client *client,
-				  struct rtmp_buffer *data,
-				  const char *name,
-				  double id)
+static int new_socket(struct rtmp_client *client, int family)
 {
-	double cmd_id;
 	int ret;
+	int fd;
+	int flags;
 
-	ULOGI("Handle connect result");
+	fd = socket(family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
 
-	/* Send releaseStream / FCPublish / createStream */
-	cmd_id = get_next_amf_id(client);
-	client->buffer.len = 0;
-	ret = amf_encode(&client->buffer,
-			 "%s,%f,0,%s",
-			 "releaseStream",
-			 cmd_id,
-			 client->key);
-	if (ret != 0) {
-		ULOG_ERRNO("amf_encode", -ret);
+	flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) {
+		ret = -errno;
 		goto error;
 	}
-	ret = send_amf_message(client->stream, &client->buffer);
-	if (ret < 0) {
-		ULOG_ERRNO("send_amf_message", -ret);
+	ret = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	if (ret == -1) {
+		ret = -errno;
 		goto error;
 	}
 
-	cmd_id = get_next_amf_id(client);
-	client->buffer.len = 0;
-	ret = amf_encode(&client->buffer,
-			 "%s,%f,0,%s",
-			 "FCPublish",
-			 cmd_id,
-			 client->key);
+#ifdef SO_NOSIGPIPE
+	flags = 1;
+	ret = setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &flags, sizeof(flags));
 	if (ret != 0) {
-		ULOG_ERRNO("amf_encode", -ret);
-		goto error;
-	}
-	ret = send_amf_message(client->stream, &client->buffer);
-	if (ret < 0) {
-		ULOG_ERRNO("send_amf_message", -ret);
+		ret = -errno;
 		goto error;
 	}
+#endif
 
-	client->create_stream_id = get_next_amf_id(client);
-	client->buffer.len = 0;
-	ret = amf_encode(&client->buffer,
-			 "%s,%f,0,%s",
-			 "createStream",
-			 client->create_stream_id,
-			 client->key);
-	if (ret != 0) {
-		ULOG_ERRNO("amf_encode", -ret);
-		goto error;
-	}
-	ret = send_amf_message(client->stream, &client->buffer);
-	if (ret < 0) {
-		ULOG_ERRNO("send_amf_message", -ret);
-		goto error;
+	if (client->fast_connect != 0) {
+		/* Do not delay the small setup messages until the previous
+		 * ones are acknowledged */
+		flags = 1;
+		ret = setsockopt(
+			fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+		if (ret != 0)
+			ULOG_ERRNO("setsockopt(TCP_NODELAY)", errno);
 	}
 
-	return;
+	setup_low_latency(client, fd);
+
+	if (client->cbs.socket_cb)
+		client->cbs.socket_cb(fd, client->userdata);
+
+	return fd;
 
 error:
-	rtmp_client_disconnect(client);
+	close(fd);
+	return ret;
 }
 
-static void handle_create_stream_result(struct rtmp_client *client,
-					struct rtmp_buffer *data,
-					const char *name,
-					double id)
+/* Connect the socket, sending C0 + C1 with the SYN if TCP Fast Open is
+ * enabled. c0c1_len is set to the length of C0 + C1 which was sent. Returns 0
+ * or -EINPROGRESS on success */
+static int connect_socket(struct rtmp_client *client,
+			  int fd,
+			  const struct rtmp_resolver_addr *addr,
+			  size_t *c0c1_len)
 {
 	int ret;
-	double cmd_id;
-	ULOGI("Handle create_stream result");
 
-	/* Remaining message format should be NULL followed by the stream ID */
-	ret = amf_get_null(data);
-	if (ret != 0) {
-		ULOG_ERRNO("amf_get_null", -ret);
-		goto error;
-	}
-	ret = amf_get_number(data, &client->published_stream_id);
-	if (ret != 0) {
-		ULOG_ERRNO("amf_get_number", -ret);
-		goto error;
+	*c0c1_len = 0;
+
+#ifdef MSG_FASTOPEN
+	/* With TLS, the first data is the ClientHello, written by the TLS
+	 * implementation */
+	if ((client->fast_connect & RTMP_FAST_CONNECT_TFO) && !client->secure) {
+		ssize_t sret;
+		sret = sendto(fd,
+			      client->buffer.buf,
+			      client->buffer.len,
+			      MSG_FASTOPEN,
+			      (const struct sockaddr *)&addr->addr,
+			      addr->len);
+		if (sret >= 0) {
+			/* Data (or a part of it) was queued with the SYN */
+			*c0c1_len = sret;
+			return -EINPROGRESS;
+		}
+		ret = -errno;
+		/* No cookie yet: a plain SYN was sent */
+		if (ret == -EINPROGRESS)
+			return ret;
+		if (ret != -EOPNOTSUPP)
+			return ret;
+		ULOGI("TCP Fast Open not available, using a regular connect");
 	}
+#endif
 
-	cmd_id = get_next_amf_id(client);
-	client->buffer.len = 0;
-	ret = amf_encode(&client->buffer,
-			 "%s,%f,0,%s,%s",
-			 "publish",
-			 cmd_id,
-			 client->key,
-			 "live");
-	if (ret != 0) {
-		ULOG_ERRNO("amf_encode", -ret);
-		goto error;
-	}
-	ret = send_amf_message(client->stream, &client->buffer);
-	if (ret < 0) {
-		ULOG_ERRNO("send_amf_message", -ret);
-		goto error;
+	ret = connect(fd, (const struct sockaddr *)&addr->addr, addr->len);
+	if (ret < 0)
+		ret = -errno;
+	return ret;
+}
+
+/* Removes a connection attempt, its socket is closed unless keep is set */
+static void remove_connect_attempt(struct rtmp_client *client,
+				   size_t idx,
+				   int keep)
+{
+	struct connect_attempt *attempt = &client->attempts[idx];
+
+	if (!keep) {
+		pomp_loop_remove(client->loop, attempt->fd);
+		close(attempt->fd);
 	}
 
-	return;
-error:
-	rtmp_client_disconnect(client);
+	client->nb_attempts--;
+	memmove(attempt,
+		attempt + 1,
+		(client->nb_attempts - idx) * sizeof(*attempt));
 }
 
-static void handle_status_update(struct rtmp_client *client,
-				 struct rtmp_buffer *data,
-				 const char *name,
-				 double id)
+static void close_connect_attempts(struct rtmp_client *client)
 {
-	char *key = NULL, *value = NULL;
-	char *code = NULL;
-	char *desc = NULL;
-	int is_error = 0;
-	int ret;
-	ULOGI("Handle onStatus");
+	while (client->nb_attempts > 0)
+		remove_connect_attempt(client, client->nb_attempts - 1, 0);
+	pomp_timer_clear(client->attempt_timer);
+}
 
-	/* Skip the NULL command object & start the Info object */
-	ret = amf_get_null(data);
-	if (ret != 0) {
-		ULOG_ERRNO("amf_get_null", -ret);
-		goto error;
-	}
-	ret = amf_get_object_start(data);
-	if (ret != 0) {
-		ULOG_ERRNO("amf_get_object_start", -ret);
-		goto error;
-	}
+/* Starts a connection attempt to the next address which can be tried. The
+ * following attempt is started after RTMP_CONNECT_ATTEMPT_DELAY if no
+ * connection succeeded or failed meanwhile */
+static int start_connect_attempt(struct rtmp_client *client)
+{
+	int ret;
+	int fd;
+	size_t c0c1_len;
+	const struct rtmp_resolver_addr *addr;
+	char str[INET6_ADDRSTRLEN + 10];
+
+	while (client->next_addr < client->nb_addrs) {
+		addr = &client->addrs[client->next_addr++];
+		addr_to_str(addr, str, sizeof(str));
+
+		fd = new_socket(client, addr->addr.ss_family);
+		if (fd < 0) {
+			ULOG_ERRNO("socket(%s)", -fd, str);
+			client->connect_error = fd;
+			continue;
+		}
 
-	while (1) {
-		free(key);
-		free(value);
-		key = value = NULL;
-		ret = amf_get_property(data, &key);
-		if (ret != 0)
-			break;
-		if (key[0] == '\0')
-			break;
-		ret = amf_get_string(data, &value);
+		ret = connect_socket(client, fd, addr, &c0c1_len);
+		if (ret == -EINPROGRESS)
+			ret = 0;
+		if (ret == 0) {
+			ret = pomp_loop_add(client->loop,
+					    fd,
+					    POMP_FD_EVENT_OUT,
+					    pomp_event_cb,
+					    client);
+		}
 		if (ret != 0) {
-			/* We only handle string value, skip other values */
-			amf_skip_data(data);
+			ULOG_ERRNO("connect(%s)", -ret, str);
+			close(fd);
+			client->connect_error = ret;
 			continue;
 		}
 
-		if (strcmp("level", key) == 0)
-			is_error = (strcmp("error", value) == 0);
-		else if (strcmp("code", key) == 0)
-			code = xstrdup(value);
-		else if (strcmp("description", key) == 0)
-			desc = xstrdup(value);
-	}
-	free(key);
-	free(value);
-
-	if (is_error) {
-		ULOGE("Server error: %s",
-		      desc ? desc : (code ? code : "Unknown error"));
-		goto error;
-	}
+		ULOGI("Connecting to %s", str);
+		client->attempts[client->nb_attempts].fd = fd;
+		client->attempts[client->nb_attempts].addr = addr;
+		client->attempts[client->nb_attempts].c0c1_len = c0c1_len;
+		client->nb_attempts++;
 
-	if (!code) {
-		ULOGE("Missing 'code' property in server answer");
-		goto error;
+		if (client->next_addr < client->nb_addrs)
+			pomp_timer_set(client->attempt_timer,
+				       RTMP_CONNECT_ATTEMPT_DELAY);
+		return 0;
 	}
 
-	if (strcmp(RTMP_ONSTATUS_PUBLISH_CODE, code) != 0) {
-		ULOGE("Bad answer code : %s, expected %s",
-		      code,
-		      RTMP_ONSTATUS_PUBLISH_CODE);
-		goto error;
-	}
-	free(desc);
-	free(code);
+	return client->connect_error;
+}
 
-	set_state(client, RTMP_CONN_READY);
-	return;
-error:
-	free(desc);
-	free(code);
-	rtmp_client_disconnect(client);
+static void invalidate_addr_cache(struct rtmp_client *client)
+{
+	free(client->cache_host);
+	client->cache_host = NULL;
+	client->cache_count = 0;
 }
 
-static void handle_bwdone(struct rtmp_client *client,
-			  struct rtmp_buffer *data,
-			  const char *name,
-			  double id)
+static int start_connection(struct rtmp_client *client,
+			    const struct rtmp_resolver_addr *addrs,
+			    size_t count)
 {
 	int ret;
-	double cmd_id;
-	ULOGI("Handle onBWDone");
 
+	memcpy(client->addrs, addrs, count * sizeof(*addrs));
+	client->nb_addrs = count;
+	client->next_addr = 0;
+	client->connect_error = -EHOSTUNREACH;
 
-	cmd_id = get_next_amf_id(client);
-	client->buffer.len = 0;
-	ret = amf_encode(&client->buffer, "%s%f0", "_checkbw", cmd_id);
-	if (ret != 0) {
-		ULOG_ERRNO("amf_encode", -ret);
-		goto error;
-	}
-	ret = send_amf_message(client->stream, &client->buffer);
-	if (ret < 0) {
-		ULOG_ERRNO("send_amf_message", -ret);
-		goto error;
-	}
+	ret = start_connect_attempt(client);
+	if (ret < 0)
+		return ret;
 
-	return;
-error:
-	rtmp_client_disconnect(client);
+	set_state(client, RTMP_CONN_WAIT_TCP);
+	return 0;
 }
 
-static void amf_msg(struct rtmp_buffer *data, void *userdata)
+/* Checks the result of a connection attempt. If it succeeded, the other
+ * attempts are closed and client->sock is set. Returns a negative errno if no
+ * attempt is left */
+static int finish_connect_attempt(struct rtmp_client *client, int fd)
 {
-	struct rtmp_client *client = userdata;
-	char *name;
-	double id;
-	name = amf_get_msg_name(data, &id);
+	int ret, sockerr;
+	socklen_t len;
+	size_t idx;
+	struct connect_attempt *attempt = NULL;
+	char str[INET6_ADDRSTRLEN + 10];
 
-	if (strcmp("_result", name) == 0) {
-		if (id == client->connect_id)
-			handle_connect_result(client, data, name, id);
-		else if (id == client->create_stream_id)
-			handle_create_stream_result(client, data, name, id);
-		else
-			ULOGW("Got a result for an unfollowed call (%f)", id);
-	} else if (strcmp("_error", name) == 0) {
-		if (id == client->connect_id) {
-			ULOGE("connect failed");
-			rtmp_client_disconnect(client);
-		} else if (id == client->create_stream_id) {
-			ULOGE("create_stream failed");
-			rtmp_client_disconnect(client);
-		} else {
-			ULOGW("Got an error for an unfollowed call (%f)", id);
+	for (idx = 0; idx < client->nb_attempts; idx++) {
+		if (client->attempts[idx].fd == fd) {
+			attempt = &client->attempts[idx];
+			break;
 		}
-	} else if (strcmp("onStatus", name) == 0) {
-		handle_status_update(client, data, name, id);
-	} else if (strcmp("onBWDone", name) == 0) {
-		handle_bwdone(client, data, name, id);
-	} else {
-		ULOGW("Unexpected message %s", name);
 	}
+	if (!attempt)
+		return 0;
 
-	free(name);
-}
+	addr_to_str(attempt->addr, str, sizeof(str));
 
-static void data_sent(uint8_t *data, void *data_userdata, void *userdata)
-{
-	struct rtmp_client *client = userdata;
-	client->cbs.data_unref(data, data_userdata, client->userdata);
+	len = sizeof(sockerr);
+	ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, &sockerr, &len);
+	if (ret < 0)
+		ret = -errno;
+	else if (sockerr != 0)
+		ret = -sockerr;
+
+	if (ret < 0) {
+		ULOG_ERRNO("connect(%s)", -ret, str);
+		client->connect_error = ret;
+		remove_connect_attempt(client, idx, 0);
+
+		/* Do not wait for the attempt delay to try the next address */
+		if (client->next_addr < client->nb_addrs) {
+			pomp_timer_clear(client->attempt_timer);
+			start_connect_attempt(client);
+		}
+		if (client->nb_attempts > 0)
+			return 0;
+
+		invalidate_addr_cache(client);
+		return client->connect_error;
+	}
+
+	ULOGI("Connected to %s", str);
+	client->sock = fd;
+	/* Part of C0 + C1 already sent with the SYN */
+	client->buffer.rd = attempt->c0c1_len;
+	remove_connect_attempt(client, idx, 1);
+	close_connect_attempts(client);
+
+	return 0;
 }
 
-static void pomp_idle_disconnect(void *userdata)
+static void attempt_timer_cb(struct pomp_timer *timer, void *userdata)
 {
 	struct rtmp_client *client = userdata;
-	rtmp_client_disconnect(client);
+	int ret;
+
+	if (client->state != RTMP_CONN_WAIT_TCP || client->sock >= 0)
+		return;
+
+	ret = start_connect_attempt(client);
+	if (ret < 0 && client->nb_attempts == 0) {
+		invalidate_addr_cache(client);
+		connection_error(client);
+	}
 }
 
-static void rtmp_chunk_stream_disconnected(void *userdata)
+static void resolver_cb(int status,
+			const struct rtmp_resolver_addr *addrs,
+			size_t count,
+			void *userdata)
 {
 	struct rtmp_client *client = userdata;
-	pomp_loop_idle_add(client->loop, pomp_idle_disconnect, client);
-}
-
-static const struct rtmp_chunk_cbs chunk_cbs = {
-	.peer_bw_changed = peer_bw_changed,
-	.amf_msg = amf_msg,
-	.data_sent = data_sent,
-	.disconnected = rtmp_chunk_stream_disconnected,
-};
+	int ret;
 
-static int parse_uri(struct rtmp_client *client,
-		     const char *uri,
-		     uint16_t *port,
-		     struct in_addr *addr)
-{
-	int ret = 0;
-	char *raw, *tmp;
-	char *raw_addr, *app, *key;
-	char *host, *port_s;
+	client->resolver_req = NULL;
 
-	struct addrinfo *infos, *i;
+	if (status < 0) {
+		ULOG_ERRNO("resolve(%s)", -status, client->host);
+		goto error;
+	}
 
-	if (!uri || !port || !addr)
-		return -EINVAL;
+	if (client->dns_cache_ttl > 0) {
+		invalidate_addr_cache(client);
+		client->cache_host = xstrdup(client->host);
+		if (client->cache_host) {
+			client->cache_port = client->port;
+			client->cache_expiry = get_time_us() +
+					       client->dns_cache_ttl * 1000ULL;
+			memcpy(client->cache_addrs,
+			       addrs,
+			       count * sizeof(*addrs));
+			client->cache_count = count;
+		}
+	}
 
-	ULOGI("Parsing %s", uri);
+	ret = start_connection(client, addrs, count);
+	if (ret < 0)
+		goto error;
 
-	if (strncmp(uri, "rtmp://", 7) != 0)
-		return -EINVAL;
+	return;
 
-	raw = xstrdup(&uri[7]);
-	if (!raw) {
-		ret = -EINVAL;
-		goto exit;
-	}
+error:
+	connection_error(client);
+}
 
-	/* Format is host[:port]/app/key */
-	raw_addr = strtok_r(raw, "/", &tmp);
-	if (!raw_addr) {
-		ret = -EINVAL;
-		goto exit;
-	}
-	app = strtok_r(NULL, "/", &tmp);
-	if (!app) {
-		ret = -EINVAL;
-		goto exit;
-	}
-	key = strtok_r(NULL, "", &tmp);
-	if (!key) {
-		ret = -EINVAL;
-		goto exit;
-	}
+/* Start the connection to client->host, using the cached addresses if still
+ * valid */
+static int start_connect(struct rtmp_client *client)
+{
+	int ret;
 
-	/* search for port number in address */
-	host = strtok_r(raw_addr, ":", &tmp);
-	port_s = strtok_r(NULL, "", &tmp);
-	if (port_s) {
-		uint16_t p;
-		int match = sscanf(port_s, "%hu", &p);
-		if (match != 1) {
-			ret = -EINVAL;
-			goto exit;
-		}
-		*port = htons(p);
-	} else {
-		*port = htons(DEFAULT_RTMP_PORT);
+	client->connect_start = get_time_us();
+	memset(&client->timings, 0, sizeof(client->timings));
+	client->create_stream_sent = 0;
+	prepare_c0c1(client);
+
+	if (client->cache_host && client->cache_port == client->port &&
+	    strcmp(client->cache_host, client->host) == 0 &&
+	    get_time_us() < client->cache_expiry) {
+		ULOGI("Using cached addresses for %s", client->host);
+		ret = start_connection(
+			client, client->cache_addrs, client->cache_count);
+		if (ret < 0)
+			invalidate_addr_cache(client);
+		return ret;
 	}
 
-	ret = getaddrinfo(host, NULL, NULL, &infos);
-	if (ret != 0) {
-		ret = -EFAULT;
-		goto exit;
+	ret = rtmp_resolver_start(client->loop,
+				  client->host,
+				  client->port,
+				  resolver_cb,
+				  client,
+				  &client->resolver_req);
+	if (ret < 0) {
+		ULOG_ERRNO("rtmp_resolver_start", -ret);
+		return ret;
 	}
 
-	i = infos;
-	for (i = infos; i; i = i->ai_next) {
-		struct sockaddr_in *ai;
-		if (i->ai_family != AF_INET)
-			continue;
-		ai = (struct sockaddr_in *)i->ai_addr;
-		addr->s_addr = ai->sin_addr.s_addr;
-		break;
-	}
+	set_state(client, RTMP_CONN_RESOLVING);
+	return 0;
+}
 
-	freeaddrinfo(infos);
+/* Close the current connection, whatever its state */
+static void close_connection(struct rtmp_client *client)
+{
+	pomp_timer_clear(client->bw_timer);
 
-	if (!i) {
-		ret = -EFAULT;
-		goto exit;
+	if (client->resolver_req) {
+		rtmp_resolver_cancel(client->resolver_req);
+		client->resolver_req = NULL;
 	}
+	close_connect_attempts(client);
 
-	client->host = xstrdup(host);
-	client->port = ntohs(*port);
-	client->app = xstrdup(app);
-	client->key = xstrdup(key);
+	/* We remove the fd from the loop when creating a chunk_stream. */
+	if (client->stream)
+		delete_chunk_stream(client->stream);
+	else if (client->sock >= 0)
+		pomp_loop_remove(client->loop, client->sock);
+	client->stream = NULL;
 
-	ULOGI("Address resolution :");
-	ULOGI("Input string : %s", uri);
-	ULOGI("host   : %s", host);
-	ULOGI("port_s : %s", port_s);
-	ULOGI("Resolved address : %x (%s)", addr->s_addr, inet_ntoa(*addr));
-	ULOGI("Resolved port    : %hu", ntohs(*port));
-	ULOGI("App : %s", client->app);
-	ULOGI("Key : %s", client->key);
+	rtmp_tls_destroy(client->tls);
+	client->tls = NULL;
+	client->tls_connected = 0;
 
-exit:
-	free(raw);
-	return ret;
+	if (client->sock >= 0)
+		close(client->sock);
+	client->sock = -1;
+	client->c0c1_sent = 0;
+	client->create_stream_sent = 0;
+	client->buffer.len = 0;
+	client->buffer.rd = 0;
 }
 
-static void handle_wait_tcp(struct rtmp_client *client)
+static uint32_t get_reconnect_delay(struct rtmp_client *client)
 {
-	int sockerr, ret;
-	socklen_t len;
+	unsigned int i;
+	uint32_t delay;
+
+	/* The first retry is immediate */
+	if (client->retries <= 1)
+		return 0;
+
+	delay = client->reconnect.min_delay;
+	for (i = 2; i < client->retries && delay < client->reconnect.max_delay;
+	     i++)
+		delay *= 2;
+	return delay < client->reconnect.max_delay ? delay
+						   : client->reconnect.max_delay;
+}
 
-	if (!client)
+/* Called on any connection error: the client is disconnected, or reconnected
+ * if enabled and the stream was already published */
+static void connection_error(struct rtmp_client *client)
+{
+	uint32_t delay;
+
+	if (!client->reconnect.enabled || !client->published) {
+		rtmp_client_disconnect(client);
 		return;
+	}
 
-	len = sizeof(sockerr);
-	ret = getsockopt(client->sock, SOL_SOCKET, SO_ERROR, &sockerr, &len);
-	if (ret < 0) {
-		ULOG_ERRNO("getsockopt", errno);
-		goto error;
+	/* The backlog of a previous failed attempt is kept, no media was
+	 * queued since */
+	if (client->stream && !client->backlog &&
+	    client->reconnect.max_latency > 0) {
+		client->backlog = take_tx_backlog(client->stream,
+						  client->reconnect.max_latency);
 	}
+	close_connection(client);
 
-	if (sockerr != 0) {
-		ULOG_ERRNO("connect", sockerr);
-		goto error;
+	client->retries++;
+	if (client->reconnect.max_retries > 0 &&
+	    client->retries > client->reconnect.max_retries) {
+		ULOGE("Reconnection failed after %u attempts",
+		      client->retries - 1);
+		rtmp_client_disconnect(client);
+		return;
 	}
 
-	pomp_loop_update(client->loop, client->sock, POMP_FD_EVENT_IN);
+	delay = get_reconnect_delay(client);
+	ULOGI("Reconnection attempt %u in %" PRIu32 "ms",
+	      client->retries,
+	      delay);
+	set_state(client, RTMP_CONN_WAIT_RECONNECT);
+	pomp_timer_set(client->reconnect_timer, delay > 0 ? delay : 1);
+}
 
-	set_state(client, RTMP_CONN_WAIT_S0);
+static void reconnect_timer_cb(struct pomp_timer *timer, void *userdata)
+{
+	struct rtmp_client *client = userdata;
+	int ret;
 
-	ret = send_c0(client);
-	if (ret < 0) {
-		ULOG_ERRNO("send_c0", -ret);
-		goto error;
-	}
-	ret = send_c1(client);
-	if (ret < 0) {
-		ULOG_ERRNO("send_c1", -ret);
-		goto error;
-	}
+	if (client->state != RTMP_CONN_WAIT_RECONNECT)
+		return;
 
-	return;
-error:
-	rtmp_client_disconnect(client);
+	ret = start_connect(client);
+	if (ret < 0)
+		connection_error(client);
 }
 
-static void handle_wait_s0(struct rtmp_client *client)
+struct rtmp_client *rtmp_client_new(struct pomp_loop *loop,
+				    const struct rtmp_callbacks *cbs,
+				    void *userdata)
 {
-	uint8_t s0;
-	ssize_t len;
+	struct rtmp_client *client;
 
-	if (!client)
-		return;
+	if (!cbs || !loop) {
+		ULOG_ERRNO("rtmp_client_new", EINVAL);
+		return NULL;
+	}
 
-	len = recv(client->sock, &s0, sizeof(s0), 0);
-	if (len < 0) {
-		ULOG_ERRNO("recv", errno);
+	pthread_once(&amf_once, init_amf);
+	if (amf_status != 0)
+		return NULL;
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		ULOG_ERRNO("calloc", ENOMEM);
+		return NULL;
+	}
+
+	client->loop = loop;
+	client->cbs = *cbs;
+	client->userdata = userdata;
+	set_state(client, RTMP_CONN_IDLE);
+	client->sock = -1;
+	client->tx_chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
+	client->sched_quantum = RTMP_DEFAULT_SCHED_QUANTUM;
+	client->bw_estimate_period = RTMP_DEFAULT_BW_ESTIMATE_PERIOD;
+	client->ack_window = RTMP_DEFAULT_ACK_WINDOW;
+	client->dns_cache_ttl = RTMP_DEFAULT_DNS_CACHE_TTL;
+	client->reconnect.min_delay = RTMP_DEFAULT_RECONNECT_MIN_DELAY;
+	client->reconnect.max_delay = RTMP_DEFAULT_RECONNECT_MAX_DELAY;
+
+	/* Large enough for C0 + C1 */
+	client->buffer.buf = malloc(HANDSHAKE_SIZE + 1);
+	if (!client->buffer.buf) {
+		free(client);
+		return NULL;
+	}
+	client->buffer.cap = HANDSHAKE_SIZE + 1;
+
+	client->bw_timer = pomp_timer_new(loop, bw_timer_cb, client);
+	if (!client->bw_timer) {
+		ULOG_ERRNO("pomp_timer_new", ENOMEM);
 		goto error;
 	}
-	if (len != sizeof(s0)) {
-		ULOG_ERRNO("recv", ENODATA);
+
+	client->attempt_timer =
+		pomp_timer_new(loop, attempt_timer_cb, client);
+	if (!client->attempt_timer) {
+		ULOG_ERRNO("pomp_timer_new", ENOMEM);
 		goto error;
 	}
 
-	if (s0 != 3) {
-		ULOGE("Bad RTMP version from server, got %u, expected 3", s0);
+	client->reconnect_timer =
+		pomp_timer_new(loop, reconnect_timer_cb, client);
+	if (!client->reconnect_timer) {
+		ULOG_ERRNO("pomp_timer_new", ENOMEM);
 		goto error;
 	}
 
-	set_state(client, RTMP_CONN_WAIT_S1);
+	return client;
 
-	return;
 error:
-	rtmp_client_disconnect(client);
+	if (client->attempt_timer)
+		pomp_timer_destroy(client->attempt_timer);
+	if (client->bw_timer)
+		pomp_timer_destroy(client->bw_timer);
+	free(client->buffer.buf);
+	free(client);
+	return NULL;
 }
 
-static void handle_wait_s1(struct rtmp_client *client)
+RTMP_API void rtmp_client_destroy(struct rtmp_client *client)
 {
-	size_t missing_len;
-	ssize_t read_len;
-	int ret;
-
 	if (!client)
 		return;
+	EINVAL;
 
-	missing_len = HANDSHAKE_SIZE - client->buffer.len;
-	read_len = recv(client->sock,
-			&client->buffer.buf[client->buffer.len],
-			missing_len,
-			0);
-	if (read_len < 0) {
-		ULOG_ERRNO("read", errno);
-		goto error;
-	}
+	if (client->group)
+		rtmp_group_remove_client(client->group, client);
 
-	client->buffer.len += read_len;
+	if (client->state != RTMP_CONN_IDLE)
+		rtmp_client_disconnect(client);
 
-	if (client->buffer.len < HANDSHAKE_SIZE) {
-		ULOGI("Got %zu bytes out of %u for S1",
-		      client->buffer.len,
-		      HANDSHAKE_SIZE);
-		return;
-	}
+	destroy_submit_queue(client);
+	free(client->host);
+	free(client->app);
+	free(client->key);
+	free(client->buffer.buf);
+	free(client->cache_host);
+	free(client->avcc.buf);
+	free(client->asc.buf);
+	free(client->metadata.buf);
+	pomp_timer_destroy(client->bw_timer);
+	pomp_timer_destroy(client->attempt_timer);
+	pomp_timer_destroy(client->reconnect_timer);
 
-	/* We have a complete s1 in client->buffer.buf */
+	free(client);
+}
 
-	set_state(client, RTMP_CONN_WAIT_S2);
-	ret = send_c2(client, client->buffer.buf, client->buffer.len);
-	if (ret != 0) {
-		ULOG_ERRNO("send_c2", -ret);
-		goto error;
-	}
-	client->buffer.len = 0;
+static void peer_bw_changed(uint32_t bandwidth, void *userdata)
+{
+	struct rtmp_client *client = userdata;
 
-	return;
-error:
-	rtmp_client_disconnect(client);
+	if (client->cbs.peer_bw_changed)
+		client->cbs.peer_bw_changed(bandwidth, client->userdata);
+	else
+		ULOGI("Peer BW changed to %" PRIu32 " B/s", bandwidth);
 }
 
-static void handle_wait_s2(struct rtmp_client *client)
+/* Send releaseStream / FCPublish / createStream, or only createStream in
+ * play mode */
+static int send_create_stream(struct rtmp_client *client)
 {
-	size_t missing_len;
-	ssize_t read_len;
+	double cmd_id;
 	int ret;
-	char tcUrl[64];
 
-	if (!client)
-		return;
+	if (client->create_stream_sent)
+		return 0;
+	if (client->mode == RTMP_CLIENT_MODE_PLAY)
+		goto create_stream;
 
-	missing_len = HANDSHAKE_SIZE - client->buffer.len;
-	read_len = recv(client->sock,
-			&client->buffer.buf[client->buffer.len],
-			missing_len,
-			0);
-	if (read_len < 0) {
-		ULOG_ERRNO("read", errno);
-		goto error;
+	cmd_id = get_next_amf_id(client);
+	ret = send_amf_command(client->stream,
+			       &amf_cmds[AMF_CMD_STREAM],
+			       "releaseStream",
+			       cmd_id,
+			       client->key);
+	if (ret < 0) {
+		ULOG_ERRNO("send_amf_command", -ret);
+		return ret;
 	}
 
-	client->buffer.len += read_len;
+	cmd_id = get_next_amf_id(client);
+	ret = send_amf_command(client->stream,
+			       &amf_cmds[AMF_CMD_STREAM],
+			       "FCPublish",
+			       cmd_id,
+			       client->key);
+	if (ret < 0) {
+		ULOG_ERRNO("send_amf_command", -ret);
+		return ret;
+	}
 
-	if (client->buffer.len < HANDSHAKE_SIZE) {
-		ULOGI("Got %zu bytes out of %u for S2",
-		      client->buffer.len,
-		      HANDSHAKE_SIZE);
-		return;
+create_stream:
+	client->create_stream_id = get_next_amf_id(client);
+	ret = send_amf_command(client->stream,
+			       &amf_cmds[AMF_CMD_STREAM],
+			       "createStream",
+			       client->create_stream_id,
+			       client->key);
+	if (ret < 0) {
+		ULOG_ERRNO("send_amf_command", -ret);
+		return ret;
 	}
 
-	/* We have a complete s2 in client->buffer.buf */
+	client->create_stream_sent = 1;
+	return 0;
+}
 
-	client->buffer.len = 0;
-	client->buffer.rd = 0;
+static void handle_connect_result(struct rtmp_client *client,
+				  struct rtmp_buffer *data,
+				  const struct amf_str *name,
+				  double id)
+{
+	int ret;
 
-	client->connect_id = get_next_amf_id(client);
+	ULOGD("Handle connect result");
 
-	snprintf(tcUrl,
-		 sizeof(tcUrl),
-		 "rtmp://%s:%d/%s",
-		 client->host,
-		 client->port,
-		 client->app);
+	set_phase_time(client, &client->timings.connect);
+
+	/* Already sent if the createStream command was pipelined */
+	ret = send_create_stream(client);
+	if (ret < 0)
+		goto error;
+
+	return;
+
+error:
+	connection_error(client);
+}
+
+static void handle_create_stream_result(struct rtmp_client *client,
+					struct rtmp_buffer *data,
+					const struct amf_str *name,
+					double id)
+{
+	int ret;
+	double cmd_id;
+	ULOGD("Handle create_stream result");
+
+	set_phase_time(client, &client->timings.create_stream);
 
-	ret = amf_encode(&client->buffer,
-			 "%s,%f,{%s:%s,%s:%s,%s:%s,%s:%s}",
-			 "connect",
-			 client->connect_id,
-			 "app",
-			 client->app,
-			 "type",
-			 "nonprivate",
-			 "flashVer",
-			 "FMLE/3.0 (compatible; librtmp)",
-			 "tcUrl",
-			 tcUrl);
+	/* Remaining message format should be NULL followed by the stream ID */
+	ret = amf_get_null(data);
+	if (ret != 0) {
+		ULOG_ERRNO("amf_get_null", -ret);
+		goto error;
+	}
+	ret = amf_get_number(data, &client->published_stream_id);
 	if (ret != 0) {
-		ULOG_ERRNO("amf_encode", -ret);
+		ULOG_ERRNO("amf_get_number", -ret);
 		goto error;
 	}
 
-	/* Open the chunk stream. Remove the fd from the loop here, the chunk
-	 * stream needs to have its own callback */
-	pomp_loop_remove(client->loop, client->sock);
-	client->stream = new_chunk_stream(
-		client->loop, client->sock, &chunk_cbs, client);
-	if (!client->stream)
+	cmd_id = get_next_amf_id(client);
+	if (client->mode == RTMP_CLIENT_MODE_PLAY)
+		goto play;
+	ret = send_amf_command(client->stream,
+			       &amf_cmds[AMF_CMD_PUBLISH],
+			       "publish",
+			       cmd_id,
+			       client->key,
+			       "live");
+	if (ret < 0) {
+		ULOG_ERRNO("send_amf_command", -ret);
+		goto error;
+	}
+
+	return;
+
+play:
+	ret = send_amf_command(client->stream,
+			       &amf_cmds[AMF_CMD_STREAM],
+			       "play",
+			       cmd_id,
+			       client->key);
+	if (ret < 0) {
+		ULOG_ERRNO("send_amf_command", -ret);
+		goto error;
+	}
+	ret = send_set_buffer_length(client->stream,
+				     (uint32_t)client->published_stream_id,
+				     RTMP_PLAY_BUFFER_LENGTH);
+	if (ret < 0) {
+		ULOG_ERRNO("send_set_buffer_length", -ret);
+		goto error;
+	}
+
+	return;
+error:
+	connection_error(client);
+}
+
+/* Keep a copy of a codec configuration or metadata, to send it again after a
+ * reconnection */
+static int save_config(struct rtmp_buffer *config,
+		       const uint8_t *buf,
+		       size_t len)
+{
+	uint8_t *tmp;
+
+	if (len > config->cap) {
+		tmp = realloc(config->buf, len);
+		if (!tmp)
+			return -ENOMEM;
+		config->buf = tmp;
+		config->cap = len;
+	}
+	memcpy(config->buf, buf, len);
+	config->len = len;
+	config->rd = 0;
+	return 0;
+}
+
+static int copy_config(const struct rtmp_buffer *config,
+		       struct rtmp_buffer *copy)
+{
+	copy->buf = malloc(config->len);
+	if (!copy->buf)
+		return -ENOMEM;
+	memcpy(copy->buf, config->buf, config->len);
+	copy->cap = config->len;
+	copy->len = config->len;
+	copy->rd = 0;
+	return 0;
+}
+
+/* Once published again after a reconnection, send the saved metadata & codec
+ * configurations, then the media messages kept from the previous
+ * connection */
+static void replay_stream(struct rtmp_client *client)
+{
+	int ret;
+	struct rtmp_buffer b;
+	uint32_t msid = (uint32_t)client->published_stream_id;
+
+	/* The server lost the decoding context, with or without a backlog:
+	 * the video must restart from a keyframe */
+	ret = set_tx_wait_keyframe(client->stream);
+	if (ret < 0)
+		ULOG_ERRNO("set_tx_wait_keyframe", -ret);
+
+	if (client->metadata.len > 0 &&
+	    copy_config(&client->metadata, &b) == 0) {
+		ret = send_metadata(client->stream,
+				    &b,
+				    client->metadata_ts,
+				    RTMP_DATA_ALLOCATED,
+				    NULL);
+		if (ret < 0) {
+			ULOG_ERRNO("send_metadata", -ret);
+			free(b.buf);
+		}
+	}
+	if (client->avcc.len > 0 && copy_config(&client->avcc, &b) == 0) {
+		ret = send_video_frame(client->stream,
+				       &b,
+				       msid,
+				       0,
+				       0,
+				       1,
+				       1,
+				       0,
+				       RTMP_DATA_ALLOCATED,
+				       NULL);
+		if (ret < 0) {
+			ULOG_ERRNO("send_video_frame", -ret);
+			free(b.buf);
+		}
+	}
+	if (client->asc.len > 0 && copy_config(&client->asc, &b) == 0) {
+		ret = send_audio_data(
+			client->stream, &b, msid, 0, 1, RTMP_DATA_ALLOCATED, NULL);
+		if (ret < 0) {
+			ULOG_ERRNO("send_audio_data", -ret);
+			free(b.buf);
+		}
+	}
+
+	if (client->backlog) {
+		ret = restore_tx_backlog(client->stream,
+					 client->backlog,
+					 msid,
+					 client->reconnect.max_latency);
+		if (ret < 0)
+			ULOG_ERRNO("restore_tx_backlog", -ret);
+		client->backlog = NULL;
+	}
+}
+
+static void handle_status_update(struct rtmp_client *client,
+				 struct rtmp_buffer *data,
+				 const struct amf_str *name,
+				 double id)
+{
+	struct amf_str key, value;
+	struct amf_str code = {0};
+	struct amf_str desc = {0};
+	const char *start_code;
+	int is_error = 0;
+	int ret;
+	ULOGD("Handle onStatus");
+
+	/* Skip the NULL command object & start the Info object */
+	ret = amf_get_null(data);
+	if (ret != 0) {
+		ULOG_ERRNO("amf_get_null", -ret);
+		goto error;
+	}
+	ret = amf_get_object_start(data);
+	if (ret != 0) {
+		ULOG_ERRNO("amf_get_object_start", -ret);
+		goto error;
+	}
+
+	while ((ret = amf_object_next(data, &key)) == 1) {
+		ret = amf_get_string_view(data, &value);
+		if (ret < 0) {
+			/* We only handle string value, skip other values */
+			ret = amf_skip_data(data);
+			if (ret != 0)
+				break;
+			continue;
+		}
+
+		if (amf_str_eq(&key, "level"))
+			is_error = amf_str_eq(&value, "error");
+		else if (amf_str_eq(&key, "code"))
+			code = value;
+		else if (amf_str_eq(&key, "description"))
+			desc = value;
+	}
+	if (ret < 0)
+		ULOG_ERRNO("amf_object_next", -ret);
+
+	if (is_error) {
+		if (desc.ptr)
+			ULOGE("Server error: %.*s", (int)desc.len, desc.ptr);
+		else if (code.ptr)
+			ULOGE("Server error: %.*s", (int)code.len, code.ptr);
+		else
+			ULOGE("Server error: Unknown error");
+		goto error;
+	}
+
+	if (!code.ptr) {
+		ULOGE("Missing 'code' property in server answer");
+		goto error;
+	}
+
+	start_code = client->mode == RTMP_CLIENT_MODE_PLAY
+			     ? RTMP_ONSTATUS_PLAY_CODE
+			     : RTMP_ONSTATUS_PUBLISH_CODE;
+	if (!amf_str_eq(&code, start_code)) {
+		if (client->mode == RTMP_CLIENT_MODE_PLAY) {
+			/* e.g. NetStream.Play.Reset, or the notifications of
+			 * the publisher state */
+			ULOGI("Play status : %.*s", (int)code.len, code.ptr);
+			return;
+		}
+		ULOGE("Bad answer code : %.*s, expected %s",
+		      (int)code.len,
+		      code.ptr,
+		      start_code);
+		goto error;
+	}
+	if (client->state == RTMP_CONN_READY) {
+		ULOGI("Stream already started");
+		return;
+	}
+
+	set_phase_time(client, &client->timings.publish);
+	if (client->published) {
+		ULOGI("Started again after %u reconnection attempts",
+		      client->retries);
+		if (client->mode == RTMP_CLIENT_MODE_PUBLISH)
+			replay_stream(client);
+	}
+	client->published = 1;
+	client->retries = 0;
+	ULOGI("Connection setup: tcp %" PRIu64 "us, handshake %" PRIu64
+	      "us, connect %" PRIu64 "us, createStream %" PRIu64
+	      "us, publish %" PRIu64 "us",
+	      client->timings.tcp,
+	      client->timings.handshake,
+	      client->timings.connect,
+	      client->timings.create_stream,
+	      client->timings.publish);
+
+	set_state(client, RTMP_CONN_READY);
+	return;
+error:
+	connection_error(client);
+}
+
+static void handle_bwdone(struct rtmp_client *client,
+			  struct rtmp_buffer *data,
+			  const struct amf_str *name,
+			  double id)
+{
+	int ret;
+	double cmd_id;
+	ULOGD("Handle onBWDone");
+
+
+	cmd_id = get_next_amf_id(client);
+	ret = send_amf_command(client->stream,
+			       &amf_cmds[AMF_CMD_CHECKBW],
+			       "_checkbw",
+			       cmd_id);
+	if (ret < 0) {
+		ULOG_ERRNO("send_amf_command", -ret);
 		goto error;
+	}
+
+	return;
+error:
+	connection_error(client);
+}
+
+static void handle_result(struct rtmp_client *client,
+			  struct rtmp_buffer *data,
+			  const struct amf_str *name,
+			  double id)
+{
+	if (id == client->connect_id)
+		handle_connect_result(client, data, name, id);
+	else if (id == client->create_stream_id)
+		handle_create_stream_result(client, data, name, id);
+	else
+		ULOGW("Got a result for an unfollowed call (%f)", id);
+}
+
+static void handle_error(struct rtmp_client *client,
+			 struct rtmp_buffer *data,
+			 const struct amf_str *name,
+			 double id)
+{
+	if (id == client->connect_id) {
+		ULOGE("connect failed");
+		connection_error(client);
+	} else if (id == client->create_stream_id) {
+		ULOGE("create_stream failed");
+		connection_error(client);
+	} else {
+		ULOGW("Got an error for an unfollowed call (%f)", id);
+	}
+}
+
+#define AMF_HANDLER(_name, _cb)                                                \
+	{                                                                      \
+		.name = _name, .len = sizeof(_name) - 1, .cb = _cb,            \
+	}
+
+static const struct amf_handler amf_handlers[] = {
+	AMF_HANDLER("_result", handle_result),
+	AMF_HANDLER("_error", handle_error),
+	AMF_HANDLER("onStatus", handle_status_update),
+	AMF_HANDLER("onBWDone", handle_bwdone),
+};
+
+static uint32_t amf_handler_hash(const char *name, size_t len)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void index_amf_handlers(void)
+{
+	size_t i;
+	uint32_t slot;
+
+	for (i = 0; i < sizeof(amf_handlers) / sizeof(amf_handlers[0]); i++) {
+		slot = amf_handler_hash(amf_handlers[i].name,
+					amf_handlers[i].len);
+		while (amf_handlers_index[slot & AMF_HANDLERS_MASK])
+			slot++;
+		amf_handlers_index[slot & AMF_HANDLERS_MASK] = &amf_handlers[i];
+	}
+}
+
+static const struct amf_handler *find_amf_handler(const struct amf_str *name)
+{
+	const struct amf_handler *handler;
+	uint32_t slot = amf_handler_hash(name->ptr, name->len);
+
+	while ((handler = amf_handlers_index[slot & AMF_HANDLERS_MASK])) {
+		if (handler->len == name->len &&
+		    memcmp(handler->name, name->ptr, name->len) == 0)
+			return handler;
+		slot++;
+	}
+	return NULL;
+}
+
+static void amf_msg(struct rtmp_buffer *data, void *userdata)
+{
+	struct rtmp_client *client = userdata;
+	const struct amf_handler *handler;
+	struct amf_str name;
+	double id;
+	int ret;
+
+	ret = amf_get_msg_name_view(data, &name, &id);
+	if (ret < 0)
+		return;
+
+	handler = find_amf_handler(&name);
+	if (handler)
+		handler->cb(client, data, &name, id);
+	else
+		ULOGW("Unexpected message %.*s", (int)name.len, name.ptr);
+}
+
+/* Parse the FLV tag header of a media message received in play mode, the
+ * payload being reported in place */
+static void media_msg(uint8_t mtid,
+		      uint32_t timestamp,
+		      struct rtmp_buffer *data,
+		      void *userdata)
+{
+	struct rtmp_client *client = userdata;
+	struct rtmp_media_frame frame;
+	const uint8_t *b = &data->buf[data->rd];
+	size_t len = data->len - data->rd;
+	size_t hdr_len = 0;
+	uint32_t cts;
+
+	if (client->mode != RTMP_CLIENT_MODE_PLAY) {
+		ULOGW("Unexpected media message (mtid %u)", mtid);
+		return;
+	}
+	/* Some servers send empty audio & video messages */
+	if (len == 0)
+		return;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.timestamp = timestamp;
+	frame.buffer = data->buf;
+
+	switch (mtid) {
+	case 0x08: /* Audio */
+		frame.type = RTMP_MEDIA_AUDIO;
+		frame.codec = b[0] >> 4;
+		frame.audio_flags = b[0] & 0x0f;
+		hdr_len = 1;
+		if (frame.codec != RTMP_AUDIO_FORMAT_AAC)
+			break;
+		if (len < 2)
+			goto bad_msg;
+		/* AACPacketType: 0 for the AudioSpecificConfig */
+		frame.is_config = b[1] == 0;
+		hdr_len = 2;
+		break;
+
+	case 0x09: /* Video */
+		frame.type = RTMP_MEDIA_VIDEO;
+		frame.codec = b[0] & 0x0f;
+		/* FrameType: 1 for keyframes, 3 for disposable inter frames */
+		frame.is_key = (b[0] >> 4) == 1;
+		frame.is_non_ref = (b[0] >> 4) == 3;
+		hdr_len = 1;
+		if (frame.codec != RTMP_VIDEO_CODEC_AVC)
+			break;
+		if (len < 5)
+			goto bad_msg;
+		/* AVCPacketType: 0 for the AVCDecoderConfigurationRecord, 1 for
+		 * NAL units, 2 for the end of sequence */
+		if (b[1] == 2)
+			return;
+		frame.is_config = b[1] == 0;
+		cts = ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 8) | b[4];
+		if (cts & 0x800000)
+			frame.cts = (int32_t)cts - 0x1000000;
+		else
+			frame.cts = (int32_t)cts;
+		hdr_len = 5;
+		break;
+
+	default:
+		frame.type = RTMP_MEDIA_DATA;
+		break;
+	}
+
+	frame.data = &b[hdr_len];
+	frame.len = len - hdr_len;
+	client->cbs.media_frame(&frame, client->userdata);
+	return;
+
+bad_msg:
+	ULOGW("Bad media message (mtid %u, %zu bytes)", mtid, len);
+}
+
+static void data_sent(uint8_t *data, void *data_userdata, void *userdata)
+{
+	struct rtmp_client *client = userdata;
+	client->cbs.data_unref(data, data_userdata, client->userdata);
+}
+
+static void shared_data_sent(uint8_t *data, void *data_userdata, void *userdata)
+{
+	group_frame_unref(data_userdata, data);
+}
+
+static void pomp_idle_disconnect(void *userdata)
+{
+	struct rtmp_client *client = userdata;
+	connection_error(client);
+}
+
+static void rtmp_chunk_stream_disconnected(void *userdata)
+{
+	struct rtmp_client *client = userdata;
+	pomp_loop_idle_add(client->loop, pomp_idle_disconnect, client);
+}
+
+static const struct rtmp_chunk_cbs chunk_cbs = {
+	.peer_bw_changed = peer_bw_changed,
+	.amf_msg = amf_msg,
+	.data_sent = data_sent,
+	.shared_data_sent = shared_data_sent,
+	.disconnected = rtmp_chunk_stream_disconnected,
+	.media_msg = media_msg,
+};
+
+static int queue_to_csid(enum rtmp_data_queue queue)
+{
+	switch (queue) {
+	case RTMP_QUEUE_VIDEO:
+		return RTMP_CSID_VIDEO;
+	case RTMP_QUEUE_AUDIO:
+		return RTMP_CSID_AUDIO;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int parse_uri(struct rtmp_client *client, const char *uri)
+{
+	int ret = 0;
+	char *raw, *tmp;
+	char *raw_addr, *app, *key;
+	char *host, *port_s, *end;
+	uint16_t port;
+	int secure;
+	size_t scheme_len;
+
+	if (!uri)
+		return -EINVAL;
+
+	ULOGI("Parsing %s", uri);
+
+	if (strncmp(uri, "rtmp://", 7) == 0) {
+		secure = 0;
+		scheme_len = 7;
+		port = DEFAULT_RTMP_PORT;
+	} else if (strncmp(uri, "rtmps://", 8) == 0) {
+		secure = 1;
+		scheme_len = 8;
+		port = DEFAULT_RTMPS_PORT;
+	} else {
+		return -EINVAL;
+	}
+
+	raw = xstrdup(&uri[scheme_len]);
+	if (!raw) {
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	/* Format is host[:port]/app/key */
+	raw_addr = strtok_r(raw, "/", &tmp);
+	if (!raw_addr) {
+		ret = -EINVAL;
+		goto exit;
+	}
+	app = strtok_r(NULL, "/", &tmp);
+	if (!app) {
+		ret = -EINVAL;
+		goto exit;
+	}
+	key = strtok_r(NULL, "", &tmp);
+	if (!key) {
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	/* search for port number in address, IPv6 literal addresses are
+	 * enclosed in brackets */
+	if (raw_addr[0] == '[') {
+		host = &raw_addr[1];
+		end = strchr(host, ']');
+		if (!end || (end[1] != '\0' && end[1] != ':')) {
+			ret = -EINVAL;
+			goto exit;
+		}
+		*end = '\0';
+		port_s = end[1] == ':' ? &end[2] : NULL;
+	} else {
+		host = strtok_r(raw_addr, ":", &tmp);
+		port_s = strtok_r(NULL, "", &tmp);
+	}
+	if (!host || host[0] == '\0') {
+		ret = -EINVAL;
+		goto exit;
+	}
+	if (port_s) {
+		int match = sscanf(port_s, "%hu", &port);
+		if (match != 1) {
+			ret = -EINVAL;
+			goto exit;
+		}
+	}
+
+	free(client->host);
+	free(client->app);
+	free(client->key);
+	client->secure = secure;
+	client->host = xstrdup(host);
+	client->port = port;
+	client->app = xstrdup(app);
+	client->key = xstrdup(key);
+	if (!client->host || !client->app || !client->key) {
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	ULOGI("Address parsing :");
+	ULOGI("Input string : %s", uri);
+	ULOGI("Secure : %s", client->secure ? "yes" : "no");
+	ULOGI("host   : %s", host);
+	ULOGI("port_s : %s", port_s);
+	ULOGI("Port : %d", client->port);
+	ULOGI("App : %s", client->app);
+	ULOGI("Key : %s", client->key);
+
+exit:
+	free(raw);
+	return ret;
+}
+
+static void handle_wait_tls(struct rtmp_client *client);
+
+static void handle_wait_tcp(struct rtmp_client *client, int fd)
+{
+	int ret;
+
+	if (!client)
+		return;
+
+	if (client->sock >= 0 && fd != client->sock)
+		return;
+
+	if (client->sock < 0) {
+		ret = finish_connect_attempt(client, fd);
+		if (ret < 0)
+			goto error;
+		/* Waiting for the other attempts */
+		if (client->sock < 0)
+			return;
+		set_phase_time(client, &client->timings.tcp);
+
+		if (client->secure) {
+			client->tls = rtmp_tls_new(client->has_tls_backend
+							   ? &client->tls_backend
+							   : NULL,
+						   client->tls_userdata,
+						   client->sock,
+						   client->host);
+			if (!client->tls) {
+				ULOG_ERRNO("rtmp_tls_new", EPROTO);
+				goto error;
+			}
+			set_state(client, RTMP_CONN_WAIT_TLS);
+			handle_wait_tls(client);
+			return;
+		}
+	}
+
+	/* C0 + C1 may have been (partially) sent with the SYN */
+	if (!client->c0c1_sent) {
+		ret = send_c0c1(client);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+			/* Wait for the socket to be writable again */
+			pomp_loop_update(
+				client->loop, client->sock, POMP_FD_EVENT_OUT);
+			return;
+		} else if (ret < 0) {
+			ULOG_ERRNO("send_c0c1", -ret);
+			goto error;
+		}
+	}
+
+	pomp_loop_update(client->loop, client->sock, POMP_FD_EVENT_IN);
+
+	set_state(client, RTMP_CONN_WAIT_S0);
+
+	return;
+error:
+	connection_error(client);
+}
+
+/* TLS handshake, then C0 + C1 are sent through the TLS session */
+static void handle_wait_tls(struct rtmp_client *client)
+{
+	int ret;
+	int want_write;
+
+	if (!client)
+		return;
+
+	if (!client->tls_connected) {
+		ret = rtmp_tls_handshake(client->tls, &want_write);
+		if (ret == -EAGAIN) {
+			pomp_loop_update(client->loop,
+					 client->sock,
+					 want_write ? POMP_FD_EVENT_OUT
+						    : POMP_FD_EVENT_IN);
+			return;
+		} else if (ret < 0) {
+			goto error;
+		}
+		client->tls_connected = 1;
+		set_phase_time(client, &client->timings.tls);
+
+		/* Only the transmit direction is handed over to the kernel:
+		 * the TLS implementation might have read the beginning of the
+		 * following records already */
+		ret = rtmp_tls_enable_ktls_tx(client->tls);
+		if (ret < 0)
+			ULOGI("Kernel TLS not available (%s), using the TLS "
+			      "implementation",
+			      strerror(-ret));
+		else
+			ULOGI("Kernel TLS enabled for transmission");
+	}
+
+	handle_wait_tcp(client, client->sock);
+	return;
+
+error:
+	connection_error(client);
+}
+
+static void handle_wait_s0(struct rtmp_client *client)
+{
+	uint8_t s0;
+	ssize_t len;
+
+	if (!client)
+		return;
+
+	len = client_recv(client, &s0, sizeof(s0));
+	if (len == -EAGAIN || len == -EWOULDBLOCK)
+		return;
+	if (len < 0) {
+		ULOG_ERRNO("recv", (int)-len);
+		goto error;
+	}
+	if (len != sizeof(s0)) {
+		ULOG_ERRNO("recv", ENODATA);
+		goto error;
+	}
+
+	if (s0 != 3) {
+		ULOGE("Bad RTMP version from server, got %u, expected 3", s0);
+		goto error;
+	}
+
+	set_state(client, RTMP_CONN_WAIT_S1);
+
+	return;
+error:
+	connection_error(client);
+}
+
+/* Allocated "rtmp[s]://host:port/app" string */
+static char *get_tc_url(struct rtmp_client *client)
+{
+	const char *fmt = strchr(client->host, ':') ? "%s://[%s]:%d/%s"
+						    : "%s://%s:%d/%s";
+	const char *scheme = client->secure ? "rtmps" : "rtmp";
+	char *url;
+	int len;
+
+	len = snprintf(NULL,
+		       0,
+		       fmt,
+		       scheme,
+		       client->host,
+		       client->port,
+		       client->app);
+	if (len < 0)
+		return NULL;
+	url = malloc(len + 1);
+	if (!url)
+		return NULL;
+	snprintf(url,
+		 len + 1,
+		 fmt,
+		 scheme,
+		 client->host,
+		 client->port,
+		 client->app);
+	return url;
+}
+
+/* Open the chunk stream and send the connect command. If c2 is not NULL, the
+ * handshake is finished by the chunk stream: c2 is sent right before the
+ * connect command, and S2 is skipped from the received data */
+static int open_chunk_stream(struct rtmp_client *client, const uint8_t *c2)
+{
+	int ret;
+	char *tcUrl;
+
+	/* Open the chunk stream. Remove the fd from the loop here, the chunk
+	 * stream needs to have its own callback */
+	pomp_loop_remove(client->loop, client->sock);
+	client->stream = new_chunk_stream(
+		client->loop, client->sock, &chunk_cbs, client);
+	if (!client->stream)
+		return -ENOMEM;
+
+	if (client->tls) {
+		ret = set_stream_tls(client->stream, client->tls);
+		if (ret < 0) {
+			ULOG_ERRNO("set_stream_tls", -ret);
+			return ret;
+		}
+	}
+
+	if (c2) {
+		ret = set_tx_preamble(client->stream, c2, HANDSHAKE_SIZE);
+		if (ret < 0) {
+			ULOG_ERRNO("set_tx_preamble", -ret);
+			return ret;
+		}
+		ret = set_rx_skip(client->stream, HANDSHAKE_SIZE);
+		if (ret < 0) {
+			ULOG_ERRNO("set_rx_skip", -ret);
+			return ret;
+		}
+	}
+
+	client->buffer.len = 0;
+	client->buffer.rd = 0;
+
+	ret = set_tx_queue_config(client->stream,
+				  RTMP_CSID_VIDEO,
+				  &client->queue_config[RTMP_QUEUE_VIDEO]);
+	if (ret < 0) {
+		ULOG_ERRNO("set_tx_queue_config", -ret);
+		return ret;
+	}
+	ret = set_tx_queue_config(client->stream,
+				  RTMP_CSID_AUDIO,
+				  &client->queue_config[RTMP_QUEUE_AUDIO]);
+	if (ret < 0) {
+		ULOG_ERRNO("set_tx_queue_config", -ret);
+		return ret;
+	}
+	ret = set_tx_drop_policy(client->stream,
+				 RTMP_CSID_VIDEO,
+				 client->drop_policy,
+				 client->max_latency);
+	if (ret < 0) {
+		ULOG_ERRNO("set_tx_drop_policy", -ret);
+		return ret;
+	}
+	ret = set_tx_sched_quantum(client->stream, client->sched_quantum);
+	if (ret < 0) {
+		ULOG_ERRNO("set_tx_sched_quantum", -ret);
+		return ret;
+	}
+	ret = set_tx_aggregation(client->stream, client->aggr_window);
+	if (ret < 0) {
+		ULOG_ERRNO("set_tx_aggregation", -ret);
+		return ret;
+	}
+	if (client->pacing_enabled) {
+		ret = set_tx_pacing(client->stream, &client->pacing);
+		if (ret < 0) {
+			ULOG_ERRNO("set_tx_pacing", -ret);
+			return ret;
+		}
+	}
+	ret = set_tx_trace(
+		client->stream, client->trace_cb, client->trace_userdata);
+	if (ret < 0) {
+		ULOG_ERRNO("set_tx_trace", -ret);
+		return ret;
+	}
+
+	tcUrl = get_tc_url(client);
+	if (!tcUrl)
+		return -ENOMEM;
+
+	client->connect_id = get_next_amf_id(client);
+	ret = send_amf_command(client->stream,
+			       &amf_cmds[AMF_CMD_CONNECT],
+			       "connect",
+			       client->connect_id,
+			       "app",
+			       client->app,
+			       "type",
+			       "nonprivate",
+			       "flashVer",
+			       "FMLE/3.0 (compatible; librtmp)",
+			       "tcUrl",
+			       tcUrl);
+	free(tcUrl);
+	if (ret < 0) {
+		ULOG_ERRNO("send_amf_command", -ret);
+		return ret;
+	}
+
+	if (client->tx_chunk_size == RTMP_CHUNK_SIZE_AUTO) {
+		ret = set_chunk_size_auto(client->stream, 1);
+		if (ret < 0) {
+			ULOG_ERRNO("set_chunk_size_auto", -ret);
+			return ret;
+		}
+	} else {
+		ret = set_chunk_size(client->stream, client->tx_chunk_size);
+		if (ret < 0) {
+			ULOG_ERRNO("set_chunk_size", -ret);
+			return ret;
+		}
+	}
+
+	if (client->notsent_lowat_set) {
+		ret = set_tx_notsent_lowat(client->stream,
+					   client->notsent_lowat);
+		if (ret < 0) {
+			ULOG_ERRNO("set_tx_notsent_lowat", -ret);
+			return ret;
+		}
+	}
+
+	if (client->zerocopy_threshold > 0) {
+		ret = set_tx_zerocopy(client->stream,
+				      client->zerocopy_threshold);
+		if (ret < 0)
+			ULOGW("zero-copy transmission not available (%s)",
+			      strerror(-ret));
+	}
+
+	if (client->cbs.bw_estimate) {
+		if (client->ack_window > 0) {
+			ret = set_tx_ack_window(client->stream,
+						client->ack_window);
+			if (ret < 0) {
+				ULOG_ERRNO("set_tx_ack_window", -ret);
+				return ret;
+			}
+		}
+		if (client->bw_estimate_period > 0) {
+			ret = pomp_timer_set_periodic(
+				client->bw_timer,
+				client->bw_estimate_period,
+				client->bw_estimate_period);
+			if (ret < 0)
+				ULOG_ERRNO("pomp_timer_set_periodic", -ret);
+		}
+	}
+
+	if (client->fast_connect & RTMP_FAST_CONNECT_PIPELINE) {
+		ret = send_create_stream(client);
+		if (ret < 0)
+			return ret;
+	}
+
+	set_state(client, RTMP_CONN_WAIT_FMS);
+
+	return 0;
+}
+
+static void handle_wait_s1(struct rtmp_client *client)
+{
+	size_t missing_len;
+	ssize_t read_len;
+	int ret;
+
+	if (!client)
+		return;
+
+	missing_len = HANDSHAKE_SIZE - client->buffer.len;
+	read_len = client_recv(
+		client, &client->buffer.buf[client->buffer.len], missing_len);
+	if (read_len == -EAGAIN || read_len == -EWOULDBLOCK)
+		return;
+	if (read_len < 0) {
+		ULOG_ERRNO("read", (int)-read_len);
+		goto error;
+	}
+
+	client->buffer.len += read_len;
+
+	if (client->buffer.len < HANDSHAKE_SIZE) {
+		ULOGD("Got %zu bytes out of %u for S1",
+		      client->buffer.len,
+		      HANDSHAKE_SIZE);
+		return;
+	}
+
+	/* We have a complete s1 in client->buffer.buf */
+
+	if (client->fast_connect & RTMP_FAST_CONNECT_COALESCE) {
+		/* Do not wait for S2, C2 is sent along with the connect
+		 * command, and S2 is skipped by the chunk stream */
+		set_phase_time(client, &client->timings.handshake);
+		ret = open_chunk_stream(client, client->buffer.buf);
+		if (ret < 0)
+			goto error;
+		return;
+	}
+
+	set_state(client, RTMP_CONN_WAIT_S2);
+	ret = send_c2(client, client->buffer.buf, client->buffer.len);
+	if (ret != 0) {
+		ULOG_ERRNO("send_c2", -ret);
+		goto error;
+	}
+	client->buffer.len = 0;
+
+	return;
+error:
+	connection_error(client);
+}
+
+static void handle_wait_s2(struct rtmp_client *client)
+{
+	size_t missing_len;
+	ssize_t read_len;
+	int ret;
+
+	if (!client)
+		return;
+
+	missing_len = HANDSHAKE_SIZE - client->buffer.len;
+	read_len = client_recv(
+		client, &client->buffer.buf[client->buffer.len], missing_len);
+	if (read_len == -EAGAIN || read_len == -EWOULDBLOCK)
+		return;
+	if (read_len < 0) {
+		ULOG_ERRNO("read", (int)-read_len);
+		goto error;
+	}
+
+	client->buffer.len += read_len;
+
+	if (client->buffer.len < HANDSHAKE_SIZE) {
+		ULOGD("Got %zu bytes out of %u for S2",
+		      client->buffer.len,
+		      HANDSHAKE_SIZE);
+		return;
+	}
+
+	/* We have a complete s2 in client->buffer.buf */
+
+	set_phase_time(client, &client->timings.handshake);
+	ret = open_chunk_stream(client, NULL);
+	if (ret < 0)
+		goto error;
+
+	return;
+error:
+	connection_error(client);
+}
+
+static void pomp_event_cb(int fd, uint32_t revents, void *userdata)
+{
+	struct rtmp_client *client = userdata;
+	if (!client)
+		return;
+
+	/* Connection attempts use their own sockets */
+	if (client->state == RTMP_CONN_WAIT_TCP) {
+		handle_wait_tcp(client, fd);
+		return;
+	}
+
+	if (fd != client->sock)
+		return;
+
+	/* The data already decrypted by the TLS session does not make the
+	 * socket readable */
+	do {
+		switch (client->state) {
+		case RTMP_CONN_WAIT_TLS:
+			handle_wait_tls(client);
+			return;
+		case RTMP_CONN_WAIT_S0:
+			handle_wait_s0(client);
+			break;
+		case RTMP_CONN_WAIT_S1:
+			handle_wait_s1(client);
+			break;
+		case RTMP_CONN_WAIT_S2:
+			handle_wait_s2(client);
+			break;
+		default:
+			return;
+		}
+	} while (client->tls && rtmp_tls_pending(client->tls) > 0);
+}
+
+RTMP_API int rtmp_client_set_chunk_size(struct rtmp_client *client,
+					uint32_t chunk_size)
+{
+	int ret;
+
+	if (!client || chunk_size > RTMP_MAX_CHUNK_SIZE)
+		return -EINVAL;
+
+	client->tx_chunk_size = chunk_size;
+
+	/* Not connected yet, the chunk size will be sent after the connect
+	 * command */
+	if (!client->stream)
+		return 0;
+
+	if (chunk_size == RTMP_CHUNK_SIZE_AUTO)
+		return set_chunk_size_auto(client->stream, 1);
+
+	ret = set_chunk_size_auto(client->stream, 0);
+	if (ret < 0)
+		return ret;
+	ret = set_chunk_size(client->stream, chunk_size);
+	return ret < 0 ? ret : 0;
+}
+
+RTMP_API int rtmp_client_set_queue_config(struct rtmp_client *client,
+					  enum rtmp_data_queue queue,
+					  const struct rtmp_queue_config *config)
+{
+	int ret;
+	int csid;
+
+	if (!client || !config)
+		return -EINVAL;
+
+	csid = queue_to_csid(queue);
+	if (csid < 0)
+		return csid;
+
+	if (client->stream) {
+		ret = set_tx_queue_config(client->stream, csid, config);
+		if (ret < 0)
+			return ret;
+	}
+
+	client->queue_config[queue] = *config;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_sched_quantum(struct rtmp_client *client,
+					   size_t quantum)
+{
+	int ret;
+
+	if (!client)
+		return -EINVAL;
+
+	if (client->stream) {
+		ret = set_tx_sched_quantum(client->stream, quantum);
+		if (ret < 0)
+			return ret;
+	}
+
+	client->sched_quantum = quantum;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_audio_aggregation(struct rtmp_client *client,
+					       uint32_t window)
+{
+	int ret;
+
+	if (!client)
+		return -EINVAL;
+
+	if (client->stream) {
+		ret = set_tx_aggregation(client->stream, window);
+		if (ret < 0)
+			return ret;
+	}
+
+	client->aggr_window = window;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_pacing(struct rtmp_client *client,
+				    const struct rtmp_pacing_config *config)
+{
+	int ret;
+
+	if (!client)
+		return -EINVAL;
+
+	if (client->stream) {
+		ret = set_tx_pacing(client->stream, config);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (config)
+		client->pacing = *config;
+	client->pacing_enabled = config != NULL;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_drop_policy(struct rtmp_client *client,
+					 enum rtmp_drop_policy policy,
+					 uint32_t max_latency)
+{
+	int ret;
+
+	if (!client)
+		return -EINVAL;
+
+	switch (policy) {
+	case RTMP_DROP_NONE:
+	case RTMP_DROP_NON_REF:
+	case RTMP_DROP_GOP:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (client->stream) {
+		ret = set_tx_drop_policy(
+			client->stream, RTMP_CSID_VIDEO, policy, max_latency);
+		if (ret < 0)
+			return ret;
+	}
+
+	client->drop_policy = policy;
+	client->max_latency = max_latency;
+	return 0;
+}
+
+RTMP_API int rtmp_client_get_queue_status(struct rtmp_client *client,
+					  enum rtmp_data_queue queue,
+					  struct rtmp_queue_status *status)
+{
+	int csid;
+
+	if (!client || !status)
+		return -EINVAL;
+
+	csid = queue_to_csid(queue);
+	if (csid < 0)
+		return csid;
+
+	if (!client->stream) {
+		memset(status, 0, sizeof(*status));
+		return 0;
+	}
+
+	return get_tx_queue_status(client->stream, csid, status);
+}
+
+RTMP_API int rtmp_client_set_low_latency(struct rtmp_client *client,
+					 uint32_t notsent_lowat,
+					 uint32_t sndbuf)
+{
+	if (!client)
+		return -EINVAL;
+
+	client->notsent_lowat = notsent_lowat;
+	client->sndbuf = sndbuf;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_zero_copy(struct rtmp_client *client,
+				       size_t threshold)
+{
+	if (!client)
+		return -EINVAL;
+
+#ifndef __linux__
+	if (threshold > 0)
+		return -ENOTSUP;
+#endif
+
+	client->zerocopy_threshold = threshold;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_trace_cb(struct rtmp_client *client,
+				      rtmp_trace_cb_t cb,
+				      void *userdata)
+{
+	int ret;
+
+	if (!client)
+		return -EINVAL;
+
+	if (client->stream) {
+		ret = set_tx_trace(client->stream, cb, userdata);
+		if (ret < 0)
+			return ret;
+	}
+
+	client->trace_cb = cb;
+	client->trace_userdata = userdata;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_bw_estimate_config(struct rtmp_client *client,
+						uint32_t period,
+						uint32_t ack_window)
+{
+	if (!client)
+		return -EINVAL;
+
+	client->bw_estimate_period = period;
+	client->ack_window = ack_window;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_fast_connect(struct rtmp_client *client,
+					  uint32_t flags)
+{
+	if (!client || (flags & ~RTMP_FAST_CONNECT_ALL) != 0)
+		return -EINVAL;
+
+	client->fast_connect = flags;
+	return 0;
+}
+
+RTMP_API int
+rtmp_client_set_tls_backend(struct rtmp_client *client,
+			    const struct rtmp_tls_backend *backend,
+			    void *userdata)
+{
+	if (!client)
+		return -EINVAL;
+
+	if (!backend) {
+		memset(&client->tls_backend, 0, sizeof(client->tls_backend));
+		client->has_tls_backend = 0;
+		client->tls_userdata = NULL;
+		return 0;
+	}
+
+	/* get_ktls_tx_info is optional */
+	if (!backend->session_new || !backend->handshake || !backend->read ||
+	    !backend->pending || !backend->writev || !backend->session_destroy)
+		return -EINVAL;
+
+	client->tls_backend = *backend;
+	client->has_tls_backend = 1;
+	client->tls_userdata = userdata;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_mode(struct rtmp_client *client,
+				  enum rtmp_client_mode mode)
+{
+	if (!client)
+		return -EINVAL;
+
+	switch (mode) {
+	case RTMP_CLIENT_MODE_PUBLISH:
+		break;
+	case RTMP_CLIENT_MODE_PLAY:
+		if (!client->cbs.media_frame)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (client->state != RTMP_CONN_IDLE)
+		return -EBUSY;
+
+	client->mode = mode;
+	return 0;
+}
+
+RTMP_API void rtmp_media_buffer_ref(uint8_t *buffer)
+{
+	rtmp_buffer_pool_ref(buffer);
+}
+
+RTMP_API void rtmp_media_buffer_unref(uint8_t *buffer)
+{
+	rtmp_buffer_pool_put(buffer);
+}
+
+RTMP_API int
+rtmp_client_set_reconnect(struct rtmp_client *client,
+			  const struct rtmp_reconnect_config *config)
+{
+	if (!client || !config)
+		return -EINVAL;
+
+	if (config->enabled && config->max_delay < config->min_delay)
+		return -EINVAL;
+
+	client->reconnect = *config;
+	return 0;
+}
+
+RTMP_API int rtmp_client_set_dns_cache_ttl(struct rtmp_client *client,
+					   uint32_t ttl)
+{
+	if (!client)
+		return -EINVAL;
+
+	client->dns_cache_ttl = ttl;
+	if (ttl == 0)
+		invalidate_addr_cache(client);
+	return 0;
+}
+
+RTMP_API int
+rtmp_client_get_connect_timings(struct rtmp_client *client,
+				struct rtmp_connect_timings *timings)
+{
+	if (!client || !timings)
+		return -EINVAL;
+
+	*timings = client->timings;
+	return 0;
+}
+
+RTMP_API int rtmp_client_get_stats(struct rtmp_client *client,
+				   struct rtmp_stats *stats)
+{
+	int ret;
+
+	if (!client || !stats)
+		return -EINVAL;
+
+	if (!client->stream) {
+		memset(stats, 0, sizeof(*stats));
+		ret = 0;
+	} else {
+		ret = get_stream_stats(client->stream, stats);
+	}
+
+	stats->submit_dropped = client->submit_dropped;
+	return ret;
+}
+
+RTMP_API int rtmp_client_connect(struct rtmp_client *client, const char *url)
+{
+	int ret;
+
+	if (!client || !url)
+		return -EINVAL;
+
+	if (client->state != RTMP_CONN_IDLE)
+		return -EALREADY;
+
+	ret = parse_uri(client, url);
+	if (ret != 0)
+		return ret;
+
+	if (client->secure && !client->has_tls_backend) {
+		ULOGE("No TLS implementation set, rtmps URLs are not supported");
+		return -EPROTONOSUPPORT;
+	}
+
+	return start_connect(client);
+}
+
+RTMP_API int rtmp_client_disconnect(struct rtmp_client *client)
+{
+	if (!client || client->state == RTMP_CONN_IDLE)
+		return -EINVAL;
+
+	if (client->state == RTMP_CONN_READY) {
+		int ret;
+		double cmd_id = get_next_amf_id(client);
+
+		/* Do not lose the audio frames already released */
+		ret = flush_tx_aggregate(client->stream);
+		if (ret < 0)
+			ULOG_ERRNO("flush_tx_aggregate", -ret);
+
+		/* Send delete stream */
+		ret = send_amf_command(client->stream,
+				       &amf_cmds[AMF_CMD_DELETE_STREAM],
+				       "deleteStream",
+				       cmd_id,
+				       client->published_stream_id);
+		if (ret < 0)
+			ULOG_ERRNO("send_amf_command", -ret);
+	}
+
+	close_connection(client);
+
+	pomp_timer_clear(client->reconnect_timer);
+	free_tx_backlog(client->backlog);
+	client->backlog = NULL;
+	client->published = 0;
+	client->retries = 0;
+
+	set_state(client, RTMP_CONN_IDLE);
+	return 0;
+}
+
+RTMP_API int rtmp_client_send_metadata(struct rtmp_client *client,
+				       double duration,
+				       int width,
+				       int height,
+				       double framerate,
+				       int audio_sample_rate,
+				       int audio_sample_size)
+{
+	struct rtmp_buffer b;
+	int ret;
+	double fr;
+
+	if (!client)
+		return -EINVAL;
+	if (client->state != RTMP_CONN_READY)
+		return -EAGAIN;
+
+	memset(&b, 0, sizeof(b));
+
+	fr = (framerate == 0) ? 29.97 : framerate;
+
+	ret = amf_template_encode(&amf_cmds[AMF_CMD_METADATA],
+				  &b,
+				  "onMetaData",
+				  9,
+				  "duration",
+				  duration,
+				  "width",
+				  (double)width,
+				  "height",
+				  (double)height,
+				  "framerate",
+				  framerate,
+				  "videocodecid",
+				  7.0 /* h.264 */,
+				  "audiosamplerate",
+				  (double)audio_sample_rate,
+				  "audiosamplesize",
+				  (double)audio_sample_size,
+				  "stereo",
+				  1,
+				  "audiocodecid",
+				  10.0 /* AAC */);
+	if (ret != 0) {
+		free(b.buf);
+		return ret;
+	}
+
+	if (client->reconnect.enabled) {
+		client->metadata_ts = 0;
+		if (save_config(&client->metadata, b.buf, b.len) < 0)
+			ULOG_ERRNO("save_config", ENOMEM);
+	}
+
+	ret = send_metadata(client->stream, &b, 0, RTMP_DATA_ALLOCATED, NULL);
+	if (ret < 0)
+		free(b.buf);
+	return ret;
+}
+
+/* Queue the media messages on the chunk stream of a connected client, the
+ * data being owned by the application (RTMP_DATA_EXTERNAL) or by a group
+ * (RTMP_DATA_SHARED) */
+static int queue_packedmetadata(struct rtmp_client *client,
+				const uint8_t *buf,
+				size_t len,
+				uint32_t timestamp,
+				enum rtmp_data_owner owner,
+				void *frame_userdata)
+{
+	struct rtmp_buffer b = {
+		.buf = (uint8_t *)buf,
+		.cap = len,
+		.len = len,
+		.rd = 0,
+	};
+
+	if (client->reconnect.enabled) {
+		client->metadata_ts = timestamp;
+		if (save_config(&client->metadata, buf, len) < 0)
+			ULOG_ERRNO("save_config", ENOMEM);
+	}
+
+	return send_metadata(client->stream, &b, timestamp, owner, frame_userdata);
+}
+
+static int queue_video_avcc(struct rtmp_client *client,
+			    const uint8_t *buf,
+			    size_t len,
+			    enum rtmp_data_owner owner,
+			    void *frame_userdata)
+{
+	struct rtmp_buffer b = {
+		.buf = (uint8_t *)buf,
+		.cap = len,
+		.len = len,
+		.rd = 0,
+	};
+
+	if (client->reconnect.enabled &&
+	    save_config(&client->avcc, buf, len) < 0)
+		ULOG_ERRNO("save_config", ENOMEM);
+
+	return send_video_frame(client->stream,
+				&b,
+				(uint32_t)client->published_stream_id,
+				0,
+				0,
+				1,
+				1,
+				0,
+				owner,
+				frame_userdata);
+}
+
+static int queue_video_frame(struct rtmp_client *client,
+			     const uint8_t *buf,
+			     size_t len,
+			     uint32_t timestamp,
+			     int32_t cts,
+			     int is_key,
+			     int is_non_ref,
+			     enum rtmp_data_owner owner,
+			     void *frame_userdata)
+{
+	struct rtmp_buffer b = {
+		.buf = (uint8_t *)buf,
+		.cap = len,
+		.len = len,
+		.rd = 0,
+	};
+
+	return send_video_frame(client->stream,
+				&b,
+				(uint32_t)client->published_stream_id,
+				timestamp,
+				cts,
+				0,
+				is_key,
+				is_non_ref,
+				owner,
+				frame_userdata);
+}
+
+static int queue_audio_specific_config(struct rtmp_client *client,
+				       const uint8_t *buf,
+				       size_t len,
+				       enum rtmp_data_owner owner,
+				       void *frame_userdata)
+{
+	struct rtmp_buffer b = {
+		.buf = (uint8_t *)buf,
+		.cap = len,
+		.len = len,
+		.rd = 0,
+	};
+
+	if (client->reconnect.enabled &&
+	    save_config(&client->asc, buf, len) < 0)
+		ULOG_ERRNO("save_config", ENOMEM);
+
+	return send_audio_data(client->stream,
+			       &b,
+			       (uint32_t)client->published_stream_id,
+			       0,
+			       1,
+			       owner,
+			       frame_userdata);
+}
+
+static int queue_audio_data(struct rtmp_client *client,
+			    const uint8_t *buf,
+			    size_t len,
+			    uint32_t timestamp,
+			    enum rtmp_data_owner owner,
+			    void *frame_userdata)
+{
+	struct rtmp_buffer b = {
+		.buf = (uint8_t *)buf,
+		.cap = len,
+		.len = len,
+		.rd = 0,
+	};
+
+	return send_audio_data(client->stream,
+			       &b,
+			       (uint32_t)client->published_stream_id,
+			       timestamp,
+			       0,
+			       owner,
+			       frame_userdata);
+}
+
+static int queue_flv_tag(struct rtmp_client *client,
+			 enum rtmp_flv_tag_type type,
+			 const uint8_t *buf,
+			 size_t len,
+			 uint32_t timestamp,
+			 enum rtmp_data_owner owner,
+			 void *frame_userdata)
+{
+	struct rtmp_buffer b = {
+		.buf = (uint8_t *)buf,
+		.cap = len,
+		.len = len,
+		.rd = 0,
+	};
+
+	if (type == RTMP_FLV_TAG_SCRIPT)
+		return queue_packedmetadata(
+			client, buf, len, timestamp, owner, frame_userdata);
+
+	/* Keep the AVC & AAC sequence headers without their tag header, as
+	 * given to rtmp_client_send_video_avcc() and
+	 * rtmp_client_send_audio_specific_config() */
+	if (client->reconnect.enabled && type == RTMP_FLV_TAG_VIDEO &&
+	    len >= 5 && (buf[0] & 0x0f) == 7 && buf[1] == 0x00 &&
+	    save_config(&client->avcc, &buf[5], len - 5) < 0)
+		ULOG_ERRNO("save_config", ENOMEM);
+	if (client->reconnect.enabled && type == RTMP_FLV_TAG_AUDIO &&
+	    len >= 2 && (buf[0] >> 4) == 10 && buf[1] == 0x00 &&
+	    save_config(&client->asc, &buf[2], len - 2) < 0)
+		ULOG_ERRNO("save_config", ENOMEM);
+
+	return send_flv_tag(client->stream,
+			    type,
+			    &b,
+			    (uint32_t)client->published_stream_id,
+			    timestamp,
+			    owner,
+			    frame_userdata);
+}
+
+/* Check if we have an IDR NALU or not, and if the slices are used as
+ * reference (nal_ref_idc != 0) */
+static int queue_media(struct rtmp_client *client,
+		       enum media_msg_type type,
+		       const uint8_t *buf,
+		       size_t len,
+		       uint32_t timestamp,
+		       int is_key,
+		       int is_non_ref,
+		       enum rtmp_data_owner owner,
+		       void *frame_userdata)
+{
+	switch (type) {
+	case MEDIA_MSG_METADATA:
+		return queue_packedmetadata(
+			client, buf, len, timestamp, owner, frame_userdata);
+	case MEDIA_MSG_VIDEO_CONFIG:
+		return queue_video_avcc(client, buf, len, owner, frame_userdata);
+	case MEDIA_MSG_VIDEO:
+		return queue_video_frame(client,
+					 buf,
+					 len,
+					 timestamp,
+					 0,
+					 is_key,
+					 is_non_ref,
+					 owner,
+					 frame_userdata);
+	case MEDIA_MSG_AUDIO_CONFIG:
+		return queue_audio_specific_config(
+			client, buf, len, owner, frame_userdata);
+	case MEDIA_MSG_AUDIO:
+		return queue_audio_data(
+			client, buf, len, timestamp, owner, frame_userdata);
+	default:
+		return -EINVAL;
+	}
+}
+
+RTMP_API int rtmp_client_send_packedmetadata(struct rtmp_client *client,
+					     const uint8_t *buf,
+					     size_t len,
+					     uint32_t timestamp,
+					     void *frame_userdata)
+{
+	if (!client || !buf)
+		return -EINVAL;
+
+	if (client->state != RTMP_CONN_READY)
+		return -EAGAIN;
+
+	return queue_packedmetadata(
+		client, buf, len, timestamp, RTMP_DATA_EXTERNAL, frame_userdata);
+}
+
+RTMP_API int rtmp_client_send_video_avcc(struct rtmp_client *client,
+					 const uint8_t *buf,
+					 size_t len,
+					 void *frame_userdata)
+{
+	if (!client || !buf)
+		return -EINVAL;
+
+	if (client->state != RTMP_CONN_READY)
+		return -EAGAIN;
+
+	return queue_video_avcc(
+		client, buf, len, RTMP_DATA_EXTERNAL, frame_userdata);
+}
+
+RTMP_API int rtmp_client_send_video_frame(struct rtmp_client *client,
+					  const uint8_t *buf,
+					  size_t len,
+					  uint32_t timestamp,
+					  void *frame_userdata)
+{
+	int is_key, is_non_ref;
+	int ret;
+
+	if (!client || !buf)
+		return -EINVAL;
+
+	if (client->state != RTMP_CONN_READY)
+		return -EAGAIN;
+
+	ret = rtmp_nal_scan_avcc(buf, len, &is_key, &is_non_ref);
+	if (ret < 0) {
+		ULOG_ERRNO("rtmp_nal_scan_avcc", -ret);
+		return ret;
+	}
+
+	return queue_video_frame(client,
+				 buf,
+				 len,
+				 timestamp,
+				 0,
+				 is_key,
+				 is_non_ref,
+				 RTMP_DATA_EXTERNAL,
+				 frame_userdata);
+}
+
+RTMP_API int
+rtmp_client_send_video_frame_ext(struct rtmp_client *client,
+				 const uint8_t *buf,
+				 size_t len,
+				 uint32_t timestamp,
+				 const struct rtmp_video_frame_info *info,
+				 void *frame_userdata)
+{
+	struct iovec nalus[RTMP_NAL_MAX_UNITS];
+	int count;
+
+	if (!client || !buf || !info)
+		return -EINVAL;
+	if (info->cts < RTMP_VIDEO_CTS_MIN || info->cts > RTMP_VIDEO_CTS_MAX)
+		return -EINVAL;
+
+	if (client->state != RTMP_CONN_READY)
+		return -EAGAIN;
+
+	switch (info->format) {
+	case RTMP_VIDEO_FORMAT_AVCC:
+		return queue_video_frame(client,
+					 buf,
+					 len,
+					 timestamp,
+					 info->cts,
+					 info->is_key,
+					 info->is_non_ref,
+					 RTMP_DATA_EXTERNAL,
+					 frame_userdata);
+	case RTMP_VIDEO_FORMAT_ANNEXB:
+		/* Sent as length prefixes + the NAL units of buf */
+		count = rtmp_nal_split_annexb(
+			buf, len, nalus, RTMP_NAL_MAX_UNITS);
+		if (count < 0) {
+			ULOG_ERRNO("rtmp_nal_split_annexb", -count);
+			return count;
+		}
+		return send_video_nalus(client->stream,
+					buf,
+					nalus,
+					count,
+					(uint32_t)client->published_stream_id,
+					timestamp,
+					info->cts,
+					info->is_key,
+					info->is_non_ref,
+					RTMP_DATA_EXTERNAL,
+					frame_userdata);
+	default:
+		return -EINVAL;
+	}
+}
+
+RTMP_API int rtmp_client_send_audio_specific_config(struct rtmp_client *client,
+						    const uint8_t *buf,
+						    size_t len,
+						    void *frame_userdata)
+{
+	if (!client || !buf)
+		return -EINVAL;
+
+	if (client->state != RTMP_CONN_READY)
+		return -EAGAIN;
+
+	return queue_audio_specific_config(
+		client, buf, len, RTMP_DATA_EXTERNAL, frame_userdata);
+}
+
+RTMP_API int rtmp_client_send_audio_data(struct rtmp_client *client,
+					 const uint8_t *buf,
+					 size_t len,
+					 uint32_t timestamp,
+					 void *frame_userdata)
+{
+	if (!client || !buf)
+		return -EINVAL;
+
+	if (client->state != RTMP_CONN_READY)
+		return -EAGAIN;
 
-	ret = send_amf_message(client->stream, &client->buffer);
-	if (ret < 0) {
-		ULOG_ERRNO("send_amf_message", -ret);
-		goto error;
-	}
+	return queue_audio_data(client,
+				buf,
+				len,
+				timestamp,
+				RTMP_DATA_EXTERNAL,
+				frame_userdata);
+}
 
-	ret = set_chunk_size(client->stream, 256);
-	if (ret < 0) {
-		ULOG_ERRNO("set_chunk_size", -ret);
-		goto error;
-	}
+RTMP_API int rtmp_client_send_flv_tag(struct rtmp_client *client,
+				      enum rtmp_flv_tag_type type,
+				      const uint8_t *buf,
+				      size_t len,
+				      uint32_t timestamp,
+				      void *frame_userdata)
+{
+	if (!client || !buf || len == 0)
+		return -EINVAL;
 
-	set_state(client, RTMP_CONN_WAIT_FMS);
+	if (type != RTMP_FLV_TAG_AUDIO && type != RTMP_FLV_TAG_VIDEO &&
+	    type != RTMP_FLV_TAG_SCRIPT)
+		return -EINVAL;
 
-	return;
-error:
-	rtmp_client_disconnect(client);
+	if (client->state != RTMP_CONN_READY)
+		return -EAGAIN;
+
+	return queue_flv_tag(client,
+			     type,
+			     buf,
+			     len,
+			     timestamp,
+			     RTMP_DATA_EXTERNAL,
+			     frame_userdata);
 }
 
-static void pomp_event_cb(int fd, uint32_t revents, void *userdata)
+static void group_unref(struct rtmp_group *group)
 {
-	struct rtmp_client *client = userdata;
-	if (!client || fd != client->sock)
+	if (--group->refs > 0)
 		return;
-
-	switch (client->state) {
-	case RTMP_CONN_WAIT_TCP:
-		handle_wait_tcp(client);
-		break;
-	case RTMP_CONN_WAIT_S0:
-		handle_wait_s0(client);
-		break;
-	case RTMP_CONN_WAIT_S1:
-		handle_wait_s1(client);
-		break;
-	case RTMP_CONN_WAIT_S2:
-		handle_wait_s2(client);
-		break;
-	default:
-		break;
-	}
+	free(group);
 }
 
-RTMP_API int rtmp_client_connect(struct rtmp_client *client, const char *url)
+static void group_frame_unref(struct group_frame *frame, uint8_t *data)
 {
-	int ret;
-	int flags;
-	struct sockaddr_in addr;
-
-	if (!client || !url)
-		return -EINVAL;
+	struct rtmp_group *group = frame->group;
 
-	if (client->state != RTMP_CONN_IDLE)
-		return -EALREADY;
+	if (--frame->refs > 0)
+		return;
+	group->cbs.data_unref(data, frame->frame_userdata, group->userdata);
+	free(frame);
+	group_unref(group);
+}
 
-	client->sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (client->sock < 0)
-		return -errno;
+RTMP_API struct rtmp_group *
+rtmp_group_new(const struct rtmp_group_callbacks *cbs, void *userdata)
+{
+	struct rtmp_group *group;
 
-	flags = fcntl(client->sock, F_GETFL, 0);
-	if (flags == -1) {
-		ret = -errno;
-		goto error_close;
-	}
-	ret = fcntl(client->sock, F_SETFL, flags | O_NONBLOCK);
-	if (ret == -1) {
-		ret = -errno;
-		goto error_close;
+	if (!cbs || !cbs->data_unref) {
+		ULOG_ERRNO("rtmp_group_new", EINVAL);
+		return NULL;
 	}
 
-#ifdef SO_NOSIGPIPE
-	flags = 1;
-	ret = setsockopt(
-		client->sock, SOL_SOCKET, SO_NOSIGPIPE, &flags, sizeof(flags));
-	if (ret != 0) {
-		ret = -errno;
-		goto error_close;
+	group = calloc(1, sizeof(*group));
+	if (!group) {
+		ULOG_ERRNO("calloc", ENOMEM);
+		return NULL;
 	}
-#endif
-
-	if (client->cbs.socket_cb)
-		client->cbs.socket_cb(client->sock, client->userdata);
 
-	ret = pomp_loop_add(client->loop,
-			    client->sock,
-			    POMP_FD_EVENT_OUT,
-			    pomp_event_cb,
-			    client);
-	if (ret != 0)
-		goto error_close;
-
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	ret = parse_uri(client, url, &addr.sin_port, &addr.sin_addr);
-	if (ret != 0)
-		goto error;
+	group->cbs = *cbs;
+	group->userdata = userdata;
+	group->refs = 1;
+	list_init(&group->clients);
 
-	ret = connect(
-		client->sock, (const struct sockaddr *)&addr, sizeof(addr));
-	if (ret < 0)
-		ret = -errno;
+	return group;
+}
 
-	/* EINPROGRESS should be silenced */
-	if (ret == -EINPROGRESS)
-		ret = 0;
-	if (ret != 0)
-		goto error;
+RTMP_API void rtmp_group_destroy(struct rtmp_group *group)
+{
+	struct rtmp_client *client, *tmp;
 
-	set_state(client, RTMP_CONN_WAIT_TCP);
+	if (!group)
+		return;
 
-	return ret;
+	list_walk_entry_forward_safe(&group->clients, client, tmp, group_node)
+	{
+		list_del(&client->group_node);
+		client->group = NULL;
+	}
 
-error:
-	pomp_loop_remove(client->loop, client->sock);
-error_close:
-	close(client->sock);
-	return ret;
+	/* The frames still queued keep the group until they are released */
+	group_unref(group);
 }
 
-RTMP_API int rtmp_client_disconnect(struct rtmp_client *client)
+RTMP_API int rtmp_group_add_client(struct rtmp_group *group,
+				   struct rtmp_client *client)
 {
-	if (!client || client->state == RTMP_CONN_IDLE)
+	if (!group || !client)
 		return -EINVAL;
 
-	if (client->state == RTMP_CONN_READY) {
-		int ret;
-		double cmd_id = get_next_amf_id(client);
+	if (client->group)
+		return -EBUSY;
 
-		/* Send delete stream */
-		client->buffer.len = 0;
-		ret = amf_encode(&client->buffer,
-				 "%s,%f,0,%f",
-				 "deleteStream",
-				 cmd_id,
-				 client->published_stream_id);
-		if (ret != 0) {
-			ULOG_ERRNO("amf_encode", -ret);
-		} else {
-			ret = send_amf_message(client->stream, &client->buffer);
-			if (ret < 0)
-				ULOG_ERRNO("send_amf_message", -ret);
-		}
-	}
+	list_add_before(&group->clients, &client->group_node);
+	client->group = group;
+	return 0;
+}
 
-	/* We remove the fd from the loop when creating a chunk_stream. */
-	if (!client->stream)
-		pomp_loop_remove(client->loop, client->sock);
-	else
-		delete_chunk_stream(client->stream);
-	client->stream = NULL;
+RTMP_API int rtmp_group_remove_client(struct rtmp_group *group,
+				      struct rtmp_client *client)
+{
+	if (!group || !client)
+		return -EINVAL;
 
-	close(client->sock);
-	set_state(client, RTMP_CONN_IDLE);
+	if (client->group != group)
+		return -ENOENT;
+
+	list_del(&client->group_node);
+	client->group = NULL;
 	return 0;
 }
 
-RTMP_API int rtmp_client_send_metadata(struct rtmp_client *client,
-				       double duration,
-				       int width,
-				       int height,
-				       double framerate,
-				       int audio_sample_rate,
-				       int audio_sample_size)
+/* Queue a message on every connected member of a group, the data being
+ * released once all the members have sent or dropped it */
+static int group_send(struct rtmp_group *group,
+		      enum media_msg_type type,
+		      const uint8_t *buf,
+		      size_t len,
+		      uint32_t timestamp,
+		      void *frame_userdata)
 {
-	struct rtmp_buffer b;
-	int ret;
-	double fr;
+	struct rtmp_client *client;
+	struct group_frame *frame;
+	int is_key = 0, is_non_ref = 0;
+	int ret = -EAGAIN;
+	int queued = 0;
 
-	if (!client)
+	if (!group || !buf)
 		return -EINVAL;
-	if (client->state != RTMP_CONN_READY)
-		return -EAGAIN;
 
-	b.cap = 256;
-	b.buf = malloc(b.cap);
-	if (!b.buf)
+	if (type == MEDIA_MSG_VIDEO) {
+		ret = rtmp_nal_scan_avcc(buf, len, &is_key, &is_non_ref);
+		if (ret < 0) {
+			ULOG_ERRNO("rtmp_nal_scan_avcc", -ret);
+			return ret;
+		}
+		ret = -EAGAIN;
+	}
+
+	frame = calloc(1, sizeof(*frame));
+	if (!frame)
 		return -ENOMEM;
-	b.len = 0;
-	b.rd = 0;
+	frame->group = group;
+	frame->frame_userdata = frame_userdata;
+	/* Keep the frame until all the members are done */
+	frame->refs = 1;
+	group->refs++;
+
+	list_walk_entry_forward(&group->clients, client, group_node)
+	{
+		if (client->state != RTMP_CONN_READY)
+			continue;
 
-	fr = (framerate == 0) ? 29.97 : framerate;
+		frame->refs++;
+		ret = queue_media(client,
+				  type,
+				  buf,
+				  len,
+				  timestamp,
+				  is_key,
+				  is_non_ref,
+				  RTMP_DATA_SHARED,
+				  frame);
+		if (ret < 0)
+			frame->refs--;
+		else
+			queued++;
+	}
 
-	ret = amf_encode(&b,
-			 "%s[%d,%s:%f,%s:%f,%s:%f,%s:%f,"
-			 "%s:%f,%s:%f,%s:%f,%s:%u,%s:%f]",
-			 "onMetaData",
-			 9,
-			 "duration",
-			 duration,
-			 "width",
-			 (double)width,
-			 "height",
-			 (double)height,
-			 "framerate",
-			 framerate,
-			 "videocodecid",
-			 7.0 /* h.264 */,
-			 "audiosamplerate",
-			 (double)audio_sample_rate,
-			 "audiosamplesize",
-			 (double)audio_sample_size,
-			 "stereo",
-			 1,
-			 "audiocodecid",
-			 10.0 /* AAC */);
-	if (ret != 0) {
-		free(b.buf);
+	if (queued == 0) {
+		/* Not queued, still owned by the caller */
+		free(frame);
+		group_unref(group);
 		return ret;
 	}
 
-	return send_metadata(client->stream, &b, 0, 1, NULL);
+	group_frame_unref(frame, (uint8_t *)buf);
+	return queued;
 }
 
-RTMP_API int rtmp_client_send_packedmetadata(struct rtmp_client *client,
-					     const uint8_t *buf,
-					     size_t len,
-					     uint32_t timestamp,
-					     void *frame_userdata)
+RTMP_API int rtmp_group_send_packedmetadata(struct rtmp_group *group,
+					    const uint8_t *buf,
+					    size_t len,
+					    uint32_t timestamp,
+					    void *frame_userdata)
 {
-	struct rtmp_buffer b = {
-		.buf = (uint8_t *)buf,
-		.cap = len,
-		.len = len,
-		.rd = 0,
-	};
-	if (!client || !buf)
-		return -EINVAL;
-
-	if (client->state != RTMP_CONN_READY)
-		return -EAGAIN;
+	return group_send(
+		group, MEDIA_MSG_METADATA, buf, len, timestamp, frame_userdata);
+}
 
-	return send_metadata(client->stream, &b, timestamp, 0, frame_userdata);
+RTMP_API int rtmp_group_send_video_avcc(struct rtmp_group *group,
+					const uint8_t *buf,
+					size_t len,
+					void *frame_userdata)
+{
+	return group_send(
+		group, MEDIA_MSG_VIDEO_CONFIG, buf, len, 0, frame_userdata);
 }
 
-RTMP_API int rtmp_client_send_video_avcc(struct rtmp_client *client,
+RTMP_API int rtmp_group_send_video_frame(struct rtmp_group *group,
 					 const uint8_t *buf,
 					 size_t len,
+					 uint32_t timestamp,
 					 void *frame_userdata)
 {
-	struct rtmp_buffer b = {
-		.buf = (uint8_t *)buf,
-		.cap = len,
-		.len = len,
-		.rd = 0,
-	};
+	return group_send(
+		group, MEDIA_MSG_VIDEO, buf, len, timestamp, frame_userdata);
+}
 
-	if (!client || !buf)
+RTMP_API int rtmp_group_send_audio_specific_config(struct rtmp_group *group,
+						   const uint8_t *buf,
+						   size_t len,
+						   void *frame_userdata)
+{
+	return group_send(
+		group, MEDIA_MSG_AUDIO_CONFIG, buf, len, 0, frame_userdata);
+}
+
+RTMP_API int rtmp_group_send_audio_data(struct rtmp_group *group,
+					const uint8_t *buf,
+					size_t len,
+					uint32_t timestamp,
+					void *frame_userdata)
+{
+	return group_send(
+		group, MEDIA_MSG_AUDIO, buf, len, timestamp, frame_userdata);
+}
+
+/* rtmp_submit_msg flags */
+#define SUBMIT_FLAG_KEY (1 << 0)
+#define SUBMIT_FLAG_NON_REF (1 << 1)
+
+static void release_submit_msg(struct rtmp_client *client,
+			       const struct rtmp_submit_msg *msg)
+{
+	client->submit_dropped++;
+	client->cbs.data_unref(
+		(uint8_t *)msg->buf, msg->userdata, client->userdata);
+}
+
+static void submit_msg_cb(const struct rtmp_submit_msg *msg, void *userdata)
+{
+	struct rtmp_client *client = userdata;
+	int ret;
+
+	if (client->state != RTMP_CONN_READY) {
+		release_submit_msg(client, msg);
+		return;
+	}
+
+	ret = queue_media(client,
+			  msg->type,
+			  msg->buf,
+			  msg->len,
+			  msg->timestamp,
+			  !!(msg->flags & SUBMIT_FLAG_KEY),
+			  !!(msg->flags & SUBMIT_FLAG_NON_REF),
+			  RTMP_DATA_EXTERNAL,
+			  msg->userdata);
+	if (ret < 0)
+		release_submit_msg(client, msg);
+}
+
+static void destroy_submit_queue(struct rtmp_client *client)
+{
+	struct rtmp_submit_msg msg;
+
+	if (!client->submit)
+		return;
+
+	while (rtmp_submit_queue_pop(client->submit, &msg))
+		release_submit_msg(client, &msg);
+	rtmp_submit_queue_destroy(client->submit);
+	client->submit = NULL;
+}
+
+RTMP_API int rtmp_client_set_submit_queue(struct rtmp_client *client,
+					  unsigned int size)
+{
+	if (!client)
 		return -EINVAL;
 
-	if (client->state != RTMP_CONN_READY)
-		return -EAGAIN;
+	destroy_submit_queue(client);
+	if (size == 0)
+		return 0;
 
-	return send_video_frame(client->stream,
-				&b,
-				(uint32_t)client->published_stream_id,
-				0,
-				1,
-				1,
-				frame_userdata);
+	client->submit =
+		rtmp_submit_queue_new(client->loop, size, submit_msg_cb, client);
+	if (!client->submit)
+		return -ENOMEM;
+	return 0;
 }
 
-RTMP_API int rtmp_client_send_video_frame(struct rtmp_client *client,
-					  const uint8_t *buf,
-					  size_t len,
-					  uint32_t timestamp,
-					  void *frame_userdata)
+static int submit(struct rtmp_client *client,
+		  enum media_msg_type type,
+		  const uint8_t *buf,
+		  size_t len,
+		  uint32_t timestamp,
+		  void *frame_userdata)
 {
-	struct rtmp_buffer b = {
-		.buf = (uint8_t *)buf,
-		.cap = len,
+	struct rtmp_submit_msg msg = {
+		.type = type,
+		.buf = buf,
 		.len = len,
-		.rd = 0,
+		.timestamp = timestamp,
+		.userdata = frame_userdata,
 	};
-	size_t offset = 0;
-	uint32_t nal_size;
-	uint8_t nal_type;
-	int is_key = 0;
 
 	if (!client || !buf)
 		return -EINVAL;
 
-	if (client->state != RTMP_CONN_READY)
-		return -EAGAIN;
-
-	/* Check if we have an IDR NALU or not */
-	while (offset < len) {
-		memcpy(&nal_size, &buf[offset], sizeof(nal_size));
-		nal_size = ntohl(nal_size);
-		nal_type = buf[offset + sizeof(nal_size)] & 0x1f;
-		if (nal_type == 5) {
-			is_key = 1;
-			break;
-		}
-		offset += nal_size + sizeof(nal_size);
+	if (!client->submit)
+		return -EPERM;
+
+	/* Parse the frame on the producer thread */
+	if (type == MEDIA_MSG_VIDEO) {
+		int is_key, is_non_ref;
+		int ret = rtmp_nal_scan_avcc(buf, len, &is_key, &is_non_ref);
+		if (ret < 0)
+			return ret;
+		if (is_key)
+			msg.flags |= SUBMIT_FLAG_KEY;
+		if (is_non_ref)
+			msg.flags |= SUBMIT_FLAG_NON_REF;
 	}
 
-	return send_video_frame(client->stream,
-				&b,
-				(uint32_t)client->published_stream_id,
-				timestamp,
-				0,
-				is_key,
-				frame_userdata);
+	return rtmp_submit_queue_push(client->submit, &msg);
 }
 
-RTMP_API int rtmp_client_send_audio_specific_config(struct rtmp_client *client,
-						    const uint8_t *buf,
-						    size_t len,
-						    void *frame_userdata)
+RTMP_API int rtmp_client_submit_packedmetadata(struct rtmp_client *client,
+					       const uint8_t *buf,
+					       size_t len,
+					       uint32_t timestamp,
+					       void *frame_userdata)
 {
-	struct rtmp_buffer b = {
-		.buf = (uint8_t *)buf,
-		.cap = len,
-		.len = len,
-		.rd = 0,
-	};
-	if (!client || !buf)
-		return -EINVAL;
+	return submit(
+		client, MEDIA_MSG_METADATA, buf, len, timestamp, frame_userdata);
+}
 
-	if (client->state != RTMP_CONN_READY)
-		return -EAGAIN;
+RTMP_API int rtmp_client_submit_video_avcc(struct rtmp_client *client,
+					   const uint8_t *buf,
+					   size_t len,
+					   void *frame_userdata)
+{
+	return submit(
+		client, MEDIA_MSG_VIDEO_CONFIG, buf, len, 0, frame_userdata);
+}
 
-	return send_audio_data(client->stream,
-			       &b,
-			       (uint32_t)client->published_stream_id,
-			       0,
-			       1,
-			       frame_userdata);
+RTMP_API int rtmp_client_submit_video_frame(struct rtmp_client *client,
+					    const uint8_t *buf,
+					    size_t len,
+					    uint32_t timestamp,
+					    void *frame_userdata)
+{
+	return submit(
+		client, MEDIA_MSG_VIDEO, buf, len, timestamp, frame_userdata);
 }
 
-RTMP_API int rtmp_client_send_audio_data(struct rtmp_client *client,
+RTMP_API int
+rtmp_client_submit_audio_specific_config(struct rtmp_client *client,
 					 const uint8_t *buf,
 					 size_t len,
-					 uint32_t timestamp,
 					 void *frame_userdata)
 {
-	struct rtmp_buffer b = {
-		.buf = (uint8_t *)buf,
-		.cap = len,
-		.len = len,
-		.rd = 0,
-	};
-	if (!client || !buf)
-		return -EINVAL;
-
-	if (client->state != RTMP_CONN_READY)
-		return -EAGAIN;
+	return submit(
+		client, MEDIA_MSG_AUDIO_CONFIG, buf, len, 0, frame_userdata);
+}
 
-	return send_audio_data(client->stream,
-			       &b,
-			       (uint32_t)client->published_stream_id,
-			       timestamp,
-			       0,
-			       frame_userdata);
+RTMP_API int rtmp_client_submit_audio_data(struct rtmp_client *client,
+					   const uint8_t *buf,
+					   size_t len,
+					   uint32_t timestamp,
+					   void *frame_userdata)
+{
+	return submit(
+		client, MEDIA_MSG_AUDIO, buf, len, timestamp, frame_userdata);
 }
 
 RTMP_API const char *
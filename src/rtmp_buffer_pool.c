@@ -0,0 +1,194 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "rtmp_buffer_pool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#define ULOG_TAG rtmp_buffer_pool
+#include <ulog.h>
+ULOG_DECLARE_TAG(rtmp_buffer_pool);
+
+/* Smallest size class (512 bytes) */
+#define POOL_MIN_SHIFT 9
+/* Number of size classes, the biggest one holds a full RTMP message
+ * (up to 0xFFFFFF bytes) */
+#define POOL_NUM_CLASSES 16
+/* Maximum number of free buffers kept per size class */
+#define POOL_MAX_FREE 4
+/* Maximum total size of the free buffers kept in a pool */
+#define POOL_MAX_FREE_BYTES (4 * 1024 * 1024)
+
+struct pool_buf {
+	struct rtmp_buffer_pool *pool;
+	struct pool_buf *next;
+	unsigned int cls;
+	/* Number of owners of the buffer */
+	unsigned int refs;
+	/* Keep the data aligned */
+	uint64_t data[];
+};
+
+struct rtmp_buffer_pool {
+	struct pool_buf *free[POOL_NUM_CLASSES];
+	unsigned int free_count[POOL_NUM_CLASSES];
+	size_t free_bytes;
+	/* Number of buffers owned by the users of the pool */
+	unsigned int used;
+	int destroyed;
+};
+
+static size_t class_size(unsigned int cls)
+{
+	return (size_t)1 << (POOL_MIN_SHIFT + cls);
+}
+
+static struct pool_buf *get_pool_buf(uint8_t *buf)
+{
+	return (struct pool_buf *)(buf - offsetof(struct pool_buf, data));
+}
+
+struct rtmp_buffer_pool *rtmp_buffer_pool_new(void)
+{
+	struct rtmp_buffer_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		ULOG_ERRNO("calloc", ENOMEM);
+		return NULL;
+	}
+
+	return pool;
+}
+
+static void free_cached_buffers(struct rtmp_buffer_pool *pool)
+{
+	unsigned int i;
+	struct pool_buf *pbuf;
+
+	for (i = 0; i < POOL_NUM_CLASSES; i++) {
+		while (pool->free[i]) {
+			pbuf = pool->free[i];
+			pool->free[i] = pbuf->next;
+			free(pbuf);
+		}
+		pool->free_count[i] = 0;
+	}
+	pool->free_bytes = 0;
+}
+
+void rtmp_buffer_pool_destroy(struct rtmp_buffer_pool *pool)
+{
+	if (!pool)
+		return;
+
+	free_cached_buffers(pool);
+	pool->destroyed = 1;
+	if (pool->used == 0)
+		free(pool);
+}
+
+int rtmp_buffer_pool_get(struct rtmp_buffer_pool *pool,
+			 size_t len,
+			 struct rtmp_buffer *buffer)
+{
+	unsigned int cls = 0;
+	struct pool_buf *pbuf;
+
+	if (!pool || !buffer || pool->destroyed)
+		return -EINVAL;
+
+	while (class_size(cls) < len) {
+		cls++;
+		if (cls >= POOL_NUM_CLASSES)
+			return -EMSGSIZE;
+	}
+
+	pbuf = pool->free[cls];
+	if (pbuf) {
+		pool->free[cls] = pbuf->next;
+		pool->free_count[cls]--;
+		pool->free_bytes -= class_size(cls);
+	} else {
+		pbuf = malloc(sizeof(*pbuf) + class_size(cls));
+		if (!pbuf)
+			return -ENOMEM;
+		pbuf->pool = pool;
+		pbuf->cls = cls;
+	}
+	pbuf->next = NULL;
+	pbuf->refs = 1;
+	pool->used++;
+
+	buffer->buf = (uint8_t *)pbuf->data;
+	buffer->cap = class_size(cls);
+	buffer->len = 0;
+	buffer->rd = 0;
+	return 0;
+}
+
+void rtmp_buffer_pool_ref(uint8_t *buf)
+{
+	if (!buf)
+		return;
+
+	get_pool_buf(buf)->refs++;
+}
+
+void rtmp_buffer_pool_put(uint8_t *buf)
+{
+	struct pool_buf *pbuf;
+	struct rtmp_buffer_pool *pool;
+	size_t size;
+
+	if (!buf)
+		return;
+
+	pbuf = get_pool_buf(buf);
+	if (--pbuf->refs > 0)
+		return;
+	pool = pbuf->pool;
+	size = class_size(pbuf->cls);
+	pool->used--;
+
+	if (pool->destroyed) {
+		free(pbuf);
+		if (pool->used == 0)
+			free(pool);
+		return;
+	}
+
+	/* Keep the buffer for later use, unless the pool is full */
+	if (pool->free_count[pbuf->cls] >= POOL_MAX_FREE ||
+	    pool->free_bytes + size > POOL_MAX_FREE_BYTES) {
+		free(pbuf);
+		return;
+	}
+	pbuf->next = pool->free[pbuf->cls];
+	pool->free[pbuf->cls] = pbuf;
+	pool->free_count[pbuf->cls]++;
+	pool->free_bytes += size;
+}
@@ -0,0 +1,61 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _RTMP_BUFFER_POOL_H_
+#define _RTMP_BUFFER_POOL_H_
+
+#include "rtmp_internal.h"
+
+/*
+ * Pool of message buffers, sorted in power of two size classes.
+ *
+ * Buffers taken from a pool remember their pool, so they can be returned with
+ * rtmp_buffer_pool_put() by any owner, even after the pool was destroyed.
+ * A destroyed pool is freed once all its buffers are returned.
+ *
+ * A buffer can have several owners: each rtmp_buffer_pool_ref() call must be
+ * balanced by a rtmp_buffer_pool_put() call. The pools are not thread-safe,
+ * their buffers must be referenced and returned from a single thread.
+ */
+
+struct rtmp_buffer_pool;
+
+struct rtmp_buffer_pool *rtmp_buffer_pool_new(void);
+
+void rtmp_buffer_pool_destroy(struct rtmp_buffer_pool *pool);
+
+/* Fills buffer with a pool buffer of at least len bytes (buffer->cap is set to
+ * the real buffer size, buffer->len and buffer->rd to 0) */
+int rtmp_buffer_pool_get(struct rtmp_buffer_pool *pool,
+			 size_t len,
+			 struct rtmp_buffer *buffer);
+
+/* Adds an owner to a buffer */
+void rtmp_buffer_pool_ref(uint8_t *buf);
+
+/* Releases a buffer, returned to its pool once it has no owner left */
+void rtmp_buffer_pool_put(uint8_t *buf);
+
+#endif /* _RTMP_BUFFER_POOL_H_ */
@@ -25,24 +25,47 @@
  */
 #include "rtmp_chunk_stream.h"
 #include "amf.h"
+#include "rtmp_tls.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#	include <linux/errqueue.h>
+#	include <linux/sockios.h>
+#endif
 
 #include <futils/list.h>
+#include <futils/timetools.h>
 #include <libpomp.h>
 
 #define ULOG_TAG rtmp_chunk_stream
 #include <ulog.h>
 ULOG_DECLARE_TAG(rtmp_chunk_stream);
 
-#define RTMP_CHUNK_STREAM_MSG_LEN 512
 #define RTMP_CHUNK_HEADER_MAX_LEN 18
 
+/* Minimum size of the receive buffer, many chunks are read per recv() */
+#define RTMP_RX_BUFFER_LEN 65536
+
+/* Max number of iovecs used for a single sendmsg() call. Each chunk needs at
+ * most 3 iovecs (header, data header, data) */
+#ifdef IOV_MAX
+#	define RTMP_TX_IOV_MAX IOV_MAX
+#else
+#	define RTMP_TX_IOV_MAX 1024
+#endif
+
 enum bw_type {
 	BW_TYPE_HARD = 0,
 	BW_TYPE_SOFT,
@@ -50,39 +73,222 @@ enum bw_type {
 	BW_TYPE_UNKNOWN,
 };
 
-#define RTMP_MAX_QUEUE 10
+/* Chunk size is limited to 31 bits */
+#define RTMP_CHUNK_SIZE_MAX 0x7FFFFFFF
+
+/* Automatic chunk size: the chunk size is a multiple of the socket MSS,
+ * covering the average video frame size, up to RTMP_AUTO_CHUNK_MAX_SEGMENTS
+ * segments (bigger chunks would delay the audio messages too much). It is
+ * re-evaluated every RTMP_AUTO_CHUNK_PERIOD video frames */
+#define RTMP_DEFAULT_MSS 1460
+#define RTMP_AUTO_CHUNK_MAX_SEGMENTS 8
+#define RTMP_AUTO_CHUNK_PERIOD 30
+
+/* Max length of the data headers (FLV tag headers or "@setDataFrame" AMF
+ * string) and of the internal control messages stored in a tx_buffer */
+#define RTMP_TX_INLINE_LEN 16
+
+/* Max number of NAL units whose slices are stored in a tx_buffer, the slices
+ * of bigger frames are taken from the stream tx_pool */
+#define RTMP_TX_INLINE_NALUS 8
+
+/* Number of send samples kept to match the peer acks for the RTT estimate */
+#define RTMP_ACK_SAMPLES 32
+/* Bytes between two send samples when no ack window was sent to the peer */
+#define RTMP_ACK_SAMPLE_DEFAULT_INTERVAL 65536
+
+/* Lowest pacing rate in bytes per second, so that a wrong estimate can not
+ * stall the stream */
+#define RTMP_PACING_MIN_RATE 16384
+
+/* Lowest valid chunk stream id, 0 and 1 are used for the extended csid
+ * encodings */
+#define RTMP_CSID_MIN 2
+
+/* Chunk stream ids below this value (one byte basic header) are directly
+ * indexed, others are looked up in a list */
+#define RTMP_CSID_TABLE_SIZE 64
+
+/* Aggregate message sub-message: FLV tag header, data, and back-pointer (the
+ * length of the tag header and data) */
+#define RTMP_AGGREGATE_TAG_HEADER_LEN 11
+#define RTMP_AGGREGATE_BACK_POINTER_LEN 4
+/* Maximum length of an Aggregate message */
+#define RTMP_AGGREGATE_MAX_LEN 8192
+
+/* Zero-copy transmission, definitions which might be missing from the libc
+ * headers */
+#ifdef __linux__
+#	define RTMP_HAVE_ZEROCOPY
+#	ifndef SO_ZEROCOPY
+#		define SO_ZEROCOPY 60
+#	endif
+#	ifndef MSG_ZEROCOPY
+#		define MSG_ZEROCOPY 0x4000000
+#	endif
+#	ifndef SO_EE_ORIGIN_ZEROCOPY
+#		define SO_EE_ORIGIN_ZEROCOPY 5
+#	endif
+#	ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#		define SO_EE_CODE_ZEROCOPY_COPIED 1
+#	endif
+#endif
+
+/* User Control message event types */
+#define RTMP_USER_CONTROL_STREAM_BEGIN 0
+#define RTMP_USER_CONTROL_STREAM_EOF 1
+#define RTMP_USER_CONTROL_STREAM_DRY 2
+#define RTMP_USER_CONTROL_SET_BUFFER_LENGTH 3
+#define RTMP_USER_CONTROL_STREAM_IS_RECORDED 4
+#define RTMP_USER_CONTROL_PING_REQUEST 6
+#define RTMP_USER_CONTROL_PING_RESPONSE 7
+
+/* Encoded "@setDataFrame" AMF0 string, sent before every metadata */
+static const uint8_t set_data_frame_header[] = {
+	0x02, 0x00, 0x0d, '@', 's', 'e', 't', 'D', 'a', 't', 'a', 'F', 'r',
+	'a', 'm', 'e',
+};
+
+enum tx_buffer_owner {
+	/* Buffer given by the application, released by cbs.data_sent */
+	TX_BUFFER_EXTERNAL = 0,
+	/* Buffer allocated by the library, released by free() */
+	TX_BUFFER_ALLOCATED,
+	/* Data copied in the tx_buffer inline storage */
+	TX_BUFFER_INLINE,
+	/* Buffer queued on several streams, released by cbs.shared_data_sent */
+	TX_BUFFER_SHARED,
+};
+
+/* tx_buffer flags */
+/* Video keyframe */
+#define TX_BUFFER_FLAG_KEY (1 << 0)
+/* Codec configuration or metadata, never dropped */
+#define TX_BUFFER_FLAG_CONFIG (1 << 1)
+/* Non-reference video frame */
+#define TX_BUFFER_FLAG_NON_REF (1 << 2)
+/* Marked to be dropped by the drop policy */
+#define TX_BUFFER_FLAG_DROP (1 << 3)
+/* First bytes written to the socket (traced) */
+#define TX_BUFFER_FLAG_STARTED (1 << 4)
+/* Moved to a tx backlog, nothing left to release */
+#define TX_BUFFER_FLAG_MOVED (1 << 5)
 
 struct tx_buffer {
 	struct rtmp_buffer data_header;
 	struct rtmp_buffer data;
 	void *frame_userdata;
+	/* If not NULL, length prefix & NAL unit slices sent instead of
+	 * data.buf (data.len is then their total length). Points to segs_buf,
+	 * or to a tx_pool buffer, returned with the buffer */
+	struct iovec *segs;
+	int nsegs;
 
 	uint8_t mtid;
 	uint32_t msid;
 	uint32_t timestamp;
 
-	int internal;
+	enum tx_buffer_owner owner;
+	uint32_t flags;
 	uint32_t next_chunk_size;
+
+	/* Monotonic time when the message was queued (us) */
+	uint64_t queue_time;
+
+	/* Inline storage for data_header & TX_BUFFER_INLINE data */
+	uint8_t data_header_buf[RTMP_TX_INLINE_LEN];
+	uint8_t data_buf[RTMP_TX_INLINE_LEN];
+	/* Inline storage for the slices of up to RTMP_TX_INLINE_NALUS NAL
+	 * units, and their length prefixes */
+	struct iovec segs_buf[2 * RTMP_TX_INLINE_NALUS];
+	uint32_t nal_len_buf[RTMP_TX_INLINE_NALUS];
+};
+
+/* Message sent with MSG_ZEROCOPY, released once the kernel completed its last
+ * sendmsg() call. The kernel also reads the headers sent along until then,
+ * they are copied here */
+struct zerocopy_msg {
+	struct list_node node;
+	int csid;
+	struct tx_buffer buffer;
+	/* Id of the MSG_ZEROCOPY sendmsg() call following the last one of the
+	 * message */
+	uint32_t id_end;
+	uint8_t header[RTMP_CHUNK_HEADER_MAX_LEN];
+	uint8_t cont_header[RTMP_CHUNK_HEADER_MAX_LEN];
+	uint8_t data_header[RTMP_TX_INLINE_LEN];
+	uint32_t nal_len[RTMP_TX_INLINE_NALUS];
 };
 
 struct rtmp_chunk_tx_chan {
 	int csid;
 	struct list_node node;
+	/* Scheduling priority, lower values are sent first */
+	int priority;
 
 	uint8_t prev_mtid;
 	uint32_t prev_msid;
 	size_t prev_len;
 	uint32_t prev_delta;
 	uint32_t prev_timestamp;
+	/* The last type 0, 1 or 2 header had an extended timestamp */
+	int prev_extended_ts;
 
 	int first;
 	int need_abort;
 
-	struct tx_buffer queue[RTMP_MAX_QUEUE];
+	/* Ring buffer of queued messages */
+	struct tx_buffer *queue;
+	int queue_size;
 	int queue_idx;
 	int queue_len;
+	/* Total length of the queued messages */
+	size_t queue_bytes;
+	/* Queue limits (0 for unlimited) */
+	size_t max_bytes;
+	uint32_t max_duration;
+
+	/* Drop policy */
+	enum rtmp_drop_policy drop_policy;
+	uint32_t max_latency;
+	/* Set when the rest of a GOP was dropped, non-key frames are then
+	 * dropped until the next keyframe */
+	int wait_keyframe;
 	size_t chunk_partial_len;
+	/* Header of the first chunk of the current message. Its len is reset to
+	 * 0 once the message is fully sent */
 	struct rtmp_buffer header;
+	/* Type 3 header used by all the other chunks of the current message */
+	struct rtmp_buffer cont_header;
+	/* Current message, if sent with MSG_ZEROCOPY */
+	struct zerocopy_msg *zc;
+
+	/* Statistics, csid & queue_len are only filled by get_stream_stats() */
+	struct rtmp_channel_stats stats;
+};
+
+/* Media messages taken from the tx queues of a chunk stream, in queue order
+ * for each channel */
+struct backlog_msg {
+	int csid;
+	struct tx_buffer buffer;
+};
+
+struct rtmp_tx_backlog {
+	/* Callbacks of the original stream, to release the messages */
+	struct rtmp_chunk_cbs cbs;
+	void *userdata;
+	rtmp_trace_cb_t trace_cb;
+	void *trace_userdata;
+
+	int count;
+	struct backlog_msg msgs[];
+};
+
+/* Time at which the byte count seq was reached by the send side */
+struct ack_sample {
+	uint32_t seq;
+	uint64_t time;
 };
 
 struct rtmp_chunk_rx_chan {
@@ -94,6 +300,9 @@ struct rtmp_chunk_rx_chan {
 	size_t len;
 	uint32_t timestamp;
 	uint32_t delta;
+	/* The last type 0, 1 or 2 header had an extended timestamp, repeated
+	 * in the following type 3 headers */
+	int extended_ts;
 
 	struct rtmp_buffer msg;
 };
@@ -105,28 +314,141 @@ struct rtmp_chunk_stream {
 	struct rtmp_chunk_cbs cbs;
 	void *userdata;
 
+	/* TLS session (rtmps), NULL for plain connections */
+	struct rtmp_tls *tls;
+
+	/* Lifecycle events of the tx messages (NULL if disabled) */
+	rtmp_trace_cb_t trace_cb;
+	void *trace_userdata;
+
+	/* Zero-copy transmission of the messages of at least zc_threshold
+	 * bytes (0 if disabled). zc_next is the id of the next MSG_ZEROCOPY
+	 * sendmsg() call, and zc_done the id following the last completed
+	 * one. The sent messages wait for their completion in zc_msgs */
+	size_t zc_threshold;
+	uint32_t zc_next;
+	uint32_t zc_done;
+	struct list_node zc_msgs;
+
 	/* Runtime */
 	struct list_node rx_channels;
 	uint32_t rx_chunk_size;
 
 	struct list_node tx_channels;
 	uint32_t tx_chunk_size;
-
+	/* Last chunk size sent to the peer, applied to tx_chunk_size once the
+	 * SetChunkSize message is sent */
+	uint32_t tx_chunk_size_req;
+
+	/* Automatic chunk size */
+	int auto_chunk_size;
+	uint32_t mss;
+	size_t avg_frame_len;
+	unsigned int auto_frame_count;
+
+	/* csid of the channel with a partially sent chunk, which must be
+	 * completed before any other chunk is sent */
 	int tx_chan_in_progess;
+	/* Maximum payload length sent on a channel before scheduling the other
+	 * channels again (0 to send whole messages) */
+	size_t tx_sched_quantum;
+
+	/* Maximum amount of unsent data in the socket buffer (0 for no limit),
+	 * and remaining bytes which can be written in the current
+	 * event_data_out() call */
+	uint32_t notsent_lowat;
+	size_t tx_budget;
+
+	/* Token bucket pacer, enabled if pacing is set. pacer_tokens bytes can
+	 * be sent at pacer_time, the bucket being refilled at pacer_rate (0
+	 * while no limit is known). pacer_wait is set while waiting for
+	 * pacer_timer, without watching POLLOUT */
+	int pacing;
+	struct rtmp_pacing_config pacing_config;
+	struct pomp_timer *pacer_timer;
+	uint64_t pacer_tokens;
+	uint64_t pacer_time;
+	uint32_t pacer_rate;
+	int pacer_wait;
 
 	uint32_t window_ack_size;
 	uint32_t total_bytes;
+
+	/* Sent bytes & peer acks tracking */
+	uint64_t tx_total_bytes;
+	uint32_t tx_ack_window;
+	struct ack_sample ack_samples[RTMP_ACK_SAMPLES];
+	int ack_sample_idx;
+	int ack_sample_count;
+	uint32_t last_ack_seq;
+	uint64_t last_ack_time;
+	uint32_t acks;
+	uint32_t acked_rate;
+	uint32_t srtt;
+	/* Values at the previous get_bw_estimate() call */
+	uint64_t est_prev_bytes;
+	uint64_t est_prev_time;
 	uint32_t rcv_bytes_since_last_ack;
 
 	uint32_t bw;
 	enum bw_type bw_type;
 
-	/* recv buffer, should be big enough for one chunk */
+	/* Raw data sent before the first chunk (handshake end) */
+	struct rtmp_buffer tx_preamble;
+	/* Number of raw bytes to ignore before the first received chunk */
+	size_t rx_skip;
+
+	/* Pool of the message reassembly buffers */
+	struct rtmp_buffer_pool *rx_pool;
+	/* Pool of the slices of the frames with more than
+	 * RTMP_TX_INLINE_NALUS NAL units */
+	struct rtmp_buffer_pool *tx_pool;
+
+	/* recv buffer, always big enough for one chunk. rcvbuf.rd is the
+	 * offset of the first unconsumed byte, rcvbuf.len the end of the
+	 * received data */
 	struct rtmp_buffer rcvbuf;
 
+	/* iovecs used by send_chunks() */
+	struct iovec iov[RTMP_TX_IOV_MAX];
+
+	/* Channels with a csid below RTMP_CSID_TABLE_SIZE, indexed by csid
+	 * (unused entries have a csid of 0). Used channels are also linked
+	 * in rx_channels/tx_channels, with the extended csid channels */
+	struct rtmp_chunk_rx_chan rx_table[RTMP_CSID_TABLE_SIZE];
+	struct rtmp_chunk_tx_chan tx_table[RTMP_CSID_TABLE_SIZE];
+
+	/* Set while POLLOUT is watched: from a send which did not complete
+	 * until a POLLOUT event finds nothing to send. Messages are otherwise
+	 * sent right away when queued (write-through) */
 	int pomp_watch_write;
+
+	/* Audio messages packed in an Aggregate message, not queued yet. The
+	 * aggregate is queued once it covers aggr_window ms of audio, when it
+	 * is full, or by aggr_timer. Disabled if aggr_window is 0 */
+	uint32_t aggr_window;
+	struct pomp_timer *aggr_timer;
+	struct rtmp_buffer aggr;
+	int aggr_count;
+	uint32_t aggr_msid;
+	uint32_t aggr_timestamp;
+	/* Monotonic time when the first message was packed (us) */
+	uint64_t aggr_time;
+
+	/* Statistics, the channels are only filled by get_stream_stats() */
+	struct rtmp_stats stats;
 };
 
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+	uint64_t us = 0;
+
+	time_get_monotonic(&ts);
+	time_timespec_to_us(&ts, &us);
+	return us;
+}
+
 static int clone_buffer(struct rtmp_buffer *src, struct rtmp_buffer *dst)
 {
 	if (!src || !dst)
@@ -142,103 +464,251 @@ static int clone_buffer(struct rtmp_buffer *src, struct rtmp_buffer *dst)
 	return 0;
 }
 
-static int clone_data(void *src, size_t len, struct rtmp_buffer *dst)
+static void release_tx_segs(struct tx_buffer *buffer)
 {
-	if (!src || !dst)
-		return -EINVAL;
+	if (buffer->segs && buffer->segs != buffer->segs_buf)
+		rtmp_buffer_pool_put((uint8_t *)buffer->segs);
+	buffer->segs = NULL;
+	buffer->nsegs = 0;
+}
 
-	dst->cap = len;
-	dst->len = len;
-	dst->rd = 0;
-	dst->buf = malloc(dst->cap);
-	if (!dst->buf)
-		return -ENOMEM;
-	memcpy(dst->buf, src, dst->len);
+/* Store the length prefix & data slices of count NAL units in the buffer,
+ * in segs_buf if they fit */
+static int fill_tx_segs(struct rtmp_chunk_stream *stream,
+			struct tx_buffer *buffer,
+			const struct iovec *nalus,
+			int count)
+{
+	int i, ret;
+	uint32_t *nal_len;
+	struct rtmp_buffer b;
+
+	if (count <= RTMP_TX_INLINE_NALUS) {
+		buffer->segs = buffer->segs_buf;
+		nal_len = buffer->nal_len_buf;
+	} else {
+		ret = rtmp_buffer_pool_get(stream->tx_pool,
+					   count * (2 * sizeof(*buffer->segs) +
+						    sizeof(*nal_len)),
+					   &b);
+		if (ret < 0)
+			return ret;
+		buffer->segs = (struct iovec *)b.buf;
+		nal_len = (uint32_t *)&buffer->segs[2 * count];
+	}
+
+	for (i = 0; i < count; i++) {
+		nal_len[i] = htonl(nalus[i].iov_len);
+		buffer->segs[2 * i].iov_base = &nal_len[i];
+		buffer->segs[2 * i].iov_len = sizeof(*nal_len);
+		buffer->segs[2 * i + 1] = nalus[i];
+	}
+	buffer->nsegs = 2 * count;
 	return 0;
 }
 
-static struct rtmp_chunk_tx_chan *new_chunk_tx_chan(int csid)
+static void release_data(const struct rtmp_chunk_cbs *cbs,
+			 void *userdata,
+			 struct tx_buffer *buffer)
 {
-	struct rtmp_chunk_tx_chan *chan;
+	switch (buffer->owner) {
+	case TX_BUFFER_EXTERNAL:
+		cbs->data_sent(buffer->data.buf, buffer->frame_userdata, userdata);
+		break;
+	case TX_BUFFER_SHARED:
+		cbs->shared_data_sent(
+			buffer->data.buf, buffer->frame_userdata, userdata);
+		break;
+	case TX_BUFFER_ALLOCATED:
+		free(buffer->data.buf);
+		break;
+	case TX_BUFFER_INLINE:
+	default:
+		break;
+	}
+	buffer->data.buf = NULL;
+	release_tx_segs(buffer);
+}
 
-	chan = calloc(1, sizeof(*chan));
-	if (!chan) {
-		ULOG_ERRNO("calloc", ENOMEM);
-		return NULL;
+static void trace_tx_buffer(rtmp_trace_cb_t cb,
+			    void *userdata,
+			    enum rtmp_trace_type type,
+			    int csid,
+			    const struct tx_buffer *buffer,
+			    enum rtmp_trace_drop_reason reason)
+{
+	struct rtmp_trace_event event = {
+		.type = type,
+		.time_us = get_time_us(),
+		.csid = csid,
+		.mtid = buffer->mtid,
+		.timestamp = buffer->timestamp,
+		.size = buffer->data_header.len + buffer->data.len,
+		.data = buffer->data.buf,
+		.drop_reason = reason,
+	};
+
+	if (buffer->owner == TX_BUFFER_EXTERNAL ||
+	    buffer->owner == TX_BUFFER_SHARED)
+		event.buffer_userdata = buffer->frame_userdata;
+	cb(&event, userdata);
+}
+
+static void trace_tx_event(struct rtmp_chunk_stream *stream,
+			   enum rtmp_trace_type type,
+			   int csid,
+			   const struct tx_buffer *buffer)
+{
+	if (!stream->trace_cb)
+		return;
+	trace_tx_buffer(stream->trace_cb,
+			stream->trace_userdata,
+			type,
+			csid,
+			buffer,
+			RTMP_TRACE_DROP_NONE);
+}
+
+static void release_tx_buffer(struct rtmp_chunk_stream *stream,
+			      int csid,
+			      struct tx_buffer *buffer,
+			      enum rtmp_trace_drop_reason reason)
+{
+	if (buffer->flags & TX_BUFFER_FLAG_MOVED)
+		return;
+	if (stream->trace_cb)
+		trace_tx_buffer(stream->trace_cb,
+				stream->trace_userdata,
+				RTMP_TRACE_RELEASED,
+				csid,
+				buffer,
+				reason);
+	release_data(&stream->cbs, stream->userdata, buffer);
+}
+
+static enum tx_buffer_owner get_tx_owner(enum rtmp_data_owner owner)
+{
+	switch (owner) {
+	case RTMP_DATA_ALLOCATED:
+		return TX_BUFFER_ALLOCATED;
+	case RTMP_DATA_SHARED:
+		return TX_BUFFER_SHARED;
+	case RTMP_DATA_EXTERNAL:
+	default:
+		return TX_BUFFER_EXTERNAL;
+	}
+}
+
+/* Copy a queued buffer to a new location, updating its inline storage
+ * pointers */
+static void move_tx_buffer(struct tx_buffer *dst, struct tx_buffer *src)
+{
+	int i;
+
+	*dst = *src;
+	if (dst->data_header.cap > 0)
+		dst->data_header.buf = dst->data_header_buf;
+	if (dst->owner == TX_BUFFER_INLINE)
+		dst->data.buf = dst->data_buf;
+	if (src->segs != src->segs_buf)
+		return;
+	/* The prefixes can also be kept by a zerocopy_msg */
+	dst->segs = dst->segs_buf;
+	for (i = 0; i < dst->nsegs / 2; i++) {
+		if (src->segs[2 * i].iov_base == &src->nal_len_buf[i])
+			dst->segs[2 * i].iov_base = &dst->nal_len_buf[i];
+	}
+}
+
+static int csid_priority(int csid)
+{
+	switch (csid) {
+	case RTMP_CSID_CONTROL:
+		return 0;
+	case RTMP_CSID_COMMAND:
+		return 1;
+	case RTMP_CSID_AUDIO:
+		return 2;
+	case RTMP_CSID_VIDEO:
+		return 3;
+	default:
+		return 4;
 	}
+}
+
+static int init_chunk_tx_chan(struct rtmp_chunk_tx_chan *chan, int csid)
+{
+	memset(chan, 0, sizeof(*chan));
 
 	chan->csid = csid;
+	chan->priority = csid_priority(csid);
 
 	list_init(&chan->node);
 
 	chan->first = 1;
 
+	chan->queue = calloc(RTMP_DEFAULT_QUEUE_LEN, sizeof(*chan->queue));
+	if (!chan->queue)
+		goto error;
+	chan->queue_size = RTMP_DEFAULT_QUEUE_LEN;
+
 	chan->header.buf = malloc(RTMP_CHUNK_HEADER_MAX_LEN);
-	if (!chan->header.buf) {
-		ULOG_ERRNO("malloc", ENOMEM);
-		free(chan);
-		return NULL;
-	}
+	if (!chan->header.buf)
+		goto error;
 	chan->header.cap = RTMP_CHUNK_HEADER_MAX_LEN;
 
-	return chan;
+	chan->cont_header.buf = malloc(RTMP_CHUNK_HEADER_MAX_LEN);
+	if (!chan->cont_header.buf)
+		goto error;
+	chan->cont_header.cap = RTMP_CHUNK_HEADER_MAX_LEN;
+
+	return 0;
+
+error:
+	ULOG_ERRNO("init_chunk_tx_chan", ENOMEM);
+	free(chan->queue);
+	free(chan->header.buf);
+	memset(chan, 0, sizeof(*chan));
+	return -ENOMEM;
 }
 
-static void delete_chunk_tx_chan(struct rtmp_chunk_stream *stream,
-				 struct rtmp_chunk_tx_chan *chan)
+static void clear_chunk_tx_chan(struct rtmp_chunk_stream *stream,
+				struct rtmp_chunk_tx_chan *chan)
 {
 	int i;
-	if (!chan)
-		return;
 
 	/* Unref all waiting buffers */
 	for (i = 0; i < chan->queue_len; i++) {
-		int idx = chan->queue_idx + i % RTMP_MAX_QUEUE;
-		if (chan->queue[idx].internal)
-			free(chan->queue[idx].data.buf);
-		else
-			stream->cbs.data_sent(chan->queue[idx].data.buf,
-					      chan->queue[idx].frame_userdata,
-					      stream->userdata);
-		if (chan->queue[idx].data_header.cap)
-			free(chan->queue[idx].data_header.buf);
+		int idx = (chan->queue_idx + i) % chan->queue_size;
+		release_tx_buffer(stream,
+				  chan->csid,
+				  &chan->queue[idx],
+				  RTMP_TRACE_DROP_DISCONNECTED);
 	}
 
+	free(chan->queue);
 	free(chan->header.buf);
-	free(chan);
+	free(chan->cont_header.buf);
+	free(chan->zc);
+	memset(chan, 0, sizeof(*chan));
 }
 
-static struct rtmp_chunk_rx_chan *new_chunk_rx_chan(int csid)
+static int init_chunk_rx_chan(struct rtmp_chunk_rx_chan *chan, int csid)
 {
-	struct rtmp_chunk_rx_chan *chan;
-
-	chan = calloc(1, sizeof(*chan));
-	if (!chan) {
-		ULOG_ERRNO("calloc", ENOMEM);
-		return NULL;
-	}
+	memset(chan, 0, sizeof(*chan));
 
 	chan->csid = csid;
 	list_init(&chan->node);
 
-	chan->msg.buf = malloc(RTMP_CHUNK_STREAM_MSG_LEN);
-	if (!chan->msg.buf) {
-		free(chan);
-		ULOG_ERRNO("malloc", ENOMEM);
-		return NULL;
-	}
-	chan->msg.cap = RTMP_CHUNK_STREAM_MSG_LEN;
+	/* chan->msg.buf is taken from the stream pool for each message */
 
-	return chan;
+	return 0;
 }
 
-static void delete_chunk_rx_chan(struct rtmp_chunk_rx_chan *chan)
+static void clear_chunk_rx_chan(struct rtmp_chunk_rx_chan *chan)
 {
-	if (!chan)
-		return;
-
-	free(chan->msg.buf);
-	free(chan);
+	rtmp_buffer_pool_put(chan->msg.buf);
+	memset(chan, 0, sizeof(*chan));
 }
 
 static int update_pomp_event(struct rtmp_chunk_stream *stream)
@@ -246,6 +716,9 @@ static int update_pomp_event(struct rtmp_chunk_stream *stream)
 	int need_out = 0;
 	struct rtmp_chunk_tx_chan *chan;
 
+	if (stream->tx_preamble.rd < stream->tx_preamble.len)
+		need_out = 1;
+
 	list_walk_entry_forward(&stream->tx_channels, chan, node)
 	{
 		if (chan->queue_len > 0) {
@@ -254,6 +727,10 @@ static int update_pomp_event(struct rtmp_chunk_stream *stream)
 		}
 	}
 
+	/* The pacer timer resumes the transmission */
+	if (stream->pacer_wait)
+		need_out = 0;
+
 	if (need_out == stream->pomp_watch_write)
 		return 0;
 
@@ -278,12 +755,15 @@ static void notify_disconnection(struct rtmp_chunk_stream *stream)
 	stream->cbs.disconnected(stream->userdata);
 }
 
+/* Fill the header of the first chunk of a message in header, and the type 3
+ * header used by the following chunks of the same message in cont_header */
 static int fill_header_buffer(struct rtmp_chunk_tx_chan *chan,
 			      uint8_t mtid,
 			      uint32_t msid,
 			      size_t len,
 			      uint32_t timestamp,
-			      struct rtmp_buffer *header)
+			      struct rtmp_buffer *header,
+			      struct rtmp_buffer *cont_header)
 {
 	int header_type;
 	uint8_t basic_header[3];
@@ -293,11 +773,13 @@ static int fill_header_buffer(struct rtmp_chunk_tx_chan *chan,
 	uint8_t *b;
 	uint32_t embedded_ts;
 
-	if (!chan || !header)
+	if (!chan || !header || !cont_header)
 		return -EINVAL;
 
 	if (header->cap < RTMP_CHUNK_HEADER_MAX_LEN || header->len > 0)
 		return -EINVAL;
+	if (cont_header->cap < RTMP_CHUNK_HEADER_MAX_LEN)
+		return -EINVAL;
 
 	timestamp_delta = timestamp - chan->prev_timestamp;
 	if (timestamp_delta < 0 || chan->first) {
@@ -305,8 +787,10 @@ static int fill_header_buffer(struct rtmp_chunk_tx_chan *chan,
 		header_type = 0;
 	} else if ((chan->prev_mtid == mtid) && (chan->prev_msid == msid) &&
 		   (chan->prev_len == len) &&
-		   (chan->prev_delta == (uint32_t)timestamp_delta)) {
-		/* No Header */
+		   (chan->prev_delta == (uint32_t)timestamp_delta) &&
+		   !chan->prev_extended_ts) {
+		/* No Header. Not used after an extended timestamp, which the
+		 * peer would expect again in the type 3 header */
 		header_type = 3;
 	} else if ((chan->prev_mtid == mtid) && (chan->prev_msid == msid) &&
 		   (chan->prev_len == len)) {
@@ -344,6 +828,11 @@ static int fill_header_buffer(struct rtmp_chunk_tx_chan *chan,
 	memcpy(header->buf, basic_header, bh_len);
 	header->len += bh_len;
 
+	/* Continuation chunks always use a type 3 header */
+	memcpy(cont_header->buf, basic_header, bh_len);
+	cont_header->buf[0] |= (3 << 6);
+	cont_header->len = bh_len;
+
 	/* Header type 0 embeds an absolute timestamp, other headers embed a
 	 * delta */
 	embedded_ts = header_type != 0 ? (uint32_t)timestamp_delta : timestamp;
@@ -395,6 +884,12 @@ static int fill_header_buffer(struct rtmp_chunk_tx_chan *chan,
 		uint32_t ets_ne = htonl(embedded_ts);
 		memcpy(b, &ets_ne, sizeof(ets_ne));
 		header->len += sizeof(ets_ne);
+		/* Type 3 continuation headers repeat the extended timestamp of
+		 * the message header */
+		memcpy(&cont_header->buf[cont_header->len],
+		       &ets_ne,
+		       sizeof(ets_ne));
+		cont_header->len += sizeof(ets_ne);
 	}
 
 	/* Save values to channel */
@@ -403,63 +898,208 @@ static int fill_header_buffer(struct rtmp_chunk_tx_chan *chan,
 	chan->prev_msid = msid;
 	chan->prev_timestamp = timestamp;
 	chan->prev_delta = (uint32_t)timestamp_delta;
+	if (header_type != 3)
+		chan->prev_extended_ts = need_extended_ts;
 	chan->first = 0;
 
 	return 0;
 }
 
+/* Returns the tx channel for csid, or NULL if it was never used */
 static struct rtmp_chunk_tx_chan *
-get_tx_channel(struct rtmp_chunk_stream *stream, int csid)
+find_tx_channel(struct rtmp_chunk_stream *stream, int csid)
 {
 	struct rtmp_chunk_tx_chan *chan;
-	int found = 0;
 
-	if (!stream)
+	if (csid < RTMP_CSID_MIN)
 		return NULL;
 
+	if (csid < RTMP_CSID_TABLE_SIZE) {
+		chan = &stream->tx_table[csid];
+		return chan->csid == csid ? chan : NULL;
+	}
+
 	list_walk_entry_forward(&stream->tx_channels, chan, node)
 	{
-		if (chan->csid == csid) {
-			found = 1;
-			break;
-		}
+		if (chan->csid == csid)
+			return chan;
 	}
 
-	if (!found) {
-		chan = new_chunk_tx_chan(csid);
-		list_add_before(&stream->tx_channels, &chan->node);
+	return NULL;
+}
+
+static struct rtmp_chunk_tx_chan *
+get_tx_channel(struct rtmp_chunk_stream *stream, int csid)
+{
+	struct rtmp_chunk_tx_chan *chan;
+	int ret;
+
+	if (!stream || csid < RTMP_CSID_MIN)
+		return NULL;
+
+	chan = find_tx_channel(stream, csid);
+	if (chan)
+		return chan;
+
+	if (csid < RTMP_CSID_TABLE_SIZE) {
+		chan = &stream->tx_table[csid];
+		ret = init_chunk_tx_chan(chan, csid);
+		if (ret < 0)
+			return NULL;
+	} else {
+		chan = malloc(sizeof(*chan));
+		if (!chan) {
+			ULOG_ERRNO("malloc", ENOMEM);
+			return NULL;
+		}
+		ret = init_chunk_tx_chan(chan, csid);
+		if (ret < 0) {
+			free(chan);
+			return NULL;
+		}
 	}
+	list_add_before(&stream->tx_channels, &chan->node);
 
 	return chan;
 }
 
+/* Returns the rx channel for csid, or NULL if it was never used */
 static struct rtmp_chunk_rx_chan *
-get_rx_channel(struct rtmp_chunk_stream *stream, int csid)
+find_rx_channel(struct rtmp_chunk_stream *stream, int csid)
 {
 	struct rtmp_chunk_rx_chan *chan;
-	int found = 0;
 
-	if (!stream)
+	if (csid < RTMP_CSID_MIN)
 		return NULL;
 
+	if (csid < RTMP_CSID_TABLE_SIZE) {
+		chan = &stream->rx_table[csid];
+		return chan->csid == csid ? chan : NULL;
+	}
+
 	list_walk_entry_forward(&stream->rx_channels, chan, node)
 	{
-		if (chan->csid == csid) {
-			found = 1;
-			break;
-		}
+		if (chan->csid == csid)
+			return chan;
 	}
 
-	if (!found) {
-		chan = new_chunk_rx_chan(csid);
-		list_add_before(&stream->rx_channels, &chan->node);
+	return NULL;
+}
+
+static struct rtmp_chunk_rx_chan *
+get_rx_channel(struct rtmp_chunk_stream *stream, int csid)
+{
+	struct rtmp_chunk_rx_chan *chan;
+	int ret;
+
+	if (!stream || csid < RTMP_CSID_MIN)
+		return NULL;
+
+	chan = find_rx_channel(stream, csid);
+	if (chan)
+		return chan;
+
+	if (csid < RTMP_CSID_TABLE_SIZE) {
+		chan = &stream->rx_table[csid];
+		ret = init_chunk_rx_chan(chan, csid);
+		if (ret < 0)
+			return NULL;
+	} else {
+		chan = malloc(sizeof(*chan));
+		if (!chan) {
+			ULOG_ERRNO("malloc", ENOMEM);
+			return NULL;
+		}
+		ret = init_chunk_rx_chan(chan, csid);
+		if (ret < 0) {
+			free(chan);
+			return NULL;
+		}
 	}
+	list_add_before(&stream->rx_channels, &chan->node);
 
 	return chan;
 }
 
 static int send_ack(struct rtmp_chunk_stream *stream);
 
+/* Record the time at which the current sent byte count was reached, at most
+ * a few times per ack window */
+static void add_ack_sample(struct rtmp_chunk_stream *stream)
+{
+	uint32_t seq = (uint32_t)stream->tx_total_bytes;
+	uint32_t interval;
+	struct ack_sample *last;
+	int idx;
+
+	interval = stream->tx_ack_window > 0 ? stream->tx_ack_window / 4
+					     : RTMP_ACK_SAMPLE_DEFAULT_INTERVAL;
+	if (stream->ack_sample_count > 0) {
+		idx = (stream->ack_sample_idx + stream->ack_sample_count - 1) %
+		      RTMP_ACK_SAMPLES;
+		last = &stream->ack_samples[idx];
+		if (seq - last->seq < interval)
+			return;
+	}
+
+	if (stream->ack_sample_count == RTMP_ACK_SAMPLES) {
+		/* Forget the oldest sample */
+		stream->ack_sample_idx =
+			(stream->ack_sample_idx + 1) % RTMP_ACK_SAMPLES;
+		stream->ack_sample_count--;
+	}
+	idx = (stream->ack_sample_idx + stream->ack_sample_count) %
+	      RTMP_ACK_SAMPLES;
+	stream->ack_samples[idx].seq = seq;
+	stream->ack_samples[idx].time = get_time_us();
+	stream->ack_sample_count++;
+}
+
+/* Update the goodput and RTT estimates with a peer ack */
+static void process_ack(struct rtmp_chunk_stream *stream, uint32_t seq)
+{
+	uint64_t now = get_time_us();
+	uint64_t sample_time = 0;
+	struct ack_sample *sample;
+
+	if (stream->acks > 0 && now > stream->last_ack_time) {
+		uint64_t rate = (uint64_t)(seq - stream->last_ack_seq) *
+				1000000 / (now - stream->last_ack_time);
+		if (rate > UINT32_MAX)
+			rate = UINT32_MAX;
+		if (stream->acks == 1)
+			stream->acked_rate = rate;
+		else
+			stream->acked_rate = (3 * (uint64_t)stream->acked_rate +
+					      rate) /
+					     4;
+	}
+
+	/* Use the newest send sample acknowledged by seq */
+	while (stream->ack_sample_count > 0) {
+		sample = &stream->ack_samples[stream->ack_sample_idx];
+		if ((int32_t)(sample->seq - seq) > 0)
+			break;
+		sample_time = sample->time;
+		stream->ack_sample_idx =
+			(stream->ack_sample_idx + 1) % RTMP_ACK_SAMPLES;
+		stream->ack_sample_count--;
+	}
+	if (sample_time > 0 && now >= sample_time) {
+		uint64_t rtt = now - sample_time;
+		if (rtt > UINT32_MAX)
+			rtt = UINT32_MAX;
+		if (stream->srtt == 0)
+			stream->srtt = rtt;
+		else
+			stream->srtt = (7 * (uint64_t)stream->srtt + rtt) / 8;
+	}
+
+	stream->last_ack_seq = seq;
+	stream->last_ack_time = now;
+	stream->acks++;
+}
+
 static int send_ack_if_needed(struct rtmp_chunk_stream *stream)
 {
 	int ret;
@@ -477,6 +1117,20 @@ static int send_ack_if_needed(struct rtmp_chunk_stream *stream)
 	return ret;
 }
 
+/* Size of the receive buffer for a given chunk size: at least a full chunk
+ * and its header. Chunks are never longer than a message */
+static size_t get_rcvbuf_size(uint32_t chunk_size)
+{
+	size_t size;
+
+	if (chunk_size > RTMP_MAX_CHUNK_SIZE)
+		chunk_size = RTMP_MAX_CHUNK_SIZE;
+	size = (size_t)chunk_size + RTMP_CHUNK_HEADER_MAX_LEN;
+	if (size < RTMP_RX_BUFFER_LEN)
+		size = RTMP_RX_BUFFER_LEN;
+	return size;
+}
+
 static int set_rx_chunk_size(struct rtmp_chunk_stream *stream,
 			     uint32_t chunk_size)
 {
@@ -485,7 +1139,7 @@ static int set_rx_chunk_size(struct rtmp_chunk_stream *stream,
 	if (!stream)
 		return -EINVAL;
 
-	buf_size = chunk_size + RTMP_CHUNK_HEADER_MAX_LEN;
+	buf_size = get_rcvbuf_size(chunk_size);
 
 	if (buf_size > stream->rcvbuf.cap) {
 		void *tmp = realloc(stream->rcvbuf.buf, buf_size);
@@ -515,6 +1169,99 @@ static int set_window_ack_size(struct rtmp_chunk_stream *stream,
 	return send_ack_if_needed(stream);
 }
 
+static int send_user_control(struct rtmp_chunk_stream *stream,
+			     uint16_t event,
+			     const uint32_t *values,
+			     size_t count);
+
+static int user_control(struct rtmp_chunk_stream *stream,
+			struct rtmp_chunk_rx_chan *chan)
+{
+	uint16_t event;
+	uint32_t value;
+
+	if (chan->msg.len < 6) {
+		ULOGW("Bad UserControl size (%zu)", chan->msg.len);
+		return -EBADMSG;
+	}
+	event = ((uint16_t)chan->msg.buf[0] << 8) | chan->msg.buf[1];
+	value = ((uint32_t)chan->msg.buf[2] << 24) |
+		((uint32_t)chan->msg.buf[3] << 16) |
+		((uint32_t)chan->msg.buf[4] << 8) | chan->msg.buf[5];
+
+	switch (event) {
+	case RTMP_USER_CONTROL_STREAM_BEGIN:
+		ULOGI("Stream %" PRIu32 " begin", value);
+		break;
+	case RTMP_USER_CONTROL_STREAM_EOF:
+		ULOGI("Stream %" PRIu32 " EOF", value);
+		break;
+	case RTMP_USER_CONTROL_STREAM_DRY:
+		ULOGI("Stream %" PRIu32 " dry", value);
+		break;
+	case RTMP_USER_CONTROL_STREAM_IS_RECORDED:
+		break;
+	case RTMP_USER_CONTROL_PING_REQUEST:
+		/* Answer with the same timestamp */
+		return send_user_control(
+			stream, RTMP_USER_CONTROL_PING_RESPONSE, &value, 1);
+	case RTMP_USER_CONTROL_PING_RESPONSE:
+		break;
+	default:
+		ULOGW("Unknown user control event : %u", event);
+		break;
+	}
+
+	return 0;
+}
+
+/* Report the sub-messages of an Aggregate message. The timestamps of the
+ * sub-messages are offset, so that the first one is the timestamp of the
+ * aggregate */
+static int split_aggregate(struct rtmp_chunk_stream *stream,
+			   struct rtmp_chunk_rx_chan *chan)
+{
+	const uint8_t *b;
+	struct rtmp_buffer sub;
+	size_t off = 0;
+	size_t len;
+	uint32_t ts;
+	uint32_t first_ts = 0;
+
+	while (off < chan->msg.len) {
+		if (chan->msg.len - off < RTMP_AGGREGATE_TAG_HEADER_LEN)
+			return -EBADMSG;
+		b = &chan->msg.buf[off];
+		len = ((size_t)b[1] << 16) | ((size_t)b[2] << 8) | b[3];
+		ts = ((uint32_t)b[7] << 24) | ((uint32_t)b[4] << 16) |
+		     ((uint32_t)b[5] << 8) | b[6];
+		if (chan->msg.len - off - RTMP_AGGREGATE_TAG_HEADER_LEN <
+		    len + RTMP_AGGREGATE_BACK_POINTER_LEN)
+			return -EBADMSG;
+		if (off == 0)
+			first_ts = ts;
+
+		/* The sub-messages are reported in place, in the aggregate
+		 * buffer */
+		sub.buf = chan->msg.buf;
+		sub.cap = chan->msg.cap;
+		sub.rd = off + RTMP_AGGREGATE_TAG_HEADER_LEN;
+		sub.len = sub.rd + len;
+		if (b[0] == 0x08 || b[0] == 0x09 || b[0] == 0x12)
+			stream->cbs.media_msg(b[0],
+					      chan->timestamp + (ts - first_ts),
+					      &sub,
+					      stream->userdata);
+		else
+			ULOGW("Unknown aggregated tag type : %u", b[0]);
+
+		off += RTMP_AGGREGATE_TAG_HEADER_LEN + len +
+		       RTMP_AGGREGATE_BACK_POINTER_LEN;
+	}
+
+	return 0;
+}
+
 static int data_complete(struct rtmp_chunk_stream *stream,
 			 struct rtmp_chunk_rx_chan *chan)
 {
@@ -541,6 +1288,12 @@ static int data_complete(struct rtmp_chunk_stream *stream,
 		}
 		memcpy(&data_ne, chan->msg.buf, sizeof(data_ne));
 		chunk_size = ntohl(data_ne);
+		if (chunk_size == 0 || chunk_size > RTMP_CHUNK_SIZE_MAX) {
+			ULOGW("Bad SetChunkSize value (%" PRIu32 ")",
+			      chunk_size);
+			ret = -EBADMSG;
+			break;
+		}
 
 		if (chunk_size != stream->rx_chunk_size)
 			ret = set_rx_chunk_size(stream, chunk_size);
@@ -557,23 +1310,33 @@ static int data_complete(struct rtmp_chunk_stream *stream,
 		memcpy(&data_ne, chan->msg.buf, sizeof(data_ne));
 		abort_csid = ntohl(data_ne);
 
-		list_walk_entry_forward(&stream->rx_channels, abort_chan, node)
-		{
-			if (abort_chan->csid != (int)abort_csid)
-				continue;
-			if (abort_chan->msg.len == 0)
-				continue;
-			if (abort_chan == chan) {
-				ULOGE("Abort on current chunk stream !");
-				continue;
-			}
-			ULOGI("Abort on chunk stream %d", abort_chan->csid);
-			chan->msg.len = 0;
+		if (abort_csid > INT_MAX)
+			break;
+		abort_chan = find_rx_channel(stream, (int)abort_csid);
+		if (!abort_chan || abort_chan->msg.len == 0)
+			break;
+		if (abort_chan == chan) {
+			ULOGE("Abort on current chunk stream !");
+			break;
 		}
+		ULOGI("Abort on chunk stream %d", abort_chan->csid);
+		abort_chan->msg.len = 0;
 		break;
 
 	case 0x03: /* Ack */
-		/* TODO */
+		if (chan->msg.len != sizeof(data_ne)) {
+			ULOGW("Bad Ack size (%zu instead of %zu)",
+			      chan->msg.len,
+			      sizeof(data_ne));
+			ret = -EBADMSG;
+			break;
+		}
+		memcpy(&data_ne, chan->msg.buf, sizeof(data_ne));
+		process_ack(stream, ntohl(data_ne));
+		break;
+
+	case 0x04: /* User control message */
+		ret = user_control(stream, chan);
 		break;
 
 	case 0x05: /* Window ack size */
@@ -637,6 +1400,27 @@ static int data_complete(struct rtmp_chunk_stream *stream,
 		stream->cbs.amf_msg(&chan->msg, stream->userdata);
 		break;
 
+	case 0x08: /* Audio */
+	case 0x09: /* Video */
+	case 0x12: /* AMF0 data */
+		if (!stream->cbs.media_msg) {
+			ULOGW("Unexpected media message (mtid %u)", chan->mtid);
+			break;
+		}
+		stream->cbs.media_msg(chan->mtid,
+				      chan->timestamp,
+				      &chan->msg,
+				      stream->userdata);
+		break;
+
+	case 0x16: /* Aggregate */
+		if (!stream->cbs.media_msg) {
+			ULOGW("Unexpected media message (mtid %u)", chan->mtid);
+			break;
+		}
+		ret = split_aggregate(stream, chan);
+		break;
+
 	default:
 		ULOGW("Unknown mtid : %u", chan->mtid);
 		break;
@@ -726,6 +1510,7 @@ static ssize_t stream_consume_rcv_data(struct rtmp_chunk_stream *stream,
 		has_extended_ts = (timestamp == 0xffffff);
 	} else {
 		timestamp = chan->delta;
+		has_extended_ts = chan->extended_ts;
 	}
 	if (header_type < 2) {
 		/* msg_len & mtid present in headers 0 and 1 */
@@ -752,7 +1537,10 @@ static ssize_t stream_consume_rcv_data(struct rtmp_chunk_stream *stream,
 		CHECK_DLEN(data, sizeof(ts_ne));
 		memcpy(&ts_ne, &data->buf[data->rd], sizeof(ts_ne));
 		data->rd += sizeof(ts_ne);
-		timestamp = ntohl(ts_ne);
+		/* On a type 3 continuation chunk, the repeated value is not
+		 * a new delta */
+		if (header_type < 3 || chan->msg.len == 0)
+			timestamp = ntohl(ts_ne);
 		total_len += sizeof(ts_ne);
 	}
 
@@ -780,6 +1568,8 @@ static ssize_t stream_consume_rcv_data(struct rtmp_chunk_stream *stream,
 	chan->mtid = mtid;
 	chan->msid = msid;
 	chan->len = msg_len;
+	if (header_type < 3)
+		chan->extended_ts = has_extended_ts;
 	if (isdelta) {
 		chan->delta = timestamp;
 		/* Increment timestamp only on new message */
@@ -789,13 +1579,15 @@ static ssize_t stream_consume_rcv_data(struct rtmp_chunk_stream *stream,
 		chan->timestamp = timestamp;
 		chan->delta = 0;
 	}
-	/* Realloc channel buffer if needed */
-	if (chan->msg.cap < chan->len) {
-		void *tmp = realloc(chan->msg.buf, chan->len);
-		if (!tmp)
-			return -ENOMEM;
-		chan->msg.buf = tmp;
-		chan->msg.cap = chan->len;
+	/* Get a big enough buffer for a new message */
+	if (chan->msg.len == 0 && (!chan->msg.buf || chan->msg.cap < msg_len)) {
+		int ret;
+		rtmp_buffer_pool_put(chan->msg.buf);
+		chan->msg.buf = NULL;
+		chan->msg.cap = 0;
+		ret = rtmp_buffer_pool_get(stream->rx_pool, msg_len, &chan->msg);
+		if (ret < 0)
+			return ret;
 	}
 
 	/* Copy data into chan->msg */
@@ -807,6 +1599,11 @@ static ssize_t stream_consume_rcv_data(struct rtmp_chunk_stream *stream,
 		int ret = data_complete(stream, chan);
 		if (ret < 0)
 			ULOG_ERRNO("data_complete", -ret);
+		/* Return the buffer to the pool, unless a callback took its
+		 * ownership, so that channels do not keep big buffers */
+		rtmp_buffer_pool_put(chan->msg.buf);
+		chan->msg.buf = NULL;
+		chan->msg.cap = 0;
 		chan->msg.rd = 0;
 		chan->msg.len = 0;
 	}
@@ -814,290 +1611,608 @@ static ssize_t stream_consume_rcv_data(struct rtmp_chunk_stream *stream,
 	return total_len;
 }
 
-static void event_data_in(struct rtmp_chunk_stream *stream)
+static ssize_t stream_recv(struct rtmp_chunk_stream *stream,
+			   void *buf,
+			   size_t len)
+{
+	ssize_t ret;
+
+	if (stream->tls)
+		return rtmp_tls_recv(stream->tls, buf, len);
+
+	ret = recv(stream->sockfd, buf, len, 0);
+	return ret < 0 ? -errno : ret;
+}
+
+static ssize_t stream_sendmsg(struct rtmp_chunk_stream *stream,
+			      struct msghdr *msg,
+			      int flags)
+{
+	ssize_t ret;
+
+	if (stream->tls && !rtmp_tls_ktls_tx(stream->tls))
+		return rtmp_tls_writev(
+			stream->tls, msg->msg_iov, (int)msg->msg_iovlen);
+
+	do {
+		ret = sendmsg(stream->sockfd, msg, flags);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : ret;
+}
+
+/* Returns 0 if data was received, -EPIPE if the stream was disconnected (and
+ * possibly deleted by the callback), another negative errno otherwise */
+static int event_data_in(struct rtmp_chunk_stream *stream)
 {
+	struct rtmp_buffer *rcvbuf;
 	size_t avail;
+	size_t start;
 	ssize_t slen;
 	ssize_t consumed;
 
 	if (!stream) {
 		ULOG_ERRNO("event_data_in", EINVAL);
-		return;
+		return -EINVAL;
+	}
+	rcvbuf = &stream->rcvbuf;
+
+	/* Move the unconsumed data to the beginning of the buffer only when
+	 * the remaining space can not hold a full chunk */
+	if (rcvbuf->rd == rcvbuf->len) {
+		rcvbuf->rd = 0;
+		rcvbuf->len = 0;
+	} else if (rcvbuf->rd > 0 &&
+		   rcvbuf->cap - rcvbuf->len <
+			   stream->rx_chunk_size + RTMP_CHUNK_HEADER_MAX_LEN) {
+		memmove(rcvbuf->buf,
+			&rcvbuf->buf[rcvbuf->rd],
+			rcvbuf->len - rcvbuf->rd);
+		rcvbuf->len -= rcvbuf->rd;
+		rcvbuf->rd = 0;
 	}
 
-	avail = stream->rcvbuf.cap - stream->rcvbuf.len;
-
+	avail = rcvbuf->cap - rcvbuf->len;
 	if (avail == 0) {
-		ULOGE("Buffer full ... this is bad");
-		exit(1);
-		return;
+		ULOGE("Receive buffer full without a complete chunk");
+		notify_disconnection(stream);
+		return -EPIPE;
 	}
 
-	slen = recv(stream->sockfd,
-		    &stream->rcvbuf.buf[stream->rcvbuf.len],
-		    avail,
-		    0);
+	slen = stream_recv(stream, &rcvbuf->buf[rcvbuf->len], avail);
 	if (slen < 0) {
-		int err = -errno;
+		int err = (int)slen;
+		if (err == -EAGAIN || err == -EWOULDBLOCK || err == -EINTR)
+			return err;
 		ULOG_ERRNO("recv", -err);
-		if (err == -ECONNRESET)
+		if (err == -ECONNRESET || stream->tls) {
+			/* TLS errors are fatal */
 			notify_disconnection(stream);
-		return;
+			return -EPIPE;
+		}
+		return err;
+	} else if (slen == 0) {
+		ULOGI("Connection closed by peer");
+		notify_disconnection(stream);
+		return -EPIPE;
+	}
+	rcvbuf->len += slen;
+
+	if (stream->rx_skip > 0) {
+		size_t skip = (size_t)slen < stream->rx_skip ? (size_t)slen
+							     : stream->rx_skip;
+		rcvbuf->rd += skip;
+		stream->rx_skip -= skip;
+		slen -= skip;
 	}
-	stream->rcvbuf.len += slen;
+
 	stream->rcv_bytes_since_last_ack += slen;
 	stream->total_bytes += slen;
 	send_ack_if_needed(stream);
 
-	do {
-		consumed = stream_consume_rcv_data(stream, &stream->rcvbuf);
+	/* Consume all the complete chunks */
+	while (rcvbuf->rd < rcvbuf->len) {
+		start = rcvbuf->rd;
+		consumed = stream_consume_rcv_data(stream, rcvbuf);
 		if (consumed < 0) {
 			ULOG_ERRNO("consume_rcv_data", -(int)consumed);
-			return;
+			notify_disconnection(stream);
+			return -EPIPE;
 		}
-
+		rcvbuf->rd = start + consumed;
 		if (consumed == 0)
 			break;
+	}
 
-		if ((size_t)consumed < stream->rcvbuf.len) {
-			/* Data remaining, move them to beginning of buffer */
-			size_t rem = stream->rcvbuf.len - consumed;
-			memmove(stream->rcvbuf.buf,
-				&stream->rcvbuf.buf[consumed],
-				rem);
-			stream->rcvbuf.len = rem;
-		} else {
-			/* All buffer consumed, just reset len */
-			stream->rcvbuf.len = 0;
+	return 0;
+}
+
+/* Add the [offset, offset + len[ part of base to the iov array, skipping the
+ * first *skip bytes (already sent) */
+static void add_iov(struct iovec *iov,
+		    int *iov_num,
+		    size_t *send_len,
+		    uint8_t *base,
+		    size_t len,
+		    size_t *skip)
+{
+	if (len == 0)
+		return;
+
+	if (*skip >= len) {
+		*skip -= len;
+		return;
+	}
+
+	iov[*iov_num].iov_base = &base[*skip];
+	iov[*iov_num].iov_len = len - *skip;
+	*send_len += iov[*iov_num].iov_len;
+	(*iov_num)++;
+	*skip = 0;
+}
+
+/* Add the [offset, offset + len[ part of the message data (excluding
+ * data_header) to the iov array, see add_iov() */
+static void add_data_iov(struct iovec *iov,
+			 int *iov_num,
+			 size_t *send_len,
+			 struct tx_buffer *buffer,
+			 size_t offset,
+			 size_t len,
+			 size_t *skip)
+{
+	int i;
+	size_t seg_len;
+
+	if (!buffer->segs) {
+		add_iov(iov,
+			iov_num,
+			send_len,
+			&buffer->data.buf[offset],
+			len,
+			skip);
+		return;
+	}
+
+	for (i = 0; i < buffer->nsegs && len > 0; i++) {
+		seg_len = buffer->segs[i].iov_len;
+		if (offset >= seg_len) {
+			offset -= seg_len;
+			continue;
+		}
+		seg_len -= offset;
+		if (seg_len > len)
+			seg_len = len;
+		add_iov(iov,
+			iov_num,
+			send_len,
+			(uint8_t *)buffer->segs[i].iov_base + offset,
+			seg_len,
+			skip);
+		offset = 0;
+		len -= seg_len;
+	}
+}
+
+/* Number of iovs needed by add_data_iov() for the same data range */
+static int count_data_iov(const struct tx_buffer *buffer,
+			  size_t offset,
+			  size_t len)
+{
+	int i;
+	int count = 0;
+	size_t seg_len;
+
+	if (!buffer->segs)
+		return 1;
+
+	for (i = 0; i < buffer->nsegs && len > 0; i++) {
+		seg_len = buffer->segs[i].iov_len;
+		if (offset >= seg_len) {
+			offset -= seg_len;
+			continue;
 		}
-		/* rd is always reset to 0 */
-		stream->rcvbuf.rd = 0;
-	} while (1);
-	/* rd is always reset to 0 */
-	stream->rcvbuf.rd = 0;
+		seg_len -= offset;
+		if (seg_len > len)
+			seg_len = len;
+		offset = 0;
+		len -= seg_len;
+		count++;
+	}
+	return count;
 }
 
-static int send_chunk(struct rtmp_chunk_stream *stream,
-		      struct rtmp_buffer *header,
-		      struct rtmp_buffer *data_header,
-		      struct rtmp_buffer *data,
-		      size_t chunk_size,
-		      size_t already_sent)
+/* Send as many chunks of the buffer as the socket accepts, batching up to
+ * RTMP_TX_IOV_MAX iovecs per sendmsg(). If quantum is not 0, stop at the
+ * first chunk boundary after quantum bytes of payload (at least one chunk is
+ * always sent). Returns 0 when the whole message was sent, 1 if the quantum
+ * was reached, -EAGAIN if the socket is full (chan->chunk_partial_len is then
+ * the number of bytes already sent in the current chunk), or a negative errno
+ * on error */
+static int send_chunks(struct rtmp_chunk_stream *stream,
+		       struct rtmp_chunk_tx_chan *chan,
+		       struct tx_buffer *buffer,
+		       size_t quantum)
 {
 	int flags;
 	ssize_t sret;
-	size_t full_len;
-	int iov_num = 0;
-	struct iovec iov[3];
+	int iov_num;
 	struct msghdr msg = {
 		.msg_name = NULL,
 		.msg_namelen = 0,
-		.msg_iov = iov,
+		.msg_iov = stream->iov,
 		.msg_iovlen = 0 /* filled later */,
 		.msg_control = NULL,
 		.msg_controllen = 0,
 		.msg_flags = 0,
 	};
-	size_t rem_dh_len;
-	size_t chunk_dh_len = 0;
-	size_t rem_data_len;
-	size_t chunk_data_len;
-	size_t original_offset = already_sent;
+	struct rtmp_buffer *data_header = &buffer->data_header;
+	struct rtmp_buffer *data = &buffer->data;
+	struct rtmp_buffer *header;
+	uint8_t *header_buf;
+	uint8_t *first_header_buf = chan->header.buf;
+	uint8_t *cont_header_buf = chan->cont_header.buf;
+	uint8_t *data_header_buf = data_header->buf;
+	size_t dh_len;
+	size_t msg_len;
+	size_t pos;
+	size_t start;
+	size_t offset;
+	size_t chunk_len;
+	size_t skip;
 	size_t send_len;
+	size_t full_len;
+	size_t dh_chunk_len;
+	size_t data_offset;
+	size_t data_len;
+	unsigned int nchunks;
 
-	if (!stream || !header || !data_header || !data)
-		return -EINVAL;
-
-	full_len = chunk_size + header->len;
-
-	send_len = 0;
-	/* Prepare iov for header */
-	if (already_sent < header->len) {
-		iov[iov_num].iov_base = &header->buf[already_sent];
-		iov[iov_num].iov_len = header->len - already_sent;
-		send_len += iov[iov_num].iov_len;
-		iov_num++;
-		already_sent = 0;
-	} else {
-		already_sent -= header->len;
-	}
-	full_len -= header->len;
-
-	/* If no data header, skip to data */
-	if (data_header->cap == 0)
-		goto data;
-
-	/* Prepare iov for data header */
-	rem_dh_len = data_header->len - data_header->rd;
-	chunk_dh_len = rem_dh_len < full_len ? rem_dh_len : full_len;
-	if (already_sent < chunk_dh_len) {
-		iov[iov_num].iov_base =
-			&data_header->buf[data_header->rd + already_sent];
-		iov[iov_num].iov_len = chunk_dh_len - already_sent;
-		send_len += iov[iov_num].iov_len;
-		iov_num++;
-		already_sent = 0;
-	} else {
-		already_sent -= chunk_dh_len;
-	}
-	full_len -= chunk_dh_len;
-
-data:
-	/* Prepare iov for data */
-	rem_data_len = data->len - data->rd;
-	chunk_data_len = rem_data_len < full_len ? rem_data_len : full_len;
-	if (already_sent < chunk_data_len) {
-		iov[iov_num].iov_base = &data->buf[data->rd + already_sent];
-		iov[iov_num].iov_len = chunk_data_len - already_sent;
-		send_len += iov[iov_num].iov_len;
-		iov_num++;
-	}
-	/* No need to update already_sent here */
-
-	/* Do the send */
-	msg.msg_iovlen = iov_num;
 #ifdef MSG_NOSIGNAL
 	flags = MSG_NOSIGNAL;
 #else
 	flags = 0;
 #endif
-	do {
-		sret = sendmsg(stream->sockfd, &msg, flags);
-	} while (sret < 0 && errno == EINTR);
-	if (sret < 0) {
-		return -errno;
-	} else if ((size_t)sret < send_len) {
-		/* Partial send, return new send offset */
-		return original_offset + sret;
+
+#ifdef RTMP_HAVE_ZEROCOPY
+	/* The kernel reads the headers until the completion */
+	if (chan->zc) {
+		flags |= MSG_ZEROCOPY;
+		first_header_buf = chan->zc->header;
+		cont_header_buf = chan->zc->cont_header;
+		data_header_buf = chan->zc->data_header;
+	}
+#endif
+
+	dh_len = data_header->cap > 0 ? data_header->len : 0;
+	msg_len = dh_len + data->len;
+
+	/* Offset of the current chunk in the message payload */
+	pos = data_header->rd + data->rd;
+	start = pos;
+
+	while (pos < msg_len) {
+		if (quantum > 0 && pos - start >= quantum)
+			return 1;
+		if (stream->tx_budget == 0)
+			return -EAGAIN;
+
+		/* Prepare iovs for as many chunks as possible */
+		iov_num = 0;
+		send_len = 0;
+		nchunks = 0;
+		skip = chan->chunk_partial_len;
+		offset = pos;
+		while (offset < msg_len &&
+		       (quantum == 0 || offset - start < quantum)) {
+			header = offset == 0 ? &chan->header
+					     : &chan->cont_header;
+			header_buf =
+				offset == 0 ? first_header_buf : cont_header_buf;
+			chunk_len = msg_len - offset;
+			if (chunk_len > stream->tx_chunk_size)
+				chunk_len = stream->tx_chunk_size;
+			dh_chunk_len = 0;
+			if (offset < dh_len) {
+				dh_chunk_len = dh_len - offset;
+				if (dh_chunk_len > chunk_len)
+					dh_chunk_len = chunk_len;
+			}
+			data_offset = offset < dh_len ? 0 : offset - dh_len;
+			data_len = chunk_len - dh_chunk_len;
+
+			/* Chunk header + data header + data slices */
+			if (iov_num + 2 +
+				    count_data_iov(buffer, data_offset, data_len) >
+			    RTMP_TX_IOV_MAX)
+				break;
+
+			add_iov(stream->iov,
+				&iov_num,
+				&send_len,
+				header_buf,
+				header->len,
+				&skip);
+			if (dh_chunk_len > 0)
+				add_iov(stream->iov,
+					&iov_num,
+					&send_len,
+					&data_header_buf[offset],
+					dh_chunk_len,
+					&skip);
+			add_data_iov(stream->iov,
+				     &iov_num,
+				     &send_len,
+				     buffer,
+				     data_offset,
+				     data_len,
+				     &skip);
+			offset += chunk_len;
+			nchunks++;
+		}
+
+		/* Do not write more than the socket budget, the end of the
+		 * data is then handled as a partial send */
+		full_len = send_len;
+		if (send_len > stream->tx_budget) {
+			size_t rem = stream->tx_budget;
+			int i;
+			for (i = 0; rem > stream->iov[i].iov_len; i++)
+				rem -= stream->iov[i].iov_len;
+			stream->iov[i].iov_len = rem;
+			iov_num = i + 1;
+			send_len = stream->tx_budget;
+		}
+
+		/* Do the send */
+		msg.msg_iovlen = iov_num;
+		sret = stream_sendmsg(stream, &msg, flags);
+		stream->stats.tx_sendmsg++;
+		if (sret < 0)
+			return (int)sret;
+		if (!(buffer->flags & TX_BUFFER_FLAG_STARTED)) {
+			buffer->flags |= TX_BUFFER_FLAG_STARTED;
+			trace_tx_event(
+				stream, RTMP_TRACE_FIRST_CHUNK, chan->csid, buffer);
+		}
+		if (chan->zc)
+			stream->zc_next++;
+		stream->tx_total_bytes += sret;
+		stream->tx_budget -= sret;
+		if (stream->pacer_rate > 0) {
+			stream->pacer_tokens =
+				(uint64_t)sret < stream->pacer_tokens
+					? stream->pacer_tokens - sret
+					: 0;
+		}
+		add_ack_sample(stream);
+
+		if ((size_t)sret == full_len) {
+			/* All prepared chunks were sent */
+			pos = offset;
+			chan->chunk_partial_len = 0;
+			stream->stats.tx_chunks += nchunks;
+		} else {
+			stream->stats.tx_partial_sends++;
+			/* Partial send, find the first incomplete chunk */
+			size_t rem = chan->chunk_partial_len + sret;
+			while (1) {
+				header = pos == 0 ? &chan->header
+						  : &chan->cont_header;
+				chunk_len = msg_len - pos;
+				if (chunk_len > stream->tx_chunk_size)
+					chunk_len = stream->tx_chunk_size;
+				if (rem < header->len + chunk_len)
+					break;
+				rem -= header->len + chunk_len;
+				pos += chunk_len;
+				stream->stats.tx_chunks++;
+			}
+			chan->chunk_partial_len = rem;
+		}
+
+		/* Update the buffers ->rd only for complete chunks */
+		data_header->rd = pos < dh_len ? pos : dh_len;
+		data->rd = pos - data_header->rd;
+
+		if ((size_t)sret != full_len)
+			return -EAGAIN;
 	}
 
-	/* Update the buffers ->rd only on success */
-	data_header->rd += chunk_dh_len;
-	data->rd += chunk_data_len;
+	return 0;
+}
+
+/* Start sending the head message of a channel with MSG_ZEROCOPY, copying its
+ * current headers */
+static int start_zerocopy_msg(struct rtmp_chunk_tx_chan *chan,
+			      struct tx_buffer *buffer)
+{
+	int i;
+	struct zerocopy_msg *zc;
+
+	zc = calloc(1, sizeof(*zc));
+	if (!zc)
+		return -ENOMEM;
 
+	memcpy(zc->header, chan->header.buf, chan->header.len);
+	memcpy(zc->cont_header, chan->cont_header.buf, chan->cont_header.len);
+	if (buffer->data_header.cap > 0)
+		memcpy(zc->data_header,
+		       buffer->data_header.buf,
+		       buffer->data_header.len);
+	/* The inline length prefixes would be overwritten once the queue slot
+	 * is reused */
+	if (buffer->segs == buffer->segs_buf) {
+		for (i = 0; i < buffer->nsegs / 2; i++) {
+			zc->nal_len[i] = buffer->nal_len_buf[i];
+			buffer->segs[2 * i].iov_base = &zc->nal_len[i];
+		}
+	}
+	chan->zc = zc;
 	return 0;
 }
 
+/* Keep a fully sent MSG_ZEROCOPY message until its completion */
+static void finish_zerocopy_msg(struct rtmp_chunk_stream *stream,
+				struct rtmp_chunk_tx_chan *chan,
+				struct tx_buffer *buffer)
+{
+	struct zerocopy_msg *zc = chan->zc;
+
+	chan->zc = NULL;
+	zc->csid = chan->csid;
+	move_tx_buffer(&zc->buffer, buffer);
+	zc->id_end = stream->zc_next;
+	list_add_before(&stream->zc_msgs, &zc->node);
+	stream->stats.tx_zerocopy_msgs++;
+}
+
+/* Release the messages whose MSG_ZEROCOPY sendmsg() calls are all completed.
+ * The TCP completions are notified in order */
+static void release_zerocopy_msgs(struct rtmp_chunk_stream *stream)
+{
+	struct zerocopy_msg *zc, *tmp;
+
+	list_walk_entry_forward_safe(&stream->zc_msgs, zc, tmp, node)
+	{
+		if ((int32_t)(stream->zc_done - zc->id_end) < 0)
+			break;
+		list_del(&zc->node);
+		release_tx_buffer(
+			stream, zc->csid, &zc->buffer, RTMP_TRACE_DROP_NONE);
+		free(zc);
+	}
+}
+
+/* Read the MSG_ZEROCOPY completions from the socket error queue */
+static void read_zerocopy_completions(struct rtmp_chunk_stream *stream)
+{
+#ifdef RTMP_HAVE_ZEROCOPY
+	ssize_t ret;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *serr;
+	union {
+		struct cmsghdr align;
+		uint8_t buf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+				       sizeof(struct sockaddr_storage))];
+	} control;
+	struct msghdr msg;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		ret = recvmsg(stream->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ULOG_ERRNO("recvmsg(MSG_ERRQUEUE)", errno);
+			break;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP &&
+			      cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 &&
+			      cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* Completed ids range: [ee_info, ee_data] */
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				stream->stats.tx_zerocopy_copied +=
+					serr->ee_data - serr->ee_info + 1;
+			stream->zc_done = serr->ee_data + 1;
+		}
+	}
+
+	release_zerocopy_msgs(stream);
+#endif /* RTMP_HAVE_ZEROCOPY */
+}
+
+/* Send the head message of a channel, see send_chunks() for the quantum and
+ * the return values. The message is released once fully sent, or once the
+ * kernel completed its transmission if it was sent with MSG_ZEROCOPY */
 static int process_channel_send(struct rtmp_chunk_stream *stream,
-				struct rtmp_chunk_tx_chan *chan)
+				struct rtmp_chunk_tx_chan *chan,
+				size_t quantum)
 {
 	int ret = 0;
-	int i;
-	int nb_full_chunks;
 	struct tx_buffer *buffer;
-	size_t dh_rem_len = 0;
-	size_t data_rem_len;
-	size_t rem_len;
 	size_t full_len;
+	uint64_t queued_time;
 
 	if (!stream || !chan)
 		return -EINVAL;
 
 	buffer = &chan->queue[chan->queue_idx];
 
-	if (chan->chunk_partial_len) {
-		/* Finish sending current chunk */
-		ret = send_chunk(stream,
-				 &chan->header,
-				 &buffer->data_header,
-				 &buffer->data,
-				 stream->tx_chunk_size,
-				 chan->chunk_partial_len);
-
-		if (ret < 0) {
-			ULOG_ERRNO("send_chunk", -ret);
-			goto error;
-		} else if (ret > 0) {
-			chan->chunk_partial_len = ret;
-			return -EAGAIN;
-		}
-	}
-	chan->chunk_partial_len = 0;
-
 	full_len = 0;
-	if (buffer->data_header.cap > 0) {
-		dh_rem_len = buffer->data_header.len - buffer->data_header.rd;
+	if (buffer->data_header.cap > 0)
 		full_len += buffer->data_header.len;
-	}
-	data_rem_len = buffer->data.len - buffer->data.rd;
 	full_len += buffer->data.len;
 
-	if (data_rem_len == 0)
+	if (buffer->data.len - buffer->data.rd == 0)
 		goto send_done;
 
-	rem_len = dh_rem_len + data_rem_len;
-
-	nb_full_chunks = rem_len / stream->tx_chunk_size;
-
-	for (i = 0; i < nb_full_chunks; i++) {
-		chan->header.len = 0;
+	/* Build the message headers only once, the header of the first chunk
+	 * must not be rebuilt when resuming a partial send */
+	if (chan->header.len == 0) {
 		ret = fill_header_buffer(chan,
 					 buffer->mtid,
 					 buffer->msid,
 					 full_len,
 					 buffer->timestamp,
-					 &chan->header);
+					 &chan->header,
+					 &chan->cont_header);
 		if (ret < 0)
 			goto error;
-
-		ret = send_chunk(stream,
-				 &chan->header,
-				 &buffer->data_header,
-				 &buffer->data,
-				 stream->tx_chunk_size,
-				 0);
-
-		if (ret < 0) {
-			ULOG_ERRNO("send_chunk", -ret);
-			goto error;
-		} else if (ret > 0) {
-			chan->chunk_partial_len = ret;
-			return -EAGAIN;
-		}
 	}
 
-	rem_len -= stream->tx_chunk_size * nb_full_chunks;
-	if (rem_len > 0) {
-		chan->header.len = 0;
-		ret = fill_header_buffer(chan,
-					 buffer->mtid,
-					 buffer->msid,
-					 full_len,
-					 buffer->timestamp,
-					 &chan->header);
-		if (ret < 0)
-			goto error;
-
-		ret = send_chunk(stream,
-				 &chan->header,
-				 &buffer->data_header,
-				 &buffer->data,
-				 rem_len,
-				 0);
+	/* The large messages are sent without copy, unless the allocation
+	 * fails */
+	if (!chan->zc && stream->zc_threshold > 0 &&
+	    buffer->data.len >= stream->zc_threshold &&
+	    buffer->owner != TX_BUFFER_INLINE)
+		(void)start_zerocopy_msg(chan, buffer);
 
-		if (ret < 0) {
-			ULOG_ERRNO("send_chunk", -ret);
-			goto error;
-		} else if (ret > 0) {
-			chan->chunk_partial_len = ret;
-			return -EAGAIN;
-		}
+	ret = send_chunks(stream, chan, buffer, quantum);
+	if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+		return -EAGAIN;
+	} else if (ret == 1) {
+		return 1;
+	} else if (ret < 0) {
+		ULOG_ERRNO("send_chunks", -ret);
+		goto error;
 	}
 
 send_done:
 
+	if (buffer->mtid < RTMP_STATS_MSG_TYPES) {
+		stream->stats.tx_msgs[buffer->mtid]++;
+		stream->stats.tx_bytes[buffer->mtid] += full_len;
+	}
+	queued_time = get_time_us() - buffer->queue_time;
+	chan->stats.sent_msgs++;
+	chan->stats.queued_time += queued_time;
+	if (queued_time > chan->stats.max_queued_time)
+		chan->stats.max_queued_time = queued_time;
+
+	chan->header.len = 0;
+	chan->cont_header.len = 0;
 	if (buffer->next_chunk_size > 0)
 		stream->tx_chunk_size = buffer->next_chunk_size;
-	if (!buffer->internal)
-		stream->cbs.data_sent(buffer->data.buf,
-				      buffer->frame_userdata,
-				      stream->userdata);
+	trace_tx_event(stream, RTMP_TRACE_LAST_CHUNK, chan->csid, buffer);
+	if (chan->zc)
+		finish_zerocopy_msg(stream, chan, buffer);
 	else
-		free(buffer->data.buf);
-	if (buffer->data_header.cap)
-		free(buffer->data_header.buf);
+		release_tx_buffer(
+			stream, chan->csid, buffer, RTMP_TRACE_DROP_NONE);
+	chan->queue_bytes -= full_len;
 	chan->queue_idx++;
-	if (chan->queue_idx >= RTMP_MAX_QUEUE)
+	if (chan->queue_idx >= chan->queue_size)
 		chan->queue_idx = 0;
 	chan->queue_len--;
 	chan->prev_timestamp = buffer->timestamp;
@@ -1107,9 +2222,202 @@ error:
 	return ret;
 }
 
+/* Lowest of the enabled pacer limits, in bytes per second (0 if none is
+ * known) */
+static uint32_t get_pacing_rate(struct rtmp_chunk_stream *stream)
+{
+	const struct rtmp_pacing_config *config = &stream->pacing_config;
+	uint64_t rate = UINT64_MAX;
+	uint64_t limit;
+
+	if (config->max_rate > 0)
+		rate = config->max_rate;
+
+	/* The peer bandwidth is a window, sent once per round trip */
+	if (config->peer_bw && stream->bw > 0 && stream->srtt > 0) {
+		limit = (uint64_t)stream->bw * 1000000 / stream->srtt;
+		if (limit < rate)
+			rate = limit;
+	}
+
+	if (config->estimate_gain > 0 && stream->acked_rate > 0) {
+		limit = (uint64_t)stream->acked_rate * config->estimate_gain /
+			100;
+		if (limit < rate)
+			rate = limit;
+	}
+
+	if (rate == UINT64_MAX)
+		return 0;
+	if (rate < RTMP_PACING_MIN_RATE)
+		return RTMP_PACING_MIN_RATE;
+	return rate > UINT32_MAX ? UINT32_MAX : rate;
+}
+
+/* Add the tokens earned since the last refill */
+static void refill_pacer(struct rtmp_chunk_stream *stream)
+{
+	uint64_t now = get_time_us();
+	uint64_t burst = stream->pacing_config.burst;
+
+	stream->pacer_rate = get_pacing_rate(stream);
+	if (stream->pacer_rate == 0 || stream->pacer_time == 0) {
+		/* Start with a full bucket */
+		stream->pacer_tokens = burst;
+	} else if (now > stream->pacer_time) {
+		stream->pacer_tokens += (now - stream->pacer_time) *
+					stream->pacer_rate / 1000000;
+		if (stream->pacer_tokens > burst)
+			stream->pacer_tokens = burst;
+	}
+	stream->pacer_time = now;
+}
+
+/* Stop watching POLLOUT until enough tokens are earned for a full segment */
+static void start_pacer_wait(struct rtmp_chunk_stream *stream)
+{
+	int ret;
+	uint64_t len;
+	uint32_t delay;
+
+	len = stream->mss < stream->pacing_config.burst
+		      ? stream->mss
+		      : stream->pacing_config.burst;
+	delay = (len * 1000 + stream->pacer_rate - 1) / stream->pacer_rate;
+	ret = pomp_timer_set(stream->pacer_timer, delay > 0 ? delay : 1);
+	if (ret < 0) {
+		ULOG_ERRNO("pomp_timer_set", -ret);
+		return;
+	}
+
+	stream->pacer_wait = 1;
+	stream->stats.tx_pacer_waits++;
+	ret = update_pomp_event(stream);
+	if (ret != 0)
+		ULOG_ERRNO("update_pomp_event", -ret);
+}
+
+/* Tells whether the last send stopped because the bucket was empty */
+static int is_pacer_limited(struct rtmp_chunk_stream *stream)
+{
+	return stream->pacing && stream->pacer_rate > 0 &&
+	       stream->pacer_tokens == 0;
+}
+
+/* Number of bytes which can be written to the socket without exceeding the
+ * unsent data limit */
+static size_t get_socket_budget(struct rtmp_chunk_stream *stream)
+{
+#ifdef SIOCOUTQNSD
+	int ret;
+	int notsent;
+
+	if (stream->notsent_lowat == 0)
+		return SIZE_MAX;
+
+	ret = ioctl(stream->sockfd, SIOCOUTQNSD, &notsent);
+	if (ret < 0 || notsent < 0)
+		return SIZE_MAX;
+	if ((uint32_t)notsent >= stream->notsent_lowat)
+		return 0;
+	return stream->notsent_lowat - notsent;
+#else
+	/* TCP_NOTSENT_LOWAT still limits the POLLOUT events */
+	return SIZE_MAX;
+#endif
+}
+
+/* Number of bytes which can be written without exceeding the unsent data
+ * limit and the pacer rate */
+static size_t get_tx_budget(struct rtmp_chunk_stream *stream)
+{
+	size_t budget = get_socket_budget(stream);
+
+	if (!stream->pacing)
+		return budget;
+
+	refill_pacer(stream);
+	if (stream->pacer_rate > 0 && stream->pacer_tokens < budget)
+		budget = stream->pacer_tokens;
+	return budget;
+}
+
+/* Pick the next channel to send from: the non-empty channel with the highest
+ * priority, then with the oldest head message. *contended is set if more than
+ * one channel has queued messages */
+static struct rtmp_chunk_tx_chan *
+schedule_tx_channel(struct rtmp_chunk_stream *stream, int *contended)
+{
+	struct rtmp_chunk_tx_chan *chan;
+	struct rtmp_chunk_tx_chan *best = NULL;
+	uint32_t ts, best_ts = 0;
+
+	*contended = 0;
+	list_walk_entry_forward(&stream->tx_channels, chan, node)
+	{
+		if (chan->queue_len == 0)
+			continue;
+		ts = chan->queue[chan->queue_idx].timestamp;
+		if (best) {
+			*contended = 1;
+			if (chan->priority > best->priority)
+				continue;
+			if (chan->priority == best->priority &&
+			    (int32_t)(ts - best_ts) >= 0)
+				continue;
+		}
+		best = chan;
+		best_ts = ts;
+	}
+
+	return best;
+}
+
+/* Send the raw preamble, corked with the following chunks when possible */
+static int send_preamble(struct rtmp_chunk_stream *stream)
+{
+	int flags;
+	ssize_t sret;
+	struct rtmp_buffer *preamble = &stream->tx_preamble;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+#ifdef MSG_NOSIGNAL
+	flags = MSG_NOSIGNAL;
+#else
+	flags = 0;
+#endif
+#ifdef MSG_MORE
+	flags |= MSG_MORE;
+#endif
+
+	iov.iov_base = &preamble->buf[preamble->rd];
+	iov.iov_len = preamble->len - preamble->rd;
+	sret = stream_sendmsg(stream, &msg, flags);
+	stream->stats.tx_sendmsg++;
+	if (sret < 0)
+		return (int)sret;
+
+	stream->tx_total_bytes += sret;
+	preamble->rd += sret;
+	if (preamble->rd < preamble->len)
+		return -EAGAIN;
+
+	free(preamble->buf);
+	memset(preamble, 0, sizeof(*preamble));
+	return 0;
+}
+
 static void event_data_out(struct rtmp_chunk_stream *stream)
 {
 	struct rtmp_chunk_tx_chan *chan;
+	struct rtmp_chunk_tx_chan *next;
+	int contended;
+	size_t quantum;
+	int sent = 0;
 	int ret;
 
 	if (!stream) {
@@ -1117,73 +2425,114 @@ static void event_data_out(struct rtmp_chunk_stream *stream)
 		return;
 	}
 
-	if (stream->tx_chan_in_progess) {
-		int found = 0;
-		list_walk_entry_forward(&stream->tx_channels, chan, node)
-		{
-			if (chan->csid != stream->tx_chan_in_progess)
-				continue;
-			found = 1;
-			break;
-		}
-		if (!found) {
-			ULOGE("Got a partial chunk sent on an "
-			      "unknown channel (%d)",
-			      stream->tx_chan_in_progess);
-			goto loop;
-		}
+	stream->tx_budget = get_tx_budget(stream);
 
-		ret = process_channel_send(stream, chan);
-		if (ret != 0) {
-			/* TODO Check ! */
-			if (ret != -EAGAIN) {
-				ULOG_ERRNO("process_channel_send", -ret);
-				notify_disconnection(stream);
-				return;
-			}
+	if (stream->tx_preamble.rd < stream->tx_preamble.len) {
+		ret = send_preamble(stream);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+			return;
+		} else if (ret < 0) {
+			ULOG_ERRNO("send_preamble", -ret);
+			notify_disconnection(stream);
 			return;
 		}
-		stream->tx_chan_in_progess = 0;
 	}
 
-loop:
-	list_walk_entry_forward(&stream->tx_channels, chan, node)
-	{
-		if (chan->queue_len == 0)
-			continue;
+	while (1) {
+		next = schedule_tx_channel(stream, &contended);
+		if (!next)
+			break;
 
-		ret = process_channel_send(stream, chan);
-		if (ret != 0) {
-			/* TODO Check ! */
-			if (ret != -EAGAIN) {
-				ULOG_ERRNO("process_channel_send", -ret);
-				notify_disconnection(stream);
-				return;
-			} else {
-				stream->tx_chan_in_progess = chan->csid;
+		/* Send at most one quantum when other channels are waiting.
+		 * Nothing can be queued while sending, so an uncontended
+		 * channel is sent until the socket is full */
+		quantum = contended ? stream->tx_sched_quantum : 0;
+
+		chan = NULL;
+		if (stream->tx_chan_in_progess) {
+			chan = find_tx_channel(stream,
+					       stream->tx_chan_in_progess);
+			if (!chan) {
+				ULOGE("Got a partial chunk sent on an "
+				      "unknown channel (%d)",
+				      stream->tx_chan_in_progess);
+			} else if (chan != next && quantum > 0) {
+				/* Only complete the partial chunk before
+				 * switching to the scheduled channel */
+				quantum = 1;
 			}
+			stream->tx_chan_in_progess = 0;
+		}
+		if (!chan)
+			chan = next;
+
+		sent = 1;
+		ret = process_channel_send(stream, chan, quantum);
+		if (ret == -EAGAIN) {
+			if (chan->chunk_partial_len > 0)
+				stream->tx_chan_in_progess = chan->csid;
+			/* Resumed by the pacer timer, or by POLLOUT if the
+			 * socket is full */
+			if (is_pacer_limited(stream))
+				start_pacer_wait(stream);
+			else
+				update_pomp_event(stream);
+			return;
+		} else if (ret < 0) {
+			ULOG_ERRNO("process_channel_send", -ret);
+			notify_disconnection(stream);
 			return;
 		}
 	}
 
-	update_pomp_event(stream);
+	/* Keep POLLOUT until an event finds nothing to send, instead of
+	 * toggling it for each message while the socket is congested */
+	if (!sent)
+		update_pomp_event(stream);
 }
 
 static void pomp_event_cb(int fd, uint32_t revents, void *userdata)
 {
 	struct rtmp_chunk_stream *stream = userdata;
+	int ret;
 
-	if (revents & POMP_FD_EVENT_IN)
-		event_data_in(stream);
+	if (revents & POMP_FD_EVENT_IN) {
+		/* The data already decrypted by the TLS session does not make
+		 * the socket readable */
+		do {
+			ret = event_data_in(stream);
+		} while (ret == 0 && rtmp_tls_pending(stream->tls) > 0);
+		if (ret == -EPIPE)
+			return;
+	}
+	if ((revents & POMP_FD_EVENT_ERR) && stream->zc_threshold > 0)
+		read_zerocopy_completions(stream);
 	if (revents & POMP_FD_EVENT_OUT)
 		event_data_out(stream);
 }
 
+static void tls_pending_idle_cb(void *userdata)
+{
+	pomp_event_cb(-1, POMP_FD_EVENT_IN, userdata);
+}
 
-struct rtmp_chunk_stream *new_chunk_stream(struct pomp_loop *loop,
-					   int sockfd,
-					   const struct rtmp_chunk_cbs *cbs,
-					   void *userdata)
+static uint32_t get_socket_mss(int sockfd)
+{
+	int ret;
+	int mss;
+	socklen_t len = sizeof(mss);
+
+	ret = getsockopt(sockfd, IPPROTO_TCP, TCP_MAXSEG, &mss, &len);
+	if (ret < 0 || mss <= 0)
+		return RTMP_DEFAULT_MSS;
+
+	return mss;
+}
+
+struct rtmp_chunk_stream *new_chunk_stream(struct pomp_loop *loop,
+					   int sockfd,
+					   const struct rtmp_chunk_cbs *cbs,
+					   void *userdata)
 {
 	int ret;
 	struct rtmp_chunk_stream *stream = NULL;
@@ -1194,7 +2543,7 @@ struct rtmp_chunk_stream *new_chunk_stream(struct pomp_loop *loop,
 	}
 
 	if (!cbs->peer_bw_changed || !cbs->amf_msg || !cbs->data_sent ||
-	    !cbs->disconnected) {
+	    !cbs->shared_data_sent || !cbs->disconnected) {
 		ret = -EINVAL;
 		goto error;
 	}
@@ -1212,195 +2561,1215 @@ struct rtmp_chunk_stream *new_chunk_stream(struct pomp_loop *loop,
 
 	list_init(&stream->rx_channels);
 	list_init(&stream->tx_channels);
+	list_init(&stream->zc_msgs);
 	stream->rx_chunk_size = 128;
 	stream->tx_chunk_size = 128;
+	stream->tx_chunk_size_req = stream->tx_chunk_size;
+	stream->tx_sched_quantum = RTMP_DEFAULT_SCHED_QUANTUM;
+	stream->tx_budget = SIZE_MAX;
+	stream->mss = get_socket_mss(sockfd);
+
+	stream->rx_pool = rtmp_buffer_pool_new();
+	stream->tx_pool = rtmp_buffer_pool_new();
+	if (!stream->rx_pool || !stream->tx_pool) {
+		ret = -ENOMEM;
+		goto error;
+	}
 
-	stream->rcvbuf.buf =
-		malloc(stream->rx_chunk_size + RTMP_CHUNK_HEADER_MAX_LEN);
+	stream->rcvbuf.cap = get_rcvbuf_size(stream->rx_chunk_size);
+	stream->rcvbuf.buf = malloc(stream->rcvbuf.cap);
 	if (!stream->rcvbuf.buf) {
 		ret = -ENOMEM;
 		goto error;
 	}
-	stream->rcvbuf.cap = stream->rx_chunk_size + RTMP_CHUNK_HEADER_MAX_LEN;
 
-	ret = pomp_loop_add(
-		loop, sockfd, POMP_FD_EVENT_IN, pomp_event_cb, stream);
-	if (ret < 0)
-		goto error;
+	ret = pomp_loop_add(
+		loop, sockfd, POMP_FD_EVENT_IN, pomp_event_cb, stream);
+	if (ret < 0)
+		goto error;
+
+	return stream;
+
+error:
+	ULOG_ERRNO("new_chunk_stream", -ret);
+	delete_chunk_stream(stream);
+	return NULL;
+}
+
+/* The first queued message can not be dropped once its header is built, as
+ * some of its chunks might already be sent */
+static int tx_buffer_in_progress(struct rtmp_chunk_stream *stream,
+				 struct rtmp_chunk_tx_chan *chan,
+				 int i)
+{
+	return i == 0 &&
+	       (chan->header.len > 0 || stream->tx_chan_in_progess == chan->csid);
+}
+
+static struct tx_buffer *get_tx_buffer(struct rtmp_chunk_tx_chan *chan, int i)
+{
+	return &chan->queue[(chan->queue_idx + i) % chan->queue_size];
+}
+
+/* Drop the queued messages flagged with TX_BUFFER_FLAG_DROP, and compact the
+ * queue */
+static int drop_tx_buffers(struct rtmp_chunk_stream *stream,
+			   struct rtmp_chunk_tx_chan *chan)
+{
+	int i;
+	int len = 0;
+	int count = 0;
+
+	for (i = 0; i < chan->queue_len; i++) {
+		struct tx_buffer *buffer = get_tx_buffer(chan, i);
+		struct tx_buffer *dst = get_tx_buffer(chan, len);
+
+		if (!(buffer->flags & TX_BUFFER_FLAG_DROP)) {
+			if (dst != buffer)
+				move_tx_buffer(dst, buffer);
+			len++;
+			continue;
+		}
+
+		chan->queue_bytes -= buffer->data_header.len + buffer->data.len;
+		release_tx_buffer(
+			stream, chan->csid, buffer, RTMP_TRACE_DROP_POLICY);
+		count++;
+	}
+	chan->queue_len = len;
+	chan->stats.dropped_msgs += count;
+
+	if (count > 0)
+		ULOGD("Dropped %d messages on chunk stream %d",
+		      count,
+		      chan->csid);
+	return count;
+}
+
+/* Get the latency of the queue, from its oldest message which is not already
+ * marked for drop, to the given timestamp */
+static int32_t get_tx_queue_latency(struct rtmp_chunk_tx_chan *chan,
+				    int first,
+				    uint32_t timestamp)
+{
+	int i;
+
+	for (i = first; i < chan->queue_len; i++) {
+		struct tx_buffer *buffer = get_tx_buffer(chan, i);
+		if (!(buffer->flags & TX_BUFFER_FLAG_DROP))
+			return timestamp - buffer->timestamp;
+	}
+
+	return 0;
+}
+
+/* Apply the drop policy of the channel before queueing a new message with the
+ * given timestamp & flags. Returns 1 if the new message should be dropped */
+static int apply_drop_policy(struct rtmp_chunk_stream *stream,
+			     struct rtmp_chunk_tx_chan *chan,
+			     uint32_t timestamp,
+			     uint32_t flags)
+{
+	int i;
+	int first;
+	int last_key = -1;
+	int drop_new = 0;
+	int32_t latency;
+
+	if (flags & TX_BUFFER_FLAG_CONFIG)
+		return 0;
+
+	if (chan->wait_keyframe) {
+		if (!(flags & TX_BUFFER_FLAG_KEY))
+			return 1;
+		chan->wait_keyframe = 0;
+	}
+
+	if (chan->drop_policy == RTMP_DROP_NONE)
+		return 0;
+
+	/* Never drop a message which is being sent */
+	first = tx_buffer_in_progress(stream, chan, 0) ? 1 : 0;
+
+	latency = get_tx_queue_latency(chan, first, timestamp);
+	if (latency <= 0 || (uint32_t)latency <= chan->max_latency)
+		return 0;
+
+	/* First, drop the non-reference frames */
+	for (i = first; i < chan->queue_len; i++) {
+		struct tx_buffer *buffer = get_tx_buffer(chan, i);
+		if (buffer->flags & TX_BUFFER_FLAG_NON_REF)
+			buffer->flags |= TX_BUFFER_FLAG_DROP;
+		else if (buffer->flags & TX_BUFFER_FLAG_KEY)
+			last_key = i;
+	}
+
+	latency = get_tx_queue_latency(chan, first, timestamp);
+	if (chan->drop_policy != RTMP_DROP_GOP || latency <= 0 ||
+	    (uint32_t)latency <= chan->max_latency)
+		goto out;
+
+	/* Then drop the rest of the GOP: all the frames before the newest
+	 * keyframe, or all the frames until the next keyframe if there is no
+	 * keyframe in the queue */
+	if (flags & TX_BUFFER_FLAG_KEY) {
+		last_key = chan->queue_len;
+	} else if (last_key < 0) {
+		last_key = chan->queue_len;
+		chan->wait_keyframe = 1;
+		drop_new = 1;
+	}
+	for (i = first; i < last_key; i++) {
+		struct tx_buffer *buffer = get_tx_buffer(chan, i);
+		if (!(buffer->flags & TX_BUFFER_FLAG_CONFIG))
+			buffer->flags |= TX_BUFFER_FLAG_DROP;
+	}
+
+out:
+	drop_tx_buffers(stream, chan);
+	return drop_new;
+}
+
+/* A new message can be sent right away if POLLOUT is not watched (the socket
+ * was not full at the last send), and if it is the only queued message: this
+ * also excludes a partially sent chunk, and a send from a data_sent callback
+ * called while the previous message is released */
+static int can_write_through(struct rtmp_chunk_stream *stream,
+			     struct rtmp_chunk_tx_chan *chan)
+{
+	struct rtmp_chunk_tx_chan *other;
+
+	if (stream->pomp_watch_write || stream->pacer_wait ||
+	    stream->sockfd < 0)
+		return 0;
+	if (stream->tx_preamble.rd < stream->tx_preamble.len)
+		return 0;
+	if (chan->queue_len != 1 || stream->tx_chan_in_progess)
+		return 0;
+
+	list_walk_entry_forward(&stream->tx_channels, other, node)
+	{
+		if (other != chan && other->queue_len > 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* Send the only queued message without waiting for the loop. POLLOUT is only
+ * watched if the socket is full. Errors are reported by the following
+ * POLLOUT event, the callbacks must not be called from send_data() */
+static void write_through(struct rtmp_chunk_stream *stream,
+			  struct rtmp_chunk_tx_chan *chan)
+{
+	int ret;
+
+	stream->tx_budget = get_tx_budget(stream);
+
+	ret = process_channel_send(stream, chan, 0);
+	if (ret == 0) {
+		stream->stats.tx_write_through++;
+		return;
+	}
+
+	if (ret == -EAGAIN && chan->chunk_partial_len > 0)
+		stream->tx_chan_in_progess = chan->csid;
+	if (ret == -EAGAIN && is_pacer_limited(stream)) {
+		start_pacer_wait(stream);
+		return;
+	}
+	ret = update_pomp_event(stream);
+	if (ret != 0)
+		ULOG_ERRNO("update_pomp_event", -ret);
+}
+
+static int send_data(struct rtmp_chunk_stream *stream,
+		     int csid,
+		     uint8_t mtid,
+		     uint32_t msid,
+		     uint32_t timestamp,
+		     const uint8_t *data_header,
+		     size_t data_header_len,
+		     struct rtmp_buffer *data,
+		     const struct iovec *nalus,
+		     int nalu_count,
+		     void *frame_userdata,
+		     enum tx_buffer_owner owner,
+		     uint32_t flags,
+		     int32_t next_chunk_size)
+{
+	struct rtmp_chunk_tx_chan *chan;
+	struct tx_buffer *buffer;
+	int idx;
+	int ret;
+	int waiting;
+	size_t len;
+
+	if (!stream || !data || csid < 0)
+		return -EINVAL;
+	if (data_header_len > RTMP_TX_INLINE_LEN)
+		return -EINVAL;
+	if (owner == TX_BUFFER_INLINE &&
+	    (nalus || data->len - data->rd > RTMP_TX_INLINE_LEN))
+		return -EINVAL;
+	/* A chunk must fit in one sendmsg(), with its headers */
+	if (nalus && 2 * nalu_count + 2 > RTMP_TX_IOV_MAX)
+		return -E2BIG;
+
+	chan = get_tx_channel(stream, csid);
+	if (!chan)
+		return -ENOMEM;
+
+	if ((chan->drop_policy != RTMP_DROP_NONE || chan->wait_keyframe) &&
+	    apply_drop_policy(stream, chan, timestamp, flags)) {
+		/* Drop the new message right away */
+		struct tx_buffer dropped = {
+			.data = *data,
+			.frame_userdata = frame_userdata,
+			.mtid = mtid,
+			.timestamp = timestamp,
+			.owner = owner,
+		};
+		dropped.data_header.len = data_header_len;
+		release_tx_buffer(stream, csid, &dropped, RTMP_TRACE_DROP_POLICY);
+		chan->stats.dropped_msgs++;
+		return chan->queue_len;
+	}
+
+	len = data_header_len + data->len;
+	if (chan->queue_len >= chan->queue_size)
+		goto queue_full;
+	if (chan->queue_len > 0 && chan->max_bytes > 0 &&
+	    chan->queue_bytes + len > chan->max_bytes)
+		goto queue_full;
+	if (chan->queue_len > 0 && chan->max_duration > 0) {
+		uint32_t first_ts = chan->queue[chan->queue_idx].timestamp;
+		int32_t duration = timestamp - first_ts;
+		if (duration > 0 && (uint32_t)duration > chan->max_duration)
+			goto queue_full;
+	}
+
+	/* Queue data */
+	idx = (chan->queue_idx + chan->queue_len) % chan->queue_size;
+	buffer = &chan->queue[idx];
+	buffer->segs = NULL;
+	buffer->nsegs = 0;
+	if (nalus) {
+		ret = fill_tx_segs(stream, buffer, nalus, nalu_count);
+		if (ret < 0)
+			return ret;
+	}
+	memset(&buffer->data_header, 0, sizeof(buffer->data_header));
+	if (data_header && data_header_len > 0) {
+		memcpy(buffer->data_header_buf, data_header, data_header_len);
+		buffer->data_header.buf = buffer->data_header_buf;
+		buffer->data_header.cap = data_header_len;
+		buffer->data_header.len = data_header_len;
+	}
+	if (owner == TX_BUFFER_INLINE) {
+		buffer->data.len = data->len - data->rd;
+		buffer->data.cap = buffer->data.len;
+		buffer->data.rd = 0;
+		memcpy(buffer->data_buf, &data->buf[data->rd], buffer->data.len);
+		buffer->data.buf = buffer->data_buf;
+	} else {
+		buffer->data = *data;
+	}
+	buffer->frame_userdata = frame_userdata;
+	buffer->owner = owner;
+	buffer->flags = flags & ~(TX_BUFFER_FLAG_STARTED | TX_BUFFER_FLAG_MOVED);
+	buffer->msid = msid;
+	buffer->mtid = mtid;
+	buffer->timestamp = timestamp;
+	buffer->next_chunk_size = next_chunk_size;
+	buffer->queue_time = get_time_us();
+	trace_tx_event(stream, RTMP_TRACE_QUEUED, csid, buffer);
+
+	chan->queue_len++;
+	chan->queue_bytes += len;
+	if ((unsigned int)chan->queue_len > chan->stats.queue_peak_len)
+		chan->stats.queue_peak_len = chan->queue_len;
+
+	/* return the number of already waiting frames */
+	waiting = chan->queue_len - 1;
+
+	/* The buffer is now owned by the channel, do not report an error */
+	if (can_write_through(stream, chan)) {
+		write_through(stream, chan);
+	} else {
+		ret = update_pomp_event(stream);
+		if (ret != 0)
+			ULOG_ERRNO("update_pomp_event", -ret);
+	}
+
+	return waiting;
+
+queue_full:
+	stream->stats.tx_eagain++;
+	return -EAGAIN;
+}
+
+static int resize_tx_queue(struct rtmp_chunk_tx_chan *chan, int size)
+{
+	int i;
+	struct tx_buffer *queue;
+
+	if (size == chan->queue_size)
+		return 0;
+	if (size < chan->queue_len)
+		return -EBUSY;
+
+	queue = calloc(size, sizeof(*queue));
+	if (!queue)
+		return -ENOMEM;
+
+	for (i = 0; i < chan->queue_len; i++) {
+		int idx = (chan->queue_idx + i) % chan->queue_size;
+		move_tx_buffer(&queue[i], &chan->queue[idx]);
+	}
+
+	free(chan->queue);
+	chan->queue = queue;
+	chan->queue_size = size;
+	chan->queue_idx = 0;
+	return 0;
+}
+
+int set_tx_queue_config(struct rtmp_chunk_stream *stream,
+			int csid,
+			const struct rtmp_queue_config *config)
+{
+	int ret;
+	int size;
+	struct rtmp_chunk_tx_chan *chan;
+
+	if (!stream || !config || csid < 2)
+		return -EINVAL;
+	if (config->max_len > INT_MAX)
+		return -EINVAL;
+
+	chan = get_tx_channel(stream, csid);
+	if (!chan)
+		return -ENOMEM;
+
+	size = config->max_len > 0 ? (int)config->max_len
+				   : RTMP_DEFAULT_QUEUE_LEN;
+	ret = resize_tx_queue(chan, size);
+	if (ret < 0)
+		return ret;
+
+	chan->max_bytes = config->max_bytes;
+	chan->max_duration = config->max_duration;
+
+	return 0;
+}
+
+int set_tx_drop_policy(struct rtmp_chunk_stream *stream,
+		       int csid,
+		       enum rtmp_drop_policy policy,
+		       uint32_t max_latency)
+{
+	struct rtmp_chunk_tx_chan *chan;
+
+	if (!stream || csid < 2)
+		return -EINVAL;
+
+	switch (policy) {
+	case RTMP_DROP_NONE:
+	case RTMP_DROP_NON_REF:
+	case RTMP_DROP_GOP:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	chan = get_tx_channel(stream, csid);
+	if (!chan)
+		return -ENOMEM;
+
+	chan->drop_policy = policy;
+	chan->max_latency = max_latency;
+	chan->wait_keyframe = 0;
+
+	return 0;
+}
+
+int set_tx_wait_keyframe(struct rtmp_chunk_stream *stream)
+{
+	struct rtmp_chunk_tx_chan *chan;
+
+	if (!stream)
+		return -EINVAL;
+
+	chan = get_tx_channel(stream, RTMP_CSID_VIDEO);
+	if (!chan)
+		return -ENOMEM;
+
+	chan->wait_keyframe = 1;
+	return 0;
+}
+
+int get_tx_queue_status(struct rtmp_chunk_stream *stream,
+			int csid,
+			struct rtmp_queue_status *status)
+{
+	struct rtmp_chunk_tx_chan *chan;
+
+	if (!stream || !status || csid < 2)
+		return -EINVAL;
+
+	chan = get_tx_channel(stream, csid);
+	if (!chan)
+		return -ENOMEM;
+
+	memset(status, 0, sizeof(*status));
+	status->len = chan->queue_len;
+	status->bytes = chan->queue_bytes;
+	if (chan->queue_len > 0) {
+		int last = (chan->queue_idx + chan->queue_len - 1) %
+			   chan->queue_size;
+		int32_t duration = chan->queue[last].timestamp -
+				   chan->queue[chan->queue_idx].timestamp;
+		status->duration = duration > 0 ? duration : 0;
+	}
+
+	return 0;
+}
+
+int get_stream_stats(struct rtmp_chunk_stream *stream,
+		     struct rtmp_stats *stats)
+{
+	struct rtmp_chunk_tx_chan *chan;
+	struct rtmp_channel_stats *cstats;
+
+	if (!stream || !stats)
+		return -EINVAL;
+
+	*stats = stream->stats;
+	stats->nb_channels = 0;
+	list_walk_entry_forward(&stream->tx_channels, chan, node)
+	{
+		if (stats->nb_channels >= RTMP_STATS_MAX_CHANNELS)
+			break;
+		cstats = &stats->channels[stats->nb_channels++];
+		*cstats = chan->stats;
+		cstats->csid = chan->csid;
+		cstats->queue_len = chan->queue_len;
+	}
+
+	stats->tx_total_bytes = stream->tx_total_bytes;
+	stats->rx_total_bytes = stream->total_bytes;
+	stats->rx_bytes_since_last_ack = stream->rcv_bytes_since_last_ack;
+	stats->peer_bw = stream->bw;
+	stats->window_ack_size = stream->window_ack_size;
+	stats->tx_pacing_rate = stream->pacing ? stream->pacer_rate : 0;
+
+	return 0;
+}
+
+/* Send a 4 bytes protocol control message on chunk stream 2 */
+static int send_control_message(struct rtmp_chunk_stream *stream,
+				uint8_t mtid,
+				uint32_t value,
+				uint32_t next_chunk_size)
+{
+	uint32_t value_ne = htonl(value);
+	struct rtmp_buffer buf = {
+		.buf = (uint8_t *)&value_ne,
+		.cap = sizeof(value_ne),
+		.len = sizeof(value_ne),
+		.rd = 0,
+	};
+
+	return send_data(stream,
+			 RTMP_CSID_CONTROL,
+			 mtid,
+			 0,
+			 0,
+			 NULL,
+			 0,
+			 &buf,
+			 NULL,
+			 0,
+			 NULL,
+			 TX_BUFFER_INLINE,
+			 0,
+			 next_chunk_size);
+}
+
+int set_chunk_size(struct rtmp_chunk_stream *stream, uint32_t chunk_size)
+{
+	int ret;
+
+	if (!stream)
+		return -EINVAL;
+
+	if (chunk_size < 1 || chunk_size > RTMP_CHUNK_SIZE_MAX)
+		return -EINVAL;
+
+	ret = send_control_message(stream, 0x01, chunk_size, chunk_size);
+	if (ret < 0)
+		return ret;
+	stream->tx_chunk_size_req = chunk_size;
+
+	ULOGI("Tx chunk size set to %" PRIu32 " bytes", chunk_size);
+	return ret;
+}
+
+static uint32_t get_auto_chunk_size(struct rtmp_chunk_stream *stream)
+{
+	size_t segments;
+
+	segments = (stream->avg_frame_len + stream->mss - 1) / stream->mss;
+	if (segments < 1)
+		segments = 1;
+	else if (segments > RTMP_AUTO_CHUNK_MAX_SEGMENTS)
+		segments = RTMP_AUTO_CHUNK_MAX_SEGMENTS;
+
+	return segments * stream->mss;
+}
+
+static void update_auto_chunk_size(struct rtmp_chunk_stream *stream,
+				   size_t frame_len)
+{
+	int ret;
+	uint32_t chunk_size;
+
+	if (!stream->auto_chunk_size)
+		return;
+
+	/* Exponential moving average of the video frames size */
+	if (stream->avg_frame_len == 0)
+		stream->avg_frame_len = frame_len;
+	else
+		stream->avg_frame_len =
+			(stream->avg_frame_len * 15 + frame_len) / 16;
+
+	stream->auto_frame_count++;
+	if (stream->auto_frame_count < RTMP_AUTO_CHUNK_PERIOD)
+		return;
+	stream->auto_frame_count = 0;
+
+	chunk_size = get_auto_chunk_size(stream);
+	if (chunk_size == stream->tx_chunk_size_req)
+		return;
+
+	ret = set_chunk_size(stream, chunk_size);
+	if (ret < 0)
+		ULOG_ERRNO("set_chunk_size", -ret);
+}
+
+int set_chunk_size_auto(struct rtmp_chunk_stream *stream, int enable)
+{
+	if (!stream)
+		return -EINVAL;
+
+	stream->auto_chunk_size = enable;
+	if (!enable)
+		return 0;
+
+	/* Start with a single segment per chunk, until we have enough
+	 * frames to compute an average frame size */
+	stream->avg_frame_len = 0;
+	stream->auto_frame_count = 0;
+	if (stream->tx_chunk_size_req == stream->mss)
+		return 0;
+	return set_chunk_size(stream, stream->mss);
+}
+
+int set_tx_sched_quantum(struct rtmp_chunk_stream *stream, size_t quantum)
+{
+	if (!stream)
+		return -EINVAL;
+
+	stream->tx_sched_quantum = quantum;
+	return 0;
+}
+
+static int send_abort(struct rtmp_chunk_stream *stream, uint32_t csid)
+{
+	return send_control_message(stream, 0x02, csid, 0);
+}
+
+/* User Control message: a 16-bit event type followed by its 32-bit
+ * values */
+static int send_user_control(struct rtmp_chunk_stream *stream,
+			     uint16_t event,
+			     const uint32_t *values,
+			     size_t count)
+{
+	uint8_t data[2 + 2 * sizeof(uint32_t)];
+	struct rtmp_buffer buf = {
+		.buf = data,
+		.cap = sizeof(data),
+		.len = 2,
+		.rd = 0,
+	};
+	size_t i;
+
+	if (count > 2)
+		return -EINVAL;
+
+	data[0] = event >> 8;
+	data[1] = event & 0xff;
+	for (i = 0; i < count; i++) {
+		data[buf.len++] = values[i] >> 24;
+		data[buf.len++] = (values[i] >> 16) & 0xff;
+		data[buf.len++] = (values[i] >> 8) & 0xff;
+		data[buf.len++] = values[i] & 0xff;
+	}
+
+	return send_data(stream,
+			 RTMP_CSID_CONTROL,
+			 0x04,
+			 0,
+			 0,
+			 NULL,
+			 0,
+			 &buf,
+			 NULL,
+			 0,
+			 NULL,
+			 TX_BUFFER_INLINE,
+			 0,
+			 0);
+}
+
+int send_set_buffer_length(struct rtmp_chunk_stream *stream,
+			   uint32_t stream_id,
+			   uint32_t buffer_length)
+{
+	uint32_t values[2] = {stream_id, buffer_length};
+
+	if (!stream)
+		return -EINVAL;
+
+	return send_user_control(
+		stream, RTMP_USER_CONTROL_SET_BUFFER_LENGTH, values, 2);
+}
+
+static int send_ack(struct rtmp_chunk_stream *stream)
+{
+	return send_control_message(stream, 0x03, stream->total_bytes, 0);
+}
+
+static int send_window_ack_size(struct rtmp_chunk_stream *stream,
+				uint32_t window)
+{
+	return send_control_message(stream, 0x05, window, 0);
+}
+
+int set_tx_preamble(struct rtmp_chunk_stream *stream,
+		    const uint8_t *data,
+		    size_t len)
+{
+	int ret;
+
+	if (!stream || !data || len == 0)
+		return -EINVAL;
+	if (stream->tx_preamble.buf || stream->tx_total_bytes > 0)
+		return -EBUSY;
+
+	stream->tx_preamble.buf = malloc(len);
+	if (!stream->tx_preamble.buf)
+		return -ENOMEM;
+	memcpy(stream->tx_preamble.buf, data, len);
+	stream->tx_preamble.cap = len;
+	stream->tx_preamble.len = len;
+	stream->tx_preamble.rd = 0;
+
+	ret = update_pomp_event(stream);
+	if (ret != 0)
+		ULOG_ERRNO("update_pomp_event", -ret);
+	return 0;
+}
+
+int set_stream_tls(struct rtmp_chunk_stream *stream, struct rtmp_tls *tls)
+{
+	int ret;
+
+	if (!stream || !tls)
+		return -EINVAL;
+
+	if (stream->tx_total_bytes > 0 || stream->total_bytes > 0)
+		return -EBUSY;
+
+	stream->tls = tls;
+
+	/* Data received along with the end of the handshake */
+	if (rtmp_tls_pending(tls) > 0) {
+		ret = pomp_loop_idle_add(
+			stream->loop, tls_pending_idle_cb, stream);
+		if (ret < 0) {
+			ULOG_ERRNO("pomp_loop_idle_add", -ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int set_rx_skip(struct rtmp_chunk_stream *stream, size_t len)
+{
+	if (!stream)
+		return -EINVAL;
+
+	stream->rx_skip = len;
+	return 0;
+}
+
+int set_tx_notsent_lowat(struct rtmp_chunk_stream *stream,
+			 uint32_t notsent_lowat)
+{
+	if (!stream)
+		return -EINVAL;
+
+	stream->notsent_lowat = notsent_lowat;
+	return 0;
+}
+
+int set_tx_zerocopy(struct rtmp_chunk_stream *stream, size_t threshold)
+{
+#ifdef RTMP_HAVE_ZEROCOPY
+	int ret;
+	int val = 1;
+
+	if (!stream)
+		return -EINVAL;
+
+	/* The data is copied anyway for the encryption */
+	if (threshold > 0 && stream->tls)
+		return -ENOTSUP;
+
+	if (threshold > 0 && stream->zc_threshold == 0) {
+		ret = setsockopt(stream->sockfd,
+				 SOL_SOCKET,
+				 SO_ZEROCOPY,
+				 &val,
+				 sizeof(val));
+		if (ret < 0)
+			return -errno;
+	}
+
+	/* SO_ZEROCOPY stays set, the messages still waiting for their
+	 * completion are released by read_zerocopy_completions() */
+	stream->zc_threshold = threshold;
+	return 0;
+#else /* !RTMP_HAVE_ZEROCOPY */
+	if (!stream)
+		return -EINVAL;
 
-	return stream;
+	return threshold > 0 ? -ENOTSUP : 0;
+#endif /* !RTMP_HAVE_ZEROCOPY */
+}
 
-error:
-	ULOG_ERRNO("new_chunk_stream", -ret);
-	delete_chunk_stream(stream);
-	return NULL;
+int set_tx_trace(struct rtmp_chunk_stream *stream,
+		 rtmp_trace_cb_t cb,
+		 void *userdata)
+{
+	if (!stream)
+		return -EINVAL;
+
+	stream->trace_cb = cb;
+	stream->trace_userdata = cb ? userdata : NULL;
+	return 0;
 }
 
-static int send_data(struct rtmp_chunk_stream *stream,
-		     int csid,
-		     uint8_t mtid,
-		     uint32_t msid,
-		     uint32_t timestamp,
-		     struct rtmp_buffer *data_header,
-		     struct rtmp_buffer *data,
-		     void *frame_userdata,
-		     int internal,
-		     int32_t next_chunk_size)
+int set_tx_ack_window(struct rtmp_chunk_stream *stream, uint32_t window)
 {
-	struct rtmp_chunk_tx_chan *chan;
-	struct tx_buffer *buffer;
-	int idx;
 	int ret;
 
-	if (!stream || !data || csid < 0)
+	if (!stream || window == 0)
 		return -EINVAL;
 
-	chan = get_tx_channel(stream, csid);
+	ret = send_window_ack_size(stream, window);
+	if (ret < 0)
+		return ret;
 
-	if (chan->queue_len >= RTMP_MAX_QUEUE)
-		return -EAGAIN;
+	stream->tx_ack_window = window;
+	return 0;
+}
 
-	/* Queue data */
-	idx = (chan->queue_idx + chan->queue_len) % RTMP_MAX_QUEUE;
-	buffer = &chan->queue[idx];
-	if (data_header)
-		buffer->data_header = *data_header;
-	else
-		buffer->data_header.cap = 0;
-	buffer->data = *data;
-	buffer->frame_userdata = frame_userdata;
-	buffer->internal = internal;
-	buffer->msid = msid;
-	buffer->mtid = mtid;
-	buffer->timestamp = timestamp;
-	buffer->next_chunk_size = next_chunk_size;
+int get_bw_estimate(struct rtmp_chunk_stream *stream,
+		    struct rtmp_bw_estimate *estimate)
+{
+	uint64_t now;
+	uint32_t in_flight;
 
-	chan->queue_len++;
+	if (!stream || !estimate)
+		return -EINVAL;
 
-	ret = update_pomp_event(stream);
-	if (ret != 0)
-		return ret;
+	memset(estimate, 0, sizeof(*estimate));
+	now = get_time_us();
+
+	in_flight = (uint32_t)stream->tx_total_bytes - stream->last_ack_seq;
+	/* Ignore acks for more bytes than sent */
+	if ((int32_t)in_flight < 0)
+		in_flight = 0;
+	estimate->bytes_in_flight = in_flight;
+	estimate->acked_rate = stream->acked_rate;
+	estimate->rtt = stream->srtt;
+	estimate->acks = stream->acks;
+	estimate->ack_window = stream->tx_ack_window;
+
+	if (stream->est_prev_time > 0 && now > stream->est_prev_time) {
+		uint64_t rate =
+			(stream->tx_total_bytes - stream->est_prev_bytes) *
+			1000000 / (now - stream->est_prev_time);
+		estimate->send_rate = rate > UINT32_MAX ? UINT32_MAX : rate;
+	}
+	stream->est_prev_bytes = stream->tx_total_bytes;
+	stream->est_prev_time = now;
 
-	/* return the number of already waiting frames */
-	return chan->queue_len - 1;
+	return 0;
 }
 
-int set_chunk_size(struct rtmp_chunk_stream *stream, uint32_t chunk_size)
+int flush_tx_aggregate(struct rtmp_chunk_stream *stream)
 {
-	uint32_t chunk_size_ne = htonl(chunk_size);
-	struct rtmp_buffer buf;
 	int ret;
 
 	if (!stream)
 		return -EINVAL;
+	if (stream->aggr_count == 0)
+		return 0;
 
-	if (chunk_size < 1)
-		return -EINVAL;
-
-	ret = clone_data(&chunk_size_ne, sizeof(chunk_size_ne), &buf);
-	if (ret != 0)
+	ret = send_data(stream,
+			RTMP_CSID_AUDIO,
+			0x16,
+			stream->aggr_msid,
+			stream->aggr_timestamp,
+			NULL,
+			0,
+			&stream->aggr,
+			NULL,
+			0,
+			NULL,
+			TX_BUFFER_ALLOCATED,
+			0,
+			0);
+	if (ret < 0)
 		return ret;
 
-	return send_data(
-		stream, 2, 0x01, 0, 0, NULL, &buf, NULL, 1, chunk_size);
+	/* Now owned by the tx queue */
+	memset(&stream->aggr, 0, sizeof(stream->aggr));
+	stream->aggr_count = 0;
+	pomp_timer_clear(stream->aggr_timer);
+	return 0;
 }
 
-static int send_abort(struct rtmp_chunk_stream *stream, uint32_t csid)
+static void aggr_timer_cb(struct pomp_timer *timer, void *userdata)
 {
-	uint32_t csid_ne = htonl(csid);
-	struct rtmp_buffer buf;
+	struct rtmp_chunk_stream *stream = userdata;
 	int ret;
 
-	ret = clone_data(&csid_ne, sizeof(csid_ne), &buf);
-	if (ret != 0)
-		return ret;
+	ret = flush_tx_aggregate(stream);
+	if (ret < 0) {
+		/* Retry once the queue had some time to drain */
+		ULOG_ERRNO("flush_tx_aggregate", -ret);
+		pomp_timer_set(timer, stream->aggr_window);
+	}
+}
+
+/* Pack an audio message in the pending Aggregate message, as an FLV tag. The
+ * data is copied, and released right away. Returns -E2BIG if the message is
+ * too big to be aggregated */
+static int aggregate_audio_data(struct rtmp_chunk_stream *stream,
+				struct rtmp_buffer *data,
+				uint32_t msid,
+				uint32_t timestamp,
+				const uint8_t *header,
+				size_t header_len,
+				enum tx_buffer_owner owner,
+				void *frame_userdata)
+{
+	struct rtmp_chunk_tx_chan *chan;
+	struct tx_buffer copied;
+	size_t data_len = header_len + data->len - data->rd;
+	size_t tag_len = RTMP_AGGREGATE_TAG_HEADER_LEN + data_len;
+	int32_t elapsed;
+	uint8_t *b;
+	int ret;
+
+	if (tag_len + RTMP_AGGREGATE_BACK_POINTER_LEN > RTMP_AGGREGATE_MAX_LEN)
+		return -E2BIG;
+
+	if (stream->aggr_count > 0) {
+		elapsed = timestamp - stream->aggr_timestamp;
+		if (msid != stream->aggr_msid || elapsed < 0 ||
+		    (uint32_t)elapsed >= stream->aggr_window ||
+		    stream->aggr.len + tag_len +
+				    RTMP_AGGREGATE_BACK_POINTER_LEN >
+			    stream->aggr.cap) {
+			ret = flush_tx_aggregate(stream);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	if (stream->aggr_count == 0) {
+		stream->aggr.buf = malloc(RTMP_AGGREGATE_MAX_LEN);
+		if (!stream->aggr.buf)
+			return -ENOMEM;
+		stream->aggr.cap = RTMP_AGGREGATE_MAX_LEN;
+		stream->aggr.len = 0;
+		stream->aggr.rd = 0;
+		stream->aggr_msid = msid;
+		stream->aggr_timestamp = timestamp;
+		stream->aggr_time = get_time_us();
+		ret = pomp_timer_set(stream->aggr_timer, stream->aggr_window);
+		if (ret < 0)
+			ULOG_ERRNO("pomp_timer_set", -ret);
+	}
+
+	/* FLV tag header, with a stream id of 0: the message stream id of the
+	 * Aggregate message applies to all its sub-messages */
+	b = &stream->aggr.buf[stream->aggr.len];
+	b[0] = 0x08;
+	b[1] = (data_len >> 16) & 0xff;
+	b[2] = (data_len >> 8) & 0xff;
+	b[3] = data_len & 0xff;
+	b[4] = (timestamp >> 16) & 0xff;
+	b[5] = (timestamp >> 8) & 0xff;
+	b[6] = timestamp & 0xff;
+	b[7] = (timestamp >> 24) & 0xff;
+	b[8] = 0;
+	b[9] = 0;
+	b[10] = 0;
+	b += RTMP_AGGREGATE_TAG_HEADER_LEN;
+	if (header_len > 0)
+		memcpy(b, header, header_len);
+	b += header_len;
+	memcpy(b, &data->buf[data->rd], data->len - data->rd);
+	b += data->len - data->rd;
+	/* Back-pointer: size of the previous tag */
+	b[0] = (tag_len >> 24) & 0xff;
+	b[1] = (tag_len >> 16) & 0xff;
+	b[2] = (tag_len >> 8) & 0xff;
+	b[3] = tag_len & 0xff;
+	stream->aggr.len += tag_len + RTMP_AGGREGATE_BACK_POINTER_LEN;
+	stream->aggr_count++;
+	stream->stats.tx_aggregated_msgs++;
+
+	copied = (struct tx_buffer){
+		.data = *data,
+		.frame_userdata = frame_userdata,
+		.mtid = 0x08,
+		.timestamp = timestamp,
+		.owner = owner,
+	};
+	release_tx_buffer(
+		stream, RTMP_CSID_AUDIO, &copied, RTMP_TRACE_DROP_NONE);
 
-	return send_data(stream, 2, 0x02, 0, 0, NULL, &buf, NULL, 1, 0);
+	chan = find_tx_channel(stream, RTMP_CSID_AUDIO);
+	return chan ? chan->queue_len : 0;
 }
 
-static int send_ack(struct rtmp_chunk_stream *stream)
+static void pacer_timer_cb(struct pomp_timer *timer, void *userdata)
+{
+	struct rtmp_chunk_stream *stream = userdata;
+
+	stream->pacer_wait = 0;
+	event_data_out(stream);
+}
+
+int set_tx_pacing(struct rtmp_chunk_stream *stream,
+		  const struct rtmp_pacing_config *config)
 {
-	uint32_t seq_ne = htonl(stream->total_bytes);
-	struct rtmp_buffer buf;
 	int ret;
 
-	ret = clone_data(&seq_ne, sizeof(seq_ne), &buf);
-	if (ret != 0)
-		return ret;
+	if (!stream)
+		return -EINVAL;
+
+	if (config && !stream->pacer_timer) {
+		stream->pacer_timer =
+			pomp_timer_new(stream->loop, pacer_timer_cb, stream);
+		if (!stream->pacer_timer)
+			return -ENOMEM;
+	}
+
+	if (config) {
+		stream->pacing_config = *config;
+		if (stream->pacing_config.burst == 0)
+			stream->pacing_config.burst = RTMP_DEFAULT_PACING_BURST;
+		if (!stream->pacing)
+			stream->pacer_time = 0;
+		stream->pacing = 1;
+		return 0;
+	}
 
-	return send_data(stream, 2, 0x03, 0, 0, NULL, &buf, NULL, 1, 0);
+	stream->pacing = 0;
+	stream->pacer_rate = 0;
+	if (stream->pacer_timer)
+		pomp_timer_clear(stream->pacer_timer);
+	if (stream->pacer_wait) {
+		/* Resume the transmission */
+		stream->pacer_wait = 0;
+		ret = update_pomp_event(stream);
+		if (ret != 0)
+			ULOG_ERRNO("update_pomp_event", -ret);
+	}
+	return 0;
 }
 
-static int send_window_ack_size(struct rtmp_chunk_stream *stream,
-				uint32_t window)
+int set_tx_aggregation(struct rtmp_chunk_stream *stream, uint32_t window)
 {
-	uint32_t win_ne = htonl(window);
-	struct rtmp_buffer buf;
 	int ret;
 
-	ret = clone_data(&win_ne, sizeof(win_ne), &buf);
-	if (ret != 0)
-		return ret;
-	return send_data(stream, 2, 0x05, 0, 0, NULL, &buf, NULL, 1, 0);
+	if (!stream)
+		return -EINVAL;
+
+	if (window > 0 && !stream->aggr_timer) {
+		stream->aggr_timer =
+			pomp_timer_new(stream->loop, aggr_timer_cb, stream);
+		if (!stream->aggr_timer)
+			return -ENOMEM;
+	}
+	if (window == 0) {
+		ret = flush_tx_aggregate(stream);
+		if (ret < 0)
+			return ret;
+	}
+
+	stream->aggr_window = window;
+	return 0;
 }
 
 int send_metadata(struct rtmp_chunk_stream *stream,
 		  struct rtmp_buffer *data,
 		  uint32_t timestamp,
-		  int internal,
+		  enum rtmp_data_owner owner,
 		  void *frame_userdata)
 {
 	int ret;
-	struct rtmp_buffer b;
-	b.cap = 16;
-	b.buf = malloc(b.cap);
-	if (!b.buf)
-		return -ENOMEM;
-	b.rd = 0;
-	b.len = 0;
-	ret = amf_encode(&b, "%s", "@setDataFrame");
-	if (ret != 0)
-		return ret;
+
+	/* Keep the order of the audio channel messages */
+	if (stream) {
+		ret = flush_tx_aggregate(stream);
+		if (ret < 0)
+			return ret;
+	}
+
 	return send_data(stream,
-			 4,
+			 RTMP_CSID_AUDIO,
 			 0x12,
 			 0,
 			 timestamp,
-			 &b,
+			 set_data_frame_header,
+			 sizeof(set_data_frame_header),
 			 data,
+			 NULL,
+			 0,
 			 frame_userdata,
-			 internal,
+			 get_tx_owner(owner),
+			 TX_BUFFER_FLAG_CONFIG,
 			 0);
 }
 
+/* Fill the VideoTagHeader of an AVC frame, and get its tx_buffer flags */
+static uint32_t fill_video_header(uint8_t header[5],
+				  int is_meta,
+				  int is_key,
+				  int is_non_ref,
+				  int32_t cts)
+{
+	uint32_t flags = 0;
+
+	header[0] = is_key ? 0x17 : 0x27;
+	header[1] = is_meta ? 0x00 : 0x01;
+	/* Composition time offset, SI24 */
+	header[2] = ((uint32_t)cts >> 16) & 0xff;
+	header[3] = ((uint32_t)cts >> 8) & 0xff;
+	header[4] = (uint32_t)cts & 0xff;
+
+	if (is_meta)
+		flags |= TX_BUFFER_FLAG_CONFIG;
+	if (is_key)
+		flags |= TX_BUFFER_FLAG_KEY;
+	if (is_non_ref)
+		flags |= TX_BUFFER_FLAG_NON_REF;
+	return flags;
+}
+
 int send_video_frame(struct rtmp_chunk_stream *stream,
 		     struct rtmp_buffer *frame,
 		     uint32_t stream_id,
 		     uint32_t timestamp,
+		     int32_t cts,
 		     int is_meta,
 		     int is_key,
+		     int is_non_ref,
+		     enum rtmp_data_owner owner,
 		     void *frame_userdata)
 {
-	struct rtmp_buffer b;
-	b.cap = 5;
-	b.buf = calloc(b.cap, 1);
-	if (!b.buf)
-		return -ENOMEM;
-	b.rd = 0;
-	b.len = b.cap;
+	uint8_t header[5];
+	uint32_t flags;
+
+	flags = fill_video_header(header, is_meta, is_key, is_non_ref, cts);
 
-	b.buf[0] = is_key ? 0x17 : 0x27;
-	b.buf[1] = is_meta ? 0x00 : 0x01;
+	if (!is_meta)
+		update_auto_chunk_size(stream, frame->len + sizeof(header));
 
 	return send_data(stream,
-			 6,
+			 RTMP_CSID_VIDEO,
 			 0x09,
 			 stream_id,
 			 timestamp,
-			 &b,
+			 header,
+			 sizeof(header),
 			 frame,
-			 frame_userdata,
+			 NULL,
 			 0,
+			 frame_userdata,
+			 get_tx_owner(owner),
+			 flags,
+			 0);
+}
+
+int send_video_nalus(struct rtmp_chunk_stream *stream,
+		     const uint8_t *frame,
+		     const struct iovec *nalus,
+		     int count,
+		     uint32_t stream_id,
+		     uint32_t timestamp,
+		     int32_t cts,
+		     int is_key,
+		     int is_non_ref,
+		     enum rtmp_data_owner owner,
+		     void *frame_userdata)
+{
+	uint8_t header[5];
+	uint32_t flags;
+	size_t len = 0;
+	int i;
+	struct rtmp_buffer data = {
+		.buf = (uint8_t *)frame,
+	};
+
+	if (!stream || !frame || !nalus || count <= 0)
+		return -EINVAL;
+
+	/* The length prefixes are stored with the queued message */
+	for (i = 0; i < count; i++)
+		len += sizeof(uint32_t) + nalus[i].iov_len;
+	data.cap = len;
+	data.len = len;
+
+	flags = fill_video_header(header, 0, is_key, is_non_ref, cts);
+
+	update_auto_chunk_size(stream, len + sizeof(header));
+
+	return send_data(stream,
+			 RTMP_CSID_VIDEO,
+			 0x09,
+			 stream_id,
+			 timestamp,
+			 header,
+			 sizeof(header),
+			 &data,
+			 nalus,
+			 count,
+			 frame_userdata,
+			 get_tx_owner(owner),
+			 flags,
 			 0);
 }
 
@@ -1409,28 +3778,127 @@ int send_audio_data(struct rtmp_chunk_stream *stream,
 		    uint32_t stream_id,
 		    uint32_t timestamp,
 		    int is_meta,
+		    enum rtmp_data_owner owner,
 		    void *frame_userdata)
 {
-	struct rtmp_buffer b;
-	b.cap = 2;
-	b.buf = calloc(b.cap, 1);
-	if (!b.buf)
-		return -ENOMEM;
-	b.rd = 0;
-	b.len = b.cap;
+	uint8_t header[2];
+	int ret;
 
-	b.buf[0] = 0xaf;
-	b.buf[1] = is_meta ? 0x00 : 0x01;
+	header[0] = 0xaf;
+	header[1] = is_meta ? 0x00 : 0x01;
+
+	if (stream && data && stream->aggr_window > 0) {
+		if (!is_meta) {
+			ret = aggregate_audio_data(stream,
+						   data,
+						   stream_id,
+						   timestamp,
+						   header,
+						   sizeof(header),
+						   get_tx_owner(owner),
+						   frame_userdata);
+			if (ret != -E2BIG)
+				return ret;
+		}
+		/* Keep the order of the audio channel messages */
+		ret = flush_tx_aggregate(stream);
+		if (ret < 0)
+			return ret;
+	}
 
 	return send_data(stream,
-			 4,
+			 RTMP_CSID_AUDIO,
 			 0x08,
 			 stream_id,
 			 timestamp,
-			 &b,
+			 header,
+			 sizeof(header),
 			 data,
+			 NULL,
+			 0,
 			 frame_userdata,
+			 get_tx_owner(owner),
+			 is_meta ? TX_BUFFER_FLAG_CONFIG : 0,
+			 0);
+}
+
+int send_flv_tag(struct rtmp_chunk_stream *stream,
+		 uint8_t type,
+		 struct rtmp_buffer *data,
+		 uint32_t stream_id,
+		 uint32_t timestamp,
+		 enum rtmp_data_owner owner,
+		 void *frame_userdata)
+{
+	const uint8_t *b;
+	size_t len;
+	uint32_t flags = 0;
+	int csid;
+	int ret;
+
+	if (!stream || !data || data->len <= data->rd)
+		return -EINVAL;
+
+	b = &data->buf[data->rd];
+	len = data->len - data->rd;
+
+	switch (type) {
+	case 0x08: /* Audio */
+		csid = RTMP_CSID_AUDIO;
+		/* AAC sequence header */
+		if ((b[0] >> 4) == 10 && len >= 2 && b[1] == 0x00)
+			flags |= TX_BUFFER_FLAG_CONFIG;
+		if (stream->aggr_window == 0)
+			break;
+		if (!(flags & TX_BUFFER_FLAG_CONFIG)) {
+			ret = aggregate_audio_data(stream,
+						   data,
+						   stream_id,
+						   timestamp,
+						   NULL,
+						   0,
+						   get_tx_owner(owner),
+						   frame_userdata);
+			if (ret != -E2BIG)
+				return ret;
+		}
+		/* Keep the order of the audio channel messages */
+		ret = flush_tx_aggregate(stream);
+		if (ret < 0)
+			return ret;
+		break;
+
+	case 0x09: /* Video */
+		csid = RTMP_CSID_VIDEO;
+		/* FrameType: keyframe or disposable inter frame */
+		if ((b[0] >> 4) == 1)
+			flags |= TX_BUFFER_FLAG_KEY;
+		else if ((b[0] >> 4) == 3)
+			flags |= TX_BUFFER_FLAG_NON_REF;
+		/* AVC sequence header */
+		if ((b[0] & 0x0f) == 7 && len >= 2 && b[1] == 0x00)
+			flags |= TX_BUFFER_FLAG_CONFIG;
+		else
+			update_auto_chunk_size(stream, len);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return send_data(stream,
+			 csid,
+			 type,
+			 stream_id,
+			 timestamp,
+			 NULL,
 			 0,
+			 data,
+			 NULL,
+			 0,
+			 frame_userdata,
+			 get_tx_owner(owner),
+			 flags,
 			 0);
 }
 
@@ -1441,7 +3909,249 @@ int send_amf_message(struct rtmp_chunk_stream *stream, struct rtmp_buffer *msg)
 	ret = clone_buffer(msg, &buf);
 	if (ret != 0)
 		return ret;
-	return send_data(stream, 3, 0x14, 0, 0, NULL, &buf, NULL, 1, 0);
+	ret = send_data(stream,
+			RTMP_CSID_COMMAND,
+			0x14,
+			0,
+			0,
+			NULL,
+			0,
+			&buf,
+			NULL,
+			0,
+			NULL,
+			TX_BUFFER_ALLOCATED,
+			TX_BUFFER_FLAG_CONFIG,
+			0);
+	if (ret < 0)
+		free(buf.buf);
+	return ret;
+}
+
+int send_amf_command(struct rtmp_chunk_stream *stream,
+		     const struct amf_template *tpl,
+		     ...)
+{
+	va_list ap;
+	int ret;
+	struct rtmp_buffer buf = {0};
+
+	/* Encoded in a buffer of the exact size, which is then owned by the
+	 * tx queue */
+	va_start(ap, tpl);
+	ret = amf_template_vencode(tpl, &buf, ap);
+	va_end(ap);
+	if (ret != 0) {
+		free(buf.buf);
+		return ret;
+	}
+
+	ret = send_data(stream,
+			RTMP_CSID_COMMAND,
+			0x14,
+			0,
+			0,
+			NULL,
+			0,
+			&buf,
+			NULL,
+			0,
+			NULL,
+			TX_BUFFER_ALLOCATED,
+			TX_BUFFER_FLAG_CONFIG,
+			0);
+	if (ret < 0)
+		free(buf.buf);
+	return ret;
+}
+
+/* Media messages which can be sent on a new stream: application audio and
+ * video messages, excluding the codec configurations, and the aggregates of
+ * audio messages */
+static int is_backlog_msg(struct tx_buffer *buffer)
+{
+	if (buffer->mtid == 0x16)
+		return 1;
+	return (buffer->owner == TX_BUFFER_EXTERNAL ||
+		buffer->owner == TX_BUFFER_SHARED) &&
+	       (buffer->mtid == 0x08 || buffer->mtid == 0x09) &&
+	       !(buffer->flags & TX_BUFFER_FLAG_CONFIG);
+}
+
+struct rtmp_tx_backlog *take_tx_backlog(struct rtmp_chunk_stream *stream,
+					uint32_t max_age)
+{
+	static const int csids[] = {RTMP_CSID_AUDIO, RTMP_CSID_VIDEO};
+	struct rtmp_tx_backlog *backlog;
+	struct rtmp_chunk_tx_chan *chan;
+	struct tx_buffer *buffer;
+	uint64_t now;
+	unsigned int c;
+	int i, count = 0;
+	int wait_key;
+
+	if (!stream)
+		return NULL;
+
+	for (c = 0; c < sizeof(csids) / sizeof(csids[0]); c++) {
+		chan = find_tx_channel(stream, csids[c]);
+		if (chan)
+			count += chan->queue_len;
+	}
+	if (stream->aggr_count > 0)
+		count++;
+
+	backlog = calloc(1, sizeof(*backlog) + count * sizeof(*backlog->msgs));
+	if (!backlog)
+		return NULL;
+	backlog->cbs = stream->cbs;
+	backlog->userdata = stream->userdata;
+	backlog->trace_cb = stream->trace_cb;
+	backlog->trace_userdata = stream->trace_userdata;
+
+	now = get_time_us();
+	for (c = 0; c < sizeof(csids) / sizeof(csids[0]); c++) {
+		chan = find_tx_channel(stream, csids[c]);
+		if (!chan)
+			continue;
+
+		/* The video must restart from a keyframe */
+		wait_key = csids[c] == RTMP_CSID_VIDEO;
+
+		for (i = 0; i < chan->queue_len; i++) {
+			struct backlog_msg *msg = &backlog->msgs[backlog->count];
+			buffer = get_tx_buffer(chan, i);
+			if (!is_backlog_msg(buffer))
+				continue;
+			if (max_age > 0 &&
+			    now - buffer->queue_time > max_age * 1000ULL)
+				continue;
+			if (wait_key && !(buffer->flags & TX_BUFFER_FLAG_KEY))
+				continue;
+			wait_key = 0;
+
+			/* Moved to the backlog, not released with the stream */
+			msg->csid = csids[c];
+			move_tx_buffer(&msg->buffer, buffer);
+			msg->buffer.data_header.rd = 0;
+			msg->buffer.data.rd = 0;
+			buffer->owner = TX_BUFFER_INLINE;
+			buffer->flags |= TX_BUFFER_FLAG_MOVED;
+			buffer->segs = NULL;
+			backlog->count++;
+		}
+	}
+
+	/* The pending aggregate follows the queued audio messages */
+	if (stream->aggr_count > 0 &&
+	    (max_age == 0 || now - stream->aggr_time <= max_age * 1000ULL)) {
+		struct backlog_msg *msg = &backlog->msgs[backlog->count++];
+		msg->csid = RTMP_CSID_AUDIO;
+		msg->buffer.data = stream->aggr;
+		msg->buffer.mtid = 0x16;
+		msg->buffer.msid = stream->aggr_msid;
+		msg->buffer.timestamp = stream->aggr_timestamp;
+		msg->buffer.owner = TX_BUFFER_ALLOCATED;
+		msg->buffer.queue_time = stream->aggr_time;
+		memset(&stream->aggr, 0, sizeof(stream->aggr));
+		stream->aggr_count = 0;
+	}
+
+	ULOGI("%d messages kept in the tx backlog", backlog->count);
+	return backlog;
+}
+
+static void release_backlog_msg(struct rtmp_tx_backlog *backlog,
+				struct backlog_msg *msg,
+				enum rtmp_trace_drop_reason reason)
+{
+	if (backlog->trace_cb)
+		trace_tx_buffer(backlog->trace_cb,
+				backlog->trace_userdata,
+				RTMP_TRACE_RELEASED,
+				msg->csid,
+				&msg->buffer,
+				reason);
+	release_data(&backlog->cbs, backlog->userdata, &msg->buffer);
+}
+
+int restore_tx_backlog(struct rtmp_chunk_stream *stream,
+		       struct rtmp_tx_backlog *backlog,
+		       uint32_t msid,
+		       uint32_t max_age)
+{
+	struct rtmp_chunk_tx_chan *chan;
+	struct tx_buffer *buffer;
+	uint64_t now;
+	int i, j, ret;
+	int restored = 0;
+
+	if (!stream || !backlog)
+		return -EINVAL;
+
+	now = get_time_us();
+	for (i = 0; i < backlog->count; i++) {
+		struct backlog_msg *msg = &backlog->msgs[i];
+		int nalu_count = 0;
+		buffer = &msg->buffer;
+		if (max_age > 0 && now - buffer->queue_time > max_age * 1000ULL) {
+			release_backlog_msg(
+				backlog, msg, RTMP_TRACE_DROP_EXPIRED);
+			continue;
+		}
+		/* The NAL units are taken back from their slices, in place:
+		 * the new queue slot stores its own slices */
+		for (j = 0; buffer->segs && j < buffer->nsegs / 2; j++)
+			buffer->segs[nalu_count++] = buffer->segs[2 * j + 1];
+		ret = send_data(stream,
+				msg->csid,
+				buffer->mtid,
+				msid,
+				buffer->timestamp,
+				buffer->data_header.len > 0
+					? msg->buffer.data_header_buf
+					: NULL,
+				buffer->data_header.len,
+				&buffer->data,
+				buffer->segs,
+				nalu_count,
+				buffer->frame_userdata,
+				buffer->owner,
+				buffer->flags,
+				0);
+		if (ret < 0) {
+			release_backlog_msg(
+				backlog, msg, RTMP_TRACE_DROP_DISCONNECTED);
+			continue;
+		}
+		release_tx_segs(buffer);
+		/* Keep the original queue time, for the latency statistics */
+		chan = find_tx_channel(stream, msg->csid);
+		if (chan && chan->queue_len > 0)
+			get_tx_buffer(chan, chan->queue_len - 1)->queue_time =
+				buffer->queue_time;
+		restored++;
+	}
+
+	ULOGI("%d/%d messages restored from the tx backlog",
+	      restored,
+	      backlog->count);
+	free(backlog);
+	return 0;
+}
+
+void free_tx_backlog(struct rtmp_tx_backlog *backlog)
+{
+	int i;
+
+	if (!backlog)
+		return;
+
+	for (i = 0; i < backlog->count; i++)
+		release_backlog_msg(backlog,
+				    &backlog->msgs[i],
+				    RTMP_TRACE_DROP_DISCONNECTED);
+	free(backlog);
 }
 
 int delete_chunk_stream(struct rtmp_chunk_stream *stream)
@@ -1449,6 +4159,7 @@ int delete_chunk_stream(struct rtmp_chunk_stream *stream)
 	int ret;
 	struct rtmp_chunk_tx_chan *tchan, *ttmp;
 	struct rtmp_chunk_rx_chan *rchan, *rtmp;
+	int csid;
 
 	if (!stream)
 		return -EINVAL;
@@ -1456,18 +4167,36 @@ int delete_chunk_stream(struct rtmp_chunk_stream *stream)
 	ret = pomp_loop_remove(stream->loop, stream->sockfd);
 	if (ret != 0)
 		return ret;
+	pomp_loop_idle_remove(stream->loop, tls_pending_idle_cb, stream);
 
 	list_walk_entry_forward_safe(&stream->tx_channels, tchan, ttmp, node)
 	{
 		list_del(&tchan->node);
-		delete_chunk_tx_chan(stream, tchan);
+		csid = tchan->csid;
+		clear_chunk_tx_chan(stream, tchan);
+		if (csid >= RTMP_CSID_TABLE_SIZE)
+			free(tchan);
 	}
 	list_walk_entry_forward_safe(&stream->rx_channels, rchan, rtmp, node)
 	{
 		list_del(&rchan->node);
-		delete_chunk_rx_chan(rchan);
+		csid = rchan->csid;
+		clear_chunk_rx_chan(rchan);
+		if (csid >= RTMP_CSID_TABLE_SIZE)
+			free(rchan);
 	}
-
+	/* The socket is closed, do not wait for the zero-copy completions */
+	stream->zc_done = stream->zc_next;
+	release_zerocopy_msgs(stream);
+
+	if (stream->aggr_timer)
+		pomp_timer_destroy(stream->aggr_timer);
+	if (stream->pacer_timer)
+		pomp_timer_destroy(stream->pacer_timer);
+	free(stream->aggr.buf);
+	rtmp_buffer_pool_destroy(stream->rx_pool);
+	rtmp_buffer_pool_destroy(stream->tx_pool);
+	free(stream->tx_preamble.buf);
 	free(stream->rcvbuf.buf);
 	free(stream);
 	return 0;
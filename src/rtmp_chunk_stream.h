@@ -26,16 +26,54 @@
 #ifndef _RTMP_CHUNK_STREAM_H_
 #define _RTMP_CHUNK_STREAM_H_
 
+#include "rtmp_buffer_pool.h"
 #include "rtmp_internal.h"
 
+#include <rtmp.h>
+
+/* Chunk stream ids */
+#define RTMP_CSID_CONTROL 2
+#define RTMP_CSID_COMMAND 3
+#define RTMP_CSID_AUDIO 4
+#define RTMP_CSID_VIDEO 6
+
 struct rtmp_chunk_stream;
+struct amf_template;
+struct iovec;
 struct pomp_loop;
+struct rtmp_tls;
 
+/* Received messages are lent to the callbacks: data->buf is returned to the
+ * stream buffer pool once the callback returns. A callback can keep the
+ * message without copying it by taking data->buf and setting it to NULL, the
+ * buffer must then be released with rtmp_buffer_pool_put() */
 struct rtmp_chunk_cbs {
 	void (*peer_bw_changed)(uint32_t bandwidth, void *userdata);
 	void (*amf_msg)(struct rtmp_buffer *data, void *userdata);
 	void (*data_sent)(uint8_t *data, void *data_userdata, void *userdata);
+	void (*shared_data_sent)(uint8_t *data,
+				 void *data_userdata,
+				 void *userdata);
 	void (*disconnected)(void *userdata);
+	/* Optional: received audio, video & data messages, the sub-messages of
+	 * the Aggregate messages are reported one by one. The message starts
+	 * at data->rd in data->buf, which can be shared by several messages:
+	 * instead of being taken, it is kept with rtmp_buffer_pool_ref() */
+	void (*media_msg)(uint8_t mtid,
+			  uint32_t timestamp,
+			  struct rtmp_buffer *data,
+			  void *userdata);
+};
+
+/* Owner of the data given to send_metadata(), send_video_frame() and
+ * send_audio_data() */
+enum rtmp_data_owner {
+	/* Application data, released by cbs.data_sent */
+	RTMP_DATA_EXTERNAL = 0,
+	/* Allocated by the library, released by free() */
+	RTMP_DATA_ALLOCATED,
+	/* Data queued on several streams, released by cbs.shared_data_sent */
+	RTMP_DATA_SHARED,
 };
 
 struct rtmp_chunk_stream *new_chunk_stream(struct pomp_loop *loop,
@@ -43,27 +81,141 @@ struct rtmp_chunk_stream *new_chunk_stream(struct pomp_loop *loop,
 					   const struct rtmp_chunk_cbs *cbs,
 					   void *userdata);
 
+/* Raw data sent before the first chunk, and number of raw bytes received
+ * before the first chunk, used to finish the handshake in the chunk stream */
+int set_tx_preamble(struct rtmp_chunk_stream *stream,
+		    const uint8_t *data,
+		    size_t len);
+int set_rx_skip(struct rtmp_chunk_stream *stream, size_t len);
+
+/* TLS session of the connection, the data is then received through it, and
+ * sent through it unless the kernel TLS encrypts the transmitted data */
+int set_stream_tls(struct rtmp_chunk_stream *stream, struct rtmp_tls *tls);
+
 int set_chunk_size(struct rtmp_chunk_stream *stream, uint32_t chunk_size);
+int set_chunk_size_auto(struct rtmp_chunk_stream *stream, int enable);
+int set_tx_sched_quantum(struct rtmp_chunk_stream *stream, size_t quantum);
+
+/* Pack the audio messages sent within window ms in Aggregate messages (0 to
+ * disable) */
+int set_tx_aggregation(struct rtmp_chunk_stream *stream, uint32_t window);
+
+/* Token bucket pacer, config is copied (NULL to disable) */
+int set_tx_pacing(struct rtmp_chunk_stream *stream,
+		  const struct rtmp_pacing_config *config);
+
+/* Queue the pending Aggregate message right away. It stays pending on error
+ * (queue full) */
+int flush_tx_aggregate(struct rtmp_chunk_stream *stream);
+
+int set_tx_queue_config(struct rtmp_chunk_stream *stream,
+			int csid,
+			const struct rtmp_queue_config *config);
+int set_tx_drop_policy(struct rtmp_chunk_stream *stream,
+		       int csid,
+		       enum rtmp_drop_policy policy,
+		       uint32_t max_latency);
+/* Drop the new video frames until a keyframe (e.g. after a reconnection, the
+ * peer lost the decoding context) */
+int set_tx_wait_keyframe(struct rtmp_chunk_stream *stream);
+int get_tx_queue_status(struct rtmp_chunk_stream *stream,
+			int csid,
+			struct rtmp_queue_status *status);
+int get_stream_stats(struct rtmp_chunk_stream *stream,
+		     struct rtmp_stats *stats);
+
+int set_tx_notsent_lowat(struct rtmp_chunk_stream *stream,
+			 uint32_t notsent_lowat);
+
+/* Messages of at least threshold bytes are sent with MSG_ZEROCOPY, and
+ * released once the kernel completed their transmission (0 to disable) */
+int set_tx_zerocopy(struct rtmp_chunk_stream *stream, size_t threshold);
+
+/* Lifecycle events of the tx messages (NULL to disable) */
+int set_tx_trace(struct rtmp_chunk_stream *stream,
+		 rtmp_trace_cb_t cb,
+		 void *userdata);
+
+int set_tx_ack_window(struct rtmp_chunk_stream *stream, uint32_t window);
+int get_bw_estimate(struct rtmp_chunk_stream *stream,
+		    struct rtmp_bw_estimate *estimate);
+
+/* Tell the peer how many ms of the given message stream are buffered by the
+ * player */
+int send_set_buffer_length(struct rtmp_chunk_stream *stream,
+			   uint32_t stream_id,
+			   uint32_t buffer_length);
 
 int send_metadata(struct rtmp_chunk_stream *stream,
 		  struct rtmp_buffer *data,
 		  uint32_t timestamp,
-		  int internal,
+		  enum rtmp_data_owner owner,
 		  void *frame_userdata);
 int send_video_frame(struct rtmp_chunk_stream *stream,
 		     struct rtmp_buffer *frame,
 		     uint32_t stream_id,
 		     uint32_t timestamp,
+		     int32_t cts,
 		     int is_meta,
 		     int is_key,
+		     int is_non_ref,
+		     enum rtmp_data_owner owner,
+		     void *frame_userdata);
+/* Send a video frame made of the given NAL units of frame (e.g. split from
+ * an Annex B byte stream), each one preceded by its length. The NAL units are
+ * sent from frame without being copied. frame is the pointer released once
+ * the message is sent */
+int send_video_nalus(struct rtmp_chunk_stream *stream,
+		     const uint8_t *frame,
+		     const struct iovec *nalus,
+		     int count,
+		     uint32_t stream_id,
+		     uint32_t timestamp,
+		     int32_t cts,
+		     int is_key,
+		     int is_non_ref,
+		     enum rtmp_data_owner owner,
 		     void *frame_userdata);
 int send_audio_data(struct rtmp_chunk_stream *stream,
 		    struct rtmp_buffer *data,
 		    uint32_t stream_id,
 		    uint32_t timestamp,
 		    int is_meta,
+		    enum rtmp_data_owner owner,
 		    void *frame_userdata);
+/* Send an FLV audio (0x08) or video (0x09) tag body as it is, its
+ * AudioTagHeader or VideoTagHeader included. The keyframes, disposable
+ * frames and AVC/AAC sequence headers are found from the tag header */
+int send_flv_tag(struct rtmp_chunk_stream *stream,
+		 uint8_t type,
+		 struct rtmp_buffer *data,
+		 uint32_t stream_id,
+		 uint32_t timestamp,
+		 enum rtmp_data_owner owner,
+		 void *frame_userdata);
 int send_amf_message(struct rtmp_chunk_stream *stream, struct rtmp_buffer *msg);
+/* Encode a command message directly in the memory queued for sending */
+int send_amf_command(struct rtmp_chunk_stream *stream,
+		     const struct amf_template *tpl,
+		     ...);
+
+/* Media messages kept from a closed stream, to be sent on a new one (e.g.
+ * after a reconnection). take_tx_backlog() moves the audio and video
+ * messages queued for less than max_age ms (0 for no limit) to a backlog,
+ * the video starting from a keyframe. It must be called right before
+ * delete_chunk_stream(). restore_tx_backlog() queues the messages still
+ * younger than max_age again with the given message stream id, then frees
+ * the backlog. free_tx_backlog() releases the messages and frees the
+ * backlog */
+struct rtmp_tx_backlog;
+
+struct rtmp_tx_backlog *take_tx_backlog(struct rtmp_chunk_stream *stream,
+					uint32_t max_age);
+int restore_tx_backlog(struct rtmp_chunk_stream *stream,
+		       struct rtmp_tx_backlog *backlog,
+		       uint32_t msid,
+		       uint32_t max_age);
+void free_tx_backlog(struct rtmp_tx_backlog *backlog);
 
 int delete_chunk_stream(struct rtmp_chunk_stream *stream);
 
@@ -0,0 +1,206 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <rtmp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ULOG_TAG rtmp_flv_reader
+#include <ulog.h>
+ULOG_DECLARE_TAG(rtmp_flv_reader);
+
+#define FLV_HEADER_LEN 9
+#define FLV_TAG_HEADER_LEN 11
+#define FLV_PREV_TAG_SIZE_LEN 4
+
+struct rtmp_flv_reader {
+	/* Whole file mapping */
+	const uint8_t *map;
+	size_t size;
+	/* Offset of the first tag, and of the next one */
+	size_t first_tag;
+	size_t offset;
+};
+
+static uint32_t read_be24(const uint8_t *b)
+{
+	return ((uint32_t)b[0] << 16) | ((uint32_t)b[1] << 8) | b[2];
+}
+
+static uint32_t read_be32(const uint8_t *b)
+{
+	return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+	       ((uint32_t)b[2] << 8) | b[3];
+}
+
+RTMP_API struct rtmp_flv_reader *rtmp_flv_reader_new(const char *path)
+{
+	struct rtmp_flv_reader *reader;
+	struct stat st;
+	void *map;
+	uint32_t header_len;
+	int fd;
+	int ret;
+
+	if (!path) {
+		ULOG_ERRNO("rtmp_flv_reader_new", EINVAL);
+		return NULL;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ULOG_ERRNO("open(%s)", errno, path);
+		return NULL;
+	}
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		ULOG_ERRNO("fstat", errno);
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < FLV_HEADER_LEN + FLV_PREV_TAG_SIZE_LEN ||
+	    (uint64_t)st.st_size > SIZE_MAX) {
+		ULOGE("%s: bad FLV file size", path);
+		close(fd);
+		return NULL;
+	}
+
+	/* The mapping stays valid once the file is closed */
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ULOG_ERRNO("mmap", errno);
+		return NULL;
+	}
+	ret = posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+	if (ret != 0)
+		ULOG_ERRNO("posix_madvise", ret);
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader) {
+		ULOG_ERRNO("calloc", ENOMEM);
+		munmap(map, (size_t)st.st_size);
+		return NULL;
+	}
+	reader->map = map;
+	reader->size = (size_t)st.st_size;
+
+	if (reader->map[0] != 'F' || reader->map[1] != 'L' ||
+	    reader->map[2] != 'V') {
+		ULOGE("%s: not a FLV file", path);
+		goto error;
+	}
+	header_len = read_be32(&reader->map[5]);
+	if (header_len < FLV_HEADER_LEN ||
+	    header_len > reader->size - FLV_PREV_TAG_SIZE_LEN) {
+		ULOGE("%s: bad FLV header length (%" PRIu32 ")",
+		      path,
+		      header_len);
+		goto error;
+	}
+
+	/* Skip the header and PreviousTagSize0 */
+	reader->first_tag = header_len + FLV_PREV_TAG_SIZE_LEN;
+	reader->offset = reader->first_tag;
+
+	return reader;
+
+error:
+	rtmp_flv_reader_destroy(reader);
+	return NULL;
+}
+
+RTMP_API void rtmp_flv_reader_destroy(struct rtmp_flv_reader *reader)
+{
+	if (!reader)
+		return;
+
+	munmap((void *)reader->map, reader->size);
+	free(reader);
+}
+
+RTMP_API int rtmp_flv_reader_next(struct rtmp_flv_reader *reader,
+				  struct rtmp_flv_tag *tag)
+{
+	const uint8_t *b;
+	size_t left;
+	size_t len;
+	uint8_t type;
+
+	if (!reader || !tag)
+		return -EINVAL;
+
+	while (reader->offset < reader->size) {
+		left = reader->size - reader->offset;
+		b = &reader->map[reader->offset];
+		if (left < FLV_TAG_HEADER_LEN)
+			break;
+		len = read_be24(&b[1]);
+		/* The PreviousTagSize of the last tag can be missing */
+		if (left - FLV_TAG_HEADER_LEN < len)
+			break;
+		reader->offset += FLV_TAG_HEADER_LEN + len;
+		if (reader->size - reader->offset >= FLV_PREV_TAG_SIZE_LEN)
+			reader->offset += FLV_PREV_TAG_SIZE_LEN;
+		else
+			reader->offset = reader->size;
+
+		/* Ignore the Filter & reserved bits */
+		type = b[0] & 0x1f;
+		if (type != RTMP_FLV_TAG_AUDIO && type != RTMP_FLV_TAG_VIDEO &&
+		    type != RTMP_FLV_TAG_SCRIPT) {
+			ULOGD("Skipping tag of type %u", type);
+			continue;
+		}
+
+		tag->type = (enum rtmp_flv_tag_type)type;
+		/* TimestampExtended holds the upper 8 bits */
+		tag->timestamp = read_be24(&b[4]) | ((uint32_t)b[7] << 24);
+		tag->data = &b[FLV_TAG_HEADER_LEN];
+		tag->len = len;
+		return 0;
+	}
+
+	if (reader->offset < reader->size) {
+		ULOGW("Truncated tag at offset %zu", reader->offset);
+		reader->offset = reader->size;
+	}
+	return -ENODATA;
+}
+
+RTMP_API int rtmp_flv_reader_rewind(struct rtmp_flv_reader *reader)
+{
+	if (!reader)
+		return -EINVAL;
+
+	reader->offset = reader->first_tag;
+	return 0;
+}
@@ -42,6 +42,7 @@
 
 
 #define DEFAULT_RTMP_PORT 1935
+#define DEFAULT_RTMPS_PORT 443
 
 
 struct rtmp_buffer {
@@ -0,0 +1,147 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "rtmp_nal.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+
+#define NAL_TYPE_SLICE 1
+#define NAL_TYPE_IDR 5
+
+/* AVCC NAL unit length prefix */
+#define NAL_LEN_SIZE 4
+
+int rtmp_nal_scan_avcc(const uint8_t *buf,
+		       size_t len,
+		       int *is_key,
+		       int *is_non_ref)
+{
+	size_t offset = 0;
+	uint32_t nal_size;
+	uint8_t nal_header;
+	int has_slice = 0;
+	int has_ref_slice = 0;
+
+	if (!buf || !is_key || !is_non_ref)
+		return -EINVAL;
+
+	*is_key = 0;
+	*is_non_ref = 0;
+	while (offset < len) {
+		if (len - offset < NAL_LEN_SIZE)
+			return -EBADMSG;
+		memcpy(&nal_size, &buf[offset], sizeof(nal_size));
+		nal_size = ntohl(nal_size);
+		offset += NAL_LEN_SIZE;
+		if (nal_size > len - offset)
+			return -EBADMSG;
+		if (nal_size == 0)
+			continue;
+
+		nal_header = buf[offset];
+		if ((nal_header & 0x1f) == NAL_TYPE_IDR) {
+			*is_key = 1;
+			return 0;
+		}
+		if ((nal_header & 0x1f) == NAL_TYPE_SLICE) {
+			has_slice = 1;
+			if (nal_header & 0x60)
+				has_ref_slice = 1;
+		}
+		offset += nal_size;
+	}
+	*is_non_ref = has_slice && !has_ref_slice;
+	return 0;
+}
+
+const uint8_t *rtmp_nal_find_start_code(const uint8_t *buf, const uint8_t *end)
+{
+	const uint8_t *p;
+
+	if (end - buf < 3)
+		return end;
+
+	/* Look for the 0x01 bytes with memchr(), which the libc vectorizes,
+	 * then check the two preceding bytes: 0x01 is rare in slice data, so
+	 * few candidates are checked */
+	p = buf + 2;
+	while (p < end) {
+		p = memchr(p, 0x01, end - p);
+		if (!p)
+			return end;
+		if (p[-1] == 0 && p[-2] == 0)
+			return p - 2;
+		/* p is not a zero byte, so the next 0x01 of a start code is at
+		 * least 3 bytes further */
+		p += 3;
+	}
+	return end;
+}
+
+int rtmp_nal_split_annexb(const uint8_t *buf,
+			  size_t len,
+			  struct iovec *nalus,
+			  int max)
+{
+	const uint8_t *end = buf + len;
+	const uint8_t *p;
+	const uint8_t *next;
+	const uint8_t *nal_end;
+	int count = 0;
+
+	if (!buf || !nalus || max <= 0)
+		return -EINVAL;
+
+	/* Only zero bytes are allowed before the first start code */
+	p = rtmp_nal_find_start_code(buf, end);
+	if (p == end)
+		return -EBADMSG;
+	for (next = buf; next < p; next++) {
+		if (*next != 0)
+			return -EBADMSG;
+	}
+
+	while (p < end) {
+		p += 3;
+		next = rtmp_nal_find_start_code(p, end);
+		/* Trailing zero bytes (or the first byte of a 4 bytes start
+		 * code) are not part of the NAL unit */
+		nal_end = next;
+		while (nal_end > p && nal_end[-1] == 0)
+			nal_end--;
+		if (nal_end > p) {
+			if (count >= max)
+				return -E2BIG;
+			nalus[count].iov_base = (void *)p;
+			nalus[count].iov_len = nal_end - p;
+			count++;
+		}
+		p = next;
+	}
+
+	return count > 0 ? count : -EBADMSG;
+}
@@ -0,0 +1,62 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _RTMP_NAL_H_
+#define _RTMP_NAL_H_
+
+#include "rtmp_internal.h"
+
+#include <sys/uio.h>
+
+/*
+ * H.264 NAL units parsing, for the frames given to the library.
+ */
+
+/* Maximum number of NAL units in an Annex B frame */
+#define RTMP_NAL_MAX_UNITS 256
+
+/* Find the keyframe (IDR slice) and non-reference (only slices with a
+ * nal_ref_idc of 0) flags of a frame made of NAL units with 4 bytes length
+ * prefixes (AVCC). Returns 0, or -EBADMSG if a length goes past the end of
+ * the frame */
+int rtmp_nal_scan_avcc(const uint8_t *buf,
+		       size_t len,
+		       int *is_key,
+		       int *is_non_ref);
+
+/* Returns the first start code (00 00 01) of [buf, end[, or end if there is
+ * none */
+const uint8_t *rtmp_nal_find_start_code(const uint8_t *buf, const uint8_t *end);
+
+/* Split an Annex B frame in NAL units (start codes and trailing zero bytes
+ * removed), pointing inside buf. Returns the number of NAL units, -EBADMSG if
+ * buf does not start with a start code or has no NAL unit, or -E2BIG if it has
+ * more than max NAL units */
+int rtmp_nal_split_annexb(const uint8_t *buf,
+			  size_t len,
+			  struct iovec *nalus,
+			  int max);
+
+#endif /* _RTMP_NAL_H_ */
@@ -0,0 +1,247 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "rtmp_resolver.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ULOG_TAG rtmp_resolver
+#include <ulog.h>
+ULOG_DECLARE_TAG(rtmp_resolver);
+
+struct rtmp_resolver_req {
+	struct pomp_loop *loop;
+	struct pomp_evt *evt;
+	rtmp_resolver_cb_t cb;
+	void *userdata;
+
+	char *host;
+	char port[8];
+
+	/* Protects done & cancelled, which tell who frees the request */
+	pthread_mutex_t mutex;
+	int done;
+	int cancelled;
+
+	/* Result, written by the resolver thread before done is set */
+	int status;
+	struct rtmp_resolver_addr addrs[RTMP_RESOLVER_MAX_ADDRS];
+	size_t count;
+};
+
+static void req_free(struct rtmp_resolver_req *req)
+{
+	if (req->evt)
+		pomp_evt_destroy(req->evt);
+	pthread_mutex_destroy(&req->mutex);
+	free(req->host);
+	free(req);
+}
+
+static int gai_to_errno(int err)
+{
+	switch (err) {
+	case EAI_AGAIN:
+		return -EAGAIN;
+	case EAI_MEMORY:
+		return -ENOMEM;
+	case EAI_SYSTEM:
+		return errno != 0 ? -errno : -EFAULT;
+	default:
+		return -EFAULT;
+	}
+}
+
+/* Copy the addresses to req->addrs, interleaving the families */
+static void sort_addrs(struct rtmp_resolver_req *req, struct addrinfo *infos)
+{
+	struct addrinfo *i, *first[2] = {NULL, NULL};
+	int family[2];
+	int cur = 0;
+
+	family[0] = infos->ai_family;
+	family[1] = family[0] == AF_INET6 ? AF_INET : AF_INET6;
+
+	first[0] = infos;
+	for (i = infos; i; i = i->ai_next) {
+		if (i->ai_family == family[1]) {
+			first[1] = i;
+			break;
+		}
+	}
+
+	while (req->count < RTMP_RESOLVER_MAX_ADDRS && (first[0] || first[1])) {
+		i = first[cur];
+		if (i) {
+			memcpy(&req->addrs[req->count].addr,
+			       i->ai_addr,
+			       i->ai_addrlen);
+			req->addrs[req->count].len = i->ai_addrlen;
+			req->count++;
+
+			/* Next address of the same family */
+			for (i = i->ai_next; i; i = i->ai_next) {
+				if (i->ai_family == family[cur])
+					break;
+			}
+			first[cur] = i;
+		}
+		cur = !cur;
+	}
+}
+
+static void *resolver_thread(void *userdata)
+{
+	struct rtmp_resolver_req *req = userdata;
+	struct addrinfo hints, *infos;
+	int ret, cancelled;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+
+	ret = getaddrinfo(req->host, req->port, &hints, &infos);
+	if (ret != 0) {
+		ULOGE("getaddrinfo(%s): %s", req->host, gai_strerror(ret));
+		req->status = gai_to_errno(ret);
+	} else {
+		sort_addrs(req, infos);
+		freeaddrinfo(infos);
+		req->status = req->count > 0 ? 0 : -EFAULT;
+	}
+
+	pthread_mutex_lock(&req->mutex);
+	req->done = 1;
+	cancelled = req->cancelled;
+	if (!cancelled)
+		pomp_evt_signal(req->evt);
+	pthread_mutex_unlock(&req->mutex);
+
+	if (cancelled)
+		req_free(req);
+
+	return NULL;
+}
+
+static void evt_cb(struct pomp_evt *evt, void *userdata)
+{
+	struct rtmp_resolver_req *req = userdata;
+
+	/* Wait for the thread to release the request */
+	pthread_mutex_lock(&req->mutex);
+	pthread_mutex_unlock(&req->mutex);
+
+	pomp_evt_detach_from_loop(req->evt, req->loop);
+
+	req->cb(req->status, req->addrs, req->count, req->userdata);
+
+	req_free(req);
+}
+
+int rtmp_resolver_start(struct pomp_loop *loop,
+			const char *host,
+			uint16_t port,
+			rtmp_resolver_cb_t cb,
+			void *userdata,
+			struct rtmp_resolver_req **ret_req)
+{
+	int ret;
+	pthread_t thread;
+	pthread_attr_t attr;
+	struct rtmp_resolver_req *req;
+
+	if (!loop || !host || !cb || !ret_req)
+		return -EINVAL;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return -ENOMEM;
+
+	req->loop = loop;
+	req->cb = cb;
+	req->userdata = userdata;
+	snprintf(req->port, sizeof(req->port), "%u", port);
+	pthread_mutex_init(&req->mutex, NULL);
+
+	req->host = strdup(host);
+	if (!req->host) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	req->evt = pomp_evt_new();
+	if (!req->evt) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	ret = pomp_evt_attach_to_loop(req->evt, loop, evt_cb, req);
+	if (ret < 0) {
+		ULOG_ERRNO("pomp_evt_attach_to_loop", -ret);
+		goto error;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, resolver_thread, req);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		ULOG_ERRNO("pthread_create", ret);
+		pomp_evt_detach_from_loop(req->evt, loop);
+		ret = -ret;
+		goto error;
+	}
+
+	*ret_req = req;
+	return 0;
+
+error:
+	req_free(req);
+	return ret;
+}
+
+void rtmp_resolver_cancel(struct rtmp_resolver_req *req)
+{
+	int done;
+
+	if (!req)
+		return;
+
+	pomp_evt_detach_from_loop(req->evt, req->loop);
+
+	pthread_mutex_lock(&req->mutex);
+	done = req->done;
+	req->cancelled = 1;
+	pthread_mutex_unlock(&req->mutex);
+
+	/* Otherwise, the thread frees the request when done */
+	if (done)
+		req_free(req);
+}
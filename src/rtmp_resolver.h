@@ -0,0 +1,71 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _RTMP_RESOLVER_H_
+#define _RTMP_RESOLVER_H_
+
+#include "rtmp_internal.h"
+
+#include <libpomp.h>
+#include <sys/socket.h>
+
+/*
+ * Asynchronous host name resolution.
+ *
+ * getaddrinfo() is run in a dedicated thread, and the result is reported on
+ * the pomp loop. The addresses are sorted for Happy Eyeballs (RFC 8305):
+ * address families are interleaved, starting with the first family returned
+ * by the system.
+ */
+
+/* Maximum number of addresses reported by a resolution */
+#define RTMP_RESOLVER_MAX_ADDRS 16
+
+struct rtmp_resolver_addr {
+	struct sockaddr_storage addr;
+	socklen_t len;
+};
+
+struct rtmp_resolver_req;
+
+/* Called on the pomp loop when the resolution is done. status is 0 or a
+ * negative errno. The request is freed after this callback returns, and must
+ * not be cancelled from it */
+typedef void (*rtmp_resolver_cb_t)(int status,
+				   const struct rtmp_resolver_addr *addrs,
+				   size_t count,
+				   void *userdata);
+
+int rtmp_resolver_start(struct pomp_loop *loop,
+			const char *host,
+			uint16_t port,
+			rtmp_resolver_cb_t cb,
+			void *userdata,
+			struct rtmp_resolver_req **ret_req);
+
+/* Cancels a pending request, the callback will not be called */
+void rtmp_resolver_cancel(struct rtmp_resolver_req *req);
+
+#endif /* _RTMP_RESOLVER_H_ */
@@ -0,0 +1,207 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "rtmp_submit_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#define ULOG_TAG rtmp_submit_queue
+#include <ulog.h>
+ULOG_DECLARE_TAG(rtmp_submit_queue);
+
+/* Bounded queue with a sequence number per slot (D. Vyukov): a producer
+ * reserves a slot by moving head forward, and publishes the message by
+ * setting the slot sequence to pos + 1. The consumer frees the slot by
+ * setting its sequence to pos + size */
+struct submit_slot {
+	size_t seq;
+	struct rtmp_submit_msg msg;
+};
+
+struct rtmp_submit_queue {
+	struct pomp_loop *loop;
+	struct pomp_evt *evt;
+	rtmp_submit_cb_t cb;
+	void *userdata;
+
+	struct submit_slot *slots;
+	size_t mask;
+
+	/* Next slot to reserve, shared by the producers */
+	size_t head;
+	/* Set when the loop was woken and has not drained the queue yet */
+	int wake_pending;
+
+	/* Keep the consumer index away from the producers cache line */
+	uint8_t pad[64];
+
+	/* Next slot to read, only used by the consumer */
+	size_t tail;
+};
+
+static void wake_consumer(struct rtmp_submit_queue *queue)
+{
+	if (__atomic_exchange_n(&queue->wake_pending, 1, __ATOMIC_SEQ_CST))
+		return;
+	pomp_evt_signal(queue->evt);
+}
+
+int rtmp_submit_queue_push(struct rtmp_submit_queue *queue,
+			   const struct rtmp_submit_msg *msg)
+{
+	struct submit_slot *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	if (!queue || !msg)
+		return -EINVAL;
+
+	pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue->slots[pos & queue->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->head,
+							&pos,
+							pos + 1,
+							1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* The slot was not consumed yet: full */
+			return -EAGAIN;
+		} else {
+			pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->msg = *msg;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	wake_consumer(queue);
+	return 0;
+}
+
+int rtmp_submit_queue_pop(struct rtmp_submit_queue *queue,
+			  struct rtmp_submit_msg *msg)
+{
+	struct submit_slot *slot;
+	size_t pos;
+
+	if (!queue || !msg)
+		return 0;
+
+	pos = queue->tail;
+	slot = &queue->slots[pos & queue->mask];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return 0;
+
+	*msg = slot->msg;
+	__atomic_store_n(&slot->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+	queue->tail = pos + 1;
+	return 1;
+}
+
+static void evt_cb(struct pomp_evt *evt, void *userdata)
+{
+	struct rtmp_submit_queue *queue = userdata;
+	struct rtmp_submit_msg msg;
+	size_t i;
+
+	/* Messages pushed from now on wake the loop again */
+	__atomic_store_n(&queue->wake_pending, 0, __ATOMIC_SEQ_CST);
+
+	/* Drain at most one queue length per wake up, so that producers
+	 * cannot keep the loop busy */
+	for (i = 0; i <= queue->mask; i++) {
+		if (!rtmp_submit_queue_pop(queue, &msg))
+			return;
+		queue->cb(&msg, queue->userdata);
+	}
+
+	wake_consumer(queue);
+}
+
+struct rtmp_submit_queue *rtmp_submit_queue_new(struct pomp_loop *loop,
+						unsigned int size,
+						rtmp_submit_cb_t cb,
+						void *userdata)
+{
+	struct rtmp_submit_queue *queue;
+	size_t i, count = 1;
+	int ret;
+
+	if (!loop || size == 0 || !cb)
+		return NULL;
+
+	while (count < size)
+		count <<= 1;
+
+	queue = calloc(1, sizeof(*queue));
+	if (!queue)
+		return NULL;
+	queue->loop = loop;
+	queue->cb = cb;
+	queue->userdata = userdata;
+	queue->mask = count - 1;
+
+	queue->slots = calloc(count, sizeof(*queue->slots));
+	if (!queue->slots)
+		goto error;
+	for (i = 0; i < count; i++)
+		queue->slots[i].seq = i;
+
+	queue->evt = pomp_evt_new();
+	if (!queue->evt)
+		goto error;
+	ret = pomp_evt_attach_to_loop(queue->evt, loop, evt_cb, queue);
+	if (ret < 0) {
+		ULOG_ERRNO("pomp_evt_attach_to_loop", -ret);
+		goto error;
+	}
+
+	return queue;
+
+error:
+	if (queue->evt)
+		pomp_evt_destroy(queue->evt);
+	free(queue->slots);
+	free(queue);
+	return NULL;
+}
+
+void rtmp_submit_queue_destroy(struct rtmp_submit_queue *queue)
+{
+	if (!queue)
+		return;
+
+	pomp_evt_detach_from_loop(queue->evt, queue->loop);
+	pomp_evt_destroy(queue->evt);
+	free(queue->slots);
+	free(queue);
+}
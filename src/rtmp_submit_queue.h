@@ -0,0 +1,77 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _RTMP_SUBMIT_QUEUE_H_
+#define _RTMP_SUBMIT_QUEUE_H_
+
+#include "rtmp_internal.h"
+
+#include <libpomp.h>
+
+/*
+ * Lock-free bounded queue of messages submitted from any thread and handled
+ * on the pomp loop (multiple producers, single consumer).
+ *
+ * rtmp_submit_queue_push() never blocks and fails with -EAGAIN when the queue
+ * is full. The loop is woken through a pomp_evt only by the first message
+ * pushed after the last drain, and the messages are then given to the
+ * callback in batches.
+ */
+
+struct rtmp_submit_msg {
+	int type;
+	const uint8_t *buf;
+	size_t len;
+	uint32_t timestamp;
+	uint32_t flags;
+	void *userdata;
+};
+
+struct rtmp_submit_queue;
+
+/* Called on the pomp loop for each message pushed to the queue */
+typedef void (*rtmp_submit_cb_t)(const struct rtmp_submit_msg *msg,
+				 void *userdata);
+
+/* size is rounded up to a power of two */
+struct rtmp_submit_queue *rtmp_submit_queue_new(struct pomp_loop *loop,
+						unsigned int size,
+						rtmp_submit_cb_t cb,
+						void *userdata);
+
+/* The queue must be empty (see rtmp_submit_queue_pop()) and no producer
+ * must be using it anymore */
+void rtmp_submit_queue_destroy(struct rtmp_submit_queue *queue);
+
+/* Can be called from any thread. Returns 0 or -EAGAIN if the queue is full */
+int rtmp_submit_queue_push(struct rtmp_submit_queue *queue,
+			   const struct rtmp_submit_msg *msg);
+
+/* Pops a message without calling the callback, from the loop thread only.
+ * Returns 1 if a message was popped, 0 if the queue is empty */
+int rtmp_submit_queue_pop(struct rtmp_submit_queue *queue,
+			  struct rtmp_submit_msg *msg);
+
+#endif /* _RTMP_SUBMIT_QUEUE_H_ */
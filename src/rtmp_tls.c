@@ -0,0 +1,210 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "rtmp_tls.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define ULOG_TAG rtmp_tls
+#include <ulog.h>
+ULOG_DECLARE_TAG(rtmp_tls);
+
+/* Kernel TLS definitions, from linux/tcp.h and linux/tls.h which might be
+ * missing from the libc headers */
+#ifdef __linux__
+#	define RTMP_HAVE_KTLS
+#	ifndef TCP_ULP
+#		define TCP_ULP 31
+#	endif
+#	ifndef SOL_TLS
+#		define SOL_TLS 282
+#	endif
+#	ifndef TLS_TX
+#		define TLS_TX 1
+#	endif
+#endif
+
+/* Large enough for all the tls12_crypto_info_* structures */
+#define KTLS_INFO_MAX_LEN 128
+
+
+struct rtmp_tls {
+	struct rtmp_tls_backend backend;
+	void *session;
+	int fd;
+	int ktls_tx;
+};
+
+
+struct rtmp_tls *rtmp_tls_new(const struct rtmp_tls_backend *backend,
+			      void *userdata,
+			      int fd,
+			      const char *host)
+{
+	struct rtmp_tls *tls;
+
+	if (!backend || fd < 0 || !host)
+		return NULL;
+
+	tls = calloc(1, sizeof(*tls));
+	if (!tls) {
+		ULOG_ERRNO("calloc", ENOMEM);
+		return NULL;
+	}
+	tls->backend = *backend;
+	tls->fd = fd;
+
+	tls->session = tls->backend.session_new(fd, host, userdata);
+	if (!tls->session) {
+		ULOGE("failed to create the TLS session");
+		free(tls);
+		return NULL;
+	}
+
+	return tls;
+}
+
+
+void rtmp_tls_destroy(struct rtmp_tls *tls)
+{
+	if (!tls)
+		return;
+
+	tls->backend.session_destroy(tls->session);
+	free(tls);
+}
+
+
+int rtmp_tls_handshake(struct rtmp_tls *tls, int *want_write)
+{
+	int ret;
+
+	if (!tls || !want_write)
+		return -EINVAL;
+
+	*want_write = 0;
+	ret = tls->backend.handshake(tls->session, want_write);
+	if (ret < 0 && ret != -EAGAIN)
+		ULOG_ERRNO("TLS handshake", -ret);
+	return ret;
+}
+
+
+int rtmp_tls_enable_ktls_tx(struct rtmp_tls *tls)
+{
+#ifdef RTMP_HAVE_KTLS
+	uint8_t info[KTLS_INFO_MAX_LEN];
+	socklen_t optlen = sizeof(info);
+	ssize_t len;
+	int ret;
+
+	if (!tls)
+		return -EINVAL;
+
+	if (tls->ktls_tx)
+		return 0;
+
+	/* The TLS library might have enabled the kernel TLS by itself */
+	if (getsockopt(tls->fd, SOL_TLS, TLS_TX, info, &optlen) == 0) {
+		tls->ktls_tx = 1;
+		ret = 0;
+		goto out;
+	}
+
+	if (!tls->backend.get_ktls_tx_info)
+		return -ENOTSUP;
+
+	/* Attach the TLS ULP first: without kernel support, the session is
+	 * left untouched and the backend keeps on writing */
+	ret = setsockopt(tls->fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	len = tls->backend.get_ktls_tx_info(tls->session, info, sizeof(info));
+	if (len < 0) {
+		ret = (int)len;
+		goto out;
+	} else if (len == 0 || (size_t)len > sizeof(info)) {
+		ret = -EPROTO;
+		goto out;
+	}
+
+	ret = setsockopt(tls->fd, SOL_TLS, TLS_TX, info, (socklen_t)len);
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+	tls->ktls_tx = 1;
+
+out:
+	/* Do not leave the keys on the stack */
+	memset(info, 0, sizeof(info));
+	__asm__ __volatile__("" : : "r"(info) : "memory");
+	return ret;
+#else /* !RTMP_HAVE_KTLS */
+	return -ENOTSUP;
+#endif /* !RTMP_HAVE_KTLS */
+}
+
+
+int rtmp_tls_ktls_tx(struct rtmp_tls *tls)
+{
+	return tls ? tls->ktls_tx : 0;
+}
+
+
+ssize_t rtmp_tls_recv(struct rtmp_tls *tls, void *buf, size_t len)
+{
+	if (!tls || !buf)
+		return -EINVAL;
+
+	return tls->backend.read(tls->session, buf, len);
+}
+
+
+size_t rtmp_tls_pending(struct rtmp_tls *tls)
+{
+	if (!tls)
+		return 0;
+
+	return tls->backend.pending(tls->session);
+}
+
+
+ssize_t rtmp_tls_writev(struct rtmp_tls *tls, const struct iovec *iov, int iovcnt)
+{
+	if (!tls || !iov)
+		return -EINVAL;
+
+	return tls->backend.writev(tls->session, iov, iovcnt);
+}
@@ -0,0 +1,77 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _RTMP_TLS_H_
+#define _RTMP_TLS_H_
+
+#include "rtmp_internal.h"
+
+#include <rtmp.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * TLS session of a connection, on top of an application provided
+ * rtmp_tls_backend.
+ *
+ * Once the handshake is done, rtmp_tls_enable_ktls_tx() tries to move the
+ * transmit direction to the kernel TLS. When it succeeds, the messages are
+ * written to the socket directly and encrypted by the kernel, while the
+ * received data is still decrypted by the backend.
+ */
+
+struct rtmp_tls;
+
+struct rtmp_tls *rtmp_tls_new(const struct rtmp_tls_backend *backend,
+			      void *userdata,
+			      int fd,
+			      const char *host);
+
+void rtmp_tls_destroy(struct rtmp_tls *tls);
+
+/* Returns 0 once the handshake is done, -EAGAIN while in progress (want_write
+ * tells which socket event to wait for), negative errno on error */
+int rtmp_tls_handshake(struct rtmp_tls *tls, int *want_write);
+
+/* Hands the transmit direction over to the kernel TLS, returns 0 on success,
+ * negative errno if the kernel TLS is unavailable (the backend keeps on
+ * encrypting the data) */
+int rtmp_tls_enable_ktls_tx(struct rtmp_tls *tls);
+
+/* Tells whether the kernel TLS encrypts the transmitted data */
+int rtmp_tls_ktls_tx(struct rtmp_tls *tls);
+
+/* recv() equivalent, returns -errno on error (-EAGAIN if no data) */
+ssize_t rtmp_tls_recv(struct rtmp_tls *tls, void *buf, size_t len);
+
+/* Number of bytes readable with rtmp_tls_recv() without reading the socket */
+size_t rtmp_tls_pending(struct rtmp_tls *tls);
+
+/* writev() equivalent through the backend, to be used when the kernel TLS
+ * does not encrypt the transmitted data, returns -errno on error */
+ssize_t rtmp_tls_writev(struct rtmp_tls *tls, const struct iovec *iov, int iovcnt);
+
+#endif /* _RTMP_TLS_H_ */
@@ -27,22 +27,16 @@
 #define _FLV_READER_H_
 
 #include <inttypes.h>
-#include <stdio.h>
+#include <rtmp.h>
 
 struct pomp_loop;
 struct pomp_timer;
 
-enum flv_data_type {
-	FLV_META,
-	FLV_AUDIO,
-	FLV_VIDEO,
-	FLV_UNKNOWN,
-};
-
 struct flv_reader_cbs {
-	void (*tag_cb)(uint8_t *buffer,
-		       size_t len,
-		       enum flv_data_type type,
+	/* tag->data points into the file mapping, and stays valid until the
+	 * reader is closed. timestamp is the tag timestamp, scaled by the
+	 * reading speed and increasing across loops */
+	void (*tag_cb)(const struct rtmp_flv_tag *tag,
 		       uint32_t timestamp,
 		       void *userdata);
 
@@ -59,6 +53,6 @@ void flv_close_file(struct flv_reader *r);
 
 int flv_start_read(struct flv_reader *r, float speed, int loop);
 
-const char *flv_data_type_str(enum flv_data_type type);
+const char *flv_tag_type_str(enum rtmp_flv_tag_type type);
 
 #endif /* _FLV_READER_H_ */
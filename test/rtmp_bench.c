@@ -0,0 +1,746 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* In-process micro-benchmarks of the send, receive and AMF hot paths. The
+ * chunk streams run over a socketpair() drained by the same loop. Built from
+ * the library sources, to reach the internal APIs */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libpomp.h>
+#include <rtmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "amf.h"
+#include "rtmp_chunk_stream.h"
+#include "rtmp_nal.h"
+
+#define ULOG_TAG rtmp_bench
+#include <ulog.h>
+ULOG_DECLARE_TAG(rtmp_bench);
+
+/* Default duration of each benchmark (ms) */
+#define BENCH_DEFAULT_DURATION 500
+
+/* Queue length of the media channels, to keep the socket busy */
+#define BENCH_QUEUE_LEN 64
+
+/* Number of NAL units of the Annex B frames */
+#define BENCH_ANNEXB_NALUS 4
+
+/* Messages recorded for the receive benchmarks */
+#define BENCH_RX_MSGS 256
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Allocation counter: malloc(), calloc() & realloc() are interposed with
+ * glibc, to report the allocations made by the library in the hot paths */
+static uint64_t allocs;
+
+#ifdef __GLIBC__
+#	define BENCH_COUNT_ALLOCS 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+#else
+#	define BENCH_COUNT_ALLOCS 0
+#endif
+
+/* Sizes of the sent video frames: one keyframe every gop frames */
+struct frame_dist {
+	const char *name;
+	size_t key_len;
+	size_t len;
+	int gop;
+	int annexb;
+};
+
+static const struct frame_dist frame_dists[] = {
+	/* Header bound: chunk header building & queueing */
+	{"tiny", 16, 16, 1, 0},
+	{"small", 256, 256, 1, 0},
+	{"p-frames", 4096, 4096, 1, 0},
+	{"gop-30", 65536, 4096, 30, 0},
+	{"gop-30-annexb", 65536, 4096, 30, 1},
+	{"large", 262144, 262144, 1, 0},
+};
+
+static const uint32_t chunk_sizes[] = {128, 4096, 65536};
+
+#define BENCH_MAX_FRAME_LEN 262144
+
+struct bench_ctx {
+	struct pomp_loop *loop;
+	int fds[2];
+	struct rtmp_chunk_stream *stream;
+	uint32_t duration;
+
+	/* Frame buffer shared by all the queued messages */
+	uint8_t *frame;
+
+	/* Completed messages (released by the tx queue, or received) */
+	uint64_t msgs;
+	uint64_t payload_bytes;
+
+	/* Data read from the socketpair: discarded, or recorded */
+	uint8_t *drain_buf;
+	size_t drain_cap;
+	struct rtmp_buffer *record;
+	uint64_t drained_bytes;
+};
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void peer_bw_changed(uint32_t bandwidth, void *userdata)
+{
+}
+
+static void amf_msg(struct rtmp_buffer *data, void *userdata)
+{
+	struct bench_ctx *ctx = userdata;
+
+	ctx->msgs++;
+	ctx->payload_bytes += data->len;
+}
+
+static void data_sent(uint8_t *data, void *data_userdata, void *userdata)
+{
+	struct bench_ctx *ctx = userdata;
+
+	ctx->msgs++;
+	ctx->payload_bytes += (uintptr_t)data_userdata;
+}
+
+static void disconnected(void *userdata)
+{
+	ULOGE("chunk stream disconnected");
+}
+
+static const struct rtmp_chunk_cbs bench_cbs = {
+	.peer_bw_changed = peer_bw_changed,
+	.amf_msg = amf_msg,
+	.data_sent = data_sent,
+	.shared_data_sent = data_sent,
+	.disconnected = disconnected,
+};
+
+static int record_data(struct rtmp_buffer *record,
+		       const uint8_t *data,
+		       size_t len)
+{
+	uint8_t *buf;
+	size_t cap;
+
+	if (record->len + len > record->cap) {
+		cap = record->cap > 0 ? record->cap : 65536;
+		while (cap < record->len + len)
+			cap *= 2;
+		buf = realloc(record->buf, cap);
+		if (!buf)
+			return -ENOMEM;
+		record->buf = buf;
+		record->cap = cap;
+	}
+	memcpy(&record->buf[record->len], data, len);
+	record->len += len;
+	return 0;
+}
+
+/* Read everything available from the peer end of the socketpair */
+static void drain_cb(int fd, uint32_t revents, void *userdata)
+{
+	struct bench_ctx *ctx = userdata;
+	ssize_t ret;
+
+	for (;;) {
+		ret = read(fd, ctx->drain_buf, ctx->drain_cap);
+		if (ret <= 0)
+			break;
+		ctx->drained_bytes += ret;
+		if (ctx->record &&
+		    record_data(ctx->record, ctx->drain_buf, ret) < 0) {
+			ULOG_ERRNO("record_data", ENOMEM);
+			break;
+		}
+	}
+}
+
+static int bench_open(struct bench_ctx *ctx, int stream_fd, int drain_fd)
+{
+	int ret;
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, ctx->fds);
+	if (ret < 0) {
+		ret = -errno;
+		ULOG_ERRNO("socketpair", -ret);
+		return ret;
+	}
+	fcntl(ctx->fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(ctx->fds[1], F_SETFL, O_NONBLOCK);
+
+	ctx->stream = new_chunk_stream(
+		ctx->loop, ctx->fds[stream_fd], &bench_cbs, ctx);
+	if (!ctx->stream) {
+		close(ctx->fds[0]);
+		close(ctx->fds[1]);
+		return -ENOMEM;
+	}
+
+	if (drain_fd >= 0) {
+		ret = pomp_loop_add(ctx->loop,
+				    ctx->fds[drain_fd],
+				    POMP_FD_EVENT_IN,
+				    drain_cb,
+				    ctx);
+		if (ret < 0)
+			ULOG_ERRNO("pomp_loop_add", -ret);
+	}
+
+	ctx->msgs = 0;
+	ctx->payload_bytes = 0;
+	ctx->drained_bytes = 0;
+	return 0;
+}
+
+static void bench_close(struct bench_ctx *ctx, int drain_fd)
+{
+	if (drain_fd >= 0)
+		pomp_loop_remove(ctx->loop, ctx->fds[drain_fd]);
+	delete_chunk_stream(ctx->stream);
+	ctx->stream = NULL;
+	close(ctx->fds[0]);
+	close(ctx->fds[1]);
+}
+
+/* Fill the frame buffer with BENCH_ANNEXB_NALUS NAL units, and split it */
+static int prepare_annexb(struct bench_ctx *ctx,
+			  size_t len,
+			  struct iovec *nalus)
+{
+	size_t nalu_len = len / BENCH_ANNEXB_NALUS;
+	size_t i;
+
+	memset(ctx->frame, 0xaa, len);
+	for (i = 0; i < BENCH_ANNEXB_NALUS; i++) {
+		uint8_t *start = &ctx->frame[i * nalu_len];
+		start[0] = 0x00;
+		start[1] = 0x00;
+		start[2] = 0x00;
+		start[3] = 0x01;
+		start[4] = 0x41;
+	}
+	return rtmp_nal_split_annexb(ctx->frame, len, nalus, RTMP_NAL_MAX_UNITS);
+}
+
+static int send_frame(struct bench_ctx *ctx,
+		      const struct frame_dist *dist,
+		      uint64_t idx,
+		      const struct iovec *key_nalus,
+		      int key_count,
+		      const struct iovec *nalus,
+		      int count)
+{
+	int is_key = (idx % dist->gop) == 0;
+	size_t len = is_key ? dist->key_len : dist->len;
+	uint32_t ts = (uint32_t)(idx * 33);
+	struct rtmp_buffer b = {
+		.buf = ctx->frame,
+		.cap = len,
+		.len = len,
+		.rd = 0,
+	};
+
+	if (dist->annexb)
+		return send_video_nalus(ctx->stream,
+					ctx->frame,
+					is_key ? key_nalus : nalus,
+					is_key ? key_count : count,
+					1,
+					ts,
+					0,
+					is_key,
+					0,
+					RTMP_DATA_EXTERNAL,
+					(void *)(uintptr_t)len);
+
+	return send_video_frame(ctx->stream,
+				&b,
+				1,
+				ts,
+				0,
+				0,
+				is_key,
+				0,
+				RTMP_DATA_EXTERNAL,
+				(void *)(uintptr_t)len);
+}
+
+/* Send video frames as fast as the socketpair is drained */
+static int bench_tx(struct bench_ctx *ctx,
+		    const struct frame_dist *dist,
+		    uint32_t chunk_size)
+{
+	struct rtmp_queue_config config = {.max_len = BENCH_QUEUE_LEN};
+	struct iovec key_nalus[RTMP_NAL_MAX_UNITS];
+	struct iovec nalus[RTMP_NAL_MAX_UNITS];
+	int key_count = 0, count = 0;
+	struct rtmp_stats st0, st1;
+	uint64_t allocs0, nallocs, start, end, idx = 0;
+	double elapsed, mb;
+	int ret;
+
+	ret = bench_open(ctx, 0, 1);
+	if (ret < 0)
+		return ret;
+
+	ret = set_tx_queue_config(ctx->stream, RTMP_CSID_VIDEO, &config);
+	if (ret < 0)
+		goto out;
+	ret = set_chunk_size(ctx->stream, chunk_size);
+	if (ret < 0)
+		goto out;
+
+	if (dist->annexb) {
+		/* The keyframe NAL units are at the start of the frame buffer,
+		 * shorter frames use the beginning of the same units */
+		key_count = prepare_annexb(ctx, dist->key_len, key_nalus);
+		count = rtmp_nal_split_annexb(
+			ctx->frame, dist->len, nalus, RTMP_NAL_MAX_UNITS);
+		if (key_count < 0 || count < 0) {
+			ret = key_count < 0 ? key_count : count;
+			goto out;
+		}
+	}
+
+	/* Let the SetChunkSize message go out first */
+	pomp_loop_wait_and_process(ctx->loop, 0);
+
+	get_stream_stats(ctx->stream, &st0);
+	ctx->msgs = 0;
+	ctx->payload_bytes = 0;
+	allocs0 = allocs;
+	start = get_time_us();
+	end = start + ctx->duration * 1000ULL;
+
+	while (get_time_us() < end) {
+		/* Keep the queue full */
+		for (;;) {
+			ret = send_frame(
+				ctx, dist, idx, key_nalus, key_count, nalus, count);
+			if (ret < 0)
+				break;
+			idx++;
+		}
+		if (ret != -EAGAIN)
+			goto out;
+		pomp_loop_wait_and_process(ctx->loop, 100);
+	}
+
+	nallocs = allocs - allocs0;
+	elapsed = (get_time_us() - start) / 1e6;
+	get_stream_stats(ctx->stream, &st1);
+	mb = (st1.tx_total_bytes - st0.tx_total_bytes) / 1e6;
+
+	printf("tx  %-14s chunk %6" PRIu32 ": %9.0f msg/s %9.1f MB/s",
+	       dist->name,
+	       chunk_size,
+	       ctx->msgs / elapsed,
+	       ctx->payload_bytes / 1e6 / elapsed);
+	if (BENCH_COUNT_ALLOCS)
+		printf(" %6.2f allocs/msg",
+		       ctx->msgs > 0 ? (double)nallocs / ctx->msgs : 0.);
+	printf(" %8.1f sendmsg/MB %6.2f chunks/msg\n",
+	       mb > 0 ? (st1.tx_sendmsg - st0.tx_sendmsg) / mb : 0.,
+	       ctx->msgs > 0 ? (double)(st1.tx_chunks - st0.tx_chunks) /
+				       ctx->msgs
+			     : 0.);
+	ret = 0;
+
+	/* The send paths must not allocate once the queue is set up */
+	if (BENCH_COUNT_ALLOCS && nallocs > 0) {
+		ULOGE("%" PRIu64 " allocations while sending", nallocs);
+		ret = -EPROTO;
+	}
+
+out:
+	if (ret < 0)
+		ULOG_ERRNO("bench_tx(%s, %" PRIu32 ")", -ret, dist->name,
+			   chunk_size);
+	bench_close(ctx, 1);
+	return ret;
+}
+
+/* Record the chunks of BENCH_RX_MSGS AMF messages of len bytes */
+static int record_rx_data(struct bench_ctx *ctx,
+			  size_t len,
+			  uint32_t chunk_size,
+			  struct rtmp_buffer *record)
+{
+	struct rtmp_buffer b = {
+		.buf = ctx->frame,
+		.cap = len,
+		.len = len,
+		.rd = 0,
+	};
+	struct rtmp_queue_status status;
+	int i, ret;
+
+	ret = bench_open(ctx, 0, 1);
+	if (ret < 0)
+		return ret;
+	ctx->record = record;
+
+	ret = set_chunk_size(ctx->stream, chunk_size);
+	if (ret < 0)
+		goto out;
+
+	/* The payload is not parsed by the chunk layer */
+	memset(ctx->frame, 0x55, len);
+	for (i = 0; i < BENCH_RX_MSGS;) {
+		ret = send_amf_message(ctx->stream, &b);
+		if (ret == -EAGAIN) {
+			pomp_loop_wait_and_process(ctx->loop, 100);
+			continue;
+		} else if (ret < 0) {
+			goto out;
+		}
+		i++;
+	}
+	/* Wait for the queue to be sent, then get the last bytes */
+	for (;;) {
+		ret = get_tx_queue_status(ctx->stream, RTMP_CSID_COMMAND, &status);
+		if (ret < 0)
+			goto out;
+		if (status.len == 0)
+			break;
+		pomp_loop_wait_and_process(ctx->loop, 100);
+	}
+	drain_cb(ctx->fds[1], POMP_FD_EVENT_IN, ctx);
+	ret = 0;
+
+out:
+	ctx->record = NULL;
+	bench_close(ctx, 1);
+	return ret;
+}
+
+/* Feed recorded chunks to a receiving chunk stream */
+static int bench_rx(struct bench_ctx *ctx, size_t len, uint32_t chunk_size)
+{
+	struct rtmp_buffer record = {0};
+	uint64_t allocs0, start, end, wire = 0;
+	uint64_t writes = 0;
+	size_t off = 0;
+	double elapsed;
+	ssize_t wlen;
+	int ret;
+
+	ret = record_rx_data(ctx, len, chunk_size, &record);
+	if (ret < 0)
+		goto out;
+
+	ret = bench_open(ctx, 1, -1);
+	if (ret < 0)
+		goto out;
+
+	allocs0 = allocs;
+	start = get_time_us();
+	end = start + ctx->duration * 1000ULL;
+
+	while (get_time_us() < end) {
+		wlen = write(ctx->fds[0], &record.buf[off], record.len - off);
+		if (wlen > 0) {
+			writes++;
+			wire += wlen;
+			off += wlen;
+			if (off == record.len)
+				off = 0;
+		}
+		pomp_loop_wait_and_process(ctx->loop, 0);
+	}
+
+	elapsed = (get_time_us() - start) / 1e6;
+	printf("rx  %-14zu chunk %6" PRIu32 ": %9.0f msg/s %9.1f MB/s",
+	       len,
+	       chunk_size,
+	       ctx->msgs / elapsed,
+	       ctx->payload_bytes / 1e6 / elapsed);
+	if (BENCH_COUNT_ALLOCS)
+		printf(" %6.2f allocs/msg",
+		       ctx->msgs > 0 ? (double)(allocs - allocs0) / ctx->msgs
+				     : 0.);
+	printf(" %8.1f write/MB\n", wire > 0 ? writes / (wire / 1e6) : 0.);
+	bench_close(ctx, -1);
+
+out:
+	if (ret < 0)
+		ULOG_ERRNO("bench_rx(%zu, %" PRIu32 ")", -ret, len, chunk_size);
+	free(record.buf);
+	return ret;
+}
+
+static void print_amf_result(const char *name,
+			     uint64_t ops,
+			     uint64_t bytes,
+			     uint64_t allocs0,
+			     uint64_t start)
+{
+	double elapsed = (get_time_us() - start) / 1e6;
+
+	printf("amf %-31s: %9.0f op/s  %9.1f MB/s", name, ops / elapsed,
+	       bytes / 1e6 / elapsed);
+	if (BENCH_COUNT_ALLOCS)
+		printf(" %6.2f allocs/op", (double)(allocs - allocs0) / ops);
+	printf("\n");
+}
+
+#define AMF_BENCH_BATCH 1000
+
+#define AMF_CONNECT_FORMAT "%s,%f,{%s:%s,%s:%s,%s:%s,%s:%s}"
+#define AMF_CONNECT_ARGS                                                       \
+	"connect", 1., "app", "live", "type", "nonprivate", "flashVer",        \
+		"FMLE/3.0 (compatible; FMSc/1.0)", "tcUrl",                    \
+		"rtmp://localhost/live"
+
+static int bench_amf(struct bench_ctx *ctx)
+{
+	struct amf_template tpl;
+	struct rtmp_buffer buf = {0};
+	struct rtmp_buffer msg = {0};
+	struct amf_str name, key, value;
+	uint64_t allocs0, start, end, ops, bytes;
+	double id;
+	char *cname, *ckey, *cvalue;
+	int i, ret;
+
+	ret = amf_template_compile(&tpl, AMF_CONNECT_FORMAT);
+	if (ret < 0)
+		goto out;
+
+	/* Encode, parsing the format string each time. The buffer is reused,
+	 * and only grown once */
+	allocs0 = allocs;
+	ops = bytes = 0;
+	start = get_time_us();
+	end = start + ctx->duration * 1000ULL;
+	while (get_time_us() < end) {
+		for (i = 0; i < AMF_BENCH_BATCH; i++) {
+			buf.len = 0;
+			ret = amf_encode(&buf, AMF_CONNECT_FORMAT,
+					 AMF_CONNECT_ARGS);
+			if (ret < 0)
+				goto out;
+			bytes += buf.len;
+		}
+		ops += AMF_BENCH_BATCH;
+	}
+	print_amf_result("amf_encode (connect)", ops, bytes, allocs0, start);
+
+	/* Encode from the compiled template */
+	allocs0 = allocs;
+	ops = bytes = 0;
+	start = get_time_us();
+	end = start + ctx->duration * 1000ULL;
+	while (get_time_us() < end) {
+		for (i = 0; i < AMF_BENCH_BATCH; i++) {
+			buf.len = 0;
+			ret = amf_template_encode(&tpl, &buf, AMF_CONNECT_ARGS);
+			if (ret < 0)
+				goto out;
+			bytes += buf.len;
+		}
+		ops += AMF_BENCH_BATCH;
+	}
+	print_amf_result(
+		"amf_template_encode (connect)", ops, bytes, allocs0, start);
+
+	ret = amf_encode(&msg,
+			 "%s,%f,0,{%s:%s,%s:%s,%s:%s}",
+			 "onStatus",
+			 0.,
+			 "level",
+			 "status",
+			 "code",
+			 "NetStream.Publish.Start",
+			 "description",
+			 "Publishing live");
+	if (ret < 0)
+		goto out;
+
+	/* Decode without allocations */
+	allocs0 = allocs;
+	ops = bytes = 0;
+	start = get_time_us();
+	end = start + ctx->duration * 1000ULL;
+	while (get_time_us() < end) {
+		for (i = 0; i < AMF_BENCH_BATCH; i++) {
+			msg.rd = 0;
+			ret = amf_get_msg_name_view(&msg, &name, &id);
+			if (ret == 0)
+				ret = amf_get_null(&msg);
+			if (ret == 0)
+				ret = amf_get_object_start(&msg);
+			while (ret == 0 &&
+			       (ret = amf_object_next(&msg, &key)) == 1)
+				ret = amf_get_string_view(&msg, &value);
+			if (ret < 0)
+				goto out;
+			bytes += msg.len;
+		}
+		ops += AMF_BENCH_BATCH;
+	}
+	print_amf_result("amf_get_*_view (onStatus)", ops, bytes, allocs0, start);
+
+	/* Decode with the allocating getters */
+	allocs0 = allocs;
+	ops = bytes = 0;
+	start = get_time_us();
+	end = start + ctx->duration * 1000ULL;
+	while (get_time_us() < end) {
+		for (i = 0; i < AMF_BENCH_BATCH; i++) {
+			msg.rd = 0;
+			cname = amf_get_msg_name(&msg, &id);
+			if (!cname) {
+				ret = -EBADMSG;
+				goto out;
+			}
+			free(cname);
+			ret = amf_get_null(&msg);
+			if (ret == 0)
+				ret = amf_get_object_start(&msg);
+			while (ret == 0) {
+				ret = amf_get_property(&msg, &ckey);
+				if (ret < 0)
+					break;
+				/* Empty name of the object end marker */
+				if (ckey[0] == '\0') {
+					free(ckey);
+					break;
+				}
+				free(ckey);
+				ret = amf_get_string(&msg, &cvalue);
+				if (ret < 0)
+					break;
+				free(cvalue);
+			}
+			if (ret < 0)
+				goto out;
+			bytes += msg.len;
+		}
+		ops += AMF_BENCH_BATCH;
+	}
+	print_amf_result("amf_get_* (onStatus)", ops, bytes, allocs0, start);
+	ret = 0;
+
+out:
+	if (ret < 0)
+		ULOG_ERRNO("bench_amf", -ret);
+	free(buf.buf);
+	free(msg.buf);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t rx_lens[] = {256, 4096, 65536};
+	struct bench_ctx ctx = {0};
+	int status = EXIT_SUCCESS;
+	unsigned int i, j;
+
+	ctx.duration = BENCH_DEFAULT_DURATION;
+	if (argc > 1)
+		ctx.duration = strtoul(argv[1], NULL, 0);
+	if (ctx.duration == 0) {
+		fprintf(stderr, "Usage: %s [duration_ms]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	ctx.loop = pomp_loop_new();
+	ctx.frame = malloc(BENCH_MAX_FRAME_LEN);
+	ctx.drain_cap = 65536;
+	ctx.drain_buf = malloc(ctx.drain_cap);
+	if (!ctx.loop || !ctx.frame || !ctx.drain_buf) {
+		ULOG_ERRNO("init", ENOMEM);
+		status = EXIT_FAILURE;
+		goto out;
+	}
+	memset(ctx.frame, 0xaa, BENCH_MAX_FRAME_LEN);
+
+	for (i = 0; i < ARRAY_SIZE(frame_dists); i++) {
+		for (j = 0; j < ARRAY_SIZE(chunk_sizes); j++) {
+			if (bench_tx(&ctx, &frame_dists[i], chunk_sizes[j]) < 0)
+				status = EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(rx_lens); i++) {
+		for (j = 0; j < ARRAY_SIZE(chunk_sizes); j++) {
+			if (bench_rx(&ctx, rx_lens[i], chunk_sizes[j]) < 0)
+				status = EXIT_FAILURE;
+		}
+	}
+
+	if (bench_amf(&ctx) < 0)
+		status = EXIT_FAILURE;
+
+out:
+	free(ctx.drain_buf);
+	free(ctx.frame);
+	if (ctx.loop)
+		pomp_loop_destroy(ctx.loop);
+	return status;
+}
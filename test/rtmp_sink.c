@@ -0,0 +1,752 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rtmp_sink.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libpomp.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "amf.h"
+#include "rtmp_chunk_stream.h"
+#include "rtmp_tls_identity.h"
+
+#define ULOG_TAG rtmp_sink
+#include <ulog.h>
+ULOG_DECLARE_TAG(rtmp_sink);
+
+#define HANDSHAKE_SIZE 1536
+
+/* Message stream id given to the publishers & players */
+#define RTMP_SINK_STREAM_ID 1
+
+/* Queue length of the messages sent to a player, which can receive bursts
+ * of aggregated audio and video messages */
+#define RTMP_SINK_PLAY_QUEUE_LEN 64
+
+enum sink_state {
+	SINK_IDLE,
+	SINK_WAIT_TLS_HELLO,
+	SINK_WAIT_C0C1,
+	SINK_WAIT_C2,
+	SINK_CONNECTED,
+};
+
+enum sink_role {
+	SINK_ROLE_NONE,
+	SINK_ROLE_PUBLISHER,
+	SINK_ROLE_PLAYER,
+};
+
+enum sink_cmd {
+	SINK_CMD_CONNECT_RESULT,
+	SINK_CMD_CREATE_STREAM_RESULT,
+	SINK_CMD_STATUS,
+
+	SINK_CMD_COUNT,
+};
+
+static const char *const sink_cmd_formats[SINK_CMD_COUNT] = {
+	[SINK_CMD_CONNECT_RESULT] = "%s,%f,{%s:%s,%s:%f},{%s:%s,%s:%s,%s:%s}",
+	[SINK_CMD_CREATE_STREAM_RESULT] = "%s,%f,0,%f",
+	[SINK_CMD_STATUS] = "%s,%f,0,{%s:%s,%s:%s,%s:%s}",
+};
+
+struct sink_conn {
+	struct rtmp_sink *sink;
+
+	enum sink_state state;
+	enum sink_role role;
+	int fd;
+	struct rtmp_chunk_stream *stream;
+	int close_pending;
+
+	/* Received TLS hello, C0 + C1, then C2 */
+	uint8_t hs[1 + HANDSHAKE_SIZE];
+	size_t hs_len;
+
+	/* Published or played stream name */
+	char name[256];
+
+	/* Last AVC & AAC sequence headers of a publisher (FLV tag bodies),
+	 * sent first to the clients starting to play its stream */
+	struct rtmp_buffer avcc;
+	struct rtmp_buffer asc;
+};
+
+struct rtmp_sink {
+	struct pomp_loop *loop;
+	struct rtmp_sink_cbs cbs;
+	void *userdata;
+	int listen_fd;
+	uint16_t port;
+	int rtmps;
+
+	struct sink_conn conns[RTMP_SINK_MAX_CONNS];
+
+	struct amf_template cmds[SINK_CMD_COUNT];
+};
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void idle_close_connection(void *userdata);
+
+static void close_connection(struct sink_conn *conn)
+{
+	struct rtmp_sink *sink = conn->sink;
+	enum sink_role role = conn->role;
+
+	if (conn->close_pending) {
+		pomp_loop_idle_remove(sink->loop, idle_close_connection, conn);
+		conn->close_pending = 0;
+	}
+
+	if (conn->state == SINK_IDLE)
+		return;
+
+	if (conn->stream) {
+		/* Also removes the fd from the loop */
+		delete_chunk_stream(conn->stream);
+		conn->stream = NULL;
+	} else {
+		pomp_loop_remove(sink->loop, conn->fd);
+	}
+	close(conn->fd);
+	conn->fd = -1;
+	conn->state = SINK_IDLE;
+	conn->role = SINK_ROLE_NONE;
+	free(conn->avcc.buf);
+	free(conn->asc.buf);
+	memset(&conn->avcc, 0, sizeof(conn->avcc));
+	memset(&conn->asc, 0, sizeof(conn->asc));
+	ULOGI("client disconnected");
+
+	if (role == SINK_ROLE_PUBLISHER && sink->cbs.closed_cb)
+		sink->cbs.closed_cb(conn->name, sink->userdata);
+}
+
+static void idle_close_connection(void *userdata)
+{
+	struct sink_conn *conn = userdata;
+
+	conn->close_pending = 0;
+	close_connection(conn);
+}
+
+/* The chunk stream can not be deleted from its own callbacks */
+static void close_connection_later(struct sink_conn *conn)
+{
+	if (conn->close_pending)
+		return;
+	conn->close_pending = 1;
+	pomp_loop_idle_add(conn->sink->loop, idle_close_connection, conn);
+}
+
+static void peer_bw_changed(uint32_t bandwidth, void *userdata)
+{
+}
+
+/* The message format is null, followed by the stream name */
+static int get_stream_name(struct sink_conn *conn, struct rtmp_buffer *data)
+{
+	struct amf_str name = {0};
+	int ret;
+
+	ret = amf_get_null(data);
+	if (ret == 0)
+		ret = amf_get_string_view(data, &name);
+	if (ret < 0)
+		return ret;
+	snprintf(conn->name,
+		 sizeof(conn->name),
+		 "%.*s",
+		 (int)name.len,
+		 name.ptr);
+	return 0;
+}
+
+static int send_status(struct sink_conn *conn,
+		       const char *code,
+		       const char *description)
+{
+	return send_amf_command(conn->stream,
+				&conn->sink->cmds[SINK_CMD_STATUS],
+				"onStatus",
+				0.,
+				"level",
+				"status",
+				"code",
+				code,
+				"description",
+				description);
+}
+
+/* Queue a copy of an FLV audio or video tag body for a player */
+static int send_to_player(struct sink_conn *player,
+			  uint8_t mtid,
+			  uint32_t timestamp,
+			  const uint8_t *data,
+			  size_t len)
+{
+	struct rtmp_buffer b = {0};
+	int ret;
+
+	b.buf = malloc(len);
+	if (!b.buf)
+		return -ENOMEM;
+	memcpy(b.buf, data, len);
+	b.cap = len;
+	b.len = len;
+
+	ret = send_flv_tag(player->stream,
+			   mtid,
+			   &b,
+			   RTMP_SINK_STREAM_ID,
+			   timestamp,
+			   RTMP_DATA_ALLOCATED,
+			   NULL);
+	if (ret < 0)
+		free(b.buf);
+	return ret;
+}
+
+static struct sink_conn *find_publisher(struct rtmp_sink *sink,
+					const char *name)
+{
+	int i;
+
+	for (i = 0; i < RTMP_SINK_MAX_CONNS; i++) {
+		struct sink_conn *conn = &sink->conns[i];
+		if (conn->role == SINK_ROLE_PUBLISHER &&
+		    strcmp(conn->name, name) == 0)
+			return conn;
+	}
+	return NULL;
+}
+
+static void handle_publish(struct sink_conn *conn, struct rtmp_buffer *data)
+{
+	struct rtmp_sink *sink = conn->sink;
+	int ret;
+
+	ret = get_stream_name(conn, data);
+	if (ret < 0) {
+		ULOG_ERRNO("publish", -ret);
+		close_connection_later(conn);
+		return;
+	}
+	if (find_publisher(sink, conn->name)) {
+		ULOGE("stream '%s' already published", conn->name);
+		close_connection_later(conn);
+		return;
+	}
+
+	ret = send_status(conn, "NetStream.Publish.Start", "Publishing.");
+	if (ret < 0) {
+		ULOG_ERRNO("send_amf_command", -ret);
+		close_connection_later(conn);
+		return;
+	}
+	conn->role = SINK_ROLE_PUBLISHER;
+
+	ULOGI("stream '%s' published", conn->name);
+	if (sink->cbs.publish_cb)
+		sink->cbs.publish_cb(conn->name, sink->userdata);
+}
+
+static void handle_play(struct sink_conn *conn, struct rtmp_buffer *data)
+{
+	struct rtmp_sink *sink = conn->sink;
+	struct sink_conn *publisher;
+	struct rtmp_queue_config queue = {
+		.max_len = RTMP_SINK_PLAY_QUEUE_LEN,
+	};
+	int ret;
+
+	ret = get_stream_name(conn, data);
+	if (ret < 0) {
+		ULOG_ERRNO("play", -ret);
+		close_connection_later(conn);
+		return;
+	}
+
+	ret = set_tx_queue_config(conn->stream, RTMP_CSID_VIDEO, &queue);
+	if (ret == 0)
+		ret = set_tx_queue_config(conn->stream, RTMP_CSID_AUDIO, &queue);
+	if (ret == 0)
+		ret = set_tx_aggregation(conn->stream,
+					 RTMP_SINK_PLAY_AGGR_WINDOW);
+	if (ret == 0)
+		ret = send_status(conn, "NetStream.Play.Start", "Playing.");
+	if (ret < 0) {
+		ULOG_ERRNO("play", -ret);
+		close_connection_later(conn);
+		return;
+	}
+	conn->role = SINK_ROLE_PLAYER;
+
+	/* The player joins the live stream: it needs the codec
+	 * configurations which were already sent by the publisher */
+	publisher = find_publisher(sink, conn->name);
+	if (publisher && publisher->avcc.len > 0)
+		ret = send_to_player(conn,
+				     0x09,
+				     0,
+				     publisher->avcc.buf,
+				     publisher->avcc.len);
+	if (ret == 0 && publisher && publisher->asc.len > 0)
+		ret = send_to_player(
+			conn, 0x08, 0, publisher->asc.buf, publisher->asc.len);
+	if (ret < 0)
+		ULOG_ERRNO("send_to_player", -ret);
+
+	ULOGI("stream '%s' played", conn->name);
+	if (sink->cbs.play_cb)
+		sink->cbs.play_cb(conn->name, sink->userdata);
+}
+
+static void amf_msg(struct rtmp_buffer *data, void *userdata)
+{
+	struct sink_conn *conn = userdata;
+	struct rtmp_sink *sink = conn->sink;
+	struct amf_str name;
+	double id;
+	int ret = 0;
+
+	ret = amf_get_msg_name_view(data, &name, &id);
+	if (ret < 0) {
+		ULOG_ERRNO("amf_get_msg_name_view", -ret);
+		return;
+	}
+
+	if (amf_str_eq(&name, "connect")) {
+		ret = send_amf_command(conn->stream,
+				       &sink->cmds[SINK_CMD_CONNECT_RESULT],
+				       "_result",
+				       id,
+				       "fmsVer",
+				       "FMS/3,0,1,123",
+				       "capabilities",
+				       31.,
+				       "level",
+				       "status",
+				       "code",
+				       "NetConnection.Connect.Success",
+				       "description",
+				       "Connection succeeded.");
+	} else if (amf_str_eq(&name, "createStream")) {
+		ret = send_amf_command(
+			conn->stream,
+			&sink->cmds[SINK_CMD_CREATE_STREAM_RESULT],
+			"_result",
+			id,
+			(double)RTMP_SINK_STREAM_ID);
+	} else if (amf_str_eq(&name, "publish")) {
+		handle_publish(conn, data);
+	} else if (amf_str_eq(&name, "play")) {
+		handle_play(conn, data);
+	} else if (amf_str_eq(&name, "deleteStream")) {
+		close_connection_later(conn);
+	}
+	/* Other commands (releaseStream, FCPublish...) need no answer */
+
+	if (ret < 0) {
+		ULOG_ERRNO("send_amf_command", -ret);
+		close_connection_later(conn);
+	}
+}
+
+static void data_sent(uint8_t *data, void *data_userdata, void *userdata)
+{
+	/* Only library allocated messages are sent */
+}
+
+static void disconnected(void *userdata)
+{
+	struct sink_conn *conn = userdata;
+
+	close_connection_later(conn);
+}
+
+static int save_config(struct rtmp_buffer *config,
+		       const uint8_t *data,
+		       size_t len)
+{
+	uint8_t *buf;
+
+	buf = realloc(config->buf, len);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, data, len);
+	config->buf = buf;
+	config->cap = len;
+	config->len = len;
+	return 0;
+}
+
+static void media_msg(uint8_t mtid,
+		      uint32_t timestamp,
+		      struct rtmp_buffer *data,
+		      void *userdata)
+{
+	struct sink_conn *conn = userdata;
+	struct rtmp_sink *sink = conn->sink;
+	const uint8_t *b = &data->buf[data->rd];
+	size_t len = data->len - data->rd;
+	int i, ret;
+
+	if (conn->role != SINK_ROLE_PUBLISHER)
+		return;
+
+	sink->cbs.media_cb(conn->name,
+			   mtid,
+			   timestamp,
+			   b,
+			   len,
+			   get_time_us(),
+			   sink->userdata);
+
+	/* Only the audio & video messages are played */
+	if ((mtid != 0x08 && mtid != 0x09) || len == 0)
+		return;
+	if (len >= 2 && b[1] == 0x00) {
+		ret = save_config(mtid == 0x09 ? &conn->avcc : &conn->asc,
+				  b,
+				  len);
+		if (ret < 0)
+			ULOG_ERRNO("save_config", -ret);
+	}
+
+	for (i = 0; i < RTMP_SINK_MAX_CONNS; i++) {
+		struct sink_conn *player = &sink->conns[i];
+		if (player->role != SINK_ROLE_PLAYER ||
+		    strcmp(player->name, conn->name) != 0)
+			continue;
+		ret = send_to_player(player, mtid, timestamp, b, len);
+		if (ret < 0)
+			ULOG_ERRNO("send_to_player", -ret);
+	}
+}
+
+static const struct rtmp_chunk_cbs sink_chunk_cbs = {
+	.peer_bw_changed = peer_bw_changed,
+	.amf_msg = amf_msg,
+	.data_sent = data_sent,
+	.shared_data_sent = data_sent,
+	.disconnected = disconnected,
+	.media_msg = media_msg,
+};
+
+/* S0 + S1 + S2, S2 being an echo of C1 */
+static int send_s0s1s2(struct sink_conn *conn)
+{
+	uint8_t buf[1 + 2 * HANDSHAKE_SIZE];
+	size_t i;
+	ssize_t ret;
+
+	buf[0] = 0x03;
+	memset(&buf[1], 0, 8);
+	for (i = 9; i < 1 + HANDSHAKE_SIZE; i++)
+		buf[i] = rand() & 0xff;
+	memcpy(&buf[1 + HANDSHAKE_SIZE], &conn->hs[1], HANDSHAKE_SIZE);
+
+	/* The socket buffer is empty at this point */
+	ret = send(conn->fd, buf, sizeof(buf), MSG_NOSIGNAL);
+	if (ret < 0)
+		return -errno;
+	if ((size_t)ret != sizeof(buf))
+		return -EAGAIN;
+	return 0;
+}
+
+/* The identity TLS hello is echoed, the data is not encrypted */
+static int answer_tls_hello(struct sink_conn *conn)
+{
+	ssize_t ret;
+
+	if (memcmp(conn->hs,
+		   RTMP_TLS_IDENTITY_HELLO,
+		   RTMP_TLS_IDENTITY_HELLO_LEN) != 0)
+		return -EPROTO;
+
+	/* The socket buffer is empty at this point */
+	ret = send(conn->fd,
+		   RTMP_TLS_IDENTITY_HELLO,
+		   RTMP_TLS_IDENTITY_HELLO_LEN,
+		   MSG_NOSIGNAL);
+	if (ret < 0)
+		return -errno;
+	if (ret != RTMP_TLS_IDENTITY_HELLO_LEN)
+		return -EAGAIN;
+	return 0;
+}
+
+static void handshake_cb(int fd, uint32_t revents, void *userdata)
+{
+	struct sink_conn *conn = userdata;
+	struct rtmp_sink *sink = conn->sink;
+	size_t want;
+	ssize_t len;
+	int ret;
+
+	switch (conn->state) {
+	case SINK_WAIT_TLS_HELLO:
+		want = RTMP_TLS_IDENTITY_HELLO_LEN;
+		break;
+	case SINK_WAIT_C0C1:
+		want = 1 + HANDSHAKE_SIZE;
+		break;
+	default:
+		want = HANDSHAKE_SIZE;
+		break;
+	}
+
+	/* Read exactly the handshake, the next bytes are chunks */
+	len = recv(fd, &conn->hs[conn->hs_len], want - conn->hs_len, 0);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		if (len < 0)
+			ULOG_ERRNO("recv", errno);
+		close_connection(conn);
+		return;
+	}
+	conn->hs_len += len;
+	if (conn->hs_len < want)
+		return;
+	conn->hs_len = 0;
+
+	if (conn->state == SINK_WAIT_TLS_HELLO) {
+		ret = answer_tls_hello(conn);
+		if (ret < 0) {
+			ULOG_ERRNO("answer_tls_hello", -ret);
+			close_connection(conn);
+			return;
+		}
+		conn->state = SINK_WAIT_C0C1;
+		return;
+	}
+
+	if (conn->state == SINK_WAIT_C0C1) {
+		if (conn->hs[0] != 0x03) {
+			ULOGE("unsupported RTMP version %u", conn->hs[0]);
+			close_connection(conn);
+			return;
+		}
+		ret = send_s0s1s2(conn);
+		if (ret < 0) {
+			ULOG_ERRNO("send_s0s1s2", -ret);
+			close_connection(conn);
+			return;
+		}
+		conn->state = SINK_WAIT_C2;
+		return;
+	}
+
+	/* C2 is not checked, the chunk stream takes over the socket */
+	pomp_loop_remove(sink->loop, fd);
+	conn->stream = new_chunk_stream(sink->loop, fd, &sink_chunk_cbs, conn);
+	if (!conn->stream) {
+		/* Removed from the loop already */
+		close(fd);
+		conn->fd = -1;
+		conn->state = SINK_IDLE;
+		return;
+	}
+	conn->state = SINK_CONNECTED;
+}
+
+static void listen_cb(int fd, uint32_t revents, void *userdata)
+{
+	struct rtmp_sink *sink = userdata;
+	struct sink_conn *conn = NULL;
+	int cfd;
+	int one = 1;
+	int i, ret;
+
+	cfd = accept(fd, NULL, NULL);
+	if (cfd < 0) {
+		ULOG_ERRNO("accept", errno);
+		return;
+	}
+
+	for (i = 0; i < RTMP_SINK_MAX_CONNS && !conn; i++) {
+		if (sink->conns[i].state == SINK_IDLE &&
+		    !sink->conns[i].close_pending)
+			conn = &sink->conns[i];
+	}
+	if (!conn) {
+		ULOGW("too many connections, connection refused");
+		close(cfd);
+		return;
+	}
+
+	fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+	setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	ret = pomp_loop_add(
+		sink->loop, cfd, POMP_FD_EVENT_IN, handshake_cb, conn);
+	if (ret < 0) {
+		ULOG_ERRNO("pomp_loop_add", -ret);
+		close(cfd);
+		return;
+	}
+
+	conn->fd = cfd;
+	conn->hs_len = 0;
+	conn->name[0] = '\0';
+	conn->state = sink->rtmps ? SINK_WAIT_TLS_HELLO : SINK_WAIT_C0C1;
+	ULOGI("client connected");
+}
+
+struct rtmp_sink *rtmp_sink_new(struct pomp_loop *loop,
+				uint16_t port,
+				const struct rtmp_sink_cbs *cbs,
+				void *userdata)
+{
+	struct rtmp_sink *sink;
+	struct sockaddr_in addr = {0};
+	socklen_t addr_len = sizeof(addr);
+	int one = 1;
+	int i, ret;
+
+	if (!loop || !cbs || !cbs->media_cb)
+		return NULL;
+
+	sink = calloc(1, sizeof(*sink));
+	if (!sink)
+		return NULL;
+	sink->loop = loop;
+	sink->cbs = *cbs;
+	sink->userdata = userdata;
+	sink->listen_fd = -1;
+	for (i = 0; i < RTMP_SINK_MAX_CONNS; i++) {
+		sink->conns[i].sink = sink;
+		sink->conns[i].fd = -1;
+	}
+
+	for (i = 0; i < SINK_CMD_COUNT; i++) {
+		ret = amf_template_compile(&sink->cmds[i], sink_cmd_formats[i]);
+		if (ret < 0) {
+			ULOG_ERRNO("amf_template_compile", -ret);
+			goto error;
+		}
+	}
+
+	sink->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sink->listen_fd < 0) {
+		ret = -errno;
+		ULOG_ERRNO("socket", -ret);
+		goto error;
+	}
+	setsockopt(sink->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(sink->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sink->listen_fd, RTMP_SINK_MAX_CONNS) < 0 ||
+	    getsockname(sink->listen_fd, (struct sockaddr *)&addr, &addr_len) <
+		    0) {
+		ret = -errno;
+		ULOG_ERRNO("bind/listen", -ret);
+		goto error;
+	}
+	sink->port = ntohs(addr.sin_port);
+
+	ret = pomp_loop_add(
+		loop, sink->listen_fd, POMP_FD_EVENT_IN, listen_cb, sink);
+	if (ret < 0) {
+		ULOG_ERRNO("pomp_loop_add", -ret);
+		goto error;
+	}
+
+	return sink;
+
+error:
+	if (sink->listen_fd >= 0)
+		close(sink->listen_fd);
+	free(sink);
+	return NULL;
+}
+
+void rtmp_sink_destroy(struct rtmp_sink *sink)
+{
+	int i;
+
+	if (!sink)
+		return;
+
+	/* No closed_cb on destruction */
+	sink->cbs.closed_cb = NULL;
+	for (i = 0; i < RTMP_SINK_MAX_CONNS; i++)
+		close_connection(&sink->conns[i]);
+	pomp_loop_remove(sink->loop, sink->listen_fd);
+	close(sink->listen_fd);
+	free(sink);
+}
+
+uint16_t rtmp_sink_get_port(struct rtmp_sink *sink)
+{
+	return sink ? sink->port : 0;
+}
+
+int rtmp_sink_set_rtmps(struct rtmp_sink *sink, int enable)
+{
+	if (!sink)
+		return -EINVAL;
+
+	sink->rtmps = enable;
+	return 0;
+}
+
+void rtmp_sink_drop_connection(struct rtmp_sink *sink)
+{
+	int i;
+
+	if (!sink)
+		return;
+
+	for (i = 0; i < RTMP_SINK_MAX_CONNS; i++) {
+		if (sink->conns[i].state != SINK_IDLE)
+			close_connection_later(&sink->conns[i]);
+	}
+}
@@ -0,0 +1,85 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _RTMP_SINK_H_
+#define _RTMP_SINK_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+struct pomp_loop;
+
+/* Minimal RTMP server: accepts up to RTMP_SINK_MAX_CONNS connections at a
+ * time, answers the connect/createStream/publish or play sequences, reports
+ * the received media messages, and sends the audio & video messages of a
+ * published stream to the clients playing it. The audio sent to the players
+ * is aggregated over RTMP_SINK_PLAY_AGGR_WINDOW ms */
+
+#define RTMP_SINK_MAX_CONNS 4
+#define RTMP_SINK_PLAY_AGGR_WINDOW 40
+
+struct rtmp_sink_cbs {
+	/* Received audio (0x08), video (0x09) or data (0x12) message of the
+	 * published stream name, with the monotonic time of its reception
+	 * (us). data is only valid during the call */
+	void (*media_cb)(const char *name,
+			 uint8_t mtid,
+			 uint32_t timestamp,
+			 const uint8_t *data,
+			 size_t len,
+			 uint64_t recv_time,
+			 void *userdata);
+
+	/* The stream was published (optional) */
+	void (*publish_cb)(const char *name, void *userdata);
+
+	/* A client started playing the stream (optional) */
+	void (*play_cb)(const char *name, void *userdata);
+
+	/* The publisher of the stream disconnected or deleted its stream
+	 * (optional) */
+	void (*closed_cb)(const char *name, void *userdata);
+};
+
+struct rtmp_sink;
+
+/* Listen on the given loopback port (0 for any port) */
+struct rtmp_sink *rtmp_sink_new(struct pomp_loop *loop,
+				uint16_t port,
+				const struct rtmp_sink_cbs *cbs,
+				void *userdata);
+void rtmp_sink_destroy(struct rtmp_sink *sink);
+
+uint16_t rtmp_sink_get_port(struct rtmp_sink *sink);
+
+/* Expect the handshake of the identity TLS backend (see rtmp_tls_identity.h)
+ * before the RTMP handshake of the new connections, for the rtmps URLs */
+int rtmp_sink_set_rtmps(struct rtmp_sink *sink, int enable);
+
+/* Close all the connections from the loop, as if the network was lost. New
+ * connections are accepted again afterwards */
+void rtmp_sink_drop_connection(struct rtmp_sink *sink);
+
+#endif /* _RTMP_SINK_H_ */
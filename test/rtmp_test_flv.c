@@ -82,7 +82,7 @@ static void peer_bw_changed(uint32_t bandwidth, void *userdata)
 
 static void data_unref(uint8_t *data, void *buffer_userdata, void *userdata)
 {
-	free(buffer_userdata);
+	/* The tags are sent from the file mapping */
 }
 
 static const struct rtmp_callbacks rtmp_cbs = {
@@ -92,61 +92,23 @@ static const struct rtmp_callbacks rtmp_cbs = {
 	.data_unref = data_unref,
 };
 
-static void flv_tag(uint8_t *buffer,
-		    size_t len,
-		    enum flv_data_type type,
+static void flv_tag(const struct rtmp_flv_tag *tag,
 		    uint32_t timestamp,
 		    void *userdata)
 {
-	int ret = 0;
-	uint8_t *buf;
+	int ret;
 	struct rtmp_test_ctx *ctx = userdata;
 	ULOGI("Got a tag of type %s, len %zu, timestamp %" PRIu32 "ms",
-	      flv_data_type_str(type),
-	      len,
+	      flv_tag_type_str(tag->type),
+	      tag->len,
 	      timestamp);
 
-	buf = malloc(len);
-	if (!buf) {
-		ULOGE("Whoopsie, ENOMEM !");
-		return;
-	}
-	memcpy(buf, buffer, len);
-
-	switch (type) {
-	case FLV_META:
-		ret = rtmp_client_send_packedmetadata(
-			ctx->rtmp, buf, len, timestamp, buf);
-		break;
-	case FLV_AUDIO:
-		if (buf[1])
-			ret = rtmp_client_send_audio_data(
-				ctx->rtmp, &buf[2], len - 2, timestamp, buf);
-		else
-			ret = rtmp_client_send_audio_specific_config(
-				ctx->rtmp, &buf[2], len - 2, buf);
-		break;
-	case FLV_VIDEO:
-		if (len < 5) {
-			ret = -EINVAL;
-			break;
-		}
-		if (buf[1])
-			ret = rtmp_client_send_video_frame(
-				ctx->rtmp, &buf[5], len - 5, timestamp, buf);
-		else
-			ret = rtmp_client_send_video_avcc(
-				ctx->rtmp, &buf[5], len - 5, buf);
-		break;
-	default:
-		ret = -ENOSYS;
-	}
-	if (ret < 0) {
-		free(buf);
+	ret = rtmp_client_send_flv_tag(
+		ctx->rtmp, tag->type, tag->data, tag->len, timestamp, NULL);
+	if (ret < 0)
 		ULOG_ERRNO("send flv tag", -ret);
-	} else if (ret > 0) {
+	else if (ret > 0)
 		ULOGI("Already %d frames waiting", ret);
-	}
 }
 
 static void flv_eof(void *userdata)
@@ -253,10 +215,11 @@ int main(int argc, char *argv[])
 		status_code = EXIT_FAILURE;
 	}
 exit:
-	flv_close_file(ctx.reader);
-
+	/* The queued tags point to the file mapping */
 	if (ctx.rtmp)
 		rtmp_client_destroy(ctx.rtmp);
+	flv_close_file(ctx.reader);
+
 	if (ctx.loop) {
 		ret = pomp_loop_destroy(ctx.loop);
 		if (ret != 0) {
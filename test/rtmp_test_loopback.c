@@ -0,0 +1,1752 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* End-to-end latency benchmark: an rtmp_client publishes synthetic video &
+ * audio to an in-process rtmp_sink on the loopback interface, and every
+ * received media message is timestamped against its submit time. A second
+ * rtmp_client can play the stream back from the sink, its frames being
+ * checked against the sent ones. The messages can also be submitted from
+ * several producer threads through the submission queue, or published by two
+ * clients through a group, over rtmp or rtmps with an identity TLS backend.
+ * Network conditions can be emulated on the loopback interface with tc
+ * netem */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <libpomp.h>
+#include <pthread.h>
+#include <rtmp.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtmp_sink.h"
+#include "rtmp_tls_identity.h"
+
+#define ULOG_TAG rtmp_test_loopback
+#include <ulog.h>
+ULOG_DECLARE_TAG(rtmp_test_loopback);
+
+/* AAC frames of 1024 samples at 48kHz */
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_FRAME_SAMPLES 1024
+#define AUDIO_FRAME_LEN 256
+
+/* Time given to the queued messages to be received once the sending stops */
+#define DRAIN_TIMEOUT_MS 2000
+
+/* Time given to the clients to connect, the end timer being armed for it
+ * until the sending starts */
+#define CONNECT_TIMEOUT_MS 5000
+
+/* Size of the submission queue shared by the producer threads, small enough
+ * for them to fill it */
+#define SUBMIT_QUEUE_SIZE 8
+
+/* Offset of the producer id & sequence number in the submitted video frames
+ * (after the AVCC NAL unit length & header) and audio frames */
+#define SUBMIT_VIDEO_ID_OFFSET 5
+#define SUBMIT_AUDIO_ID_OFFSET 0
+#define SUBMIT_ID_LEN 8
+
+/* Stream key of the second client of a group */
+#define GROUP_MEMBER_KEY "loopback2"
+
+/* FLV tag header lengths of the AVC & AAC messages received by the sink */
+#define FLV_VIDEO_HEADER_LEN 5
+#define FLV_AUDIO_HEADER_LEN 2
+
+/* Submit times of the sent messages of one type, matched by timestamp */
+struct media_track {
+	const char *name;
+
+	/* Ring of the sent timestamps & submit times, not received yet */
+	uint32_t *ts;
+	uint64_t *submit_time;
+	size_t size;
+	size_t head;
+	size_t len;
+
+	uint64_t sent;
+	uint64_t refused;
+	uint64_t received;
+	uint64_t lost;
+	uint64_t unmatched;
+
+	/* Latencies of the received messages (us) */
+	uint32_t *latencies;
+	size_t nb_latencies;
+	size_t latencies_cap;
+};
+
+/* Thread submitting video & audio frames, fields indexed by 0 for the video
+ * and 1 for the audio */
+struct producer {
+	struct loopback_ctx *ctx;
+	pthread_t thread;
+	int started;
+	uint32_t id;
+
+	/* Written by the producer thread, read once it is joined */
+	uint64_t accepted[2];
+	uint64_t refused;
+	uint64_t ring_full;
+
+	/* Written on the loop thread */
+	uint64_t received[2];
+	int64_t last_seq[2];
+	/* data_unref() calls of each message, by sequence number */
+	uint8_t *unrefs[2];
+};
+
+struct loopback_ctx {
+	struct pomp_loop *loop;
+	struct rtmp_sink *sink;
+	struct rtmp_client *client;
+	struct rtmp_client *player;
+	struct rtmp_group *group;
+	struct rtmp_client *member;
+	struct pomp_timer *video_timer;
+	struct pomp_timer *audio_timer;
+	struct pomp_timer *end_timer;
+	struct pomp_timer *drop_timer;
+	int run;
+	int draining;
+	int status;
+
+	/* Configuration */
+	uint32_t duration;
+	uint32_t bitrate;
+	uint32_t fps;
+	uint32_t gop;
+	uint32_t chunk_size;
+	uint32_t aggr_window;
+	enum rtmp_drop_policy drop_policy;
+	uint32_t max_latency;
+	/* Time after which the sink drops the connection (ms, 0 if never) */
+	uint32_t drop_time;
+	/* Timestamp of the first frames (ms) */
+	uint32_t start_ts;
+	/* Play the published stream back from the sink */
+	int play;
+	/* Producer threads submitting the frames (0 to send them from the
+	 * loop) and number of frames of each type they submit */
+	uint32_t nb_producers;
+	uint32_t submit_count;
+	/* Publish through a group with a second client (member), removed from
+	 * the group half-way */
+	int use_group;
+	/* rtmps URLs, with the identity TLS backend */
+	int rtmps;
+	char url[64];
+	char member_url[64];
+
+	/* drop_pending is set until the sink closed the dropped connection,
+	 * wait_video until the first video frame of the new connection */
+	int drop_pending;
+	int dropped;
+	int wait_video;
+
+	/* Monotonic time of the first frames (us) */
+	uint64_t start_time;
+	uint64_t video_frames;
+	uint64_t audio_frames;
+	struct media_track video;
+	struct media_track audio;
+
+	/* play_wait_video is set from the reconnection of the player until
+	 * its first video frame */
+	int play_connected;
+	int play_reconnected;
+	int play_wait_video;
+	struct media_track play_video;
+	struct media_track play_audio;
+	/* Last frame of each type, kept with rtmp_media_buffer_ref() and
+	 * checked again once released */
+	struct rtmp_media_frame kept[2];
+
+	struct producer *producers;
+	/* Number of finished producer threads (atomic) */
+	uint32_t producers_done;
+	int producers_joined;
+	uint64_t submit_unrefs;
+	uint64_t submit_out_of_order;
+
+	/* Connected publishers, the sending starting once all are */
+	int nb_connected;
+	int member_removed;
+	struct media_track member_video;
+	struct media_track member_audio;
+	/* data_unref() calls of the group, by message index */
+	uint8_t *group_unrefs;
+	size_t group_msgs;
+	size_t group_msgs_max;
+	uint64_t group_queued;
+	uint64_t group_released;
+
+	struct rtmp_tls_identity_stats tls_stats;
+};
+
+static const uint8_t avcc[] = {
+	0x01, 0x42, 0xc0, 0x1e, 0xff, 0xe1, 0x00, 0x04, 0x67, 0x42,
+	0xc0, 0x1e, 0x01, 0x00, 0x04, 0x68, 0xce, 0x3c, 0x80,
+};
+/* AAC LC, 48kHz, stereo */
+static const uint8_t asc[] = {0x11, 0x90};
+
+static uint64_t get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int track_init(struct media_track *track, const char *name, size_t size)
+{
+	memset(track, 0, sizeof(*track));
+	track->name = name;
+	track->size = size;
+	track->ts = calloc(size, sizeof(*track->ts));
+	track->submit_time = calloc(size, sizeof(*track->submit_time));
+	if (!track->ts || !track->submit_time)
+		return -ENOMEM;
+	return 0;
+}
+
+static void track_clear(struct media_track *track)
+{
+	free(track->ts);
+	free(track->submit_time);
+	free(track->latencies);
+}
+
+static void track_submit(struct media_track *track, uint32_t ts, int ret)
+{
+	size_t idx;
+
+	if (ret < 0) {
+		track->refused++;
+		return;
+	}
+	track->sent++;
+
+	/* The oldest messages are considered lost when the ring is full */
+	if (track->len == track->size) {
+		track->head = (track->head + 1) % track->size;
+		track->len--;
+		track->lost++;
+	}
+	idx = (track->head + track->len) % track->size;
+	track->ts[idx] = ts;
+	track->submit_time[idx] = get_time_us();
+	track->len++;
+}
+
+static void track_receive(struct media_track *track,
+			  uint32_t ts,
+			  uint64_t recv_time)
+{
+	uint32_t *latencies;
+	uint64_t latency;
+	size_t cap;
+
+	/* Messages sent before this one were dropped */
+	while (track->len > 0 && track->ts[track->head] != ts &&
+	       (int32_t)(ts - track->ts[track->head]) > 0) {
+		track->head = (track->head + 1) % track->size;
+		track->len--;
+		track->lost++;
+	}
+	if (track->len == 0 || track->ts[track->head] != ts) {
+		track->unmatched++;
+		return;
+	}
+
+	latency = recv_time - track->submit_time[track->head];
+	track->head = (track->head + 1) % track->size;
+	track->len--;
+	track->received++;
+
+	if (track->nb_latencies == track->latencies_cap) {
+		cap = track->latencies_cap > 0 ? 2 * track->latencies_cap
+					       : 1024;
+		latencies = realloc(track->latencies, cap * sizeof(*latencies));
+		if (!latencies)
+			return;
+		track->latencies = latencies;
+		track->latencies_cap = cap;
+	}
+	track->latencies[track->nb_latencies++] =
+		latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t *)a;
+	uint32_t lb = *(const uint32_t *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static void track_print(struct media_track *track)
+{
+	uint64_t sum = 0;
+	size_t i, n = track->nb_latencies;
+	uint32_t *l = track->latencies;
+
+	/* The messages still waiting were never received */
+	track->lost += track->len;
+	track->len = 0;
+
+	printf("%-6s sent %" PRIu64 " refused %" PRIu64 " received %" PRIu64
+	       " lost %" PRIu64 " unmatched %" PRIu64 "\n",
+	       track->name,
+	       track->sent,
+	       track->refused,
+	       track->received,
+	       track->lost,
+	       track->unmatched);
+	if (n == 0)
+		return;
+
+	qsort(l, n, sizeof(*l), compare_latencies);
+	for (i = 0; i < n; i++)
+		sum += l[i];
+	printf("%-6s latency (ms): min %.2f avg %.2f p50 %.2f p95 %.2f "
+	       "p99 %.2f max %.2f\n",
+	       track->name,
+	       l[0] / 1000.,
+	       sum / 1000. / n,
+	       l[n / 2] / 1000.,
+	       l[n * 95 / 100] / 1000.,
+	       l[n * 99 / 100] / 1000.,
+	       l[n - 1] / 1000.);
+}
+
+static void stop(struct loopback_ctx *ctx, int status)
+{
+	if (status != EXIT_SUCCESS)
+		ctx->status = status;
+	/* Also read by the producer threads */
+	__atomic_store_n(&ctx->run, 0, __ATOMIC_RELAXED);
+	pomp_loop_wakeup(ctx->loop);
+}
+
+static void write_u32(uint8_t *buf, uint32_t val)
+{
+	buf[0] = (val >> 24) & 0xff;
+	buf[1] = (val >> 16) & 0xff;
+	buf[2] = (val >> 8) & 0xff;
+	buf[3] = val & 0xff;
+}
+
+static uint32_t read_u32(const uint8_t *buf)
+{
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+	       ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+/* Every accepted submitted message was received or dropped, and released */
+static int all_submitted_received(struct loopback_ctx *ctx)
+{
+	struct rtmp_stats stats;
+	uint64_t accepted = 0, received = 0;
+	uint32_t i;
+
+	if (ctx->nb_producers == 0)
+		return 1;
+	if (!ctx->producers_joined ||
+	    rtmp_client_get_stats(ctx->client, &stats) < 0)
+		return 0;
+
+	for (i = 0; i < ctx->nb_producers; i++) {
+		struct producer *p = &ctx->producers[i];
+		accepted += p->accepted[0] + p->accepted[1];
+		received += p->received[0] + p->received[1];
+	}
+	return received + stats.submit_dropped == accepted &&
+	       ctx->submit_unrefs == accepted;
+}
+
+/* All the sent messages were received */
+static int all_received(struct loopback_ctx *ctx)
+{
+	return ctx->video.len == 0 && ctx->audio.len == 0 &&
+	       ctx->play_video.len == 0 && ctx->play_audio.len == 0 &&
+	       ctx->member_video.len == 0 && ctx->member_audio.len == 0 &&
+	       all_submitted_received(ctx);
+}
+
+/* The messages of each producer must be received in order */
+static void submit_receive(struct loopback_ctx *ctx,
+			   uint8_t mtid,
+			   const uint8_t *data,
+			   size_t len)
+{
+	int type = mtid == 0x09 ? 0 : 1;
+	size_t off = type == 0
+			     ? FLV_VIDEO_HEADER_LEN + SUBMIT_VIDEO_ID_OFFSET
+			     : FLV_AUDIO_HEADER_LEN + SUBMIT_AUDIO_ID_OFFSET;
+	struct producer *p;
+	uint32_t id, seq;
+
+	if (len < off + SUBMIT_ID_LEN)
+		goto bad_msg;
+	id = read_u32(&data[off]);
+	seq = read_u32(&data[off + 4]);
+	if (id >= ctx->nb_producers || seq >= ctx->submit_count)
+		goto bad_msg;
+
+	p = &ctx->producers[id];
+	if ((int64_t)seq <= p->last_seq[type]) {
+		ULOGE("producer %" PRIu32 " %s message %" PRIu32
+		      " received after %" PRIi64,
+		      id,
+		      type == 0 ? "video" : "audio",
+		      seq,
+		      p->last_seq[type]);
+		ctx->submit_out_of_order++;
+	}
+	p->last_seq[type] = seq;
+	p->received[type]++;
+	return;
+
+bad_msg:
+	ULOGE("bad submitted message (mtid %u, %zu bytes)", mtid, len);
+	stop(ctx, EXIT_FAILURE);
+}
+
+static void media_cb(const char *name,
+		     uint8_t mtid,
+		     uint32_t timestamp,
+		     const uint8_t *data,
+		     size_t len,
+		     uint64_t recv_time,
+		     void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+	int is_member = ctx->member && strcmp(name, GROUP_MEMBER_KEY) == 0;
+
+	/* Codec configurations & metadata are not timed */
+	if (len < 2 || data[1] == 0x00)
+		return;
+
+	if (ctx->nb_producers > 0) {
+		submit_receive(ctx, mtid, data, len);
+		if (ctx->draining && all_received(ctx))
+			stop(ctx, EXIT_SUCCESS);
+		return;
+	}
+
+	/* The new connection must start with a keyframe, the frames queued
+	 * before the drop being discarded */
+	if (mtid == 0x09 && ctx->wait_video) {
+		ctx->wait_video = 0;
+		if ((data[0] >> 4) != 1) {
+			ULOGE("first video frame after the reconnection "
+			      "(ts %" PRIu32 ") is not a keyframe",
+			      timestamp);
+			stop(ctx, EXIT_FAILURE);
+			return;
+		}
+		ULOGI("reconnection resumed from a keyframe (ts %" PRIu32 ")",
+		      timestamp);
+	}
+
+	if (mtid == 0x09)
+		track_receive(is_member ? &ctx->member_video : &ctx->video,
+			      timestamp,
+			      recv_time);
+	else if (mtid == 0x08)
+		track_receive(is_member ? &ctx->member_audio : &ctx->audio,
+			      timestamp,
+			      recv_time);
+
+	if (ctx->draining && all_received(ctx))
+		stop(ctx, EXIT_SUCCESS);
+}
+
+static void closed_cb(const char *name, void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+
+	if (ctx->drop_pending) {
+		/* Connection dropped by drop_timer_cb() */
+		ctx->drop_pending = 0;
+		ctx->dropped = 1;
+		ctx->wait_video = 1;
+		return;
+	}
+
+	if (ctx->run && !ctx->draining) {
+		ULOGE("publisher disconnected from the sink");
+		stop(ctx, EXIT_FAILURE);
+	}
+}
+
+static const struct rtmp_sink_cbs sink_cbs = {
+	.media_cb = media_cb,
+	.closed_cb = closed_cb,
+};
+
+/* Send a message through the group, with the index of its data_unref()
+ * counter as userdata. Returns the number of members it was queued on */
+static int group_send(struct loopback_ctx *ctx,
+		      uint8_t mtid,
+		      int is_config,
+		      const uint8_t *buf,
+		      size_t len,
+		      uint32_t ts)
+{
+	void *userdata;
+	int ret;
+
+	if (ctx->group_msgs == ctx->group_msgs_max)
+		return -ENOBUFS;
+	userdata = (void *)(uintptr_t)ctx->group_msgs++;
+
+	if (mtid == 0x09 && is_config)
+		ret = rtmp_group_send_video_avcc(ctx->group, buf, len, userdata);
+	else if (mtid == 0x09)
+		ret = rtmp_group_send_video_frame(
+			ctx->group, buf, len, ts, userdata);
+	else if (is_config)
+		ret = rtmp_group_send_audio_specific_config(
+			ctx->group, buf, len, userdata);
+	else
+		ret = rtmp_group_send_audio_data(
+			ctx->group, buf, len, ts, userdata);
+	if (ret >= 0)
+		ctx->group_queued++;
+	return ret;
+}
+
+/* Keyframes are 5 times bigger than the other frames */
+static size_t video_frame_len(struct loopback_ctx *ctx, uint64_t n)
+{
+	size_t len = (uint64_t)ctx->bitrate * 1000 / 8 / ctx->fps * ctx->gop /
+		     (ctx->gop + 4);
+
+	if ((n % ctx->gop) == 0)
+		len *= 5;
+	return len < 8 ? 8 : len;
+}
+
+/* Every other non-key frame is not used as reference */
+static uint8_t video_nal_header(struct loopback_ctx *ctx, uint64_t n)
+{
+	if ((n % ctx->gop) == 0)
+		return 0x65;
+	return (n % 2) ? 0x01 : 0x41;
+}
+
+static void send_video_frame(struct loopback_ctx *ctx)
+{
+	uint64_t n = ctx->video_frames++;
+	size_t len = video_frame_len(ctx, n);
+	uint32_t ts = ctx->start_ts + (uint32_t)(n * 1000 / ctx->fps);
+	uint8_t *buf;
+	int ret;
+
+	buf = malloc(len);
+	if (!buf) {
+		ULOG_ERRNO("malloc", ENOMEM);
+		return;
+	}
+	memset(buf, 0xaa, len);
+	/* One AVCC NAL unit */
+	buf[0] = ((len - 4) >> 24) & 0xff;
+	buf[1] = ((len - 4) >> 16) & 0xff;
+	buf[2] = ((len - 4) >> 8) & 0xff;
+	buf[3] = (len - 4) & 0xff;
+	buf[4] = video_nal_header(ctx, n);
+
+	/* The frames queued on the member before its removal are still
+	 * sent */
+	if (ctx->member && !ctx->member_removed &&
+	    n == (uint64_t)ctx->duration * ctx->fps / 2) {
+		ret = rtmp_group_remove_client(ctx->group, ctx->member);
+		if (ret < 0)
+			ULOG_ERRNO("rtmp_group_remove_client", -ret);
+		ctx->member_removed = 1;
+		ULOGI("member removed from the group (ts %" PRIu32 ")", ts);
+	}
+
+	if (ctx->group)
+		ret = group_send(ctx, 0x09, 0, buf, len, ts);
+	else
+		ret = rtmp_client_send_video_frame(
+			ctx->client, buf, len, ts, buf);
+	if (ret < 0)
+		free(buf);
+	track_submit(&ctx->video, ts, ret);
+	if (ctx->member && !ctx->member_removed)
+		track_submit(&ctx->member_video, ts, ret);
+	if (ctx->play)
+		track_submit(&ctx->play_video, ts, ret);
+}
+
+static void send_audio_frame(struct loopback_ctx *ctx)
+{
+	uint64_t n = ctx->audio_frames++;
+	uint32_t ts = ctx->start_ts + (uint32_t)(n * AUDIO_FRAME_SAMPLES *
+						 1000 / AUDIO_SAMPLE_RATE);
+	uint8_t *buf;
+	int ret;
+
+	buf = malloc(AUDIO_FRAME_LEN);
+	if (!buf) {
+		ULOG_ERRNO("malloc", ENOMEM);
+		return;
+	}
+	memset(buf, 0x55, AUDIO_FRAME_LEN);
+
+	if (ctx->group)
+		ret = group_send(ctx, 0x08, 0, buf, AUDIO_FRAME_LEN, ts);
+	else
+		ret = rtmp_client_send_audio_data(
+			ctx->client, buf, AUDIO_FRAME_LEN, ts, buf);
+	if (ret < 0)
+		free(buf);
+	track_submit(&ctx->audio, ts, ret);
+	if (ctx->member && !ctx->member_removed)
+		track_submit(&ctx->member_audio, ts, ret);
+	if (ctx->play)
+		track_submit(&ctx->play_audio, ts, ret);
+}
+
+/* The frames due are sent on each tick, to follow the wall clock when the
+ * timers are late and with periods which are not a whole number of ms */
+static void video_timer_cb(struct pomp_timer *timer, void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+	uint64_t elapsed = get_time_us() - ctx->start_time;
+
+	while (ctx->video_frames * 1000000 / ctx->fps <= elapsed)
+		send_video_frame(ctx);
+}
+
+static void audio_timer_cb(struct pomp_timer *timer, void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+	uint64_t elapsed = get_time_us() - ctx->start_time;
+
+	while (ctx->audio_frames * AUDIO_FRAME_SAMPLES * 1000000 /
+		       AUDIO_SAMPLE_RATE <=
+	       elapsed)
+		send_audio_frame(ctx);
+}
+
+/* Submit a frame, retrying while the submission queue is full. Returns
+ * -ECANCELED once the test is stopped */
+static int producer_submit(struct producer *p, int type, uint32_t seq)
+{
+	struct loopback_ctx *ctx = p->ctx;
+	size_t off = type == 0 ? SUBMIT_VIDEO_ID_OFFSET : SUBMIT_AUDIO_ID_OFFSET;
+	size_t len = type == 0 ? video_frame_len(ctx, seq) : AUDIO_FRAME_LEN;
+	uint32_t ts = ctx->start_ts +
+		      (uint32_t)((get_time_us() - ctx->start_time) / 1000);
+	uint8_t *buf;
+	int ret;
+
+	if (len < off + SUBMIT_ID_LEN)
+		len = off + SUBMIT_ID_LEN;
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, type == 0 ? 0xaa : 0x55, len);
+	if (type == 0) {
+		/* One AVCC NAL unit */
+		write_u32(buf, len - 4);
+		buf[4] = video_nal_header(ctx, seq);
+	}
+	write_u32(&buf[off], p->id);
+	write_u32(&buf[off + 4], seq);
+
+	do {
+		if (!__atomic_load_n(&ctx->run, __ATOMIC_RELAXED)) {
+			free(buf);
+			return -ECANCELED;
+		}
+		if (type == 0)
+			ret = rtmp_client_submit_video_frame(
+				ctx->client, buf, len, ts, &p->unrefs[0][seq]);
+		else
+			ret = rtmp_client_submit_audio_data(
+				ctx->client, buf, len, ts, &p->unrefs[1][seq]);
+		if (ret == -EAGAIN) {
+			p->ring_full++;
+			sched_yield();
+		}
+	} while (ret == -EAGAIN);
+
+	if (ret < 0) {
+		free(buf);
+		p->refused++;
+		return 0;
+	}
+	p->accepted[type]++;
+	return 0;
+}
+
+/* The frames are submitted as fast as possible, so that the submission
+ * queue fills up and the data queues overflow */
+static void *producer_thread(void *userdata)
+{
+	struct producer *p = userdata;
+	struct loopback_ctx *ctx = p->ctx;
+	uint32_t seq;
+
+	for (seq = 0; seq < ctx->submit_count; seq++) {
+		if (producer_submit(p, 0, seq) < 0 ||
+		    producer_submit(p, 1, seq) < 0)
+			break;
+	}
+
+	__atomic_add_fetch(&ctx->producers_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void join_producers(struct loopback_ctx *ctx)
+{
+	uint32_t i;
+
+	for (i = 0; i < ctx->nb_producers; i++) {
+		struct producer *p = &ctx->producers[i];
+		if (!p->started)
+			continue;
+		pthread_join(p->thread, NULL);
+		p->started = 0;
+	}
+	ctx->producers_joined = 1;
+}
+
+static void start_producers(struct loopback_ctx *ctx)
+{
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < ctx->nb_producers; i++) {
+		struct producer *p = &ctx->producers[i];
+		ret = pthread_create(&p->thread, NULL, producer_thread, p);
+		if (ret != 0) {
+			ULOG_ERRNO("pthread_create", ret);
+			stop(ctx, EXIT_FAILURE);
+			return;
+		}
+		p->started = 1;
+	}
+}
+
+static void drop_timer_cb(struct pomp_timer *timer, void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+
+	ULOGI("dropping the sink connections");
+	ctx->drop_pending = 1;
+	rtmp_sink_drop_connection(ctx->sink);
+}
+
+static void end_timer_cb(struct pomp_timer *timer, void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+
+	if (ctx->start_time == 0) {
+		ULOGE("clients not connected after %d ms", CONNECT_TIMEOUT_MS);
+		stop(ctx, EXIT_FAILURE);
+		return;
+	}
+
+	if (ctx->draining) {
+		/* The remaining messages are counted as lost */
+		stop(ctx, EXIT_SUCCESS);
+		return;
+	}
+
+	/* The producers can not be joined while they wait for room in the
+	 * submission queue, which is drained by the loop */
+	if (!ctx->producers_joined &&
+	    __atomic_load_n(&ctx->producers_done, __ATOMIC_ACQUIRE) <
+		    ctx->nb_producers) {
+		pomp_timer_set(ctx->end_timer, 100);
+		return;
+	}
+	join_producers(ctx);
+
+	pomp_timer_clear(ctx->video_timer);
+	pomp_timer_clear(ctx->audio_timer);
+	ctx->draining = 1;
+	if (all_received(ctx))
+		stop(ctx, EXIT_SUCCESS);
+	else
+		pomp_timer_set(ctx->end_timer, DRAIN_TIMEOUT_MS);
+}
+
+static void start_sending(struct loopback_ctx *ctx)
+{
+	uint8_t *buf;
+	int ret;
+
+	ret = rtmp_client_send_metadata(ctx->client,
+					0,
+					1280,
+					720,
+					ctx->fps,
+					AUDIO_SAMPLE_RATE,
+					16);
+	if (ret < 0)
+		ULOG_ERRNO("rtmp_client_send_metadata", -ret);
+
+	buf = malloc(sizeof(avcc));
+	if (buf) {
+		memcpy(buf, avcc, sizeof(avcc));
+		if (ctx->group)
+			ret = group_send(ctx, 0x09, 1, buf, sizeof(avcc), 0);
+		else
+			ret = rtmp_client_send_video_avcc(
+				ctx->client, buf, sizeof(avcc), buf);
+		if (ret < 0) {
+			ULOG_ERRNO("rtmp_client_send_video_avcc", -ret);
+			free(buf);
+		}
+	}
+	buf = malloc(sizeof(asc));
+	if (buf) {
+		memcpy(buf, asc, sizeof(asc));
+		if (ctx->group)
+			ret = group_send(ctx, 0x08, 1, buf, sizeof(asc), 0);
+		else
+			ret = rtmp_client_send_audio_specific_config(
+				ctx->client, buf, sizeof(asc), buf);
+		if (ret < 0) {
+			ULOG_ERRNO("rtmp_client_send_audio_specific_config",
+				   -ret);
+			free(buf);
+		}
+	}
+
+	ctx->start_time = get_time_us();
+	pomp_timer_set(ctx->end_timer, ctx->duration * 1000);
+	if (ctx->nb_producers > 0) {
+		start_producers(ctx);
+		return;
+	}
+	pomp_timer_set_periodic(ctx->video_timer,
+				1000 / ctx->fps,
+				1000 / ctx->fps);
+	pomp_timer_set_periodic(ctx->audio_timer,
+				AUDIO_FRAME_SAMPLES * 1000 / AUDIO_SAMPLE_RATE,
+				AUDIO_FRAME_SAMPLES * 1000 / AUDIO_SAMPLE_RATE);
+	if (ctx->drop_time > 0)
+		pomp_timer_set(ctx->drop_timer, ctx->drop_time);
+}
+
+/* With a group, the sending starts once both clients are connected */
+static void publisher_connected(struct loopback_ctx *ctx)
+{
+	ctx->nb_connected++;
+	if (ctx->start_time == 0 && ctx->nb_connected == (ctx->member ? 2 : 1))
+		start_sending(ctx);
+}
+
+static void connection_state(enum rtmp_connection_state state, void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+
+	ULOGI("connection state: %s", rtmp_connection_state_to_string(state));
+
+	if (state == RTMP_CONNECTED) {
+		publisher_connected(ctx);
+	} else if (state == RTMP_DISCONNECTED && ctx->run) {
+		ULOGE("connection lost");
+		stop(ctx, EXIT_FAILURE);
+	}
+}
+
+static void peer_bw_changed(uint32_t bandwidth, void *userdata)
+{
+}
+
+static void data_unref(uint8_t *data, void *buffer_userdata, void *userdata)
+{
+	free(buffer_userdata);
+}
+
+static const struct rtmp_callbacks rtmp_cbs = {
+	.connection_state = connection_state,
+	.peer_bw_changed = peer_bw_changed,
+	.data_unref = data_unref,
+};
+
+/* The codec configurations are given their buffer as userdata, the submitted
+ * frames their data_unref() counter */
+static void submit_data_unref(uint8_t *data,
+			      void *buffer_userdata,
+			      void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+	uint8_t *unrefs = buffer_userdata;
+
+	if (unrefs != data) {
+		if (*unrefs < UINT8_MAX)
+			(*unrefs)++;
+		ctx->submit_unrefs++;
+	}
+	free(data);
+
+	/* Pending messages are also released once the loop stopped */
+	if (ctx->run && ctx->draining && all_received(ctx))
+		stop(ctx, EXIT_SUCCESS);
+}
+
+static const struct rtmp_callbacks submit_cbs = {
+	.connection_state = connection_state,
+	.peer_bw_changed = peer_bw_changed,
+	.data_unref = submit_data_unref,
+};
+
+static void member_state(enum rtmp_connection_state state, void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+
+	ULOGI("member state: %s", rtmp_connection_state_to_string(state));
+
+	if (state == RTMP_CONNECTED) {
+		publisher_connected(ctx);
+	} else if (state == RTMP_DISCONNECTED && ctx->run) {
+		ULOGE("member connection lost");
+		stop(ctx, EXIT_FAILURE);
+	}
+}
+
+/* The group releases each message once, after both members sent it */
+static void group_data_unref(uint8_t *data,
+			     void *buffer_userdata,
+			     void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+	uintptr_t idx = (uintptr_t)buffer_userdata;
+
+	if (ctx->group_unrefs[idx] < UINT8_MAX)
+		ctx->group_unrefs[idx]++;
+	ctx->group_released++;
+	free(data);
+}
+
+static const struct rtmp_callbacks member_cbs = {
+	.connection_state = member_state,
+	.peer_bw_changed = peer_bw_changed,
+	.data_unref = data_unref,
+};
+
+static const struct rtmp_group_callbacks group_cbs = {
+	.data_unref = group_data_unref,
+};
+
+static void player_state(enum rtmp_connection_state state, void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+	int ret;
+
+	ULOGI("player state: %s", rtmp_connection_state_to_string(state));
+
+	if (state == RTMP_CONNECTED && !ctx->play_connected) {
+		/* The stream is published once played, so that the player
+		 * receives all its frames */
+		ctx->play_connected = 1;
+		ret = rtmp_client_connect(ctx->client, ctx->url);
+		if (ret < 0) {
+			ULOG_ERRNO("rtmp_client_connect", -ret);
+			stop(ctx, EXIT_FAILURE);
+		}
+	} else if (state == RTMP_CONNECTED) {
+		ctx->play_reconnected = 1;
+		ctx->play_wait_video = 1;
+	} else if (state == RTMP_DISCONNECTED && ctx->run) {
+		ULOGE("player connection lost");
+		stop(ctx, EXIT_FAILURE);
+	}
+}
+
+/* Check a played frame against the sent configurations & frames, the frame
+ * index being found from the timestamp */
+static int check_play_frame(struct loopback_ctx *ctx,
+			    const struct rtmp_media_frame *frame)
+{
+	uint32_t ts = frame->timestamp - ctx->start_ts;
+	uint64_t n = ((uint64_t)ts * ctx->fps + 999) / 1000;
+	size_t len, i;
+
+	switch (frame->type) {
+	case RTMP_MEDIA_VIDEO:
+		if (frame->codec != RTMP_VIDEO_CODEC_AVC || frame->cts != 0 ||
+		    frame->is_non_ref)
+			goto bad_header;
+		if (frame->is_config) {
+			if (frame->len != sizeof(avcc) ||
+			    memcmp(frame->data, avcc, sizeof(avcc)) != 0)
+				goto bad_payload;
+			return 0;
+		}
+		if (frame->is_key != ((n % ctx->gop) == 0))
+			goto bad_header;
+		len = video_frame_len(ctx, n);
+		if (frame->len != len || frame->data[0] != ((len - 4) >> 24) ||
+		    frame->data[1] != (((len - 4) >> 16) & 0xff) ||
+		    frame->data[2] != (((len - 4) >> 8) & 0xff) ||
+		    frame->data[3] != ((len - 4) & 0xff) ||
+		    frame->data[4] != video_nal_header(ctx, n))
+			goto bad_payload;
+		for (i = 5; i < len; i++) {
+			if (frame->data[i] != 0xaa)
+				goto bad_payload;
+		}
+		return 0;
+
+	case RTMP_MEDIA_AUDIO:
+		/* 44kHz (the highest FLV rate), 16 bits, stereo */
+		if (frame->codec != RTMP_AUDIO_FORMAT_AAC ||
+		    frame->audio_flags != 0x0f)
+			goto bad_header;
+		if (frame->is_config) {
+			if (frame->len != sizeof(asc) ||
+			    memcmp(frame->data, asc, sizeof(asc)) != 0)
+				goto bad_payload;
+			return 0;
+		}
+		if (frame->len != AUDIO_FRAME_LEN)
+			goto bad_payload;
+		for (i = 0; i < AUDIO_FRAME_LEN; i++) {
+			if (frame->data[i] != 0x55)
+				goto bad_payload;
+		}
+		return 0;
+
+	default:
+		/* The sink does not send the metadata */
+		ULOGE("unexpected data message (ts %" PRIu32 ")",
+		      frame->timestamp);
+		return -EPROTO;
+	}
+
+bad_header:
+	ULOGE("bad played %s header (ts %" PRIu32 ")",
+	      frame->type == RTMP_MEDIA_VIDEO ? "video" : "audio",
+	      frame->timestamp);
+	return -EPROTO;
+
+bad_payload:
+	ULOGE("bad played %s payload (ts %" PRIu32 ", %zu bytes)",
+	      frame->type == RTMP_MEDIA_VIDEO ? "video" : "audio",
+	      frame->timestamp,
+	      frame->len);
+	return -EPROTO;
+}
+
+/* The kept frame payload must still be valid until it is released */
+static int release_kept_frame(struct loopback_ctx *ctx,
+			      struct rtmp_media_frame *kept)
+{
+	int ret;
+
+	if (!kept->buffer)
+		return 0;
+	ret = check_play_frame(ctx, kept);
+	rtmp_media_buffer_unref(kept->buffer);
+	kept->buffer = NULL;
+	return ret;
+}
+
+static void player_frame(const struct rtmp_media_frame *frame, void *userdata)
+{
+	struct loopback_ctx *ctx = userdata;
+	struct rtmp_media_frame *kept;
+	uint64_t recv_time = get_time_us();
+
+	if (check_play_frame(ctx, frame) < 0) {
+		stop(ctx, EXIT_FAILURE);
+		return;
+	}
+
+	kept = &ctx->kept[frame->type == RTMP_MEDIA_VIDEO ? 0 : 1];
+	if (release_kept_frame(ctx, kept) < 0) {
+		stop(ctx, EXIT_FAILURE);
+		return;
+	}
+	rtmp_media_buffer_ref(frame->buffer);
+	*kept = *frame;
+
+	if (frame->is_config)
+		return;
+
+	/* After a reconnection, the player joins the stream at any frame */
+	if (frame->type == RTMP_MEDIA_VIDEO && ctx->play_wait_video) {
+		ctx->play_wait_video = 0;
+		ULOGI("player resumed after the reconnection (ts %" PRIu32 ")",
+		      frame->timestamp);
+	}
+
+	if (frame->type == RTMP_MEDIA_VIDEO)
+		track_receive(&ctx->play_video, frame->timestamp, recv_time);
+	else
+		track_receive(&ctx->play_audio, frame->timestamp, recv_time);
+
+	if (ctx->draining && all_received(ctx))
+		stop(ctx, EXIT_SUCCESS);
+}
+
+static const struct rtmp_callbacks player_cbs = {
+	.connection_state = player_state,
+	.peer_bw_changed = peer_bw_changed,
+	.data_unref = data_unref,
+	.media_frame = player_frame,
+};
+
+static int parse_drop_policy(const char *str, enum rtmp_drop_policy *policy)
+{
+	if (strcmp(str, "none") == 0)
+		*policy = RTMP_DROP_NONE;
+	else if (strcmp(str, "nonref") == 0)
+		*policy = RTMP_DROP_NON_REF;
+	else if (strcmp(str, "gop") == 0)
+		*policy = RTMP_DROP_GOP;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+static void usage(const char *progname)
+{
+	printf("Usage: %s [options]\n"
+	       "  -d <s>     duration (default 10)\n"
+	       "  -b <kbps>  video bitrate (default 2000)\n"
+	       "  -f <fps>   video framerate (default 30)\n"
+	       "  -g <n>     GOP length in frames (default 30)\n"
+	       "  -c <size>  chunk size (default: library default)\n"
+	       "  -a <ms>    audio aggregation window (default 0)\n"
+	       "  -D <p>     drop policy: none, nonref or gop (default none)\n"
+	       "  -L <ms>    max latency of the drop policy (default 500)\n"
+	       "  -r <ms>    drop the connection after <ms>, and check that\n"
+	       "             the client reconnects and resumes from a\n"
+	       "             keyframe (default: never)\n"
+	       "  -t <ms>    timestamp of the first frames, e.g. 16777216 for\n"
+	       "             extended timestamps (default 0)\n"
+	       "  -P         play the stream back from the sink with a second\n"
+	       "             client, and check the played frames\n"
+	       "  -s <n>     submit the frames from <n> producer threads, each\n"
+	       "             submitting <d> * <fps> video & audio frames as\n"
+	       "             fast as possible, and check that each is received\n"
+	       "             in order or dropped, and released once\n"
+	       "  -G         publish through a group of two clients, the\n"
+	       "             second one being removed half-way, and check\n"
+	       "             that each message is received by the members\n"
+	       "             and released once\n"
+	       "  -S         use rtmps URLs, with an identity TLS backend\n"
+	       "             which does not encrypt the data\n"
+	       "  -p <port>  sink port (default: any)\n",
+	       progname);
+}
+
+static int setup_tls(struct loopback_ctx *ctx, struct rtmp_client *client)
+{
+	if (!ctx->rtmps)
+		return 0;
+	return rtmp_client_set_tls_backend(
+		client, &rtmp_tls_identity_backend, &ctx->tls_stats);
+}
+
+/* The TLS handshake must have waited for the server, and the fallback of the
+ * kernel TLS used */
+static int print_tls_stats(struct loopback_ctx *ctx)
+{
+	struct rtmp_tls_identity_stats *stats = &ctx->tls_stats;
+
+	printf("tls handshake eagain %" PRIu64 ", reads %" PRIu64
+	       " (%" PRIu64 " leaving data pending), writev %" PRIu64 "\n",
+	       stats->handshake_eagain,
+	       stats->reads,
+	       stats->pending_reads,
+	       stats->writev);
+	if (stats->handshake_eagain == 0 || stats->pending_reads == 0 ||
+	    stats->writev == 0) {
+		ULOGE("TLS session paths not exercised");
+		return -EPROTO;
+	}
+	return 0;
+}
+
+static void setup_publisher(struct loopback_ctx *ctx,
+			    struct rtmp_client *client)
+{
+	int ret;
+
+	if (ctx->chunk_size > 0) {
+		ret = rtmp_client_set_chunk_size(client, ctx->chunk_size);
+		if (ret < 0)
+			ULOG_ERRNO("rtmp_client_set_chunk_size", -ret);
+	}
+	ret = rtmp_client_set_audio_aggregation(client, ctx->aggr_window);
+	if (ret < 0)
+		ULOG_ERRNO("rtmp_client_set_audio_aggregation", -ret);
+	ret = rtmp_client_set_drop_policy(
+		client, ctx->drop_policy, ctx->max_latency);
+	if (ret < 0)
+		ULOG_ERRNO("rtmp_client_set_drop_policy", -ret);
+}
+
+/* Each queued message must have been released exactly once */
+static int check_group_unrefs(struct loopback_ctx *ctx)
+{
+	size_t i;
+
+	printf("group queued %" PRIu64 " released %" PRIu64 "\n",
+	       ctx->group_queued,
+	       ctx->group_released);
+	for (i = 0; i < ctx->group_msgs; i++) {
+		if (ctx->group_unrefs[i] > 1) {
+			ULOGE("group message %zu released %u times",
+			      i,
+			      ctx->group_unrefs[i]);
+			return -EPROTO;
+		}
+	}
+	if (ctx->group_released != ctx->group_queued) {
+		ULOGE("%" PRIu64 " group messages released out of %" PRIu64,
+		      ctx->group_released,
+		      ctx->group_queued);
+		return -EPROTO;
+	}
+	return 0;
+}
+
+static int producers_init(struct loopback_ctx *ctx)
+{
+	uint32_t i;
+	int j;
+
+	ctx->producers = calloc(ctx->nb_producers, sizeof(*ctx->producers));
+	if (!ctx->producers)
+		return -ENOMEM;
+	for (i = 0; i < ctx->nb_producers; i++) {
+		struct producer *p = &ctx->producers[i];
+		p->ctx = ctx;
+		p->id = i;
+		for (j = 0; j < 2; j++) {
+			p->last_seq[j] = -1;
+			p->unrefs[j] = calloc(ctx->submit_count, 1);
+			if (!p->unrefs[j])
+				return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static void producers_clear(struct loopback_ctx *ctx)
+{
+	uint32_t i;
+
+	if (!ctx->producers)
+		return;
+	for (i = 0; i < ctx->nb_producers; i++) {
+		free(ctx->producers[i].unrefs[0]);
+		free(ctx->producers[i].unrefs[1]);
+	}
+	free(ctx->producers);
+}
+
+/* Each accepted message must have been received or dropped */
+static int print_submit_stats(struct loopback_ctx *ctx)
+{
+	struct rtmp_stats stats;
+	uint64_t accepted = 0, received = 0, refused = 0, ring_full = 0;
+	uint32_t i;
+	int ret;
+
+	ret = rtmp_client_get_stats(ctx->client, &stats);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < ctx->nb_producers; i++) {
+		struct producer *p = &ctx->producers[i];
+		printf("producer %" PRIu32 ": video accepted %" PRIu64
+		       " received %" PRIu64 ", audio accepted %" PRIu64
+		       " received %" PRIu64 ", queue full %" PRIu64 "\n",
+		       p->id,
+		       p->accepted[0],
+		       p->received[0],
+		       p->accepted[1],
+		       p->received[1],
+		       p->ring_full);
+		accepted += p->accepted[0] + p->accepted[1];
+		received += p->received[0] + p->received[1];
+		refused += p->refused;
+		ring_full += p->ring_full;
+	}
+	printf("submit accepted %" PRIu64 " refused %" PRIu64
+	       " received %" PRIu64 " dropped %" PRIu64 " queue full %" PRIu64
+	       "\n",
+	       accepted,
+	       refused,
+	       received,
+	       stats.submit_dropped,
+	       ring_full);
+
+	if (received + stats.submit_dropped != accepted || received == 0) {
+		ULOGE("submitted messages neither received nor dropped");
+		return -EPROTO;
+	}
+	if (ctx->submit_out_of_order > 0) {
+		ULOGE("%" PRIu64 " submitted messages received out of order",
+		      ctx->submit_out_of_order);
+		return -EPROTO;
+	}
+	return 0;
+}
+
+/* Each accepted message must have been released exactly once */
+static int check_submit_unrefs(struct loopback_ctx *ctx)
+{
+	uint64_t accepted = 0, released = 0;
+	uint32_t i, seq;
+	int j;
+
+	for (i = 0; i < ctx->nb_producers; i++) {
+		struct producer *p = &ctx->producers[i];
+		for (j = 0; j < 2; j++) {
+			accepted += p->accepted[j];
+			for (seq = 0; seq < ctx->submit_count; seq++) {
+				if (p->unrefs[j][seq] > 1) {
+					ULOGE("producer %" PRIu32
+					      " message %" PRIu32
+					      " released %u times",
+					      i,
+					      seq,
+					      p->unrefs[j][seq]);
+					return -EPROTO;
+				}
+				released += p->unrefs[j][seq];
+			}
+		}
+	}
+	if (released != accepted) {
+		ULOGE("%" PRIu64 " submitted messages released out of %" PRIu64,
+		      released,
+		      accepted);
+		return -EPROTO;
+	}
+	return 0;
+}
+
+static int print_client_stats(struct loopback_ctx *ctx)
+{
+	struct rtmp_stats stats;
+	unsigned int i;
+	int ret;
+
+	ret = rtmp_client_get_stats(ctx->client, &stats);
+	if (ret < 0)
+		return ret;
+
+	printf("client tx %" PRIu64 " bytes, %" PRIu64 " sendmsg, %" PRIu64
+	       " chunks, %" PRIu64 " eagain, %" PRIu64 " write-through\n",
+	       stats.tx_total_bytes,
+	       stats.tx_sendmsg,
+	       stats.tx_chunks,
+	       stats.tx_eagain,
+	       stats.tx_write_through);
+	for (i = 0; i < stats.nb_channels; i++) {
+		const struct rtmp_channel_stats *c = &stats.channels[i];
+		printf("client csid %u: sent %" PRIu64 " dropped %" PRIu64
+		       " queue peak %u max queued %.2fms\n",
+		       c->csid,
+		       c->sent_msgs,
+		       c->dropped_msgs,
+		       c->queue_peak_len,
+		       c->max_queued_time / 1000.);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct loopback_ctx ctx = {0};
+	/* No backlog: the queued frames are all dropped, the video then only
+	 * resumes from the next keyframe */
+	struct rtmp_reconnect_config reconnect = {
+		.enabled = 1,
+		.min_delay = RTMP_DEFAULT_RECONNECT_MIN_DELAY,
+		.max_delay = RTMP_DEFAULT_RECONNECT_MAX_DELAY,
+		.max_retries = 3,
+		.max_latency = 0,
+	};
+	uint16_t port = 0;
+	int opt;
+	int ret;
+
+	ctx.status = EXIT_SUCCESS;
+	ctx.duration = 10;
+	ctx.bitrate = 2000;
+	ctx.fps = 30;
+	ctx.gop = 30;
+	ctx.max_latency = 500;
+
+	while ((opt = getopt(argc, argv, "hd:b:f:g:c:a:D:L:r:t:Ps:GSp:")) != -1) {
+		switch (opt) {
+		case 'd':
+			ctx.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			ctx.bitrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			ctx.fps = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			ctx.gop = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			ctx.chunk_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			ctx.aggr_window = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			if (parse_drop_policy(optarg, &ctx.drop_policy) < 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'L':
+			ctx.max_latency = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			ctx.drop_time = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			ctx.start_ts = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			ctx.play = 1;
+			break;
+		case 's':
+			ctx.nb_producers = strtoul(optarg, NULL, 0);
+			break;
+		case 'G':
+			ctx.use_group = 1;
+			break;
+		case 'S':
+			ctx.rtmps = 1;
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (ctx.duration == 0 || ctx.fps == 0 || ctx.fps > 1000 ||
+	    ctx.gop == 0 || ctx.bitrate == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	/* A drop policy or a reconnection loses submitted messages without
+	 * counting them in submit_dropped */
+	if (ctx.nb_producers > 0 &&
+	    (ctx.play || ctx.drop_time > 0 || ctx.drop_policy != RTMP_DROP_NONE ||
+	     ctx.nb_producers > 64)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	ctx.submit_count = ctx.duration * ctx.fps;
+	if (ctx.use_group &&
+	    (ctx.play || ctx.drop_time > 0 || ctx.nb_producers > 0)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	ctx.loop = pomp_loop_new();
+	if (!ctx.loop) {
+		ULOG_ERRNO("pomp_loop_new", ENOMEM);
+		return EXIT_FAILURE;
+	}
+	ctx.run = 1;
+
+	/* Room for a few seconds of messages in flight */
+	ret = track_init(&ctx.video, "video", 16 * ctx.fps);
+	if (ret == 0)
+		ret = track_init(&ctx.audio,
+				 "audio",
+				 16 * AUDIO_SAMPLE_RATE / AUDIO_FRAME_SAMPLES);
+	if (ret == 0 && ctx.use_group)
+		ret = track_init(&ctx.member_video, "video2", 16 * ctx.fps);
+	if (ret == 0 && ctx.use_group)
+		ret = track_init(&ctx.member_audio,
+				 "audio2",
+				 16 * AUDIO_SAMPLE_RATE / AUDIO_FRAME_SAMPLES);
+	if (ret == 0 && ctx.play)
+		ret = track_init(&ctx.play_video, "pvideo", 16 * ctx.fps);
+	if (ret == 0 && ctx.play)
+		ret = track_init(&ctx.play_audio,
+				 "paudio",
+				 16 * AUDIO_SAMPLE_RATE / AUDIO_FRAME_SAMPLES);
+	if (ret < 0) {
+		ULOG_ERRNO("track_init", -ret);
+		ctx.status = EXIT_FAILURE;
+		goto out;
+	}
+	if (ctx.use_group) {
+		/* Room for the configurations and the frames sent until the
+		 * end timer */
+		ctx.group_msgs_max =
+			(ctx.duration + 1) *
+				(ctx.fps + AUDIO_SAMPLE_RATE /
+						   AUDIO_FRAME_SAMPLES +
+				 1) +
+			2;
+		ctx.group_unrefs = calloc(ctx.group_msgs_max, 1);
+		if (!ctx.group_unrefs) {
+			ULOG_ERRNO("calloc", ENOMEM);
+			ctx.status = EXIT_FAILURE;
+			goto out;
+		}
+	}
+	if (ctx.nb_producers > 0) {
+		ret = producers_init(&ctx);
+		if (ret < 0) {
+			ULOG_ERRNO("producers_init", -ret);
+			ctx.status = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	ctx.video_timer = pomp_timer_new(ctx.loop, video_timer_cb, &ctx);
+	ctx.audio_timer = pomp_timer_new(ctx.loop, audio_timer_cb, &ctx);
+	ctx.end_timer = pomp_timer_new(ctx.loop, end_timer_cb, &ctx);
+	ctx.drop_timer = pomp_timer_new(ctx.loop, drop_timer_cb, &ctx);
+	if (!ctx.video_timer || !ctx.audio_timer || !ctx.end_timer ||
+	    !ctx.drop_timer) {
+		ULOG_ERRNO("pomp_timer_new", ENOMEM);
+		ctx.status = EXIT_FAILURE;
+		goto out;
+	}
+
+	ctx.sink = rtmp_sink_new(ctx.loop, port, &sink_cbs, &ctx);
+	if (!ctx.sink) {
+		ULOGE("rtmp_sink_new failed");
+		ctx.status = EXIT_FAILURE;
+		goto out;
+	}
+
+	ctx.client = rtmp_client_new(ctx.loop,
+				     ctx.nb_producers > 0 ? &submit_cbs
+							  : &rtmp_cbs,
+				     &ctx);
+	if (!ctx.client) {
+		ULOGE("rtmp_client_new failed");
+		ctx.status = EXIT_FAILURE;
+		goto out;
+	}
+	if (ctx.nb_producers > 0) {
+		ret = rtmp_client_set_submit_queue(ctx.client,
+						   SUBMIT_QUEUE_SIZE);
+		if (ret < 0) {
+			ULOG_ERRNO("rtmp_client_set_submit_queue", -ret);
+			ctx.status = EXIT_FAILURE;
+			goto out;
+		}
+	}
+	setup_publisher(&ctx, ctx.client);
+	ret = setup_tls(&ctx, ctx.client);
+	if (ret < 0) {
+		ULOG_ERRNO("rtmp_client_set_tls_backend", -ret);
+		ctx.status = EXIT_FAILURE;
+		goto out;
+	}
+	if (ctx.drop_time > 0) {
+		ret = rtmp_client_set_reconnect(ctx.client, &reconnect);
+		if (ret < 0) {
+			ULOG_ERRNO("rtmp_client_set_reconnect", -ret);
+			ctx.status = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	rtmp_sink_set_rtmps(ctx.sink, ctx.rtmps);
+	snprintf(ctx.url,
+		 sizeof(ctx.url),
+		 "%s://127.0.0.1:%u/live/loopback",
+		 ctx.rtmps ? "rtmps" : "rtmp",
+		 rtmp_sink_get_port(ctx.sink));
+
+	if (ctx.use_group) {
+		ctx.group = rtmp_group_new(&group_cbs, &ctx);
+		ctx.member = rtmp_client_new(ctx.loop, &member_cbs, &ctx);
+		if (!ctx.group || !ctx.member) {
+			ULOGE("rtmp_group_new/rtmp_client_new failed");
+			ctx.status = EXIT_FAILURE;
+			goto out;
+		}
+		setup_publisher(&ctx, ctx.member);
+		snprintf(ctx.member_url,
+			 sizeof(ctx.member_url),
+			 "%s://127.0.0.1:%u/live/" GROUP_MEMBER_KEY,
+			 ctx.rtmps ? "rtmps" : "rtmp",
+			 rtmp_sink_get_port(ctx.sink));
+		ret = setup_tls(&ctx, ctx.member);
+		if (ret == 0)
+			ret = rtmp_group_add_client(ctx.group, ctx.client);
+		if (ret == 0)
+			ret = rtmp_group_add_client(ctx.group, ctx.member);
+		if (ret == 0)
+			ret = rtmp_client_connect(ctx.member, ctx.member_url);
+		if (ret < 0) {
+			ULOG_ERRNO("group setup", -ret);
+			ctx.status = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	if (ctx.play) {
+		ctx.player = rtmp_client_new(ctx.loop, &player_cbs, &ctx);
+		if (!ctx.player) {
+			ULOGE("rtmp_client_new failed");
+			ctx.status = EXIT_FAILURE;
+			goto out;
+		}
+		ret = rtmp_client_set_mode(ctx.player, RTMP_CLIENT_MODE_PLAY);
+		if (ret == 0)
+			ret = setup_tls(&ctx, ctx.player);
+		if (ret == 0 && ctx.drop_time > 0)
+			ret = rtmp_client_set_reconnect(ctx.player, &reconnect);
+		if (ret == 0)
+			ret = rtmp_client_connect(ctx.player, ctx.url);
+	} else {
+		ret = rtmp_client_connect(ctx.client, ctx.url);
+	}
+	if (ret < 0) {
+		ULOG_ERRNO("rtmp_client_connect", -ret);
+		ctx.status = EXIT_FAILURE;
+		goto out;
+	}
+	pomp_timer_set(ctx.end_timer, CONNECT_TIMEOUT_MS);
+
+	while (ctx.run)
+		pomp_loop_wait_and_process(ctx.loop, -1);
+	/* The producers see the stop and return */
+	join_producers(&ctx);
+
+	if (ctx.drop_time > 0 && (!ctx.dropped || ctx.wait_video)) {
+		ULOGE("no video frame received after the reconnection");
+		ctx.status = EXIT_FAILURE;
+	}
+	if (ctx.play && ctx.drop_time > 0 &&
+	    (!ctx.play_reconnected || ctx.play_wait_video)) {
+		ULOGE("no video frame played after the reconnection");
+		ctx.status = EXIT_FAILURE;
+	}
+
+	track_print(&ctx.video);
+	track_print(&ctx.audio);
+	if (ctx.member) {
+		track_print(&ctx.member_video);
+		track_print(&ctx.member_audio);
+	}
+	if (ctx.play) {
+		track_print(&ctx.play_video);
+		track_print(&ctx.play_audio);
+	}
+	print_client_stats(&ctx);
+	if (ctx.nb_producers > 0 && print_submit_stats(&ctx) < 0)
+		ctx.status = EXIT_FAILURE;
+	if (ctx.rtmps && print_tls_stats(&ctx) < 0)
+		ctx.status = EXIT_FAILURE;
+
+	/* Only a drop policy (with its -L latency limit) or a reconnection
+	 * can lose messages */
+	if (ctx.drop_policy == RTMP_DROP_NONE && ctx.drop_time == 0 &&
+	    (ctx.video.lost > 0 || ctx.video.unmatched > 0 ||
+	     ctx.audio.lost > 0 || ctx.audio.unmatched > 0 ||
+	     ctx.play_video.lost > 0 || ctx.play_video.unmatched > 0 ||
+	     ctx.play_audio.lost > 0 || ctx.play_audio.unmatched > 0 ||
+	     ctx.member_video.lost > 0 || ctx.member_video.unmatched > 0 ||
+	     ctx.member_audio.lost > 0 || ctx.member_audio.unmatched > 0)) {
+		ULOGE("messages lost or unmatched without drop policy");
+		ctx.status = EXIT_FAILURE;
+	}
+	rtmp_client_disconnect(ctx.client);
+	if (ctx.player)
+		rtmp_client_disconnect(ctx.player);
+	if (ctx.member)
+		rtmp_client_disconnect(ctx.member);
+
+out:
+	if (ctx.client)
+		rtmp_client_destroy(ctx.client);
+	if (ctx.member)
+		rtmp_client_destroy(ctx.member);
+	/* The messages still queued were released with the members */
+	if (ctx.group) {
+		rtmp_group_destroy(ctx.group);
+		if (check_group_unrefs(&ctx) < 0)
+			ctx.status = EXIT_FAILURE;
+	}
+	if (ctx.player)
+		rtmp_client_destroy(ctx.player);
+	/* The kept buffers outlive the player */
+	if (release_kept_frame(&ctx, &ctx.kept[0]) < 0)
+		ctx.status = EXIT_FAILURE;
+	if (release_kept_frame(&ctx, &ctx.kept[1]) < 0)
+		ctx.status = EXIT_FAILURE;
+	/* All the submitted messages are released by now */
+	if (ctx.nb_producers > 0 && check_submit_unrefs(&ctx) < 0)
+		ctx.status = EXIT_FAILURE;
+	producers_clear(&ctx);
+	rtmp_sink_destroy(ctx.sink);
+	if (ctx.drop_timer)
+		pomp_timer_destroy(ctx.drop_timer);
+	if (ctx.end_timer)
+		pomp_timer_destroy(ctx.end_timer);
+	if (ctx.audio_timer)
+		pomp_timer_destroy(ctx.audio_timer);
+	if (ctx.video_timer)
+		pomp_timer_destroy(ctx.video_timer);
+	track_clear(&ctx.video);
+	track_clear(&ctx.audio);
+	track_clear(&ctx.play_video);
+	track_clear(&ctx.play_audio);
+	track_clear(&ctx.member_video);
+	track_clear(&ctx.member_audio);
+	free(ctx.group_unrefs);
+	pomp_loop_destroy(ctx.loop);
+	return ctx.status;
+}
@@ -0,0 +1,180 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rtmp_tls_identity.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Large enough for a few records */
+#define RECV_BUF_LEN 16384
+
+struct identity_session {
+	struct rtmp_tls_identity_stats *stats;
+	int fd;
+	size_t hello_sent;
+	size_t hello_received;
+
+	/* Received data not read yet, and position of buf[rd] in the received
+	 * stream (for the record boundaries) */
+	uint8_t buf[RECV_BUF_LEN];
+	size_t rd;
+	size_t len;
+	uint64_t offset;
+};
+
+static void *identity_session_new(int fd, const char *host, void *userdata)
+{
+	struct identity_session *session;
+
+	session = calloc(1, sizeof(*session));
+	if (!session)
+		return NULL;
+	session->stats = userdata;
+	session->fd = fd;
+	return session;
+}
+
+static int identity_handshake(void *s, int *want_write)
+{
+	struct identity_session *session = s;
+	uint8_t hello[RTMP_TLS_IDENTITY_HELLO_LEN];
+	size_t want;
+	ssize_t len;
+
+	while (session->hello_sent < RTMP_TLS_IDENTITY_HELLO_LEN) {
+		len = send(session->fd,
+			   &RTMP_TLS_IDENTITY_HELLO[session->hello_sent],
+			   RTMP_TLS_IDENTITY_HELLO_LEN - session->hello_sent,
+			   MSG_NOSIGNAL);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+			*want_write = 1;
+			return -EAGAIN;
+		} else if (len < 0) {
+			return -errno;
+		}
+		session->hello_sent += len;
+	}
+
+	/* Read exactly the server hello, the next bytes are RTMP data */
+	while (session->hello_received < RTMP_TLS_IDENTITY_HELLO_LEN) {
+		want = RTMP_TLS_IDENTITY_HELLO_LEN - session->hello_received;
+		len = recv(session->fd, hello, want, 0);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+			if (session->stats)
+				session->stats->handshake_eagain++;
+			*want_write = 0;
+			return -EAGAIN;
+		} else if (len < 0) {
+			return -errno;
+		} else if (len == 0) {
+			return -ECONNRESET;
+		}
+		if (memcmp(hello,
+			   &RTMP_TLS_IDENTITY_HELLO[session->hello_received],
+			   len) != 0)
+			return -EPROTO;
+		session->hello_received += len;
+	}
+
+	return 0;
+}
+
+/* At most one record is returned per call */
+static ssize_t identity_read(void *s, void *buf, size_t len)
+{
+	struct identity_session *session = s;
+	size_t record_left;
+	ssize_t ret;
+
+	if (session->rd == session->len) {
+		ret = recv(session->fd, session->buf, sizeof(session->buf), 0);
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return 0;
+		session->rd = 0;
+		session->len = ret;
+	}
+
+	record_left = RTMP_TLS_IDENTITY_RECORD_LEN -
+		      session->offset % RTMP_TLS_IDENTITY_RECORD_LEN;
+	if (len > record_left)
+		len = record_left;
+	if (len > session->len - session->rd)
+		len = session->len - session->rd;
+	memcpy(buf, &session->buf[session->rd], len);
+	session->rd += len;
+	session->offset += len;
+
+	if (session->stats) {
+		session->stats->reads++;
+		if (session->rd < session->len)
+			session->stats->pending_reads++;
+	}
+	return len;
+}
+
+static size_t identity_pending(void *s)
+{
+	struct identity_session *session = s;
+
+	return session->len - session->rd;
+}
+
+static ssize_t identity_writev(void *s, const struct iovec *iov, int iovcnt)
+{
+	struct identity_session *session = s;
+	struct msghdr msg = {
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+	};
+	ssize_t ret;
+
+	if (session->stats)
+		session->stats->writev++;
+	ret = sendmsg(session->fd, &msg, MSG_NOSIGNAL);
+	return ret < 0 ? -errno : ret;
+}
+
+static void identity_session_destroy(void *s)
+{
+	free(s);
+}
+
+const struct rtmp_tls_backend rtmp_tls_identity_backend = {
+	.session_new = identity_session_new,
+	.handshake = identity_handshake,
+	.read = identity_read,
+	.pending = identity_pending,
+	.writev = identity_writev,
+	/* No kernel TLS */
+	.get_ktls_tx_info = NULL,
+	.session_destroy = identity_session_destroy,
+};
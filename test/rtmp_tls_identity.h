@@ -0,0 +1,55 @@
+/**
+ *  Copyright (c) 2018 Parrot Drones SAS
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Parrot Company nor the
+ *     names of its contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE PARROT COMPANY BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _RTMP_TLS_IDENTITY_H_
+#define _RTMP_TLS_IDENTITY_H_
+
+#include <inttypes.h>
+#include <rtmp.h>
+
+/* Identity "TLS" backend for the rtmps tests: the data is not encrypted, the
+ * handshake is an exchange of RTMP_TLS_IDENTITY_HELLO (the server echoes the
+ * client hello before the RTMP handshake), and the received data is read in
+ * records of RTMP_TLS_IDENTITY_RECORD_LEN bytes, so that some of it stays
+ * pending in the session like with a real TLS library. The kernel TLS is not
+ * supported: the transmitted data goes through the backend writev() */
+
+#define RTMP_TLS_IDENTITY_HELLO "RTMPS-ID"
+#define RTMP_TLS_IDENTITY_HELLO_LEN 8
+#define RTMP_TLS_IDENTITY_RECORD_LEN 512
+
+/* Backend userdata, also counting the calls of the sessions */
+struct rtmp_tls_identity_stats {
+	/* Handshake calls waiting for the server hello */
+	uint64_t handshake_eagain;
+	uint64_t reads;
+	/* Reads leaving received data pending in the session */
+	uint64_t pending_reads;
+	uint64_t writev;
+};
+
+extern const struct rtmp_tls_backend rtmp_tls_identity_backend;
+
+#endif /* _RTMP_TLS_IDENTITY_H_ */